@@ -25,10 +25,16 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
 
 #include "giognutls.h"
 
@@ -45,6 +51,9 @@ struct _GIOGnuTLSChannel {
 	gnutls_session_t session;
 	bool established;
 	bool again;
+	char *verify_name;
+	guchar *pin;
+	gsize pin_len;
 };
 
 struct _GIOGnuTLSWatch {
@@ -237,6 +246,8 @@ static void g_io_gnutls_free(GIOChannel *channel)
 
 	gnutls_certificate_free_credentials(gnutls_channel->cred);
 
+	g_free(gnutls_channel->verify_name);
+	g_free(gnutls_channel->pin);
 	g_free(gnutls_channel);
 }
 
@@ -376,7 +387,8 @@ static ssize_t g_io_gnutls_push_func(gnutls_transport_ptr_t transport_data,
 
 	DBG("count %zu", count);
 
-	result = write(gnutls_channel->fd, buf, count);
+	/* a peer closing the connection must not raise SIGPIPE */
+	result = send(gnutls_channel->fd, buf, count, MSG_NOSIGNAL);
 
 	if (result < 0 && errno == EAGAIN)
 		gnutls_channel->again = true;
@@ -408,6 +420,76 @@ static ssize_t g_io_gnutls_pull_func(gnutls_transport_ptr_t transport_data,
 	return result;
 }
 
+static bool check_pin(GIOGnuTLSChannel *gnutls_channel,
+					gnutls_x509_crt_t crt)
+{
+	gnutls_pubkey_t pubkey;
+	gnutls_datum_t spki = { NULL, 0 };
+	unsigned char digest[32];
+	bool match = false;
+
+	if (gnutls_pubkey_init(&pubkey) < 0)
+		return false;
+
+	if (gnutls_pubkey_import_x509(pubkey, crt, 0) < 0)
+		goto done;
+
+	if (gnutls_pubkey_export2(pubkey, GNUTLS_X509_FMT_DER, &spki) < 0)
+		goto done;
+
+	if (gnutls_hash_fast(GNUTLS_DIG_SHA256, spki.data, spki.size,
+								digest) < 0)
+		goto done;
+
+	match = gnutls_channel->pin_len == sizeof(digest) &&
+		memcmp(digest, gnutls_channel->pin, sizeof(digest)) == 0;
+
+done:
+	gnutls_free(spki.data);
+	gnutls_pubkey_deinit(pubkey);
+
+	return match;
+}
+
+static int verify_certificate(gnutls_session_t session)
+{
+	GIOGnuTLSChannel *gnutls_channel = gnutls_session_get_ptr(session);
+	const gnutls_datum_t *certs;
+	unsigned int count, status;
+	gnutls_x509_crt_t crt;
+	bool valid = false;
+
+	certs = gnutls_certificate_get_peers(session, &count);
+	if (!certs || count == 0)
+		return GNUTLS_E_CERTIFICATE_ERROR;
+
+	if (gnutls_x509_crt_init(&crt) < 0)
+		return GNUTLS_E_CERTIFICATE_ERROR;
+
+	if (gnutls_x509_crt_import(crt, &certs[0], GNUTLS_X509_FMT_DER) < 0)
+		goto done;
+
+	/* A pinned key replaces the CA chain, as for self-signed servers */
+	if (gnutls_channel->pin) {
+		valid = check_pin(gnutls_channel, crt);
+		goto done;
+	}
+
+	if (gnutls_certificate_verify_peers2(session, &status) < 0 ||
+								status != 0)
+		goto done;
+
+	valid = gnutls_x509_crt_check_hostname(crt,
+					gnutls_channel->verify_name) != 0;
+
+done:
+	gnutls_x509_crt_deinit(crt);
+
+	DBG("channel %p valid %d", gnutls_channel, valid);
+
+	return valid ? 0 : GNUTLS_E_CERTIFICATE_ERROR;
+}
+
 bool g_io_channel_supports_tls(void)
 {
 	return true;
@@ -467,3 +549,111 @@ GIOChannel *g_io_channel_gnutls_new(int fd)
 
 	return channel;
 }
+
+bool g_io_channel_gnutls_set_priority(GIOChannel *channel,
+						const char *priority)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+
+	DBG("channel %p priority %s", channel, priority);
+
+	return gnutls_priority_set_direct(gnutls_channel->session,
+						priority, NULL) >= 0;
+}
+
+/*
+ * Drives the handshake of a non-blocking channel without transferring
+ * any data. Returns G_IO_STATUS_AGAIN until the handshake is done.
+ */
+GIOStatus g_io_channel_gnutls_handshake(GIOChannel *channel)
+{
+	return check_handshake(channel, NULL);
+}
+
+bool g_io_channel_gnutls_set_session(GIOChannel *channel,
+					const void *data, size_t len)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+
+	DBG("channel %p len %zu", channel, len);
+
+	return gnutls_session_set_data(gnutls_channel->session,
+							data, len) >= 0;
+}
+
+/*
+ * Returns the parameters needed to resume the session later, to be
+ * freed with g_free().
+ */
+void *g_io_channel_gnutls_get_session(GIOChannel *channel, size_t *len)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+	gnutls_datum_t datum;
+	void *data;
+
+	if (!gnutls_channel->established)
+		return NULL;
+
+	if (gnutls_session_get_data2(gnutls_channel->session, &datum) < 0)
+		return NULL;
+
+	data = g_malloc(datum.size);
+	memcpy(data, datum.data, datum.size);
+	*len = datum.size;
+
+	gnutls_free(datum.data);
+
+	DBG("channel %p len %zu", channel, *len);
+
+	return data;
+}
+
+bool g_io_channel_gnutls_is_resumed(GIOChannel *channel)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+
+	return gnutls_session_is_resumed(gnutls_channel->session) != 0;
+}
+
+/*
+ * Makes the handshake fail unless the server proves its identity: the
+ * leaf key must hash to pin (a base64 SHA-256 of the SubjectPublicKeyInfo)
+ * when given, otherwise the certificate must chain to a system trusted CA
+ * and match hostname, which may also be an IP address literal.
+ */
+bool g_io_channel_gnutls_set_verify(GIOChannel *channel,
+				const char *hostname, const char *pin)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+	struct in6_addr addr;
+
+	DBG("channel %p hostname %s pin %s", channel, hostname, pin);
+
+	if (!hostname && !pin)
+		return false;
+
+	if (pin) {
+		gnutls_channel->pin = g_base64_decode(pin,
+						&gnutls_channel->pin_len);
+		if (gnutls_channel->pin_len != 32)
+			return false;
+	} else if (gnutls_certificate_set_x509_system_trust(
+						gnutls_channel->cred) <= 0) {
+		return false;
+	}
+
+	gnutls_channel->verify_name = g_strdup(hostname);
+
+	if (hostname && inet_pton(AF_INET, hostname, &addr) != 1 &&
+			inet_pton(AF_INET6, hostname, &addr) != 1 &&
+			gnutls_server_name_set(gnutls_channel->session,
+					GNUTLS_NAME_DNS, hostname,
+					strlen(hostname)) < 0)
+		return false;
+
+	gnutls_session_set_ptr(gnutls_channel->session, gnutls_channel);
+	gnutls_certificate_set_verify_function(gnutls_channel->cred,
+							verify_certificate);
+
+	return true;
+}
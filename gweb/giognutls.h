@@ -26,3 +26,14 @@
 bool g_io_channel_supports_tls(void);
 
 GIOChannel *g_io_channel_gnutls_new(int fd);
+
+bool g_io_channel_gnutls_set_priority(GIOChannel *channel,
+						const char *priority);
+GIOStatus g_io_channel_gnutls_handshake(GIOChannel *channel);
+
+bool g_io_channel_gnutls_set_session(GIOChannel *channel,
+					const void *data, size_t len);
+void *g_io_channel_gnutls_get_session(GIOChannel *channel, size_t *len);
+bool g_io_channel_gnutls_is_resumed(GIOChannel *channel);
+bool g_io_channel_gnutls_set_verify(GIOChannel *channel,
+				const char *hostname, const char *pin);
@@ -34,3 +34,36 @@ GIOChannel *g_io_channel_gnutls_new(int fd)
 {
 	return NULL;
 }
+
+bool g_io_channel_gnutls_set_priority(GIOChannel *channel,
+						const char *priority)
+{
+	return false;
+}
+
+GIOStatus g_io_channel_gnutls_handshake(GIOChannel *channel)
+{
+	return G_IO_STATUS_ERROR;
+}
+
+bool g_io_channel_gnutls_set_session(GIOChannel *channel,
+					const void *data, size_t len)
+{
+	return false;
+}
+
+void *g_io_channel_gnutls_get_session(GIOChannel *channel, size_t *len)
+{
+	return NULL;
+}
+
+bool g_io_channel_gnutls_is_resumed(GIOChannel *channel)
+{
+	return false;
+}
+
+bool g_io_channel_gnutls_set_verify(GIOChannel *channel,
+				const char *hostname, const char *pin)
+{
+	return false;
+}
@@ -74,6 +74,7 @@ struct connman_config_service {
 	char *mac;
 	char *devname;
 	bool mdns;
+	bool dns_over_tls;
 	char **nameservers;
 	char **search_domains;
 	char **timeservers;
@@ -115,6 +116,7 @@ static bool cleanup = false;
 #define SERVICE_KEY_SECURITY           "Security"
 #define SERVICE_KEY_HIDDEN             "Hidden"
 #define SERVICE_KEY_MDNS               "mDNS"
+#define SERVICE_KEY_DNS_OVER_TLS       "DNSOverTLS"
 
 #define SERVICE_KEY_IPv4               "IPv4"
 #define SERVICE_KEY_IPv6               "IPv6"
@@ -158,6 +160,7 @@ static const char *service_possible_keys[] = {
 	SERVICE_KEY_MAC,
 	SERVICE_KEY_DEVICE_NAME,
 	SERVICE_KEY_MDNS,
+	SERVICE_KEY_DNS_OVER_TLS,
 	SERVICE_KEY_NAMESERVERS,
 	SERVICE_KEY_SEARCH_DOMAINS,
 	SERVICE_KEY_TIMESERVERS,
@@ -530,6 +533,9 @@ static bool load_service_generic(GKeyFile *keyfile,
 	service->mdns = __connman_config_get_bool(keyfile, group,
 						SERVICE_KEY_MDNS, NULL);
 
+	service->dns_over_tls = __connman_config_get_bool(keyfile, group,
+					SERVICE_KEY_DNS_OVER_TLS, NULL);
+
 	return true;
 
 err:
@@ -1412,6 +1418,8 @@ static int try_provision_service(struct connman_config_service *config,
 
 	__connman_service_set_mdns(service, config->mdns);
 
+	__connman_service_set_dns_over_tls(service, config->dns_over_tls);
+
 	if (config->timeservers)
 		__connman_service_set_timeservers(service,
 						config->timeservers);
@@ -31,6 +31,7 @@ dbus_bool_t __connman_dbus_append_objpath_dict_array(DBusMessage *msg,
 			connman_dbus_append_cb_t function, void *user_data);
 dbus_bool_t __connman_dbus_append_objpath_array(DBusMessage *msg,
 			connman_dbus_append_cb_t function, void *user_data);
+void __connman_dbus_append_iter(DBusMessageIter *iter, DBusMessageIter *from);
 int __connman_dbus_init(DBusConnection *conn);
 void __connman_dbus_cleanup(void);
 
@@ -83,8 +84,14 @@ void __connman_agent_cleanup(void);
 void __connman_counter_send_usage(const char *path,
 					DBusMessage *message);
 int __connman_counter_register(const char *owner, const char *path,
-						unsigned int interval);
+				unsigned int interval, uint64_t byte_threshold,
+				uint64_t packet_threshold, bool batch);
 int __connman_counter_unregister(const char *owner, const char *path);
+unsigned int __connman_counter_get_interval(const char *path);
+bool __connman_counter_threshold_reached(const char *path,
+					uint64_t bytes, uint64_t packets);
+bool __connman_counter_is_batched(const char *path);
+void __connman_counter_usage_pending(const char *path);
 
 int __connman_counter_init(void);
 void __connman_counter_cleanup(void);
@@ -265,6 +272,12 @@ int __connman_resolvfile_append(int index, const char *domain, const char *serve
 int __connman_resolvfile_remove(int index, const char *domain, const char *server);
 int __connman_resolver_redo_servers(int index);
 int __connman_resolver_set_mdns(int index, bool enabled);
+int __connman_resolver_set_dns_over_tls(int index, bool enabled);
+
+int __connman_storage_init(unsigned int delay);
+void __connman_storage_cleanup(void);
+void __connman_storage_append_statistics(DBusMessageIter *dict);
+void __connman_storage_flush(void);
 
 GKeyFile *__connman_storage_open_global(void);
 GKeyFile *__connman_storage_load_global(void);
@@ -346,13 +359,17 @@ void __connman_ipconfig_enable_ipv6(struct connman_ipconfig *ipconfig);
 int __connman_ipconfig_init(void);
 void __connman_ipconfig_cleanup(void);
 
-struct rtnl_link_stats;
+struct rtnl_link_stats64;
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats);
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats);
+				struct rtnl_link_stats64 *stats, bool stats32);
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats,
+							bool stats32);
+void __connman_ipconfig_update_stats(int index,
+					struct rtnl_link_stats64 *stats);
+int __connman_ipconfig_request_stats(void);
 int __connman_ipconfig_newaddr(int index, int family, const char *label,
 				unsigned char prefixlen, const char *address);
 void __connman_ipconfig_deladdr(int index, int family, const char *label,
@@ -617,6 +634,8 @@ int __connman_network_enable_ipconfig(struct connman_network *network,
 const char *__connman_network_get_type(struct connman_network *network);
 const char *__connman_network_get_group(struct connman_network *network);
 const char *__connman_network_get_ident(struct connman_network *network);
+const char *__connman_network_get_service_ident(struct connman_network *network);
+void __connman_network_reset_service_ident(struct connman_network *network);
 bool __connman_network_get_weakness(struct connman_network *network);
 bool __connman_network_native_autoconnect(struct connman_network *network);
 
@@ -687,11 +706,14 @@ int __connman_service_move(struct connman_service *service,
 int __connman_service_load_modifiable(struct connman_service *service);
 
 void __connman_service_list_struct(DBusMessageIter *iter);
+int __connman_service_register_delta(const char *owner);
+int __connman_service_unregister_delta(const char *owner);
 
 int __connman_service_compare(const struct connman_service *a,
 					const struct connman_service *b);
 
 struct connman_service *__connman_service_lookup_from_index(int index);
+void __connman_service_index_changed(int index);
 struct connman_service *__connman_service_create_from_network(struct connman_network *network);
 struct connman_service *__connman_service_create_from_provider(struct connman_provider *provider);
 bool __connman_service_index_is_default(int index);
@@ -731,6 +753,8 @@ void __connman_service_set_search_domains(struct connman_service *service,
 					char **domains);
 int __connman_service_set_mdns(struct connman_service *service,
 					bool enabled);
+int __connman_service_set_dns_over_tls(struct connman_service *service,
+					bool enabled);
 
 void __connman_service_set_string(struct connman_service *service,
 					const char *key, const char *value);
@@ -831,13 +855,16 @@ int __connman_service_reset_ipconfig(struct connman_service *service,
 		enum connman_service_state *new_state);
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_error, unsigned int tx_error,
-			unsigned int rx_dropped, unsigned int tx_dropped);
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_error, uint64_t tx_error,
+			uint64_t rx_dropped, uint64_t tx_dropped,
+			bool stats32);
 
 int __connman_service_counter_register(const char *counter);
 void __connman_service_counter_unregister(const char *counter);
+void __connman_service_counter_append_usage(const char *counter,
+						DBusMessageIter *iter);
 
 #include <connman/peer.h>
 
@@ -905,6 +932,7 @@ enum connman_device_type __connman_rtnl_get_device_type(int index);
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
 int __connman_rtnl_request_update(void);
+int __connman_rtnl_request_stats(int index);
 int __connman_rtnl_send(const void *buf, size_t len);
 
 bool __connman_session_policy_autoconnect(enum connman_service_connect_reason reason);
@@ -916,14 +944,14 @@ int __connman_session_init(void);
 void __connman_session_cleanup(void);
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
@@ -938,6 +966,35 @@ int __connman_stats_get(struct connman_service *service,
 				bool roaming,
 				struct connman_stats_data *data);
 
+enum connman_stats_resolution {
+	CONNMAN_STATS_RESOLUTION_HOUR  = 0,
+	CONNMAN_STATS_RESOLUTION_DAY   = 1,
+	CONNMAN_STATS_RESOLUTION_MONTH = 2,
+};
+
+#define CONNMAN_STATS_RESOLUTION_MAX 3
+
+struct connman_stats_usage {
+	int64_t start;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t roaming_rx_bytes;
+	uint64_t roaming_tx_bytes;
+	uint64_t roaming_rx_packets;
+	uint64_t roaming_tx_packets;
+};
+
+typedef void (*connman_stats_usage_cb_t) (
+				struct connman_stats_usage *usage,
+				void *user_data);
+
+int __connman_stats_get_usage(struct connman_service *service,
+				enum connman_stats_resolution resolution,
+				time_t start, time_t end,
+				connman_stats_usage_cb_t cb, void *user_data);
+
 int __connman_iptables_dump(int type,
 				const char *table_name);
 int __connman_iptables_new_chain(int type,
@@ -987,7 +1044,9 @@ void __connman_dnsproxy_remove_listener(int index);
 int __connman_dnsproxy_append(int index, const char *domain, const char *server);
 int __connman_dnsproxy_remove(int index, const char *domain, const char *server);
 int __connman_dnsproxy_set_mdns(int index, bool enabled);
+int __connman_dnsproxy_set_dns_over_tls(int index, bool enabled);
 void __connman_dnsproxy_set_listen_port(unsigned int port);
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
@@ -1035,6 +1094,9 @@ void __connman_nat_disable(const char *name);
 
 struct firewall_context;
 
+int __connman_firewall_begin(void);
+int __connman_firewall_commit(void);
+
 struct firewall_context *__connman_firewall_create(void);
 void __connman_firewall_destroy(struct firewall_context *ctx);
 int __connman_firewall_enable_nat(struct firewall_context *ctx,
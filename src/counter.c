@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <inttypes.h>
 
 #include <gdbus.h>
 
@@ -34,10 +35,21 @@ static DBusConnection *connection;
 static GHashTable *counter_table;
 static GHashTable *owner_mapping;
 
+/*
+ * Batched counters get the usage of all services in one UsageBatch
+ * call. The services reporting within this delay after the first one
+ * are collected into the same call.
+ */
+#define USAGE_BATCH_DELAY 200
+
 struct connman_counter {
 	char *owner;
 	char *path;
 	unsigned int interval;
+	uint64_t byte_threshold;
+	uint64_t packet_threshold;
+	bool batch;
+	guint batch_timeout;
 	guint watch;
 };
 
@@ -51,6 +63,9 @@ static void remove_counter(gpointer user_data)
 
 	__connman_service_counter_unregister(counter->path);
 
+	if (counter->batch_timeout > 0)
+		g_source_remove(counter->batch_timeout);
+
 	g_free(counter->owner);
 	g_free(counter->path);
 	g_free(counter);
@@ -67,12 +82,15 @@ static void owner_disconnect(DBusConnection *conn, void *user_data)
 }
 
 int __connman_counter_register(const char *owner, const char *path,
-						unsigned int interval)
+				unsigned int interval, uint64_t byte_threshold,
+				uint64_t packet_threshold, bool batch)
 {
 	struct connman_counter *counter;
 	int err;
 
-	DBG("owner %s path %s interval %u", owner, path, interval);
+	DBG("owner %s path %s interval %u bytes %" PRIu64 " packets %"
+		PRIu64 " batch %d", owner, path, interval, byte_threshold,
+		packet_threshold, batch);
 
 	counter = g_hash_table_lookup(counter_table, path);
 	if (counter)
@@ -84,6 +102,10 @@ int __connman_counter_register(const char *owner, const char *path,
 
 	counter->owner = g_strdup(owner);
 	counter->path = g_strdup(path);
+	counter->interval = interval;
+	counter->byte_threshold = byte_threshold;
+	counter->packet_threshold = packet_threshold;
+	counter->batch = batch;
 
 	err = __connman_service_counter_register(counter->path);
 	if (err < 0) {
@@ -96,7 +118,6 @@ int __connman_counter_register(const char *owner, const char *path,
 	g_hash_table_replace(counter_table, counter->path, counter);
 	g_hash_table_replace(owner_mapping, counter->owner, counter);
 
-	counter->interval = interval;
 	__connman_rtnl_update_interval_add(counter->interval);
 
 	counter->watch = g_dbus_add_disconnect_watch(connection, owner,
@@ -127,6 +148,103 @@ int __connman_counter_unregister(const char *owner, const char *path)
 	return 0;
 }
 
+unsigned int __connman_counter_get_interval(const char *path)
+{
+	struct connman_counter *counter;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (!counter)
+		return 0;
+
+	return counter->interval;
+}
+
+/*
+ * Without thresholds every change is reported, otherwise only once the
+ * traffic since the last report reached one of them.
+ */
+bool __connman_counter_threshold_reached(const char *path,
+					uint64_t bytes, uint64_t packets)
+{
+	struct connman_counter *counter;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (!counter)
+		return false;
+
+	if (counter->byte_threshold == 0 && counter->packet_threshold == 0)
+		return bytes > 0 || packets > 0;
+
+	if (counter->byte_threshold > 0 && bytes >= counter->byte_threshold)
+		return true;
+
+	return counter->packet_threshold > 0 &&
+				packets >= counter->packet_threshold;
+}
+
+bool __connman_counter_is_batched(const char *path)
+{
+	struct connman_counter *counter;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (!counter)
+		return false;
+
+	return counter->batch;
+}
+
+static gboolean send_usage_batch(gpointer user_data)
+{
+	struct connman_counter *counter = user_data;
+	DBusMessageIter iter, array;
+	DBusMessage *message;
+
+	counter->batch_timeout = 0;
+
+	DBG("owner %s path %s", counter->owner, counter->path);
+
+	message = dbus_message_new_method_call(counter->owner, counter->path,
+				CONNMAN_COUNTER_INTERFACE, "UsageBatch");
+	if (!message)
+		return FALSE;
+
+	dbus_message_set_no_reply(message, TRUE);
+
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_OBJECT_PATH_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	__connman_service_counter_append_usage(counter->path, &array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	g_dbus_send_message(connection, message);
+
+	return FALSE;
+}
+
+void __connman_counter_usage_pending(const char *path)
+{
+	struct connman_counter *counter;
+
+	counter = g_hash_table_lookup(counter_table, path);
+	if (!counter || counter->batch_timeout > 0)
+		return;
+
+	counter->batch_timeout = g_timeout_add(USAGE_BATCH_DELAY,
+						send_usage_batch, counter);
+}
+
 void __connman_counter_send_usage(const char *path,
 					DBusMessage *message)
 {
@@ -415,6 +415,62 @@ dbus_bool_t __connman_dbus_append_objpath_array(DBusMessage *msg,
 	return TRUE;
 }
 
+/*
+ * Copies the value at the position of from, including containers. The
+ * signature of arrays and variants of basic types is built on the stack,
+ * only those holding containers need libdbus to allocate it.
+ */
+void __connman_dbus_append_iter(DBusMessageIter *iter, DBusMessageIter *from)
+{
+	DBusMessageIter from_sub, iter_sub;
+	char *sig = NULL, basic_sig[2] = { 0, 0 };
+	const char *contained = NULL;
+	int type;
+
+	type = dbus_message_iter_get_arg_type(from);
+
+	if (dbus_type_is_basic(type)) {
+		/* large enough for any basic type, strings are pointers */
+		union {
+			dbus_uint64_t u64;
+			double dbl;
+			const char *str;
+		} value;
+
+		dbus_message_iter_get_basic(from, &value);
+		dbus_message_iter_append_basic(iter, type, &value);
+		return;
+	}
+
+	if (!dbus_type_is_container(type))
+		return;
+
+	dbus_message_iter_recurse(from, &from_sub);
+
+	if (type == DBUS_TYPE_ARRAY)
+		basic_sig[0] = dbus_message_iter_get_element_type(from);
+	else if (type == DBUS_TYPE_VARIANT)
+		basic_sig[0] = dbus_message_iter_get_arg_type(&from_sub);
+
+	if (basic_sig[0] && dbus_type_is_basic(basic_sig[0])) {
+		contained = basic_sig;
+	} else if (type == DBUS_TYPE_ARRAY || type == DBUS_TYPE_VARIANT) {
+		sig = dbus_message_iter_get_signature(&from_sub);
+		contained = sig;
+	}
+
+	dbus_message_iter_open_container(iter, type, contained, &iter_sub);
+	dbus_free(sig);
+
+	while (dbus_message_iter_get_arg_type(&from_sub) !=
+							DBUS_TYPE_INVALID) {
+		__connman_dbus_append_iter(&iter_sub, &from_sub);
+		dbus_message_iter_next(&from_sub);
+	}
+
+	dbus_message_iter_close_container(iter, &iter_sub);
+}
+
 struct callback_data {
 	void *cb;
 	void *user_data;
@@ -568,8 +568,16 @@ void connman_device_set_interface(struct connman_device *device,
 void connman_device_set_ident(struct connman_device *device,
 							const char *ident)
 {
+	GHashTableIter iter;
+	gpointer key, value;
+
 	g_free(device->ident);
 	device->ident = g_strdup(ident);
+
+	/* the ident is part of the service identifiers of the networks */
+	g_hash_table_iter_init(&iter, device->networks);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		__connman_network_reset_service_ident(value);
 }
 
 const char *connman_device_get_ident(struct connman_device *device)
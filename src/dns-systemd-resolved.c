@@ -41,6 +41,11 @@ struct mdns_data {
 	bool enabled;
 };
 
+struct dns_over_tls_data {
+	int index;
+	bool enabled;
+};
+
 static GHashTable *interface_hash;
 static DBusConnection *connection;
 static GDBusClient *client;
@@ -383,6 +388,11 @@ void __connman_dnsproxy_remove_listener(int index)
 	DBG("");
 }
 
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict)
+{
+	DBG("");
+}
+
 static int setup_resolved(void)
 {
 	connection = connman_dbus_get_connection();
@@ -434,6 +444,37 @@ int __connman_dnsproxy_set_mdns(int index, bool enabled)
 	return 0;
 }
 
+static void setlinkdnsovertls_append(DBusMessageIter *iter, void *user_data)
+{
+	struct dns_over_tls_data *data = user_data;
+	char *val = "no";
+
+	if (data->enabled)
+		val = "yes";
+
+	DBG("SetLinkDNSOverTLS: %d/%s", data->index, val);
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_INT32, &data->index);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &val);
+}
+
+int __connman_dnsproxy_set_dns_over_tls(int index, bool enabled)
+{
+	struct dns_over_tls_data data = { .index = index, .enabled = enabled };
+
+	if (!resolved_proxy)
+		return -ENOENT;
+
+	if (index < 0)
+		return -EINVAL;
+
+	if (!g_dbus_proxy_method_call(resolved_proxy, "SetLinkDNSOverTLS",
+			setlinkdnsovertls_append, NULL, &data, NULL))
+		return -EINVAL;
+
+	return 0;
+}
+
 int __connman_dnsproxy_init(void)
 {
 	int ret;
@@ -37,6 +37,7 @@
 #include <netdb.h>
 #include <resolv.h>
 #include <gweb/gresolv.h>
+#include <gweb/giognutls.h>
 
 #include <glib.h>
 
@@ -97,6 +98,17 @@ struct partial_reply {
 	unsigned char buf[];
 };
 
+struct server_statistics {
+	uint64_t queries;
+	uint64_t replies;
+	uint64_t failures;
+	uint64_t hedges;
+	uint64_t query_time;
+	uint64_t handshakes;
+	uint64_t resumed_handshakes;
+	uint64_t handshake_time;
+};
+
 struct server_data {
 	int index;
 	GList *domains;
@@ -110,8 +122,43 @@ struct server_data {
 	bool enabled;
 	bool connected;
 	struct partial_reply *incoming_reply;
+	/* length prefix of the next reply on stream connections */
+	unsigned char incoming_len[2];
+	unsigned int incoming_len_received;
+	/* replies received over the current stream connection */
+	unsigned int stream_replies;
+	/* DNS-over-TLS (RFC 7858) instead of plain TCP */
+	bool tls;
+	gint64 handshake_start;
+	/* smoothed round trip time and its variance in usec, 0 if unknown */
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int failures_in_row;
+	struct server_statistics stats;
+};
+
+/* a server a request was sent to, see request_send_next() */
+struct server_attempt {
+	struct server_data *server;
+	gint64 sent;
+	bool replied;
 };
 
+/* point in time a request needs attention, see request_timer_dispatch() */
+struct request_deadline {
+	GList link; /* must be first, link.data is the request */
+	gint64 time; /* monotonic, 0 when not armed */
+};
+
+/*
+ * Forwarding a request should not need the heap: requests are recycled
+ * through a small pool, and the query, its name and the servers asked
+ * are kept inside the request unless they are unusually large.
+ */
+#define REQUEST_POOL_SIZE 64
+#define REQUEST_INLINE_LEN 256
+#define REQUEST_INLINE_ATTEMPTS 4
+
 struct request_data {
 	union {
 		struct sockaddr_in6 __sin6; /* Only for the length */
@@ -124,7 +171,6 @@ struct request_data {
 	guint16 srcid;
 	guint16 dstid;
 	guint16 altid;
-	guint timeout;
 	guint watch;
 	guint numserv;
 	guint numresp;
@@ -135,6 +181,17 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	bool append_domain;
+	bool prefetch; /* cache refresh sent on our own, there is no client */
+	GList *link; /* position in request_queue while in flight */
+	GList queue_link; /* storage for link, also used by request_pool */
+	struct server_attempt *attempts; /* servers asked while in flight */
+	unsigned int num_attempts;
+	unsigned int max_attempts;
+	struct server_attempt inline_attempts[REQUEST_INLINE_ATTEMPTS];
+	struct request_deadline expiry;
+	struct request_deadline hedge;
+	/* request and name unless they do not fit, see request_store_query() */
+	unsigned char inline_buf[REQUEST_INLINE_LEN];
 };
 
 struct listener_data {
@@ -172,22 +229,38 @@ struct cache_data {
 	int timeout;
 	uint16_t type;
 	uint16_t answers;
+	uint16_t authority; /* records in the authority section */
+	uint8_t rcode;
+	bool negative; /* NXDOMAIN or NODATA response (RFC 2308) */
+	bool prefetched; /* a fresh copy has been requested from upstream */
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
 };
 
+struct cache_key {
+	char *name; /* question name in DNS wire format */
+	uint16_t type;
+	uint16_t class;
+};
+
 struct cache_entry {
-	char *key;
+	struct cache_key key;
 	bool want_refresh;
 	size_t hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	struct cache_data *data;
+	GList lru; /* position in cache_lru, data points to the entry */
+	size_t size; /* memory accounted for in cache_bytes */
+	GList negative_lru; /* position in cache_negative_lru */
+	size_t negative_size; /* part of size used by negative responses */
 };
 
-struct cache_timeout {
-	time_t current_time;
-	time_t max_timeout;
-	bool try_harder;
+struct cache_statistics {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t negative_hits;
+	uint64_t stale_hits;
+	uint64_t prefetches;
 };
 
 struct domain_question {
@@ -219,13 +292,75 @@ struct domain_rr {
 #define MIN_CACHE_TTL (30)
 
 /*
- * We limit the cache size to some sane value so that cached data does
- * not occupy too much memory. Each cached entry occupies on average
- * about 100 bytes memory (depending on DNS name length).
- * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * SOA record data ends with the 32-bit serial, refresh, retry, expire
+ * and minimum fields.
+ */
+#define SOA_FIXED_SIZE 20
+
+/*
+ * TTL of answers served from expired cache entries when no DNS server
+ * replies, as recommended by RFC 8767.
+ */
+#define STALE_ANSWER_TTL 30
+
+/*
+ * A query goes to the server with the lowest smoothed round trip time
+ * first. If it has not answered within its retransmission timeout
+ * (srtt + 4 * rttvar as in RFC 6298, in msec and clamped below), the
+ * query is also sent to the next best server. Servers without a
+ * measurement yet are ranked as if they had SERVER_INITIAL_RTT, every
+ * failure in a row doubles the rank of a server.
+ */
+#define SERVER_INITIAL_RTT 100000
+#define SERVER_MAX_BACKOFF 6
+#define HEDGE_INITIAL_DELAY 200
+#define HEDGE_MIN_DELAY 20
+#define HEDGE_MAX_DELAY 1000
+
+/*
+ * TCP connections to the DNS servers are shared by all TCP requests
+ * and closed after being idle for this many seconds.
  */
-#define MAX_CACHE_SIZE 256
+#define TCP_IDLE_TIMEOUT 30
+
+/*
+ * DNS-over-TLS servers listen on their own port and require at least
+ * TLS 1.2 (RFC 8310). By default the strict privacy profile is used: the
+ * server must present a certificate valid for its configured name (or its
+ * address) or a key matching its configured pin. The opportunistic profile,
+ * without any authentication, has to be enabled in the configuration.
+ */
+#define DNS_OVER_TLS_PORT "853"
+#define DNS_OVER_TLS_PRIORITY "NORMAL:-VERS-SSL3.0:-VERS-TLS1.0:-VERS-TLS1.1"
+
+/*
+ * UDP sockets are drained with recvmmsg(), up to UDP_BATCH_SIZE
+ * datagrams per call and UDP_MAX_BATCHES calls per main loop wakeup so
+ * that a busy socket does not starve the others. The replies to UDP
+ * clients produced meanwhile are sent with one sendmmsg() per listener
+ * socket, only replies larger than UDP_BATCH_REPLY_LEN go out directly.
+ */
+#define UDP_BATCH_SIZE 16
+#define UDP_MAX_BATCHES 4
+#define UDP_BATCH_MSG_LEN 4096
+#define UDP_BATCH_REPLY_LEN 1232
+
+struct udp_recv_batch {
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_storage addr[UDP_BATCH_SIZE];
+	unsigned char buf[UDP_BATCH_SIZE][UDP_BATCH_MSG_LEN];
+};
+
+struct udp_reply_batch {
+	bool active;
+	int sk;
+	unsigned int count;
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_storage addr[UDP_BATCH_SIZE];
+	unsigned char buf[UDP_BATCH_SIZE][UDP_BATCH_REPLY_LEN];
+};
 
 #define DNS_HEADER_SIZE sizeof(struct domain_hdr)
 #define DNS_HEADER_TCP_EXTRA_BYTES 2
@@ -253,9 +388,39 @@ enum dns_class {
 static int cache_size;
 static GHashTable *cache;
 static int cache_refcount;
+/* cache entries, most recently used first */
+static GQueue cache_lru = G_QUEUE_INIT;
+static size_t cache_bytes;
+static unsigned int cache_max_size;
+static size_t cache_max_bytes;
+/* cache entries holding a negative response, most recently used first */
+static GQueue cache_negative_lru = G_QUEUE_INIT;
+static size_t cache_negative_bytes;
+static size_t cache_max_negative_bytes;
+/* seconds an expired entry is kept for answering when upstream fails */
+static unsigned int cache_stale_time;
+/* percentage of the TTL after which popular entries are prefetched */
+static unsigned int cache_prefetch_threshold;
+static struct cache_statistics cache_stats;
 static GSList *server_list;
-static GSList *request_list;
+/* in-flight requests in arrival order */
+static GQueue request_queue = G_QUEUE_INIT;
+/* released requests kept for reuse */
+static GQueue request_pool = G_QUEUE_INIT;
+/* armed request deadlines, earliest first */
+static GQueue request_expiry_queue = G_QUEUE_INIT;
+static GQueue request_hedge_queue = G_QUEUE_INIT;
+/* fires at the earliest deadline of both queues */
+static GSource *request_timer;
+/* in-flight requests indexed by both their dstid and altid */
+static GHashTable *request_table;
 static GHashTable *listener_table;
+/* interfaces whose DNS servers are only queried over TLS */
+static GHashTable *tls_index_table;
+/* TLS session parameters for resumption, by server address */
+static GHashTable *tls_session_table;
+/* DNS-over-TLS servers are not authenticated */
+static bool tls_opportunistic;
 static time_t next_refresh;
 static GHashTable *partial_tcp_req_table;
 static guint cache_timer;
@@ -263,15 +428,40 @@ static in_port_t dns_listen_port = 53;
 /* we can keep using the same resolve's */
 static GResolv *ipv4_resolve;
 static GResolv *ipv6_resolve;
+static struct udp_recv_batch udp_recv_batch;
+static struct udp_reply_batch udp_reply_batch;
+/* set when the kernel lacks recvmmsg() and sendmmsg() */
+static bool udp_mmsg_unsupported;
 
 static guint16 get_id(void)
 {
 	uint64_t rand;
+	guint16 id;
+
+	/*
+	 * Do not hand out an ID which still belongs to an in-flight request,
+	 * otherwise the reply could not be matched unambiguously. Give up
+	 * on that if the whole ID space is taken.
+	 */
+	do {
+		/* TODO: return code is ignored, should we rather abort() on error? */
+		__connman_util_get_random(&rand);
+		id = rand;
+	} while (request_table &&
+			g_hash_table_size(request_table) < G_MAXUINT16 &&
+			g_hash_table_contains(request_table,
+						GUINT_TO_POINTER(id)));
+
+	return id;
+}
 
-	/* TODO: return code is ignored, should we rather abort() on error? */
-	__connman_util_get_random(&rand);
+static void request_assign_ids(struct request_data *req)
+{
+	req->dstid = get_id();
 
-	return rand;
+	do {
+		req->altid = get_id();
+	} while (req->altid == req->dstid);
 }
 
 static size_t protocol_offset(int protocol)
@@ -335,18 +525,300 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 	return end_time;
 }
 
-static struct request_data *find_request(guint16 id)
+static void request_timer_update(void)
 {
-	for (GSList *list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	struct request_deadline *expiry, *hedge;
+	gint64 time = -1;
+
+	if (!request_timer)
+		return;
+
+	expiry = (void *)request_expiry_queue.head;
+	hedge = (void *)request_hedge_queue.head;
+
+	if (expiry)
+		time = expiry->time;
+
+	if (hedge && (time < 0 || hedge->time < time))
+		time = hedge->time;
+
+	g_source_set_ready_time(request_timer, time);
+}
+
+static void request_deadline_clear(GQueue *queue,
+					struct request_deadline *deadline)
+{
+	if (!deadline->time)
+		return;
+
+	g_queue_unlink(queue, &deadline->link);
+	deadline->time = 0;
+
+	request_timer_update();
+}
+
+static void request_deadline_set(GQueue *queue,
+			struct request_deadline *deadline, gint64 time)
+{
+	GList *link = &deadline->link, *prev;
+
+	if (deadline->time)
+		g_queue_unlink(queue, link);
+
+	deadline->time = time;
+
+	/* deadlines are mostly armed in order, search from the end */
+	for (prev = queue->tail; prev; prev = prev->prev) {
+		if (((struct request_deadline *)prev)->time <= time)
+			break;
+	}
+
+	if (!prev) {
+		g_queue_push_head_link(queue, link);
+	} else if (!prev->next) {
+		g_queue_push_tail_link(queue, link);
+	} else {
+		link->prev = prev;
+		link->next = prev->next;
+		prev->next->prev = link;
+		prev->next = link;
+		queue->length++;
+	}
 
-		if (req->dstid == id || req->altid == id)
-			return req;
+	request_timer_update();
+}
+
+static void request_set_timeout(struct request_data *req,
+						unsigned int seconds)
+{
+	request_deadline_set(&request_expiry_queue, &req->expiry,
+		g_get_monotonic_time() + (gint64)seconds * G_USEC_PER_SEC);
+}
+
+static struct request_data *request_data_new(void)
+{
+	struct request_data *req;
+	GList *link;
+
+	link = g_queue_pop_head_link(&request_pool);
+	if (link) {
+		req = link->data;
+		memset(req, 0, sizeof(*req));
+	} else {
+		req = g_try_new0(struct request_data, 1);
+		if (!req)
+			return NULL;
+	}
+
+	req->queue_link.data = req;
+	req->expiry.link.data = req;
+	req->hedge.link.data = req;
+	req->attempts = req->inline_attempts;
+	req->max_attempts = REQUEST_INLINE_ATTEMPTS;
+
+	return req;
+}
+
+/*
+ * Keeps a copy of the request and its name, both in one buffer which
+ * is the one inside the request if they fit.
+ */
+static int request_store_query(struct request_data *req,
+			const void *request, size_t len, const char *name)
+{
+	size_t name_len = strlen(name) + 1;
+	unsigned char *buf = req->inline_buf;
+
+	if (len + name_len > sizeof(req->inline_buf)) {
+		buf = g_try_malloc(len + name_len);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	memcpy(buf, request, len);
+	memcpy(buf + len, name, name_len);
+
+	req->request = buf;
+	req->request_len = len;
+	req->name = buf + len;
+
+	return 0;
+}
+
+static struct server_attempt *request_find_attempt(
+					struct request_data *req,
+					struct server_data *server)
+{
+	for (unsigned int i = 0; i < req->num_attempts; i++) {
+		if (req->attempts[i].server == server)
+			return &req->attempts[i];
 	}
 
 	return NULL;
 }
 
+static struct server_attempt *request_add_attempt(struct request_data *req,
+				struct server_data *server, bool hedge)
+{
+	struct server_attempt *attempt;
+
+	if (req->num_attempts == req->max_attempts) {
+		unsigned int max = req->max_attempts * 2;
+
+		if (req->attempts == req->inline_attempts) {
+			req->attempts = g_new(struct server_attempt, max);
+			memcpy(req->attempts, req->inline_attempts,
+					sizeof(req->inline_attempts));
+		} else {
+			req->attempts = g_renew(struct server_attempt,
+							req->attempts, max);
+		}
+
+		req->max_attempts = max;
+	}
+
+	attempt = &req->attempts[req->num_attempts++];
+	attempt->server = server;
+	attempt->sent = g_get_monotonic_time();
+	attempt->replied = false;
+
+	server->stats.queries++;
+	if (hedge)
+		server->stats.hedges++;
+
+	return attempt;
+}
+
+static void server_record_failure(struct server_data *server)
+{
+	server->stats.failures++;
+	server->failures_in_row++;
+}
+
+static void server_update_rtt(struct server_data *server, unsigned int rtt)
+{
+	unsigned int delta;
+
+	if (!server->srtt) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+	} else {
+		delta = rtt > server->srtt ? rtt - server->srtt :
+						server->srtt - rtt;
+		server->rttvar = (3 * server->rttvar + delta) / 4;
+		server->srtt = (7 * server->srtt + rtt) / 8;
+	}
+
+	/* zero means there is no measurement yet */
+	if (!server->srtt)
+		server->srtt = 1;
+}
+
+static void server_record_reply(struct server_data *server,
+				struct request_data *req, int rcode)
+{
+	struct server_attempt *attempt = request_find_attempt(req, server);
+	gint64 rtt;
+
+	/* only the first reply to each query is timed */
+	if (!attempt || attempt->replied || !attempt->sent)
+		return;
+
+	attempt->replied = true;
+	server->stats.replies++;
+
+	rtt = g_get_monotonic_time() - attempt->sent;
+	server_update_rtt(server, MIN(rtt, G_MAXUINT));
+	server->stats.query_time += rtt;
+
+	if (rcode == ns_r_servfail || rcode == ns_r_refused)
+		server_record_failure(server);
+	else
+		server->failures_in_row = 0;
+}
+
+static void server_record_timeouts(struct request_data *req)
+{
+	for (unsigned int i = 0; i < req->num_attempts; i++) {
+		if (!req->attempts[i].replied)
+			server_record_failure(req->attempts[i].server);
+	}
+}
+
+static void request_free_attempts(struct request_data *req)
+{
+	if (req->attempts != req->inline_attempts)
+		g_free(req->attempts);
+
+	req->attempts = req->inline_attempts;
+	req->max_attempts = REQUEST_INLINE_ATTEMPTS;
+	req->num_attempts = 0;
+
+	request_deadline_clear(&request_hedge_queue, &req->hedge);
+}
+
+/*
+ * Only in-flight requests know about servers, drop the attempts of
+ * a server that is going away.
+ */
+static void request_forget_server(struct server_data *server)
+{
+	for (GList *list = request_queue.head; list; list = list->next) {
+		struct request_data *req = list->data;
+		struct server_attempt *attempt;
+
+		attempt = request_find_attempt(req, server);
+		if (!attempt)
+			continue;
+
+		*attempt = req->attempts[--req->num_attempts];
+	}
+}
+
+static struct request_data *find_request(guint16 id)
+{
+	if (!request_table)
+		return NULL;
+
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
+}
+
+static void request_insert(struct request_data *req)
+{
+	req->link = &req->queue_link;
+	g_queue_push_tail_link(&request_queue, req->link);
+
+	if (!request_table)
+		return;
+
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid), req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid), req);
+}
+
+static void request_unindex_id(struct request_data *req, guint16 id)
+{
+	if (g_hash_table_lookup(request_table, GUINT_TO_POINTER(id)) == req)
+		g_hash_table_remove(request_table, GUINT_TO_POINTER(id));
+}
+
+static void request_remove(struct request_data *req)
+{
+	if (!req->link)
+		return;
+
+	g_queue_unlink(&request_queue, req->link);
+	req->link = NULL;
+
+	/* replies can no longer be matched, stop timing and hedging */
+	request_free_attempts(req);
+
+	if (!request_table)
+		return;
+
+	request_unindex_id(req, req->dstid);
+	request_unindex_id(req, req->altid);
+}
+
 static struct server_data *find_server(int index,
 					const char *server,
 						int protocol)
@@ -374,6 +846,15 @@ static struct server_data *find_server(int index,
 	return NULL;
 }
 
+static bool server_uses_tls(struct server_data *server)
+{
+	if (!tls_index_table || server->index < 0)
+		return false;
+
+	return g_hash_table_contains(tls_index_table,
+					GINT_TO_POINTER(server->index));
+}
+
 static void dummy_resolve_func(GResolvResultStatus status,
 					char **results, gpointer user_data)
 {
@@ -397,14 +878,14 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		g_resolv_add_nameserver(ipv6_resolve, "::1", 53, 0);
 	}
 
-	if (!entry->ipv4) {
+	if (!entry->data && entry->key.type == DNS_TYPE_A) {
 		debug("Refreshing A record for %s", name);
 		g_resolv_lookup_hostname(ipv4_resolve, name,
 					dummy_resolve_func, NULL);
 		age = 4;
 	}
 
-	if (!entry->ipv6) {
+	if (!entry->data && entry->key.type == DNS_TYPE_AAAA) {
 		debug("Refreshing AAAA record for %s", name);
 		g_resolv_lookup_hostname(ipv6_resolve, name,
 					dummy_resolve_func, NULL);
@@ -473,11 +954,146 @@ static void update_cached_ttl(unsigned char *ptr, int len, int new_ttl)
 	}
 }
 
-static void send_cached_response(int sk, const unsigned char *ptr, size_t len,
+/*
+ * Receives the next batch of datagrams from sk into udp_recv_batch and
+ * returns their number.
+ */
+static int udp_recv_batch_fill(int sk)
+{
+	struct udp_recv_batch *batch = &udp_recv_batch;
+	struct msghdr *hdr;
+	ssize_t len;
+	int i, count;
+
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		hdr = &batch->msgs[i].msg_hdr;
+
+		batch->iov[i].iov_base = batch->buf[i];
+		batch->iov[i].iov_len = UDP_BATCH_MSG_LEN;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name = &batch->addr[i];
+		hdr->msg_namelen = sizeof(batch->addr[i]);
+		hdr->msg_iov = &batch->iov[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	if (!udp_mmsg_unsupported) {
+		count = recvmmsg(sk, batch->msgs, UDP_BATCH_SIZE,
+							MSG_DONTWAIT, NULL);
+		if (count >= 0)
+			return count;
+
+		if (errno != ENOSYS)
+			return -errno;
+
+		udp_mmsg_unsupported = true;
+	}
+
+	hdr = &batch->msgs[0].msg_hdr;
+	len = recvfrom(sk, batch->buf[0], UDP_BATCH_MSG_LEN, MSG_DONTWAIT,
+				hdr->msg_name, &hdr->msg_namelen);
+	if (len < 0)
+		return -errno;
+
+	batch->msgs[0].msg_len = len;
+
+	return 1;
+}
+
+static void udp_reply_flush(void)
+{
+	struct udp_reply_batch *batch = &udp_reply_batch;
+	unsigned int sent = 0;
+	int err = -1;
+
+	while (sent < batch->count) {
+		struct msghdr *hdr = &batch->msgs[sent].msg_hdr;
+
+		if (!udp_mmsg_unsupported) {
+			err = sendmmsg(batch->sk, batch->msgs + sent,
+					batch->count - sent, MSG_NOSIGNAL);
+			if (err < 0 && errno == ENOSYS)
+				udp_mmsg_unsupported = true;
+		}
+
+		if (udp_mmsg_unsupported) {
+			err = sendto(batch->sk, hdr->msg_iov->iov_base,
+					hdr->msg_iov->iov_len, MSG_NOSIGNAL,
+					hdr->msg_name, hdr->msg_namelen);
+			if (err >= 0)
+				err = 1;
+		}
+
+		if (err <= 0) {
+			connman_error("Cannot send DNS reply to %d: %s",
+					batch->sk, strerror(errno));
+			/* drop the reply which failed, as sendto() would */
+			err = 1;
+		}
+
+		sent += err;
+	}
+
+	batch->count = 0;
+}
+
+static void udp_reply_batch_begin(void)
+{
+	udp_reply_batch.active = true;
+}
+
+static void udp_reply_batch_end(void)
+{
+	udp_reply_flush();
+	udp_reply_batch.active = false;
+}
+
+/*
+ * Sends a reply to a client. While a batch is open, UDP replies are
+ * queued and sent by udp_reply_batch_end(). Stream clients have no
+ * destination address and are always served right away.
+ */
+static ssize_t udp_reply_send(int sk, const void *buf, size_t len,
+				const struct sockaddr *to, socklen_t tolen)
+{
+	struct udp_reply_batch *batch = &udp_reply_batch;
+	struct msghdr *hdr;
+	unsigned int i;
+
+	if (!batch->active || !to || len > UDP_BATCH_REPLY_LEN ||
+			tolen > sizeof(batch->addr[0]))
+		return sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+
+	if (batch->count > 0 && (batch->sk != sk ||
+				batch->count == UDP_BATCH_SIZE))
+		udp_reply_flush();
+
+	i = batch->count++;
+	batch->sk = sk;
+
+	memcpy(batch->buf[i], buf, len);
+	memcpy(&batch->addr[i], to, tolen);
+	batch->iov[i].iov_base = batch->buf[i];
+	batch->iov[i].iov_len = len;
+
+	hdr = &batch->msgs[i].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = &batch->addr[i];
+	hdr->msg_namelen = tolen;
+	hdr->msg_iov = &batch->iov[i];
+	hdr->msg_iovlen = 1;
+
+	return len;
+}
+
+static void send_cached_response(int sk, struct cache_data *data,
 				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
+				int protocol, int id, int ttl)
 {
 	struct domain_hdr *hdr = NULL;
+	const unsigned char *ptr = data->data;
+	size_t len = data->data_len;
 	int err;
 	const size_t offset = protocol_offset(protocol);
 	/*
@@ -497,23 +1113,23 @@ static void send_cached_response(int sk, const unsigned char *ptr, size_t len,
 
 	hdr->id = id;
 	hdr->qr = 1;
-	hdr->rcode = ns_r_noerror;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
+	hdr->rcode = data->rcode;
+	hdr->ancount = htons(data->answers);
+	hdr->nscount = htons(data->authority);
 	hdr->arcount = 0;
 
-	/* if this is a negative reply, we are authoritative */
-	if (answers == 0)
-		hdr->aa = 1;
-	else {
-		const int adj_len = len - 2;
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
-	}
+	/*
+	 * For negative replies this also counts down the TTL of the SOA
+	 * record, which tells the client how long to cache the negative
+	 * answer itself.
+	 */
+	const int adj_len = len - 2;
+	update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
 
 	debug("sk %d id 0x%04x answers %d ptr %p length %zd dns %zd",
-		sk, hdr->id, answers, ptr, len, dns_len);
+		sk, hdr->id, data->answers, ptr, len, dns_len);
 
-	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
+	err = udp_reply_send(sk, ptr, len, to, tolen);
 	if (err < 0) {
 		connman_error("Cannot send cached DNS response: %s",
 				strerror(errno));
@@ -553,7 +1169,7 @@ static void send_response(int sk, unsigned char *buf, size_t len,
 	hdr->nscount = 0;
 	hdr->arcount = 0;
 
-	err = sendto(sk, buf, send_size, MSG_NOSIGNAL, to, tolen);
+	err = udp_reply_send(sk, buf, send_size, to, tolen);
 	if (err < 0) {
 		connman_error("Failed to send DNS response to %d: %s",
 				sk, strerror(errno));
@@ -564,6 +1180,9 @@ static int get_req_udp_socket(struct request_data *req)
 {
 	GIOChannel *channel;
 
+	if (!req->ifdata)
+		return -1;
+
 	if (req->family == AF_INET)
 		channel = req->ifdata->udp4_listener_channel;
 	else
@@ -577,99 +1196,45 @@ static int get_req_udp_socket(struct request_data *req)
 
 static void destroy_request_data(struct request_data *req)
 {
-	if (req->timeout > 0)
-		g_source_remove(req->timeout);
+	request_remove(req);
+	request_free_attempts(req);
+	request_deadline_clear(&request_expiry_queue, &req->expiry);
 
 	g_free(req->resp);
-	g_free(req->request);
-	g_free(req->name);
-	g_free(req);
+
+	/* the name is stored together with the request */
+	if (req->request != req->inline_buf)
+		g_free(req->request);
+
+	if (request_pool.length < REQUEST_POOL_SIZE)
+		g_queue_push_head_link(&request_pool, &req->queue_link);
+	else
+		g_free(req);
 }
 
-static gboolean request_timeout(gpointer user_data)
+static int append_data(unsigned char *buf, size_t size, const char *data)
 {
-	struct request_data *req = user_data;
-	struct sockaddr *sa;
-	int sk = -1;
+	unsigned char *ptr = buf;
+	size_t len;
 
-	if (!req)
-		return FALSE;
+	while (true) {
+		const char *dot = strchr(data, '.');
+		len = dot ? dot - data : strlen(data);
 
-	debug("id 0x%04x", req->srcid);
+		if (len == 0)
+			break;
+		else if (size < len + 1)
+			return -1;
 
-	request_list = g_slist_remove(request_list, req);
+		*ptr = len;
+		memcpy(ptr + 1, data, len);
+		ptr += len + 1;
+		size -= len + 1;
 
-	if (req->protocol == IPPROTO_UDP) {
-		sk = get_req_udp_socket(req);
-		sa = &req->sa;
-	} else if (req->protocol == IPPROTO_TCP) {
-		sk = req->client_sk;
-		sa = NULL;
-	}
-
-	if (sk < 0)
-		goto out;
-
-	if (req->resplen > 0 && req->resp) {
-		/*
-		 * Here we have received at least one reply (probably telling
-		 * "not found" result), so send that back to client instead
-		 * of more fatal server failed error.
-		 */
-		sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
-			sa, req->sa_len);
-
-	} else if (req->request) {
-		/*
-		 * There was not reply from server at all.
-		 */
-		struct domain_hdr *hdr = (void *)(req->request + protocol_offset(req->protocol));
-		hdr->id = req->srcid;
-
-		send_response(sk, req->request, req->request_len,
-			sa, req->sa_len, req->protocol);
-	}
-
-	/*
-	 * We cannot leave TCP client hanging so just kick it out
-	 * if we get a request timeout from server.
-	 */
-	if (req->protocol == IPPROTO_TCP) {
-		debug("client %d removed", req->client_sk);
-		g_hash_table_remove(partial_tcp_req_table,
-				GINT_TO_POINTER(req->client_sk));
-	}
-
-out:
-	req->timeout = 0;
-	destroy_request_data(req);
-
-	return FALSE;
-}
-
-static int append_data(unsigned char *buf, size_t size, const char *data)
-{
-	unsigned char *ptr = buf;
-	size_t len;
-
-	while (true) {
-		const char *dot = strchr(data, '.');
-		len = dot ? dot - data : strlen(data);
-
-		if (len == 0)
-			break;
-		else if (size < len + 1)
-			return -1;
-
-		*ptr = len;
-		memcpy(ptr + 1, data, len);
-		ptr += len + 1;
-		size -= len + 1;
-
-		if (!dot)
-			break;
-
-		data = dot + 1;
+		if (!dot)
+			break;
+
+		data = dot + 1;
 	}
 
 	return ptr - buf;
@@ -713,169 +1278,652 @@ static bool cache_check_is_valid(struct cache_data *data, time_t current_time)
 	return true;
 }
 
-static void cache_free_ipv4(struct cache_entry *entry)
+static guint cache_key_hash(gconstpointer ptr)
+{
+	const struct cache_key *key = ptr;
+
+	return g_str_hash(key->name) ^ (key->type << 16 | key->class);
+}
+
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct cache_key *key_a = a, *key_b = b;
+
+	return key_a->type == key_b->type && key_a->class == key_b->class &&
+		g_str_equal(key_a->name, key_b->name);
+}
+
+static const char *cache_type_str(uint16_t type)
+{
+	static char str[8];
+
+	switch (type) {
+	case DNS_TYPE_A:
+		return "A";
+	case DNS_TYPE_AAAA:
+		return "AAAA";
+	case DNS_TYPE_CNAME:
+		return "CNAME";
+	case DNS_TYPE_SOA:
+		return "SOA";
+	}
+
+	snprintf(str, sizeof(str), "%u", type);
+	return str;
+}
+
+/*
+ * Zone transfers and meta queries cannot be answered from the cache.
+ */
+static bool cache_is_cacheable(uint16_t type, uint16_t class)
+{
+	if (class == DNS_CLASS_ANY)
+		return false;
+
+	switch (type) {
+	case ns_t_ixfr:
+	case ns_t_axfr:
+	case ns_t_mailb:
+	case ns_t_maila:
+	case ns_t_any:
+	case ns_t_opt:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * only address lookups can be refreshed in the background via GResolv
+ */
+static bool cache_is_refreshable(struct cache_entry *entry)
 {
-	if (!entry->ipv4)
+	return entry->key.class == DNS_CLASS_IN &&
+		(entry->key.type == DNS_TYPE_A ||
+			entry->key.type == DNS_TYPE_AAAA);
+}
+
+/*
+ * recalculate the memory used by a cache entry after its data changed
+ */
+static void cache_update_size(struct cache_entry *entry)
+{
+	size_t size = sizeof(*entry) + strlen(entry->key.name) + 1;
+	size_t negative_size = 0;
+
+	if (entry->data) {
+		size += sizeof(*entry->data) + entry->data->data_len;
+
+		if (entry->data->negative)
+			negative_size = sizeof(*entry->data) +
+						entry->data->data_len;
+	}
+
+	cache_bytes -= entry->size;
+	entry->size = size;
+	cache_bytes += entry->size;
+
+	if (negative_size && !entry->negative_size)
+		g_queue_push_head_link(&cache_negative_lru,
+						&entry->negative_lru);
+	else if (!negative_size && entry->negative_size)
+		g_queue_unlink(&cache_negative_lru, &entry->negative_lru);
+
+	cache_negative_bytes -= entry->negative_size;
+	entry->negative_size = negative_size;
+	cache_negative_bytes += entry->negative_size;
+}
+
+static void cache_free_data(struct cache_entry *entry)
+{
+	if (!entry->data)
 		return;
 
-	g_free(entry->ipv4->data);
-	g_free(entry->ipv4);
-	entry->ipv4 = NULL;
+	g_free(entry->data->data);
+	g_free(entry->data);
+	entry->data = NULL;
+
+	cache_update_size(entry);
+}
+
+static void cache_touch(struct cache_entry *entry)
+{
+	if (cache_lru.head != &entry->lru) {
+		g_queue_unlink(&cache_lru, &entry->lru);
+		g_queue_push_head_link(&cache_lru, &entry->lru);
+	}
+
+	if (entry->negative_size &&
+			cache_negative_lru.head != &entry->negative_lru) {
+		g_queue_unlink(&cache_negative_lru, &entry->negative_lru);
+		g_queue_push_head_link(&cache_negative_lru,
+						&entry->negative_lru);
+	}
+}
+
+static bool cache_is_full(void)
+{
+	if (cache_size > 0 && (unsigned int)cache_size > cache_max_size)
+		return true;
+
+	return cache_max_bytes > 0 && cache_bytes > cache_max_bytes;
+}
+
+/*
+ * evict least recently used entries until the cache fits into its limits
+ * again, keep is the entry that was just added or updated
+ */
+static void cache_make_room(struct cache_entry *keep)
+{
+	while (cache_is_full() && cache_lru.tail &&
+			cache_lru.tail != &keep->lru) {
+		struct cache_entry *entry = cache_lru.tail->data;
+
+		debug("cache evict \"%s\" type %s hits %zu size %zu",
+				entry->key.name, cache_type_str(entry->key.type),
+				entry->hits, entry->size);
+
+		cache_stats.evictions++;
+		g_hash_table_remove(cache, &entry->key);
+	}
+
+	while (cache_negative_bytes > cache_max_negative_bytes &&
+			cache_negative_lru.tail &&
+			cache_negative_lru.tail != &keep->negative_lru) {
+		struct cache_entry *entry = cache_negative_lru.tail->data;
+
+		debug("cache evict negative \"%s\" type %s size %zu",
+				entry->key.name, cache_type_str(entry->key.type),
+				entry->negative_size);
+
+		cache_stats.evictions++;
+		g_hash_table_remove(cache, &entry->key);
+	}
+}
+
+static struct cache_entry *cache_entry_new(const char *question,
+						uint16_t type, uint16_t class)
+{
+	struct cache_entry *entry = g_try_new0(struct cache_entry, 1);
+
+	if (!entry)
+		return NULL;
+
+	entry->key.name = g_strdup(question);
+	entry->key.type = type;
+	entry->key.class = class;
+	entry->lru.data = entry;
+	entry->negative_lru.data = entry;
+
+	return entry;
+}
+
+static void cache_entry_free(struct cache_entry *entry)
+{
+	g_free(entry->key.name);
+	g_free(entry);
+}
+
+static void cache_entry_insert(struct cache_entry *entry)
+{
+	g_hash_table_replace(cache, &entry->key, entry);
+	g_queue_push_head_link(&cache_lru, &entry->lru);
+	cache_size++;
+}
+
+/*
+ * expired data is kept for a while to answer clients when no DNS server
+ * is able to reply (RFC 8767)
+ */
+static bool cache_check_is_stale_valid(struct cache_data *data,
+						time_t current_time)
+{
+	if (!data)
+		return false;
+
+	return data->cache_until + (time_t)cache_stale_time >= current_time;
+}
+
+static bool cache_is_popular(struct cache_entry *entry)
+{
+	return entry->hits > 2;
 }
 
-static void cache_free_ipv6(struct cache_entry *entry)
+/*
+ * remove stale cached entries so that they can be refreshed
+ */
+static void cache_enforce_validity(struct cache_entry *entry)
 {
-	if (!entry->ipv6)
+	time_t current_time = time(NULL);
+
+	if (entry->data &&
+			!cache_check_is_stale_valid(entry->data, current_time)) {
+		debug("cache timeout \"%s\" type %s", entry->key.name,
+					cache_type_str(entry->key.type));
+		cache_free_data(entry);
+	}
+}
+
+/*
+ * returns true if the entry holds data which has not expired yet
+ */
+static bool cache_check_validity(struct cache_entry *entry)
+{
+	const time_t current_time = time(NULL);
+
+	cache_enforce_validity(entry);
+
+	if (cache_check_is_valid(entry->data, current_time))
+		return true;
+
+	debug("cache %s \"%s\" type %s", entry->data ? "stale" : "missing",
+			entry->key.name, cache_type_str(entry->key.type));
+
+	/*
+	 * if we have a popular entry, we want a refresh instead of
+	 * total destruction of the entry.
+	 */
+	if (cache_is_popular(entry) && cache_is_refreshable(entry))
+		entry->want_refresh = true;
+	else if (!entry->data)
+		g_hash_table_remove(cache, &entry->key);
+
+	return false;
+}
+
+/*
+ * new data may replace cached data once it expired or was prefetched
+ */
+static bool cache_check_is_replaceable(struct cache_data *data,
+						time_t current_time)
+{
+	if (!data)
+		return true;
+
+	return data->prefetched || !cache_check_is_valid(data, current_time);
+}
+
+static void cache_element_destroy(gpointer value)
+{
+	struct cache_entry *entry = value;
+
+	if (!entry)
+		return;
+
+	cache_free_data(entry);
+
+	g_queue_unlink(&cache_lru, &entry->lru);
+	cache_bytes -= entry->size;
+
+	cache_entry_free(entry);
+
+	/* TODO: this would be a worrying condition. Does this ever happen? */
+	if (--cache_size < 0)
+		cache_size = 0;
+}
+
+static gboolean try_remove_cache(gpointer user_data)
+{
+	cache_timer = 0;
+
+	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
+		debug("No cache users, removing it.");
+
+		g_hash_table_destroy(cache);
+		cache = NULL;
+		cache_size = 0;
+	}
+
+	return FALSE;
+}
+
+static void create_cache(void)
+{
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
+		cache = g_hash_table_new_full(cache_key_hash,
+					cache_key_equal,
+					NULL,
+					cache_element_destroy);
+		cache_size = 0;
+	}
+}
+
+static bool cache_key_from_request(gpointer request, int proto,
+						struct cache_key *key)
+{
+	const char *question = request + protocol_offset(proto) + DNS_HEADER_SIZE;
+	const size_t offset = strlen(question) + 1;
+	const struct domain_question *q = (void *) (question + offset);
+
+	key->name = (char *)question;
+	key->type = ntohs(q->type);
+	key->class = ntohs(q->class);
+
+	return cache_is_cacheable(key->type, key->class);
+}
+
+/*
+ * returns the cached data for the request even if it has expired, as
+ * long as it is within the stale window
+ */
+static struct cache_data *cache_check_stale(gpointer request, int proto)
+{
+	struct cache_key key;
+	struct cache_entry *entry;
+
+	if (!cache || !request || !cache_stale_time)
+		return NULL;
+
+	if (!cache_key_from_request(request, proto, &key))
+		return NULL;
+
+	entry = g_hash_table_lookup(cache, &key);
+	if (!entry || !cache_check_is_stale_valid(entry->data, time(NULL)))
+		return NULL;
+
+	cache_stats.stale_hits++;
+
+	return entry->data;
+}
+
+/*
+ * lets a popular entry request a fresh copy again after its prefetch
+ * timed out or the servers could not answer it
+ */
+static void cache_prefetch_failed(struct request_data *req)
+{
+	struct cache_key key;
+	struct cache_entry *entry;
+
+	if (!cache || !req->request)
+		return;
+
+	if (!cache_key_from_request(req->request, req->protocol, &key))
 		return;
 
-	g_free(entry->ipv6->data);
-	g_free(entry->ipv6);
-	entry->ipv6 = NULL;
+	entry = g_hash_table_lookup(cache, &key);
+	if (entry && entry->data)
+		entry->data->prefetched = false;
+}
+
+/*
+ * answer the client of a failed request from the cache, if possible
+ */
+static bool send_stale_response(struct request_data *req)
+{
+	struct cache_data *data;
+	const struct sockaddr *sa = NULL;
+	socklen_t sa_len = 0;
+	int sk;
+
+	if (req->prefetch)
+		return false;
+
+	data = cache_check_stale(req->request, req->protocol);
+	if (!data)
+		return false;
+
+	if (req->protocol == IPPROTO_UDP) {
+		sk = get_req_udp_socket(req);
+		sa = &req->sa;
+		sa_len = req->sa_len;
+	} else
+		sk = req->client_sk;
+
+	if (sk < 0)
+		return false;
+
+	debug("serving stale answer for %s", (char *)req->name);
+
+	send_cached_response(sk, data, sa, sa_len, req->protocol,
+					req->srcid, STALE_ANSWER_TTL);
+
+	return true;
+}
+
+/*
+ * Sends a reply without length prefix to the client of the request,
+ * stream clients get the prefix prepended.
+ */
+static ssize_t request_send_answer(struct request_data *req, int sk,
+					const void *answer, size_t len)
+{
+	uint16_t len_hdr = htons(len);
+	struct iovec iov[2] = {
+		{ .iov_base = &len_hdr, .iov_len = sizeof(len_hdr) },
+		{ .iov_base = (void *)answer, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = G_N_ELEMENTS(iov),
+	};
+
+	if (req->protocol == IPPROTO_UDP)
+		return udp_reply_send(sk, answer, len, &req->sa, req->sa_len);
+
+	return sendmsg(sk, &msg, MSG_NOSIGNAL);
+}
+
+static void request_timeout(struct request_data *req)
+{
+	int sk = -1;
+	struct sockaddr *sa;
+
+	debug("id 0x%04x", req->srcid);
+
+	/* servers that did not answer at all are charged a failure */
+	server_record_timeouts(req);
+	request_remove(req);
+
+	if (req->prefetch) {
+		cache_prefetch_failed(req);
+		goto out;
+	}
+
+	if (req->protocol == IPPROTO_UDP) {
+		sk = get_req_udp_socket(req);
+		sa = &req->sa;
+	} else if (req->protocol == IPPROTO_TCP) {
+		sk = req->client_sk;
+		sa = NULL;
+	}
+
+	if (sk < 0)
+		goto out;
+
+	if (req->resplen > 0 && req->resp) {
+		/*
+		 * Here we have received at least one reply (probably telling
+		 * "not found" result), so send that back to client instead
+		 * of more fatal server failed error.
+		 */
+		request_send_answer(req, sk, req->resp, req->resplen);
+
+	} else if (req->request && !send_stale_response(req)) {
+		/*
+		 * There was not reply from server at all and no expired
+		 * answer was left in the cache either.
+		 */
+		struct domain_hdr *hdr = (void *)(req->request + protocol_offset(req->protocol));
+		hdr->id = req->srcid;
+
+		send_response(sk, req->request, req->request_len,
+			sa, req->sa_len, req->protocol);
+	}
+
+	/*
+	 * We cannot leave TCP client hanging so just kick it out
+	 * if we get a request timeout from server.
+	 */
+	if (req->protocol == IPPROTO_TCP) {
+		debug("client %d removed", req->client_sk);
+		g_hash_table_remove(partial_tcp_req_table,
+				GINT_TO_POINTER(req->client_sk));
+	}
+
+out:
+	destroy_request_data(req);
 }
 
 /*
- * remove stale cached entries so that they can be refreshed
+ * turn the DNS wire format name of the entry into a hostname with dots
  */
-static void cache_enforce_validity(struct cache_entry *entry)
+static void cache_entry_hostname(struct cache_entry *entry, char *dns_name,
+								size_t len)
 {
-	time_t current_time = time(NULL);
+	char *c;
 
-	if (entry->ipv4 && !cache_check_is_valid(entry->ipv4, current_time)) {
-		debug("cache timeout \"%s\" type A", entry->key);
-		cache_free_ipv4(entry);
-	}
+	strncpy(dns_name, entry->key.name, len - 1);
+	dns_name[len - 1] = '\0';
 
-	if (entry->ipv6 && !cache_check_is_valid(entry->ipv6, current_time)) {
-		debug("cache timeout \"%s\" type AAAA", entry->key);
-		cache_free_ipv6(entry);
+	c = dns_name;
+	while (*c) {
+		/* fetch the size of the current component and replace
+		   it by a dot */
+		int jump = *c;
+		*c = '.';
+		c += jump + 1;
 	}
+
+	/* drop the leading dot */
+	memmove(dns_name, dns_name + 1, strlen(dns_name));
 }
 
-static bool cache_check_validity(const char *question, uint16_t type,
-				struct cache_entry *entry)
+/*
+ * Sends the question of a popular entry directly to the DNS servers
+ * before the entry expires, so that clients keep getting answers from
+ * the cache. The reply replaces the cached data in cache_update().
+ */
+static void cache_prefetch(struct cache_entry *entry)
 {
-	struct cache_data *cached_ip = NULL, *other_ip = NULL;
-	const time_t current_time = time(NULL);
-	bool want_refresh;
+	unsigned char buf[DNS_HEADER_SIZE + NS_MAXDNAME + DNS_QUESTION_SIZE];
+	char name[NS_MAXDNAME + 1];
+	struct domain_hdr *hdr = (void *)buf;
+	struct domain_question *q;
+	struct request_data *req;
+	size_t name_len = strlen(entry->key.name) + 1;
+	size_t len;
 
-	cache_enforce_validity(entry);
+	/*
+	 * Single label names are resolved by appending the search domains,
+	 * the bare name would not give back the same answer.
+	 */
+	if (name_len <= 1 || (size_t)entry->key.name[0] + 2 >= name_len)
+		return;
 
-	switch (type) {
-	case DNS_TYPE_A: /* IPv4 */
-		cached_ip = entry->ipv4;
-		other_ip = entry->ipv6;
-		break;
+	if (name_len > NS_MAXDNAME)
+		return;
 
-	case DNS_TYPE_AAAA: /* IPv6 */
-		cached_ip = entry->ipv6;
-		other_ip = entry->ipv4;
-		break;
-	default:
-		return false;
-	}
+	req = request_data_new();
+	if (!req)
+		return;
 
-	/*
-	 * if we have a popular entry, we want a refresh instead of
-	 * total destruction of the entry.
-	 */
-	want_refresh = entry->hits > 2 ? true : false;
+	req->protocol = IPPROTO_UDP;
+	req->prefetch = true;
+	request_assign_ids(req);
+
+	memset(hdr, 0, DNS_HEADER_SIZE);
+	hdr->id = req->dstid;
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
 
-	if (!cache_check_is_valid(cached_ip, current_time)) {
-		debug("cache %s \"%s\" type %s",
-				cached_ip ?  "timeout" : "entry missing",
-				question,
-				cached_ip == entry->ipv4 ? "A" : "AAAA");
+	memcpy(buf + DNS_HEADER_SIZE, entry->key.name, name_len);
+	q = (void *)(buf + DNS_HEADER_SIZE + name_len);
+	q->type = htons(entry->key.type);
+	q->class = htons(entry->key.class);
+	len = DNS_HEADER_SIZE + name_len + DNS_QUESTION_SIZE;
 
-		if (want_refresh)
-			entry->want_refresh = true;
-		/*
-		 * We do not remove cache entry if there is still a
-		 * valid entry for another IP version found in the cache.
-		 */
-		else if (!cache_check_is_valid(other_ip, current_time)) {
-			g_hash_table_remove(cache, question);
-			return false;
-		}
-	}
+	for (GSList *list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+		int sk;
 
-	return true;
-}
+		if (server->protocol != IPPROTO_UDP || !server->enabled ||
+				!server->channel || server_uses_tls(server))
+			continue;
 
-static void cache_element_destroy(gpointer value)
-{
-	struct cache_entry *entry = value;
+		sk = g_io_channel_unix_get_fd(server->channel);
+		if (sendto(sk, buf, len, MSG_NOSIGNAL, server->server_addr,
+					server->server_addr_len) < 0)
+			continue;
 
-	if (!entry)
+		req->numserv++;
+	}
+
+	cache_entry_hostname(entry, name, sizeof(name));
+
+	if (req->numserv == 0 || request_store_query(req, buf, len, name) < 0) {
+		destroy_request_data(req);
 		return;
+	}
 
-	cache_free_ipv4(entry);
-	cache_free_ipv6(entry);
+	debug("Prefetching %s type %s", name,
+				cache_type_str(entry->key.type));
 
-	g_free(entry->key);
-	g_free(entry);
+	entry->data->prefetched = true;
+	cache_stats.prefetches++;
 
-	/* TODO: this would be a worrying condition. Does this ever happen? */
-	if (--cache_size < 0)
-		cache_size = 0;
+	request_set_timeout(req, 5);
+	request_insert(req);
 }
 
-static gboolean try_remove_cache(gpointer user_data)
+/*
+ * popular entries are refreshed once the given percentage of their
+ * lifetime in the cache has passed
+ */
+static void cache_check_prefetch(struct cache_entry *entry)
 {
-	cache_timer = 0;
+	struct cache_data *data = entry->data;
+	time_t lifetime, current_time;
 
-	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
-		debug("No cache users, removing it.");
+	if (!cache_prefetch_threshold || data->prefetched ||
+			!cache_is_popular(entry))
+		return;
 
-		g_hash_table_destroy(cache);
-		cache = NULL;
-		cache_size = 0;
-	}
+	current_time = time(NULL);
+	lifetime = data->cache_until - data->inserted;
 
-	return FALSE;
-}
+	if (current_time - data->inserted <
+			lifetime * (time_t)cache_prefetch_threshold / 100)
+		return;
 
-static void create_cache(void)
-{
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
-		cache = g_hash_table_new_full(g_str_hash,
-					g_str_equal,
-					NULL,
-					cache_element_destroy);
-		cache_size = 0;
-	}
+	cache_prefetch(entry);
 }
 
 static struct cache_entry *cache_check(gpointer request, uint16_t *qtype, int proto)
 {
+	struct cache_key key;
+	struct cache_entry *entry;
+
 	if (!request)
 		return NULL;
 
-	const char *question = request + protocol_offset(proto) + DNS_HEADER_SIZE;
-	const size_t offset = strlen(question) + 1;
-	const struct domain_question *q = (void *) (question + offset);
-	const uint16_t type = ntohs(q->type);
-	struct cache_entry *entry;
-
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != DNS_TYPE_A && type != DNS_TYPE_AAAA)
+	if (!cache_key_from_request(request, proto, &key))
 		return NULL;
 
 	if (!cache) {
 		create_cache();
+		cache_stats.misses++;
 		return NULL;
 	}
 
-	entry = g_hash_table_lookup(cache, question);
-	if (!entry)
+	entry = g_hash_table_lookup(cache, &key);
+	if (!entry || !cache_check_validity(entry)) {
+		cache_stats.misses++;
 		return NULL;
+	}
 
-	if (!cache_check_validity(question, type, entry))
-		return NULL;
+	cache_stats.hits++;
+	if (entry->data->negative)
+		cache_stats.negative_hits++;
 
-	*qtype = type;
+	cache_touch(entry);
+	cache_check_prefetch(entry);
+
+	*qtype = key.type;
 	return entry;
 }
 
+
 /*
  * Get a label/name from DNS resource record. The function decompresses the
  * label if necessary. The function does not convert the name to presentation
@@ -943,6 +1991,103 @@ static int get_name(int counter,
 	return 0;
 }
 
+/*
+ * Copies one domain name from the RDATA of a record to 'output', removing
+ * any compression as the cached record is not stored at the same offset
+ * as in the original message.
+ */
+static int copy_rdata_name(const unsigned char *buf, const unsigned char *max,
+			const unsigned char **ptr, const unsigned char *rdata_end,
+			unsigned char **output, const unsigned char *output_end)
+{
+	char name[NS_MAXDNAME];
+	int pos, len;
+
+	pos = dn_expand(buf, max, *ptr, name, sizeof(name));
+	if (pos < 0 || *ptr + pos > rdata_end)
+		return -EINVAL;
+
+	len = dn_comp(name, *output, output_end - *output, NULL, NULL);
+	if (len < 0)
+		return -ENOBUFS;
+
+	*ptr += pos;
+	*output += len;
+
+	return 0;
+}
+
+/*
+ * Copies the RDATA of a resource record. Only the record types listed in
+ * RFC 3597 section 4 may contain compressed names, all other types are
+ * copied as is.
+ */
+static int copy_rdata(const unsigned char *buf, const unsigned char *max,
+			uint16_t type, const unsigned char *rdata,
+			uint16_t rdlen, unsigned char *output,
+			size_t output_len, uint16_t *new_rdlen)
+{
+	const unsigned char *ptr = rdata, *rdata_end = rdata + rdlen;
+	unsigned char *out = output;
+	const unsigned char *out_end = output + output_len;
+	size_t fixed_len = 0;
+	int names, err;
+
+	switch (type) {
+	case ns_t_cname:
+	case ns_t_ns:
+	case ns_t_ptr:
+	case ns_t_mb:
+	case ns_t_md:
+	case ns_t_mf:
+	case ns_t_mg:
+	case ns_t_mr:
+		names = 1;
+		break;
+	case ns_t_mx:
+		/* preference precedes the exchange name */
+		if (rdlen < 2 || output_len < 2)
+			return -EINVAL;
+		memcpy(out, ptr, 2);
+		out += 2;
+		ptr += 2;
+		names = 1;
+		break;
+	case ns_t_soa:
+		names = 2;
+		fixed_len = SOA_FIXED_SIZE;
+		break;
+	case ns_t_minfo:
+		names = 2;
+		break;
+	default:
+		if (rdlen > output_len)
+			return -ENOBUFS;
+		memcpy(output, rdata, rdlen);
+		*new_rdlen = rdlen;
+		return 0;
+	}
+
+	while (names-- > 0) {
+		err = copy_rdata_name(buf, max, &ptr, rdata_end, &out, out_end);
+		if (err < 0)
+			return err;
+	}
+
+	if (ptr + fixed_len != rdata_end)
+		return -EINVAL;
+
+	if (out + fixed_len > out_end)
+		return -ENOBUFS;
+
+	memcpy(out, ptr, fixed_len);
+	out += fixed_len;
+
+	*new_rdlen = out - output;
+
+	return 0;
+}
+
 static int parse_rr(const unsigned char *buf, const unsigned char *start,
 			const unsigned char *max,
 			unsigned char *response, size_t *response_size,
@@ -952,6 +2097,7 @@ static int parse_rr(const unsigned char *buf, const unsigned char *start,
 {
 	struct domain_rr *rr;
 	size_t offset;
+	uint16_t new_rdlen;
 	int name_len = 0, output_len = 0, max_rsp = *response_size;
 	int err = get_name(0, buf, start, max, response, max_rsp,
 		&output_len, end, name, max_name, &name_len);
@@ -966,7 +2112,7 @@ static int parse_rr(const unsigned char *buf, const unsigned char *start,
 
 	rr = (void *) (*end);
 
-	if (!rr)
+	if (!rr || *end + DNS_RR_SIZE > max)
 		return -EINVAL;
 
 	*type = ntohs(rr->type);
@@ -977,18 +2123,27 @@ static int parse_rr(const unsigned char *buf, const unsigned char *start,
 	if (*ttl < 0)
 		return -EINVAL;
 
+	if ((offset + DNS_RR_SIZE) > *response_size)
+		return -ENOBUFS;
+
 	memcpy(response + offset, *end, DNS_RR_SIZE);
+	rr = (void *) (response + offset);
 
 	offset += DNS_RR_SIZE;
 	*end += DNS_RR_SIZE;
 
-	if ((offset + *rdlen) > *response_size)
-		return -ENOBUFS;
+	if (*end + *rdlen > max)
+		return -EINVAL;
+
+	err = copy_rdata(buf, max, *type, *end, *rdlen, response + offset,
+				*response_size - offset, &new_rdlen);
+	if (err < 0)
+		return err;
 
-	memcpy(response + offset, *end, *rdlen);
+	rr->rdlen = htons(new_rdlen);
 
 	*end += *rdlen;
-	*response_size = offset + *rdlen;
+	*response_size = offset + new_rdlen;
 
 	return 0;
 }
@@ -1009,9 +2164,10 @@ static bool check_alias(GSList *aliases, const char *name)
 /*
  * Parses the DNS response packet found in 'buf' consisting of 'buflen' bytes.
  *
- * The parsed question label, response type and class, ttl and number of
- * answer sections are output parameters. The response output buffer will
- * receive all matching resource records to be cached.
+ * The parsed question label, question type and class, the smallest ttl of
+ * the matching records and number of answer sections are output parameters.
+ * The response output buffer will receive all matching resource records to
+ * be cached.
  *
  * Return value is < 0 on error (negative errno) or zero on success.
  */
@@ -1058,41 +2214,42 @@ static int parse_response(const unsigned char *buf, size_t buflen,
 
 	q = (void *) ptr;
 	qtype = ntohs(q->type);
+	qclass = ntohs(q->class);
 
-	/* We cache only A and AAAA records */
-	if (qtype != DNS_TYPE_A && qtype != DNS_TYPE_AAAA)
+	*type = qtype;
+	*class = qclass;
+	*ttl = 0;
+
+	if (!cache_is_cacheable(qtype, qclass))
 		return -ENOMSG;
 
 	ptr += DNS_QUESTION_SIZE; /* advance to answers section */
 
 	ancount = ntohs(hdr->ancount);
-	qclass = ntohs(q->class);
 
 	/*
 	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
+	 * the question. We traverse the answers and parse the
+	 * resource records. Only records of the question type are
+	 * cached, all the other records in answers are skipped.
 	 */
 	for (uint16_t i = 0; i < ancount; i++) {
 		char name[NS_MAXDNAME + 1] = {0};
 		/*
-		 * Get one address at a time to this buffer.
-		 * The max size of the answer is
+		 * Get one record at a time to this buffer.
+		 * The size of an A or AAAA record is
 		 *   2 (pointer) + 2 (type) + 2 (class) +
 		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
-		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
-		 * TODO: why are we using the MAXCDNAME constant as buffer
-		 * size then?
+		 * but records like TXT or HTTPS can be a lot bigger.
 		 */
-		unsigned char rsp[NS_MAXCDNAME] = {0};
+		unsigned char rsp[TCP_MAX_BUF_LEN];
 		size_t rsp_len = sizeof(rsp) - 1;
 		const unsigned char *next = NULL;
-		uint16_t rdlen;
+		uint16_t rdlen, rec_type, rec_class;
+		int rec_ttl;
 
 		int ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name,
+			&rec_type, &rec_class, &rec_ttl, &rdlen, &next, name,
 			sizeof(name) - 1);
 		if (ret != 0) {
 			err = ret;
@@ -1114,7 +2271,7 @@ static int parse_response(const unsigned char *buf, size_t buflen,
 		 * Go to next answer if the class is not the one we are
 		 * looking for.
 		 */
-		if (*class != qclass) {
+		if (rec_class != qclass) {
 			continue;
 		}
 
@@ -1139,7 +2296,8 @@ static int parse_response(const unsigned char *buf, size_t buflen,
 		 * address of ipv6.l.google.com. For caching purposes this
 		 * should not cause any issues.
 		 */
-		if (*type == DNS_TYPE_CNAME && strncmp(question, name, qlen) == 0) {
+		if (rec_type == DNS_TYPE_CNAME && qtype != DNS_TYPE_CNAME &&
+				strncmp(question, name, qlen) == 0) {
 			/*
 			 * So now the alias answered the question. This is
 			 * not very useful from caching point of view as
@@ -1175,9 +2333,9 @@ static int parse_response(const unsigned char *buf, size_t buflen,
 			aliases = g_slist_prepend(aliases, g_strdup(name));
 
 			continue;
-		} else if (*type == qtype) {
+		} else if (rec_type == qtype) {
 			/*
-			 * We found correct type (A or AAAA)
+			 * We found correct type
 			 */
 			if (check_alias(aliases, name) ||
 				(!aliases && strncmp(question, name,
@@ -1196,6 +2354,8 @@ static int parse_response(const unsigned char *buf, size_t buflen,
 				}
 				memcpy(response + *response_len, rsp, rsp_len);
 				*response_len += rsp_len;
+				if (*answers == 0 || rec_ttl < *ttl)
+					*ttl = rec_ttl;
 				(*answers)++;
 				err = 0;
 			}
@@ -1209,190 +2369,278 @@ static int parse_response(const unsigned char *buf, size_t buflen,
 	return err;
 }
 
-static gboolean cache_check_entry(gpointer key, gpointer value,
+static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 					gpointer user_data)
 {
-	struct cache_timeout *data = user_data;
 	struct cache_entry *entry = value;
-	time_t max_timeout;
 
-	/* Scale the number of hits by half as part of cache aging */
+	/* first, delete any expired elements */
+	cache_enforce_validity(entry);
 
-	entry->hits /= 2;
+	/* if anything is not expired, mark the entry for refresh */
+	if (entry->hits > 0 && entry->data && cache_is_refreshable(entry))
+		entry->want_refresh = true;
 
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
+	/* delete the cached data */
+	cache_free_data(entry);
 
-	if (entry->ipv4 && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	/* keep the entry if we want it refreshed, delete it otherwise */
+	return entry->want_refresh ? FALSE : TRUE;
+}
 
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
+/*
+ * cache_invalidate is called from places where the DNS landscape
+ * has changed, say because connections are added or we entered a VPN.
+ * The logic is to wipe all cache data, but mark all non-expired
+ * parts of the cache for refresh rather than deleting the whole cache.
+ */
+static void cache_invalidate(void)
+{
+	debug("Invalidating the DNS cache %p", cache);
 
-	if (entry->ipv6 && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	if (!cache)
+		return;
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
+	g_hash_table_foreach_remove(cache, cache_invalidate_entry, NULL);
+}
+
+static void cache_refresh_entry(struct cache_entry *entry)
+{
+	cache_enforce_validity(entry);
+
+	if (cache_is_popular(entry) && cache_is_refreshable(entry) &&
+			!cache_check_is_valid(entry->data, time(NULL)))
+		entry->want_refresh = true;
+
+	if (entry->want_refresh) {
+		char dns_name[NS_MAXDNAME + 1];
+
+		entry->want_refresh = false;
+
+		cache_entry_hostname(entry, dns_name, sizeof(dns_name));
+		debug("Refreshing %s\n", dns_name);
+		/* then refresh the hostname */
+		refresh_dns_entry(entry, dns_name);
 	}
+}
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
+static void cache_refresh_iterator(gpointer key, gpointer value,
+					gpointer user_data)
+{
+	struct cache_entry *entry = value;
 
-	return FALSE;
+	cache_refresh_entry(entry);
+
+	/* Scale the number of hits by half as part of cache aging */
+	entry->hits /= 2;
 }
 
-static void cache_cleanup(void)
+static void cache_refresh(void)
 {
-	static time_t max_timeout;
-	struct cache_timeout data = {
-		.current_time = time(NULL),
-		.max_timeout = 0,
-		.try_harder = false
-	};
-	int count = 0;
+	if (!cache)
+		return;
 
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	debug("removed %d in the first pass", count);
+	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
+}
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = true;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+/*
+ * returns a pointer past the (possibly compressed) name at 'ptr' or NULL
+ * if the name does not fit into the message ending at 'eptr'
+ */
+static const unsigned char *dns_skip_name(const unsigned char *ptr,
+					const unsigned char *eptr)
+{
+	while (ptr < eptr) {
+		if ((*ptr & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+			return ptr + 2 <= eptr ? ptr + 2 : NULL;
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+		if (*ptr & NS_CMPRSFLGS)
+			return NULL;
+
+		if (*ptr == 0)
+			return ptr + 1;
+
+		ptr += *ptr + 1;
+	}
+
+	return NULL;
 }
 
-static gboolean cache_invalidate_entry(gpointer key, gpointer value,
-					gpointer user_data)
+/*
+ * Looks up the SOA record in the authority section of a negative DNS
+ * response. Following RFC 2308 the negative answer may be cached for the
+ * minimum of the SOA record TTL and the SOA MINIMUM field.
+ *
+ * On success 'ttl' receives this value and 'msg_len' the length of the
+ * response without its additional section.
+ */
+static int parse_negative_response(const unsigned char *buf, size_t buflen,
+					int *ttl, size_t *msg_len)
 {
-	struct cache_entry *entry = value;
+	const struct domain_hdr *hdr = (void *) buf;
+	const unsigned char *eptr = buf + buflen;
+	const unsigned char *ptr;
+	uint16_t ancount, nscount;
+	int64_t soa_ttl = -1;
 
-	/* first, delete any expired elements */
-	cache_enforce_validity(entry);
+	if (buflen < DNS_HEADER_SIZE)
+		return -EINVAL;
 
-	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
-		entry->want_refresh = true;
+	if (hdr->qr != 1 || ntohs(hdr->qdcount) != 1)
+		return -EINVAL;
+
+	ptr = dns_skip_name(buf + DNS_HEADER_SIZE, eptr);
+	if (!ptr || (eptr - ptr) < (ptrdiff_t)DNS_QUESTION_SIZE)
+		return -EINVAL;
+
+	ptr += DNS_QUESTION_SIZE;
+
+	ancount = ntohs(hdr->ancount);
+	nscount = ntohs(hdr->nscount);
+
+	for (unsigned int i = 0; i < ancount + nscount; i++) {
+		const struct domain_rr *rr;
+		uint16_t rdlen;
+
+		ptr = dns_skip_name(ptr, eptr);
+		if (!ptr || (eptr - ptr) < (ptrdiff_t)DNS_RR_SIZE)
+			return -EINVAL;
+
+		rr = (void *) ptr;
+		rdlen = ntohs(rr->rdlen);
+		ptr += DNS_RR_SIZE;
+
+		if ((eptr - ptr) < rdlen)
+			return -EINVAL;
+
+		if (i >= ancount && ntohs(rr->type) == DNS_TYPE_SOA &&
+				rdlen >= SOA_FIXED_SIZE) {
+			uint32_t minimum;
+
+			memcpy(&minimum, ptr + rdlen - sizeof(minimum),
+							sizeof(minimum));
+
+			soa_ttl = MIN(ntohl(rr->ttl), ntohl(minimum));
+		}
+
+		ptr += rdlen;
+	}
+
+	if (soa_ttl < 0)
+		return -ENOMSG;
 
-	/* delete the cached data */
-	cache_free_ipv4(entry);
-	cache_free_ipv6(entry);
+	*ttl = MIN(soa_ttl, MAX_CACHE_TTL);
+	*msg_len = ptr - buf;
 
-	/* keep the entry if we want it refreshed, delete it otherwise */
-	return entry->want_refresh ? FALSE : TRUE;
+	return 0;
 }
 
 /*
- * cache_invalidate is called from places where the DNS landscape
- * has changed, say because connections are added or we entered a VPN.
- * The logic is to wipe all cache data, but mark all non-expired
- * parts of the cache for refresh rather than deleting the whole cache.
+ * cache a NXDOMAIN or NODATA reply so that repeated queries for names
+ * which do not exist are not forwarded upstream again
  */
-static void cache_invalidate(void)
+static int cache_update_negative(struct server_data *srv,
+				const unsigned char *msg, size_t msg_len,
+				const char *question, uint16_t type,
+				uint16_t class)
 {
-	debug("Invalidating the DNS cache %p", cache);
+	const size_t offset = protocol_offset(srv->protocol);
+	const struct domain_hdr *hdr = (void *)(msg + offset);
+	const time_t current_time = time(NULL);
+	struct cache_entry *entry;
+	struct cache_data *data;
+	struct domain_hdr *cached_hdr;
+	const struct cache_key key = {
+		.name = (char *)question,
+		.type = type,
+		.class = class,
+	};
+	bool is_new_entry;
+	uint16_t *lenhdr;
+	size_t len;
+	int err, ttl;
 
-	if (!cache)
-		return;
+	if (cache_max_negative_bytes == 0)
+		return 0;
 
-	g_hash_table_foreach_remove(cache, cache_invalidate_entry, NULL);
-}
+	if (!cache_is_cacheable(type, class))
+		return 0;
 
-static void cache_refresh_entry(struct cache_entry *entry)
-{
-	cache_enforce_validity(entry);
+	/*
+	 * Without a SOA record we do not know for how long the negative
+	 * reply is valid and it must not be cached (RFC 2308 section 5).
+	 */
+	err = parse_negative_response(msg + offset, msg_len - offset,
+							&ttl, &len);
+	if (err < 0 || ttl == 0)
+		return 0;
 
-	if (entry->hits > 2 && (!entry->ipv4 || !entry->ipv6))
-		entry->want_refresh = true;
+	entry = g_hash_table_lookup(cache, &key);
+	is_new_entry = !entry;
 
-	if (entry->want_refresh) {
-		char dns_name[NS_MAXDNAME + 1];
-		char *c;
+	if (entry) {
+		if (!cache_check_is_replaceable(entry->data, current_time))
+			return 0;
 
-		entry->want_refresh = false;
+		cache_free_data(entry);
 
-		/* turn a DNS name into a hostname with dots */
-		strncpy(dns_name, entry->key, NS_MAXDNAME);
-		c = dns_name;
-		while (*c) {
-			/* fetch the size of the current component and replace
-			   it by a dot */
-			int jump = *c;
-			*c = '.';
-			c += jump + 1;
-		}
-		debug("Refreshing %s\n", dns_name);
-		/* then refresh the hostname */
-		refresh_dns_entry(entry, &dns_name[1]);
+		/* we will get a "hit" when we serve the reply from cache */
+		entry->hits = entry->hits ? entry->hits - 1 : 0;
+	} else {
+		entry = cache_entry_new(question, type, class);
+		if (!entry)
+			return -ENOMEM;
 	}
-}
 
-static void cache_refresh_iterator(gpointer key, gpointer value,
-					gpointer user_data)
-{
-	struct cache_entry *entry = value;
+	data = g_try_new0(struct cache_data, 1);
+	if (data)
+		data->data = g_try_malloc(len + DNS_HEADER_TCP_EXTRA_BYTES);
 
-	cache_refresh_entry(entry);
-}
+	if (!data || !data->data) {
+		g_free(data);
+		if (is_new_entry)
+			cache_entry_free(entry);
+		return -ENOMEM;
+	}
 
-static void cache_refresh(void)
-{
-	if (!cache)
-		return;
+	data->inserted = current_time;
+	data->type = type;
+	data->answers = ntohs(hdr->ancount);
+	data->authority = ntohs(hdr->nscount);
+	data->rcode = hdr->rcode;
+	data->negative = true;
+	data->timeout = ttl;
+	data->valid_until = current_time + ttl;
+	data->cache_until = round_down_ttl(current_time + ttl, ttl);
 
-	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
-}
+	/*
+	 * Keep the reply up to the end of the authority section as is, so
+	 * that compressed names in the SOA record stay valid.
+	 */
+	data->data_len = len + DNS_HEADER_TCP_EXTRA_BYTES;
+	lenhdr = (void *)data->data;
+	*lenhdr = htons(len);
+	memcpy(data->data + DNS_HEADER_TCP_EXTRA_BYTES, msg + offset, len);
 
-static int reply_query_type(const unsigned char *msg, int len)
-{
-	/* skip the header */
-	const unsigned char *c = msg + DNS_HEADER_SIZE;
-	int type;
-	len -= DNS_HEADER_SIZE;
+	cached_hdr = (void *)(data->data + DNS_HEADER_TCP_EXTRA_BYTES);
+	cached_hdr->arcount = 0;
 
-	if (len < 0)
-		return 0;
+	entry->data = data;
 
-	/* now the query, which is a name and 2 16 bit words for type and class */
-	c += dns_name_length(c);
+	if (is_new_entry)
+		cache_entry_insert(entry);
+	else
+		cache_touch(entry);
+
+	cache_update_size(entry);
+	cache_make_room(entry);
 
-	type = c[0] << 8 | c[1];
+	debug("cache %d %snegative question \"%s\" type %s rcode %d ttl %d "
+		"size %zu", cache_size, is_new_entry ? "new " : "old ",
+		question, cache_type_str(type), data->rcode, ttl,
+		entry->size);
 
-	return type;
+	return 0;
 }
 
 /*
@@ -1410,17 +2658,15 @@ static int cache_update(struct server_data *srv, const unsigned char *msg, size_
 	struct domain_question *q = NULL;
 	struct cache_entry *entry;
 	struct cache_data *data;
+	struct cache_key key;
 	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	unsigned char response[TCP_MAX_BUF_LEN];
 	unsigned char *ptr = NULL;
 	size_t rsplen = sizeof(response) - 1;
 	const time_t current_time = time(NULL);
 
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
+	if (cache_max_size == 0)
+		return 0;
 
 	/* don't do a cache refresh more than twice a minute */
 	if (next_refresh < current_time) {
@@ -1430,8 +2676,8 @@ static int cache_update(struct server_data *srv, const unsigned char *msg, size_
 
 	debug("offset %zd hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
 
-	/* Continue only if response code is 0 (=ok) */
-	if (hdr->rcode != ns_r_noerror)
+	/* Continue only if response code is 0 (=ok) or NXDOMAIN */
+	if (hdr->rcode != ns_r_noerror && hdr->rcode != ns_r_nxdomain)
 		return 0;
 
 	if (!cache)
@@ -1444,86 +2690,46 @@ static int cache_update(struct server_data *srv, const unsigned char *msg, size_
 				response, &rsplen, &answers);
 
 	/*
-	 * special case: if we do a ipv6 lookup and get no result
-	 * for a record that's already in our ipv4 cache.. we want
-	 * to cache the negative response.
+	 * No matching record in the answer section (NODATA) or the name
+	 * does not exist at all (NXDOMAIN).
 	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
-			reply_query_type(msg + offset,
-					msg_len - offset) == DNS_TYPE_AAAA) {
-		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && !entry->ipv6) {
-			struct cache_data *data = g_try_new(struct cache_data, 1);
-
-			if (!data)
-				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
-			data->type = type;
-			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
-			data->data_len = msg_len +
-				(offset ? 0 : DNS_HEADER_TCP_EXTRA_BYTES);
-			data->data = g_malloc(data->data_len);
-			ptr = data->data;
-			if (srv->protocol == IPPROTO_UDP) {
-				/* add the two bytes length header also for
-				 * UDP responses */
-				lenhdr = (void*)ptr;
-				*lenhdr = htons(data->data_len -
-						DNS_HEADER_TCP_EXTRA_BYTES);
-				ptr += DNS_HEADER_TCP_EXTRA_BYTES;
-			}
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
-			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
-			/*
-			 * we will get a "hit" when we serve the response
-			 * out of the cache
-			 */
-			entry->hits = entry->hits ? entry->hits - 1 : 0;
-			return 0;
-		}
-	}
+	if (err == -ENOMSG || hdr->rcode == ns_r_nxdomain)
+		return cache_update_negative(srv, msg, msg_len, question,
+							type, class);
 
 	if (err < 0 || ttl == 0)
 		return 0;
 
 	/*
-	 * If the cache contains already data, check if the
-	 * type of the cached data is the same and do not add
-	 * to cache if data is already there.
-	 * This is needed so that we can cache both A and AAAA
-	 * records for the same name.
+	 * If the cache contains already data for the same name, type
+	 * and class, do not add to cache again.
 	 */
+	key.name = question;
+	key.type = type;
+	key.class = class;
 
-	entry = g_hash_table_lookup(cache, question);
+	entry = g_hash_table_lookup(cache, &key);
 	data = NULL;
 	is_new_entry = !entry;
 
 	if (!entry) {
-		entry = g_try_new(struct cache_entry, 1);
+		entry = cache_entry_new(question, type, class);
 		if (!entry)
 			return -ENOMEM;
 
-		data = g_try_new(struct cache_data, 1);
+		data = g_try_new0(struct cache_data, 1);
 		if (!data) {
-			g_free(entry);
+			cache_entry_free(entry);
 			return -ENOMEM;
 		}
 
-		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
-		entry->want_refresh = false;
-		entry->hits = 0;
-
 	} else {
-		if (type == DNS_TYPE_A && entry->ipv4)
-			return 0;
-		else if (type == DNS_TYPE_AAAA && entry->ipv6)
+		if (!cache_check_is_replaceable(entry->data, current_time))
 			return 0;
 
-		data = g_try_new(struct cache_data, 1);
+		cache_free_data(entry);
+
+		data = g_try_new0(struct cache_data, 1);
 		if (!data)
 			return -ENOMEM;
 
@@ -1534,11 +2740,6 @@ static int cache_update(struct server_data *srv, const unsigned char *msg, size_
 		entry->hits = entry->hits ? entry->hits - 1 : 0;
 	}
 
-	if (type == DNS_TYPE_A)
-		entry->ipv4 = data;
-	else
-		entry->ipv6 = data;
-
 	if (ttl < MIN_CACHE_TTL)
 		ttl = MIN_CACHE_TTL;
 
@@ -1554,14 +2755,16 @@ static int cache_update(struct server_data *srv, const unsigned char *msg, size_
 	 * because it simplifies the sending of cached packet.
 	 */
 	data->data_len =  DNS_TCP_HEADER_SIZE + qlen + 1 + 2 + 2 + rsplen;
-	data->data = g_malloc(data->data_len);
+	data->data = g_try_malloc(data->data_len);
 	if (!data->data) {
-		g_free(entry->key);
 		g_free(data);
-		g_free(entry);
+		if (is_new_entry)
+			cache_entry_free(entry);
 		return -ENOMEM;
 	}
 
+	entry->data = data;
+
 	/*
 	 * Restrict the cached DNS record TTL to some sane value
 	 * in order to prevent data staying in the cache too long.
@@ -1596,10 +2799,13 @@ static int cache_update(struct server_data *srv, const unsigned char *msg, size_
 
 	memcpy(ptr, response, rsplen);
 
-	if (is_new_entry) {
-		g_hash_table_replace(cache, entry->key, entry);
-		cache_size++;
-	}
+	if (is_new_entry)
+		cache_entry_insert(entry);
+	else
+		cache_touch(entry);
+
+	cache_update_size(entry);
+	cache_make_room(entry);
 
 	debug("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
 								"dns len %u",
@@ -1628,25 +2834,27 @@ static int ns_try_resolv_from_cache(
 	uint16_t type = 0;
 	int ttl_left;
 	struct cache_data *data;
-	struct cache_entry *entry = cache_check(request, &type, req->protocol);
-	if (!entry)
+	struct cache_entry *entry;
+
+	/* our own prefetch requests always go to the DNS servers */
+	if (req->prefetch)
 		return 0;
 
-	debug("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
+	entry = cache_check(request, &type, req->protocol);
+	if (!entry)
+		return 0;
 
-	data = type == DNS_TYPE_A ? entry->ipv4 : entry->ipv6;
+	debug("cache hit %s type %s", lookup, cache_type_str(type));
 
-	if (!data)
-		return 0;
+	data = entry->data;
 
 	ttl_left = data->valid_until - time(NULL);
 	entry->hits++;
 
 	switch(req->protocol) {
 		case IPPROTO_TCP:
-			send_cached_response(req->client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+			send_cached_response(req->client_sk, data, NULL, 0,
+					IPPROTO_TCP, req->srcid, ttl_left);
 			return 1;
 		case IPPROTO_UDP: {
 			int udp_sk = get_req_udp_socket(req);
@@ -1654,9 +2862,8 @@ static int ns_try_resolv_from_cache(
 			if (udp_sk < 0)
 				return -EIO;
 
-			send_cached_response(udp_sk, data->data,
-				data->data_len, &req->sa, req->sa_len,
-				IPPROTO_UDP, req->srcid, data->answers,
+			send_cached_response(udp_sk, data, &req->sa,
+				req->sa_len, IPPROTO_UDP, req->srcid,
 				ttl_left);
 			return 1;
 		}
@@ -1665,11 +2872,111 @@ static int ns_try_resolv_from_cache(
 	return -EINVAL;
 }
 
+/*
+ * A TCP server has one persistent connection which carries all
+ * outstanding queries at once, the replies are told apart by their ID.
+ * The stream is only accessed through the two functions below so that
+ * it can be layered on another transport.
+ */
+static ssize_t status_to_result(GIOStatus status, gsize bytes)
+{
+	switch (status) {
+	case G_IO_STATUS_NORMAL:
+		return bytes;
+	case G_IO_STATUS_AGAIN:
+		return -EAGAIN;
+	case G_IO_STATUS_EOF:
+		return 0;
+	case G_IO_STATUS_ERROR:
+		break;
+	}
+
+	return -EIO;
+}
+
+static ssize_t server_stream_write(struct server_data *server,
+					const void *buf, size_t len)
+{
+	int sk = g_io_channel_unix_get_fd(server->channel);
+	GIOStatus status;
+	gsize written;
+	ssize_t err;
+
+	if (server->tls) {
+		status = g_io_channel_write_chars(server->channel, buf, len,
+							&written, NULL);
+		return status_to_result(status, written);
+	}
+
+	err = send(sk, buf, len, MSG_NOSIGNAL);
+	if (err < 0)
+		return -errno;
+
+	return err;
+}
+
+static ssize_t server_stream_read(struct server_data *server,
+					void *buf, size_t len)
+{
+	int sk = g_io_channel_unix_get_fd(server->channel);
+	GIOStatus status;
+	gsize bytes;
+	ssize_t err;
+
+	if (server->tls) {
+		status = g_io_channel_read_chars(server->channel, buf, len,
+							&bytes, NULL);
+		return status_to_result(status, bytes);
+	}
+
+	err = recv(sk, buf, len, 0);
+	if (err < 0)
+		return -errno;
+
+	return err;
+}
+
+static int server_send(struct server_data *server, const void *buf,
+								size_t len)
+{
+	ssize_t err;
+	int sk;
+
+	if (server->protocol == IPPROTO_UDP) {
+		sk = g_io_channel_unix_get_fd(server->channel);
+
+		if (sendto(sk, buf, len, MSG_NOSIGNAL, server->server_addr,
+					server->server_addr_len) < 0)
+			return -errno;
+
+		return 0;
+	}
+
+	err = server_stream_write(server, buf, len);
+	if (err < 0)
+		return err;
+
+	if ((size_t)err != len) {
+		/*
+		 * The rest of the message would be interleaved with the
+		 * next one, the connection cannot be used any more.
+		 */
+		sk = g_io_channel_unix_get_fd(server->channel);
+		shutdown(sk, SHUT_RDWR);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
-	int sk = -1;
+	unsigned char framed[TCP_MAX_BUF_LEN + DNS_HEADER_TCP_EXTRA_BYTES];
 	const char *lookup = (const char *)name;
+	const size_t req_offset = protocol_offset(req->protocol);
+	const size_t srv_offset = protocol_offset(server->protocol);
+	size_t request_len = req->request_len;
 	int err = ns_try_resolv_from_cache(req, request, lookup);
 
 	if (err > 0)
@@ -1679,16 +2986,35 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		/* error other than cache miss, don't continue */
 		return err;
 
-	/* forward request to real DNS server */
-	sk = g_io_channel_unix_get_fd(server->channel);
+	/*
+	 * UDP clients are served over TCP when DNS-over-TLS is used,
+	 * add or strip the length header the server expects.
+	 */
+	if (req_offset != srv_offset) {
+		size_t msg_len = request_len - req_offset;
+
+		if (msg_len + srv_offset > sizeof(framed))
+			return -EMSGSIZE;
 
-	err = sendto(sk, request, req->request_len, MSG_NOSIGNAL,
-			server->server_addr, server->server_addr_len);
+		if (srv_offset) {
+			uint16_t len_hdr = htons(msg_len);
+
+			memcpy(framed, &len_hdr, sizeof(len_hdr));
+		}
+
+		memcpy(framed + srv_offset, request + req_offset, msg_len);
+
+		request = framed;
+		request_len = msg_len + srv_offset;
+	}
+
+	/* forward request to real DNS server */
+	err = server_send(server, request, request_len);
 	if (err < 0) {
-		debug("Cannot send message to server %s sock %d "
+		debug("Cannot send message to server %s "
 			"protocol %d (%s/%d)",
-			server->server, sk, server->protocol,
-			strerror(errno), errno);
+			server->server, server->protocol,
+			strerror(-err), -err);
 		return -EIO;
 	}
 
@@ -1704,57 +3030,237 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 	if (server->domains && server->domains->data)
 		req->append_domain = true;
 
-	for (GList *list = server->domains; list; list = list->next) {
-		int domlen, altlen;
-		unsigned char alt[1024];
-		const char *domain = list->data;
-		const size_t offset = protocol_offset(server->protocol);
-		struct domain_hdr *hdr = (void *) (&alt[0] + offset);
+	for (GList *list = server->domains; list; list = list->next) {
+		int domlen, altlen;
+		unsigned char alt[1024];
+		const char *domain = list->data;
+		const size_t offset = protocol_offset(server->protocol);
+		struct domain_hdr *hdr = (void *) (&alt[0] + offset);
+
+		if (!domain)
+			continue;
+
+		domlen = strlen(domain) + 1;
+
+		if (domlen < 5)
+			return -EINVAL;
+
+		memcpy(alt + offset, &req->altid, sizeof(req->altid));
+
+		memcpy(alt + offset + 2, request + offset + 2, DNS_HEADER_SIZE - 2);
+		hdr->qdcount = htons(1);
+
+		altlen = append_query(alt + offset + DNS_HEADER_SIZE, sizeof(alt) - DNS_HEADER_SIZE - offset,
+					name, domain);
+		if (altlen < 0)
+			return -EINVAL;
+
+		altlen += DNS_HEADER_SIZE;
+		altlen += offset;
+
+		memcpy(alt + altlen,
+			request + altlen - domlen,
+			request_len - altlen + domlen);
+
+		if (server->protocol == IPPROTO_TCP) {
+			uint16_t req_len = request_len + domlen - DNS_HEADER_TCP_EXTRA_BYTES;
+			uint16_t *len_hdr = (void*)alt;
+			*len_hdr = htons(req_len);
+		}
+
+		debug("req %p dstid 0x%04x altid 0x%04x", req, req->dstid,
+				req->altid);
+
+		err = server_send(server, alt, request_len + domlen);
+		if (err < 0)
+			return -EIO;
+
+		req->numserv++;
+	}
+
+	return 0;
+}
+
+static unsigned int server_rank(struct server_data *server)
+{
+	guint64 rtt = server->srtt ? server->srtt : SERVER_INITIAL_RTT;
+
+	rtt <<= MIN(server->failures_in_row, SERVER_MAX_BACKOFF);
+
+	return MIN(rtt, G_MAXUINT);
+}
+
+static unsigned int server_hedge_delay(struct server_data *server)
+{
+	unsigned int delay;
+
+	if (!server->srtt)
+		return HEDGE_INITIAL_DELAY;
+
+	delay = (server->srtt + 4 * server->rttvar) / 1000;
+
+	return CLAMP(delay, HEDGE_MIN_DELAY, HEDGE_MAX_DELAY);
+}
+
+static struct server_data *create_server(int index,
+					const char *domain, const char *server,
+					int protocol);
+
+/*
+ * The DNS-over-TLS connection to a server replaces its UDP transport,
+ * it is opened when a query is sent over it first.
+ */
+static struct server_data *server_get_transport(struct server_data *server,
+								bool create)
+{
+	struct server_data *tls_server;
+
+	if (!server_uses_tls(server))
+		return server;
+
+	tls_server = find_server(server->index, server->server, IPPROTO_TCP);
+	if (!tls_server && create)
+		tls_server = create_server(server->index, NULL, server->server,
+								IPPROTO_TCP);
+
+	return tls_server;
+}
+
+/*
+ * the best ranked enabled UDP server the request was not sent to yet,
+ * ties go to the server that was added first
+ */
+static struct server_data *request_next_server(struct request_data *req)
+{
+	struct server_data *best = NULL;
+	unsigned int best_rank = 0;
+
+	for (GSList *list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+		struct server_data *transport;
+		unsigned int rank;
+
+		if (server->protocol != IPPROTO_UDP || !server->enabled)
+			continue;
+
+		if (!server->channel && !server_uses_tls(server))
+			continue;
+
+		if (request_find_attempt(req, server))
+			continue;
+
+		transport = server_get_transport(server, false);
+		if (transport && request_find_attempt(req, transport))
+			continue;
+
+		rank = server_rank(transport ? transport : server);
+		if (!best || rank < best_rank) {
+			best = server;
+			best_rank = rank;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Sends the request to the next best server and arms the hedge timer
+ * for the one after it.
+ *
+ * returns:
+ * > 0 on cache hit (answer is already sent out to client)
+ * == 0 when the request was sent or there is no server left to try
+ */
+static int request_send_next(struct request_data *req,
+				gpointer request, gpointer name)
+{
+	struct server_attempt *attempt;
+	struct server_data *server, *transport = NULL;
+	bool hedge = req->num_attempts > 0;
+	int err;
+
+	request_deadline_clear(&request_hedge_queue, &req->hedge);
 
-		if (!domain)
+	while ((server = request_next_server(req))) {
+		transport = server_get_transport(server, true);
+		if (!transport) {
+			attempt = request_add_attempt(req, server, hedge);
+			attempt->replied = true;
+			hedge = true;
 			continue;
+		}
 
-		domlen = strlen(domain) + 1;
+		debug("server %s rank %u hedge %d tls %d", server->server,
+				server_rank(transport), hedge, transport->tls);
 
-		if (domlen < 5)
-			return -EINVAL;
+		if (transport->protocol == IPPROTO_TCP &&
+						!transport->connected) {
+			/* sent by server_send_pending() once connected */
+			attempt = request_add_attempt(req, transport, hedge);
+			attempt->sent = 0;
+			break;
+		}
 
-		memcpy(alt + offset, &req->altid, sizeof(req->altid));
+		err = ns_resolv(transport, req, request, name);
+		if (err > 0)
+			return err;
 
-		memcpy(alt + offset + 2, request + offset + 2, DNS_HEADER_SIZE - 2);
-		hdr->qdcount = htons(1);
+		attempt = request_add_attempt(req, transport, hedge);
+		if (err == 0)
+			break;
 
-		altlen = append_query(alt + offset + DNS_HEADER_SIZE, sizeof(alt) - DNS_HEADER_SIZE - offset,
-					name, domain);
-		if (altlen < 0)
-			return -EINVAL;
+		/* nothing to wait for from this one */
+		attempt->replied = true;
+		server_record_failure(transport);
+		hedge = true;
+	}
 
-		altlen += DNS_HEADER_SIZE;
-		altlen += offset;
+	if (server && request_next_server(req))
+		request_deadline_set(&request_hedge_queue, &req->hedge,
+				g_get_monotonic_time() +
+				server_hedge_delay(transport) * 1000);
 
-		memcpy(alt + altlen,
-			request + altlen - domlen,
-			req->request_len - altlen + domlen);
+	return 0;
+}
 
-		if (server->protocol == IPPROTO_TCP) {
-			uint16_t req_len = req->request_len + domlen - DNS_HEADER_TCP_EXTRA_BYTES;
-			uint16_t *len_hdr = (void*)alt;
-			*len_hdr = htons(req_len);
-		}
+static void request_hedge(struct request_data *req)
+{
+	if (request_send_next(req, req->request, req->name) > 0)
+		/* a cached result was sent, so the request can be released */
+		destroy_request_data(req);
+}
 
-		debug("req %p dstid 0x%04x altid 0x%04x", req, req->dstid,
-				req->altid);
+/*
+ * One timer serves the timeouts and hedges of all requests, arming
+ * it does not allocate like adding a GLib timeout source would.
+ */
+static gboolean request_timer_dispatch(GSource *source,
+				GSourceFunc callback, gpointer user_data)
+{
+	gint64 now = g_source_get_time(source);
+	struct request_deadline *deadline;
 
-		err = send(sk, alt, req->request_len + domlen, MSG_NOSIGNAL);
-		if (err < 0)
-			return -EIO;
+	while ((deadline = (void *)request_expiry_queue.head) &&
+						deadline->time <= now) {
+		request_deadline_clear(&request_expiry_queue, deadline);
+		request_timeout(deadline->link.data);
+	}
 
-		req->numserv++;
+	while ((deadline = (void *)request_hedge_queue.head) &&
+						deadline->time <= now) {
+		request_deadline_clear(&request_hedge_queue, deadline);
+		request_hedge(deadline->link.data);
 	}
 
-	return 0;
+	request_timer_update();
+
+	return G_SOURCE_CONTINUE;
 }
 
+static GSourceFuncs request_timer_funcs = {
+	.dispatch = request_timer_dispatch,
+};
+
 static bool convert_label(const char *start, const char *end, const char *ptr, char *uptr,
 			int remaining_len, int *used_comp, int *used_uncomp)
 {
@@ -2180,11 +3686,24 @@ static int forward_dns_reply(char *reply, size_t reply_len, int protocol,
 {
 	const size_t offset = protocol_offset(protocol);
 	struct domain_hdr *hdr = (void *)(reply + offset);
+	char *new_reply = NULL;
+	const char *answer;
+	size_t answer_len;
+	bool last;
 	int err, sk;
 
 	/* replace with original request ID from our client */
 	hdr->id = req->srcid;
 
+	/* errors and empty answers wait for the other servers */
+	last = req->numresp >= req->numserv ||
+		(hdr->rcode == ns_r_noerror &&
+			(hdr->ancount != 0 || !req->append_domain));
+
+	/* req->resp holds an earlier, better reply */
+	answer = req->resp;
+	answer_len = req->resplen;
+
 	if (hdr->rcode == ns_r_noerror || !req->resp) {
 		/*
 		 * If the domain name was appended remove it before forwarding
@@ -2196,8 +3715,6 @@ static int forward_dns_reply(char *reply, size_t reply_len, int protocol,
 		 * DNS client tries to resolv hostname without domain part, it
 		 * also expects to get the result without a domain name part.
 		 */
-		char *new_reply = NULL;
-
 		if (req->append_domain && ntohs(hdr->qdcount) == 1) {
 			const int fixup_res = dns_reply_fixup_domains(
 					reply, reply_len,
@@ -2214,52 +3731,79 @@ static int forward_dns_reply(char *reply, size_t reply_len, int protocol,
 			}
 		}
 
+		cache_update(data, (unsigned char*)reply, reply_len);
+
 		g_free(req->resp);
+		req->resp = NULL;
 		req->resplen = 0;
 
-		req->resp = g_try_malloc(reply_len);
-		if (!req->resp)
-			return -ENOMEM;
+		answer = reply + offset;
+		answer_len = reply_len - offset;
 
-		memcpy(req->resp, reply, reply_len);
-		req->resplen = reply_len;
+		/*
+		 * The last reply is forwarded straight from the receive
+		 * buffer, only one that might be superseded is copied.
+		 * It is kept without length prefix, see request_send_answer().
+		 */
+		if (!last) {
+			req->resp = g_try_malloc(answer_len);
+			if (!req->resp) {
+				err = -ENOMEM;
+				goto out;
+			}
 
-		cache_update(data, (unsigned char*)reply, reply_len);
+			memcpy(req->resp, answer, answer_len);
+			req->resplen = answer_len;
+		}
+	}
 
-		g_free(new_reply);
+	if (!last) {
+		err = -EINVAL;
+		goto out;
 	}
 
-	if (req->numresp < req->numserv) {
-		if (hdr->rcode > ns_r_noerror) {
-			return -EINVAL;
-		} else if (hdr->ancount == 0 && req->append_domain) {
-			return -EINVAL;
-		}
+	request_remove(req);
+
+	hdr = (void *)answer;
+
+	/* a prefetch only updates the cache */
+	if (req->prefetch) {
+		if (hdr->rcode != ns_r_noerror && hdr->rcode != ns_r_nxdomain)
+			cache_prefetch_failed(req);
+
+		err = 0;
+		goto out;
 	}
 
-	request_list = g_slist_remove(request_list, req);
+	/*
+	 * If the servers could not resolve the name, an expired answer
+	 * from the cache is more useful to the client (RFC 8767).
+	 */
+	if ((hdr->rcode == ns_r_servfail || hdr->rcode == ns_r_refused) &&
+			send_stale_response(req)) {
+		err = 0;
+		goto out;
+	}
 
-	if (protocol == IPPROTO_UDP) {
+	if (req->protocol == IPPROTO_UDP)
 		sk = get_req_udp_socket(req);
-		if (sk < 0) {
-			errno = -EIO;
-			err = -EIO;
-		} else
-			err = sendto(sk, req->resp, req->resplen, 0,
-				&req->sa, req->sa_len);
-	} else {
-		const uint16_t tcp_len = htons(req->resplen - DNS_HEADER_TCP_EXTRA_BYTES);
-		/* correct TCP message length */
-		memcpy(req->resp, &tcp_len, sizeof(tcp_len));
+	else
 		sk = req->client_sk;
-		err = send(sk, req->resp, req->resplen, MSG_NOSIGNAL);
-	}
+
+	if (sk < 0) {
+		errno = EIO;
+		err = -EIO;
+	} else
+		err = request_send_answer(req, sk, answer, answer_len);
 
 	if (err < 0)
 		debug("Cannot send msg, sk %d proto %d errno %d/%s", sk,
-			protocol, errno, strerror(errno));
+			req->protocol, errno, strerror(errno));
 	else
-		debug("proto %d sent %d bytes to %d", protocol, err, sk);
+		debug("proto %d sent %d bytes to %d", req->protocol, err, sk);
+
+out:
+	g_free(new_reply);
 
 	return err;
 }
@@ -2287,6 +3831,8 @@ static void server_destroy_socket(struct server_data *data)
 
 	g_free(data->incoming_reply);
 	data->incoming_reply = NULL;
+	data->incoming_len_received = 0;
+	data->handshake_start = 0;
 }
 
 static void destroy_server(struct server_data *server)
@@ -2297,6 +3843,7 @@ static void destroy_server(struct server_data *server)
 
 	server_list = g_slist_remove(server_list, server);
 	server_destroy_socket(server);
+	request_forget_server(server);
 
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		debug("Removing DNS server %s", server->server);
@@ -2320,14 +3867,42 @@ static void destroy_server(struct server_data *server)
 	g_free(server);
 }
 
+static void udp_server_reply(struct server_data *data, unsigned char *buf,
+								size_t len)
+{
+	struct request_data *req;
+	struct domain_hdr *hdr;
+	int res;
+
+	req = lookup_request(buf, len, IPPROTO_UDP);
+
+	if (!req)
+		/* invalid / corrupt request */
+		return;
+
+	hdr = (void *)buf;
+	server_record_reply(data, req, hdr->rcode);
+
+	/* do not wait for the hedge timer if this server gave up */
+	if ((hdr->rcode == ns_r_servfail || hdr->rcode == ns_r_refused) &&
+			request_send_next(req, req->request, req->name) > 0) {
+		destroy_request_data(req);
+		return;
+	}
+
+	res = forward_dns_reply((char*)buf, len, IPPROTO_UDP, data, req);
+
+	/* on success or no further responses are expected, destroy the req */
+	if (res >= 0 || req->numresp >= req->numserv)
+		destroy_request_data(req);
+}
+
 static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[4096];
-	int sk, res;
-	ssize_t len;
+	struct udp_recv_batch *batch = &udp_recv_batch;
 	struct server_data *data = user_data;
-	struct request_data *req;
+	int sk, i, count, batches;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
 		connman_error("Error with UDP server %s", data->server);
@@ -2336,24 +3911,306 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 	}
 
 	sk = g_io_channel_unix_get_fd(channel);
-	len = recv(sk, buf, sizeof(buf), 0);
 
-	if (len <= 0)
-		return TRUE;
+	udp_reply_batch_begin();
 
-	req = lookup_request(buf, len, IPPROTO_UDP);
+	for (batches = 0; batches < UDP_MAX_BATCHES; batches++) {
+		count = udp_recv_batch_fill(sk);
+
+		for (i = 0; i < count; i++) {
+			if (batch->msgs[i].msg_len == 0)
+				continue;
+
+			udp_server_reply(data, batch->buf[i],
+					batch->msgs[i].msg_len);
+		}
+
+		if (count < UDP_BATCH_SIZE)
+			break;
+	}
+
+	udp_reply_batch_end();
+
+	return TRUE;
+}
+
+static int server_create_socket(struct server_data *data);
+
+/*
+ * Opens a new connection for a stream server, the requests in flight
+ * are sent over it once it is connected.
+ */
+static int server_reconnect(struct server_data *server)
+{
+	debug("server %s", server->server);
+
+	server_destroy_socket(server);
+
+	/* send the queries of this server again once connected */
+	for (GList *list = request_queue.head; list; list = list->next) {
+		struct server_attempt *attempt;
+
+		attempt = request_find_attempt(list->data, server);
+		if (attempt) {
+			attempt->sent = 0;
+			attempt->replied = false;
+		}
+	}
+
+	server->connected = false;
+	server->stream_replies = 0;
+
+	return server_create_socket(server);
+}
+
+static gboolean tcp_idle_timeout(gpointer user_data)
+{
+	struct server_data *server = user_data;
+
+	debug("\n");
+
+	if (!server)
+		return FALSE;
+
+	server->timeout = 0;
+	destroy_server(server);
+
+	return FALSE;
+}
+
+/* the connection is kept open until it was idle for TCP_IDLE_TIMEOUT */
+static void server_touch(struct server_data *server)
+{
+	if (server->timeout > 0)
+		g_source_remove(server->timeout);
+
+	server->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, server);
+}
+
+/*
+ * Sends the requests in flight over a freshly connected server: all
+ * TCP requests and the UDP requests which picked it in
+ * request_send_next(). Returns the number of requests sent.
+ */
+static int server_send_pending(struct server_data *server)
+{
+	int sent = 0;
+
+	/* don't advance the list in the for loop, because we might
+	 * need to delete elements while iterating through it */
+	for (GList *list = request_queue.head; list; ) {
+		struct request_data *req = list->data;
+		struct server_attempt *attempt;
+		int status;
+
+		list = list->next;
+
+		if (!req->request)
+			continue;
+
+		attempt = request_find_attempt(req, server);
+		if (attempt && (attempt->sent || attempt->replied))
+			continue;
+
+		if (!attempt && req->protocol == IPPROTO_UDP)
+			continue;
+
+		debug("Sending req %s over TCP", (char *)req->name);
+
+		status = ns_resolv(server, req, req->request, req->name);
+		if (status > 0) {
+			/*
+			 * A cached result was sent,
+			 * so the request can be released
+			 */
+			destroy_request_data(req);
+			continue;
+		} else if (status < 0) {
+			if (attempt)
+				attempt->replied = true;
+			continue;
+		}
+
+		if (attempt)
+			attempt->sent = g_get_monotonic_time();
+		else
+			request_add_attempt(req, server, false);
+
+		sent++;
+
+		if (req->protocol == IPPROTO_UDP)
+			continue;
+
+		request_set_timeout(req, 30);
+	}
+
+	return sent;
+}
+
+static void server_store_tls_session(struct server_data *server)
+{
+	void *data;
+	size_t len;
+
+	data = g_io_channel_gnutls_get_session(server->channel, &len);
+	if (!data)
+		return;
+
+	g_hash_table_replace(tls_session_table, g_strdup(server->server),
+					g_bytes_new_take(data, len));
+}
+
+/*
+ * Continues the TLS handshake on a connected stream. Returns 0 once it
+ * is done, -EAGAIN while it is still in progress.
+ */
+static int server_tls_handshake(struct server_data *server)
+{
+	gint64 elapsed;
+
+	switch (g_io_channel_gnutls_handshake(server->channel)) {
+	case G_IO_STATUS_NORMAL:
+		break;
+	case G_IO_STATUS_AGAIN:
+		return -EAGAIN;
+	default:
+		connman_error("TLS handshake with DNS server %s failed",
+							server->server);
+		return -ECONNABORTED;
+	}
+
+	elapsed = g_get_monotonic_time() - server->handshake_start;
+	server->handshake_start = 0;
+
+	server->stats.handshakes++;
+	server->stats.handshake_time += elapsed;
+	if (g_io_channel_gnutls_is_resumed(server->channel))
+		server->stats.resumed_handshakes++;
+
+	debug("server %s handshake %" G_GINT64_FORMAT " usec resumed %d",
+		server->server, elapsed,
+		g_io_channel_gnutls_is_resumed(server->channel));
+
+	server_store_tls_session(server);
+
+	return 0;
+}
+
+/*
+ * Reads the next length prefixed reply from the connection. Returns
+ * the complete reply, or NULL if more data is needed or the connection
+ * failed (err is then set).
+ */
+static struct partial_reply *server_read_reply(struct server_data *server,
+								int *err)
+{
+	struct partial_reply *reply = server->incoming_reply;
+	ssize_t bytes_recv;
+	uint16_t reply_len;
+
+	*err = 0;
+
+	while (!reply) {
+		bytes_recv = server_stream_read(server,
+			server->incoming_len + server->incoming_len_received,
+			sizeof(server->incoming_len) -
+					server->incoming_len_received);
+		if (bytes_recv == -EAGAIN || bytes_recv == -EWOULDBLOCK)
+			return NULL;
+
+		if (bytes_recv <= 0) {
+			*err = bytes_recv ? bytes_recv : -ECONNRESET;
+			return NULL;
+		}
+
+		server->incoming_len_received += bytes_recv;
+		if (server->incoming_len_received < sizeof(reply_len))
+			continue;
+
+		/* the header contains the length of the message
+		 * excluding the two length bytes */
+		memcpy(&reply_len, server->incoming_len, sizeof(reply_len));
+		reply_len = ntohs(reply_len) + DNS_HEADER_TCP_EXTRA_BYTES;
+
+		debug("TCP reply %d bytes from %s", reply_len,
+							server->server);
+
+		reply = g_try_malloc(sizeof(*reply) + reply_len + 2);
+		if (!reply) {
+			*err = -ENOMEM;
+			return NULL;
+		}
+
+		reply->len = reply_len;
+		memcpy(reply->buf, server->incoming_len,
+					sizeof(server->incoming_len));
+		reply->received = sizeof(server->incoming_len);
+
+		server->incoming_len_received = 0;
+		server->incoming_reply = reply;
+	}
+
+	while (reply->received < reply->len) {
+		bytes_recv = server_stream_read(server,
+					reply->buf + reply->received,
+					reply->len - reply->received);
+		if (bytes_recv == -EAGAIN || bytes_recv == -EWOULDBLOCK)
+			return NULL;
+
+		if (bytes_recv <= 0) {
+			*err = bytes_recv ? bytes_recv : -ECONNRESET;
+			return NULL;
+		}
+
+		reply->received += bytes_recv;
+	}
+
+	server->incoming_reply = NULL;
+
+	return reply;
+}
+
+static void server_forward_reply(struct server_data *server,
+					struct partial_reply *reply)
+{
+	struct request_data *req;
+	struct domain_hdr *hdr;
+	int res;
+
+	req = lookup_request(reply->buf, reply->received, IPPROTO_TCP);
 
 	if (!req)
 		/* invalid / corrupt request */
-		return TRUE;
+		return;
 
-	res = forward_dns_reply((char*)buf, len, IPPROTO_UDP, data, req);
+	hdr = (void *)(reply->buf + DNS_HEADER_TCP_EXTRA_BYTES);
+	server_record_reply(server, req, hdr->rcode);
 
-	/* on success or no further responses are expected, destroy the req */
-	if (res == 0 || req->numresp >= req->numserv)
+	/* TLS 1.3 hands out the session ticket after the handshake */
+	if (server->tls && !server->stream_replies)
+		server_store_tls_session(server);
+
+	server->stream_replies++;
+
+	/* do not wait for the hedge timer if this server gave up */
+	if (req->protocol == IPPROTO_UDP &&
+			(hdr->rcode == ns_r_servfail ||
+				hdr->rcode == ns_r_refused) &&
+			request_send_next(req, req->request, req->name) > 0) {
+		destroy_request_data(req);
+		return;
+	}
+
+	res = forward_dns_reply((char*)reply->buf, reply->received,
+						IPPROTO_TCP, server, req);
+
+	/*
+	 * On success or if no further responses are expected the
+	 * request is done, the connection stays open for others.
+	 */
+	if (res >= 0 || req->numresp >= req->numserv)
 		destroy_request_data(req);
-
-	return TRUE;
 }
 
 static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
@@ -2366,67 +4223,80 @@ static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
 		return FALSE;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
+		GList *list;
+		bool reconnect, reused;
 hangup:
 		debug("TCP server channel closed, sk %d", sk);
 
 		/*
-		 * Discard any partial response which is buffered; better
-		 * to get a proper response from a working server.
+		 * A connection which answered before was most likely
+		 * closed by the server for being idle, try the queries
+		 * it had outstanding again on a new one.
 		 */
-		g_free(server->incoming_reply);
-		server->incoming_reply = NULL;
+		reused = server->stream_replies > 0;
+		reconnect = false;
 
-		list = request_list;
+		list = request_queue.head;
 		while (list) {
+			struct server_attempt *attempt;
 			struct domain_hdr *hdr;
 			req = list->data;
 			list = list->next;
 
-			if (req->protocol == IPPROTO_UDP)
+			if (!req->request)
+				continue;
+
+			/*
+			 * Requests which were sent over this connection
+			 * lose a server; requests not sent anywhere yet
+			 * were only waiting for it to connect.
+			 */
+			attempt = request_find_attempt(req, server);
+			if (attempt && attempt->sent) {
+				if (req->numserv && --(req->numserv))
+					continue;
+
+				if (reused) {
+					reconnect = true;
+					continue;
+				}
+			} else if (!attempt && (req->numserv ||
+					req->protocol == IPPROTO_UDP)) {
 				continue;
-			else if (!req->request)
+			}
+
+			/* UDP clients still have the other servers */
+			if (req->protocol == IPPROTO_UDP) {
+				if (attempt)
+					attempt->replied = true;
+
+				if (request_send_next(req, req->request,
+							req->name) > 0)
+					destroy_request_data(req);
 				continue;
+			}
 
 			/*
 			 * If we're not waiting for any further response
 			 * from another name server, then we send an error
 			 * response to the client.
 			 */
-			if (req->numserv && --(req->numserv))
-				continue;
-
 			hdr = (void *)(req->request + DNS_HEADER_TCP_EXTRA_BYTES);
 			hdr->id = req->srcid;
 			send_response(req->client_sk, req->request,
 				req->request_len, NULL, 0, IPPROTO_TCP);
 
-			request_list = g_slist_remove(request_list, req);
+			request_remove(req);
 		}
 
-		destroy_server(server);
+		if (!reconnect || server_reconnect(server) < 0)
+			destroy_server(server);
 
 		return FALSE;
 	}
 
-	if ((condition & G_IO_OUT) && !server->connected) {
-		bool no_request_sent = true;
-		struct server_data *udp_server = find_server(
-				server->index, server->server,
-				IPPROTO_UDP);
-		if (udp_server) {
-			for (GList *domains = udp_server->domains; domains;
-						domains = domains->next) {
-				const char *dom = domains->data;
-
-				debug("Adding domain %s to %s",
-						dom, server->server);
-
-				server->domains = g_list_append(server->domains,
-								g_strdup(dom));
-			}
-		}
-
+	if ((condition & G_IO_OUT) && !server->connected &&
+					!server->handshake_start) {
 		/*
 		 * Remove the G_IO_OUT flag from the watch, otherwise we end
 		 * up in a busy loop, because the socket is constantly writable.
@@ -2439,150 +4309,118 @@ hangup:
 			G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
 			tcp_server_event, server);
 
-		server->connected = true;
-		server_list = g_slist_append(server_list, server);
-
-		/* don't advance the list in the for loop, because we might
-		 * need to delete elements while iterating through it */
-		for (GSList *list = request_list; list; ) {
-			int status;
-			req = list->data;
-
-			if (req->protocol == IPPROTO_UDP) {
-				list = list->next;
-				continue;
-			}
-
-			debug("Sending req %s over TCP", (char *)req->name);
-
-			status = ns_resolv(server, req,
-						req->request, req->name);
-			if (status > 0) {
-				/*
-				 * A cached result was sent,
-				 * so the request can be released
-				 */
-				list = list->next;
-				request_list = g_slist_remove(request_list, req);
-				destroy_request_data(req);
-				continue;
-			} else if (status < 0) {
-				list = list->next;
-				continue;
-			}
-
-			no_request_sent = false;
+		server_touch(server);
 
-			if (req->timeout > 0)
-				g_source_remove(req->timeout);
+		if (server->tls) {
+			int err;
 
-			req->timeout = g_timeout_add_seconds(30,
-						request_timeout, req);
-			list = list->next;
-		}
+			server->handshake_start = g_get_monotonic_time();
 
-		if (no_request_sent) {
-			destroy_server(server);
-			return FALSE;
+			err = server_tls_handshake(server);
+			if (err == -EAGAIN)
+				return TRUE;
+			if (err < 0)
+				goto hangup;
 		}
 
-	} else if (condition & G_IO_IN) {
-		struct partial_reply *reply = server->incoming_reply;
-		int bytes_recv;
-		int res;
+		server->connected = true;
 
-		if (!reply) {
-			uint16_t reply_len;
+		/*
+		 * Keep the connection even if the requests were answered
+		 * meanwhile, later TCP requests will reuse it.
+		 */
+		server_send_pending(server);
 
-			bytes_recv = recv(sk, &reply_len, sizeof(reply_len), MSG_PEEK);
-			if (!bytes_recv) {
-				goto hangup;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
+	} else if (condition & G_IO_IN) {
+		struct partial_reply *reply;
+		int err;
 
-				connman_error("DNS proxy error %s",
-						strerror(errno));
-				goto hangup;
-			} else if (bytes_recv < sizeof(reply_len))
+		if (server->handshake_start) {
+			err = server_tls_handshake(server);
+			if (err == -EAGAIN)
 				return TRUE;
+			if (err < 0)
+				goto hangup;
 
-			/* the header contains the length of the message
-			 * excluding the two length bytes */
-			reply_len = ntohs(reply_len) + DNS_HEADER_TCP_EXTRA_BYTES;
-
-			debug("TCP reply %d bytes from %d", reply_len, sk);
-
-			reply = g_try_malloc(sizeof(*reply) + reply_len + 2);
-			if (!reply)
-				return TRUE;
+			server->connected = true;
+			server_send_pending(server);
+			return TRUE;
+		}
 
-			reply->len = reply_len;
-			/* we only peeked the two length bytes, so we have to
-			   receive the complete message below proper. */
-			reply->received = 0;
+		server_touch(server);
 
-			server->incoming_reply = reply;
+		/*
+		 * Several replies may have arrived at once and TLS may
+		 * already hold them decrypted, so read until the stream
+		 * runs dry.
+		 */
+		while ((reply = server_read_reply(server, &err))) {
+			server_forward_reply(server, reply);
+			g_free(reply);
 		}
 
-		while (reply->received < reply->len) {
-			bytes_recv = recv(sk, reply->buf + reply->received,
-					reply->len - reply->received, 0);
-			if (!bytes_recv) {
-				connman_error("DNS proxy TCP disconnect");
-				break;
-			} else if (bytes_recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					return TRUE;
-
+		if (err < 0) {
+			if (err != -ECONNRESET)
 				connman_error("DNS proxy error %s",
-						strerror(errno));
-				break;
-			}
-			reply->received += bytes_recv;
+							strerror(-err));
+			goto hangup;
 		}
 
-		req = lookup_request(reply->buf, reply->received, IPPROTO_TCP);
-
-		if (!req)
-			/* invalid / corrupt request */
-			return TRUE;
-
-		res = forward_dns_reply((char*)reply->buf, reply->received, IPPROTO_TCP, server, req);
+		return TRUE;
+	}
 
-		g_free(reply);
-		server->incoming_reply = NULL;
+	return TRUE;
+}
 
-		/* on success or if no further responses are expected close
-		 * connection */
-		if (res == 0 || req->numresp >= req->numserv) {
-			destroy_request_data(req);
-			destroy_server(server);
-			return FALSE;
-		}
+/*
+ * Returns the value configured for a server in a list of
+ * "address#value" entries.
+ */
+static const char *server_tls_setting(const char *key, const char *server)
+{
+	char **entries = connman_setting_get_string_list(key);
+	size_t len = strlen(server);
+	int i;
 
-		/*
-		 * keep the TCP connection open, there are more
-		 * requests to be answered
-		 */
-		return TRUE;
+	for (i = 0; entries && entries[i]; i++) {
+		if (strncmp(entries[i], server, len) == 0 &&
+						entries[i][len] == '#')
+			return entries[i] + len + 1;
 	}
 
-	return TRUE;
+	return NULL;
 }
 
-static gboolean tcp_idle_timeout(gpointer user_data)
+static int server_tls_setup(struct server_data *data)
 {
-	struct server_data *server = user_data;
+	GBytes *session = g_hash_table_lookup(tls_session_table,
+							data->server);
+	const char *name, *pin;
 
-	debug("\n");
+	g_io_channel_set_encoding(data->channel, NULL, NULL);
+	g_io_channel_set_buffered(data->channel, FALSE);
+	g_io_channel_gnutls_set_priority(data->channel, DNS_OVER_TLS_PRIORITY);
 
-	if (!server)
-		return FALSE;
+	if (!tls_opportunistic) {
+		name = server_tls_setting("DNSOverTLSServerNames",
+							data->server);
+		pin = server_tls_setting("DNSOverTLSPins", data->server);
 
-	destroy_server(server);
+		if (!g_io_channel_gnutls_set_verify(data->channel,
+				name ? name : data->server, pin)) {
+			connman_error("Cannot authenticate DNS server %s",
+							data->server);
+			return -EACCES;
+		}
+	}
 
-	return FALSE;
+	/* resume the previous session to save a full handshake */
+	if (session)
+		g_io_channel_gnutls_set_session(data->channel,
+				g_bytes_get_data(session, NULL),
+				g_bytes_get_size(session));
+
+	return 0;
 }
 
 static int server_create_socket(struct server_data *data)
@@ -2623,7 +4461,10 @@ static int server_create_socket(struct server_data *data)
 		g_free(interface);
 	}
 
-	data->channel = g_io_channel_unix_new(sk);
+	if (data->tls)
+		data->channel = g_io_channel_gnutls_new(sk);
+	else
+		data->channel = g_io_channel_unix_new(sk);
 	if (!data->channel) {
 		connman_error("Failed to create server %s channel",
 							data->server);
@@ -2634,13 +4475,20 @@ static int server_create_socket(struct server_data *data)
 
 	g_io_channel_set_close_on_unref(data->channel, TRUE);
 
+	if (data->tls) {
+		err = server_tls_setup(data);
+		if (err < 0) {
+			server_destroy_socket(data);
+			return err;
+		}
+	}
+
 	if (data->protocol == IPPROTO_TCP) {
 		g_io_channel_set_flags(data->channel, G_IO_FLAG_NONBLOCK, NULL);
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_OUT | G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
 						tcp_server_event, data);
-		data->timeout = g_timeout_add_seconds(30, tcp_idle_timeout,
-								data);
+		server_touch(data);
 	} else
 		data->watch = g_io_add_watch(data->channel,
 			G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
@@ -2715,13 +4563,16 @@ static struct server_data *create_server(int index,
 		data->domains = g_list_append(data->domains, g_strdup(domain));
 	data->server = g_strdup(server);
 	data->protocol = protocol;
+	if (protocol == IPPROTO_TCP)
+		data->tls = server_uses_tls(data);
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_socktype = socket_type(protocol, 0);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
 
-	ret = getaddrinfo(data->server, "53", &hints, &rp);
+	ret = getaddrinfo(data->server, data->tls ? DNS_OVER_TLS_PORT : "53",
+							&hints, &rp);
 	if (ret) {
 		connman_error("Failed to parse server %s address: %s\n",
 			      data->server, gai_strerror(ret));
@@ -2774,12 +4625,32 @@ static struct server_data *create_server(int index,
 			DBG("Adding fallback DNS server %s", data->server);
 		}
 
+		server_list = g_slist_append(server_list, data);
+	} else {
+		struct server_data *udp_server = find_server(index, server,
+								IPPROTO_UDP);
+
+		for (GList *domains = udp_server ? udp_server->domains : NULL;
+					domains; domains = domains->next) {
+			const char *dom = domains->data;
+
+			debug("Adding domain %s to %s", dom, data->server);
+
+			data->domains = g_list_append(data->domains,
+							g_strdup(dom));
+		}
+
+		/* listed while connecting so that it is not created twice */
 		server_list = g_slist_append(server_list, data);
 	}
 
 	return data;
 }
 
+/*
+ * Sends the request to the best ranked server only, the others are
+ * tried one by one later from request_hedge().
+ */
 static bool resolv(struct request_data *req,
 				gpointer request, gpointer name)
 {
@@ -2802,12 +4673,9 @@ static bool resolv(struct request_data *req,
 				continue;
 			}
 		}
-
-		if (ns_resolv(data, req, request, name) > 0)
-			return true;
 	}
 
-	return false;
+	return request_send_next(req, request, name) > 0;
 }
 
 static void update_domain(int index, const char *domain, bool append)
@@ -2860,7 +4728,7 @@ static void remove_domain(int index, const char *domain)
 
 static void flush_requests(struct server_data *server)
 {
-	GSList *list = request_list;
+	GList *list = request_queue.head;
 	while (list) {
 		struct request_data *req = list->data;
 
@@ -2871,16 +4739,14 @@ static void flush_requests(struct server_data *server)
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
 			destroy_request_data(req);
 			continue;
 		}
 
-		if (req->timeout > 0)
-			g_source_remove(req->timeout);
+		if (!request_find_attempt(req, server))
+			request_add_attempt(req, server, false);
 
-		req->timeout = g_timeout_add_seconds(5, request_timeout, req);
+		request_set_timeout(req, 5);
 	}
 }
 
@@ -3049,6 +4915,10 @@ static void dnsproxy_service_state_changed(struct connman_service *service,
 	index = __connman_service_get_index(service);
 	list = server_list;
 
+	/* set again by the service once it is connected */
+	if (tls_index_table)
+		g_hash_table_remove(tls_index_table, GINT_TO_POINTER(index));
+
 	while (list) {
 		struct server_data *data = list->data;
 
@@ -3258,7 +5128,7 @@ read_another:
 		return true;
 	}
 
-	req = g_try_new0(struct request_data, 1);
+	req = request_data_new();
 	if (!req)
 		return true;
 
@@ -3271,8 +5141,7 @@ read_another:
 	hdr = (void*)(client->buf + DNS_HEADER_TCP_EXTRA_BYTES);
 
 	memcpy(&req->srcid, &hdr->id, sizeof(req->srcid));
-	req->dstid = get_id();
-	req->altid = get_id();
+	request_assign_ids(req);
 	req->request_len = msg_len + DNS_HEADER_TCP_EXTRA_BYTES;
 
 	/* replace ID the request for forwarding */
@@ -3288,73 +5157,71 @@ read_another:
 	 */
 	entry = cache_check(client->buf, &qtype, IPPROTO_TCP);
 	if (entry) {
-		debug("cache hit %s type %s", query, qtype == DNS_TYPE_A ? "A" : "AAAA");
-		struct cache_data *data = qtype == DNS_TYPE_A ?
-			entry->ipv4 : entry->ipv6;
+		debug("cache hit %s type %s", query, cache_type_str(qtype));
+		struct cache_data *data = entry->data;
+		int ttl_left = data->valid_until - time(NULL);
+		entry->hits++;
 
-		if (data) {
-			int ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+		send_cached_response(client_sk, data, NULL, 0, IPPROTO_TCP,
+				req->srcid, ttl_left);
 
-			send_cached_response(client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+		destroy_request_data(req);
+		goto out;
+	}
 
-			g_free(req);
-			goto out;
-		} else
-			debug("data missing, ignoring cache for this query");
+	/*
+	 * Copy the relevant buffers, the request is sent once the
+	 * servers are properly connected over TCP.
+	 */
+	if (request_store_query(req, client->buf, req->request_len,
+							query) < 0) {
+		send_response(client_sk, client->buf,
+			req->request_len, NULL, 0, IPPROTO_TCP);
+		destroy_request_data(req);
+		goto out;
 	}
 
 	for (GSList *list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
+		struct server_data *tcp_server;
 
 		if (data->protocol != IPPROTO_UDP || !data->enabled)
 			continue;
 
-		if (!create_server(data->index, NULL, data->server,
-					IPPROTO_TCP))
+		tcp_server = find_server(data->index, data->server,
+							IPPROTO_TCP);
+		if (!tcp_server) {
+			if (create_server(data->index, NULL, data->server,
+						IPPROTO_TCP))
+				waiting_for_connect = true;
+			continue;
+		}
+
+		if (!tcp_server->connected) {
+			waiting_for_connect = true;
+			continue;
+		}
+
+		/* pipeline the query on the existing connection */
+		if (ns_resolv(tcp_server, req, req->request, req->name))
 			continue;
 
+		request_add_attempt(req, tcp_server, false);
+		server_touch(tcp_server);
 		waiting_for_connect = true;
 	}
 
 	if (!waiting_for_connect) {
-		/* No server is waiting for connect */
+		/* No server is connected or waiting for connect */
 		send_response(client_sk, client->buf,
 			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req);
+		destroy_request_data(req);
 		return true;
 	}
 
-	/*
-	 * The server is not connected yet.
-	 * Copy the relevant buffers.
-	 * The request will actually be sent once we're
-	 * properly connected over TCP to the nameserver.
-	 */
-	req->request = g_try_malloc0(req->request_len);
-	if (!req->request) {
-		send_response(client_sk, client->buf,
-			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req);
-		goto out;
-	}
-	memcpy(req->request, client->buf, req->request_len);
-
-	req->name = g_try_malloc0(sizeof(query));
-	if (!req->name) {
-		send_response(client_sk, client->buf,
-			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req->request);
-		g_free(req);
-		goto out;
-	}
-	memcpy(req->name, query, sizeof(query));
-
-	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
+	request_set_timeout(req, 30);
 
-	request_list = g_slist_append(request_list, req);
+	request_insert(req);
 
 out:
 	if (client->buf_end > (msg_len + DNS_HEADER_TCP_EXTRA_BYTES)) {
@@ -3629,58 +5496,34 @@ static gboolean tcp6_listener_event(GIOChannel *channel, GIOCondition condition,
 				&ifdata->tcp6_listener_watch);
 }
 
-static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
-				struct listener_data *ifdata, int family,
-				guint *listener_watch)
+static void udp_listener_query(struct listener_data *ifdata, int family,
+				int sk, unsigned char *buf, int len,
+				const struct sockaddr *client_addr,
+				socklen_t client_addr_len)
 {
-	unsigned char buf[768];
 	char query[512];
 	struct request_data *req = NULL;
 	struct domain_hdr *hdr = NULL;
-	int sk = -1, err, len;
-
-	struct sockaddr_in6 client_addr6;
-	socklen_t client_addr6_len = sizeof(client_addr6);
-	struct sockaddr_in client_addr4;
-	socklen_t client_addr4_len = sizeof(client_addr4);
-	void *client_addr;
-	socklen_t *client_addr_len;
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		*listener_watch = 0;
-		return false;
-	}
-
-	if (family == AF_INET) {
-		client_addr = &client_addr4;
-		client_addr_len = &client_addr4_len;
-	} else {
-		client_addr = &client_addr6;
-		client_addr_len = &client_addr6_len;
-	}
+	int err;
 
-	memset(client_addr, 0, *client_addr_len);
-	sk = g_io_channel_unix_get_fd(channel);
-	len = recvfrom(sk, buf, sizeof(buf), 0, client_addr, client_addr_len);
-	if (len < 2)
-		return true;
+	if (len < 2 || client_addr_len > sizeof(req->__sin6))
+		return;
 
 	debug("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
 	err = parse_request(buf, len, query, sizeof(query));
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
 		send_response(sk, buf, len, client_addr,
-				*client_addr_len, IPPROTO_UDP);
-		return true;
+				client_addr_len, IPPROTO_UDP);
+		return;
 	}
 
-	req = g_try_new0(struct request_data, 1);
+	req = request_data_new();
 	if (!req)
-		return true;
+		return;
 
-	memcpy(&req->sa, client_addr, *client_addr_len);
-	req->sa_len = *client_addr_len;
+	memcpy(&req->sa, client_addr, client_addr_len);
+	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 	req->family = family;
@@ -3688,8 +5531,7 @@ static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	hdr = (void*)buf;
 
 	req->srcid = hdr->id;
-	req->dstid = get_id();
-	req->altid = get_id();
+	request_assign_ids(req);
 	req->request_len = len;
 
 	hdr->id = req->dstid;
@@ -3700,15 +5542,52 @@ static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
 
 	if (resolv(req, buf, query)) {
 		/* a cached result was sent, so the request can be released */
-	        g_free(req);
-		return true;
+		destroy_request_data(req);
+		return;
+	}
+
+	if (request_store_query(req, buf, len, query) < 0) {
+		send_response(sk, buf, len, client_addr, client_addr_len,
+							IPPROTO_UDP);
+		destroy_request_data(req);
+		return;
+	}
+
+	request_set_timeout(req, 5);
+	request_insert(req);
+}
+
+static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
+				struct listener_data *ifdata, int family,
+				guint *listener_watch)
+{
+	struct udp_recv_batch *batch = &udp_recv_batch;
+	int sk, i, count, batches;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		*listener_watch = 0;
+		return false;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	udp_reply_batch_begin();
+
+	for (batches = 0; batches < UDP_MAX_BATCHES; batches++) {
+		count = udp_recv_batch_fill(sk);
+
+		for (i = 0; i < count; i++)
+			udp_listener_query(ifdata, family, sk, batch->buf[i],
+					batch->msgs[i].msg_len,
+					batch->msgs[i].msg_hdr.msg_name,
+					batch->msgs[i].msg_hdr.msg_namelen);
+
+		if (count < UDP_BATCH_SIZE)
+			break;
 	}
 
-	req->name = g_strdup(query);
-	req->request = g_malloc(len);
-	memcpy(req->request, buf, len);
-	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	udp_reply_batch_end();
 
 	return true;
 }
@@ -3955,18 +5834,14 @@ static void destroy_listener(struct listener_data *ifdata)
 		__connman_resolvfile_remove(index, NULL, "::1");
 	}
 
-	for (GSList *list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	while (request_queue.head) {
+		struct request_data *req = request_queue.head->data;
 
 		debug("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
 		destroy_request_data(req);
-		list->data = NULL;
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
-
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
 }
@@ -4062,6 +5937,32 @@ int __connman_dnsproxy_init(void)
 							NULL,
 							free_partial_reqs);
 
+	request_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	tls_index_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	tls_session_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, (GDestroyNotify)g_bytes_unref);
+
+	request_timer = g_source_new(&request_timer_funcs, sizeof(GSource));
+	g_source_attach(request_timer, NULL);
+
+	cache_max_size = connman_setting_get_uint("DNSCacheSize");
+	cache_max_bytes = (size_t)connman_setting_get_uint("DNSCacheMemory")
+									* 1024;
+	cache_max_negative_bytes = (size_t)connman_setting_get_uint(
+					"DNSNegativeCacheMemory") * 1024;
+	cache_stale_time = connman_setting_get_uint("DNSServeStaleTime");
+	cache_prefetch_threshold = connman_setting_get_uint(
+						"DNSPrefetchThreshold");
+	if (cache_prefetch_threshold > 100)
+		cache_prefetch_threshold = 100;
+
+	tls_opportunistic = g_strcmp0(connman_setting_get_string(
+			"DNSOverTLSAuthentication"), "opportunistic") == 0;
+
+	DBG("cache size %u memory %zu negative %zu", cache_max_size,
+				cache_max_bytes, cache_max_negative_bytes);
+
 	index = connman_inet_ifindex("lo");
 	err = __connman_dnsproxy_add_listener(index);
 	if (err < 0)
@@ -4072,6 +5973,15 @@ int __connman_dnsproxy_init(void)
 		__connman_dnsproxy_remove_listener(index);
 		g_hash_table_destroy(listener_table);
 		g_hash_table_destroy(partial_tcp_req_table);
+		g_hash_table_destroy(request_table);
+		request_table = NULL;
+		g_hash_table_destroy(tls_index_table);
+		tls_index_table = NULL;
+		g_hash_table_destroy(tls_session_table);
+		tls_session_table = NULL;
+		g_source_destroy(request_timer);
+		g_source_unref(request_timer);
+		request_timer = NULL;
 
 		return err;
 	}
@@ -4084,6 +5994,44 @@ int __connman_dnsproxy_set_mdns(int index, bool enabled)
 	return -ENOTSUP;
 }
 
+int __connman_dnsproxy_set_dns_over_tls(int index, bool enabled)
+{
+	GSList *list;
+
+	DBG("index %d enabled %d", index, enabled);
+
+	if (index < 0)
+		return -EINVAL;
+
+	if (enabled && !g_io_channel_supports_tls())
+		return -ENOTSUP;
+
+	if (enabled == g_hash_table_contains(tls_index_table,
+						GINT_TO_POINTER(index)))
+		return 0;
+
+	if (enabled)
+		g_hash_table_add(tls_index_table, GINT_TO_POINTER(index));
+	else
+		g_hash_table_remove(tls_index_table, GINT_TO_POINTER(index));
+
+	/* the stream connections are opened again with the other transport */
+	list = server_list;
+	while (list) {
+		struct server_data *data = list->data;
+
+		/* Get next before the list is changed by destroy_server() */
+		list = list->next;
+
+		if (data->index == index && data->protocol == IPPROTO_TCP)
+			destroy_server(data);
+	}
+
+	cache_invalidate();
+
+	return 0;
+}
+
 void __connman_dnsproxy_cleanup(void)
 {
 	DBG("");
@@ -4106,6 +6054,21 @@ void __connman_dnsproxy_cleanup(void)
 
 	g_hash_table_destroy(partial_tcp_req_table);
 
+	g_hash_table_destroy(request_table);
+	request_table = NULL;
+
+	g_hash_table_destroy(tls_index_table);
+	tls_index_table = NULL;
+	g_hash_table_destroy(tls_session_table);
+	tls_session_table = NULL;
+
+	g_source_destroy(request_timer);
+	g_source_unref(request_timer);
+	request_timer = NULL;
+
+	while (request_pool.head)
+		g_free(g_queue_pop_head_link(&request_pool)->data);
+
 	if (ipv4_resolve)
 		g_resolv_unref(ipv4_resolve);
 	if (ipv6_resolve)
@@ -4116,3 +6079,89 @@ void __connman_dnsproxy_set_listen_port(unsigned int port)
 {
 	dns_listen_port = port;
 }
+
+static void append_server_statistics(DBusMessageIter *iter,
+					struct server_data *server)
+{
+	DBusMessageIter container, dict;
+	dbus_int32_t index = server->index;
+	dbus_bool_t enabled = server->enabled;
+
+	const char *transport = server->tls ? "tls" :
+			server->protocol == IPPROTO_TCP ? "tcp" : "udp";
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
+							NULL, &container);
+	connman_dbus_dict_open(&container, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Address",
+					DBUS_TYPE_STRING, &server->server);
+	connman_dbus_dict_append_basic(&dict, "Transport",
+					DBUS_TYPE_STRING, &transport);
+	connman_dbus_dict_append_basic(&dict, "Index",
+					DBUS_TYPE_INT32, &index);
+	connman_dbus_dict_append_basic(&dict, "Enabled",
+					DBUS_TYPE_BOOLEAN, &enabled);
+	connman_dbus_dict_append_basic(&dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &server->srtt);
+	connman_dbus_dict_append_basic(&dict, "RoundTripTimeVariance",
+					DBUS_TYPE_UINT32, &server->rttvar);
+	connman_dbus_dict_append_basic(&dict, "FailuresInRow",
+				DBUS_TYPE_UINT32, &server->failures_in_row);
+	connman_dbus_dict_append_basic(&dict, "Queries",
+				DBUS_TYPE_UINT64, &server->stats.queries);
+	connman_dbus_dict_append_basic(&dict, "Replies",
+				DBUS_TYPE_UINT64, &server->stats.replies);
+	connman_dbus_dict_append_basic(&dict, "Failures",
+				DBUS_TYPE_UINT64, &server->stats.failures);
+	connman_dbus_dict_append_basic(&dict, "HedgedQueries",
+				DBUS_TYPE_UINT64, &server->stats.hedges);
+	connman_dbus_dict_append_basic(&dict, "QueryTime",
+				DBUS_TYPE_UINT64, &server->stats.query_time);
+
+	if (server->tls) {
+		connman_dbus_dict_append_basic(&dict, "Handshakes",
+				DBUS_TYPE_UINT64, &server->stats.handshakes);
+		connman_dbus_dict_append_basic(&dict, "ResumedHandshakes",
+			DBUS_TYPE_UINT64, &server->stats.resumed_handshakes);
+		connman_dbus_dict_append_basic(&dict, "HandshakeTime",
+			DBUS_TYPE_UINT64, &server->stats.handshake_time);
+	}
+
+	connman_dbus_dict_close(&container, &dict);
+	dbus_message_iter_close_container(iter, &container);
+}
+
+static void append_servers_statistics(DBusMessageIter *iter, void *user_data)
+{
+	for (GSList *list = server_list; list; list = list->next)
+		append_server_statistics(iter, list->data);
+}
+
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict)
+{
+	dbus_uint32_t entries = cache_size;
+	dbus_uint32_t bytes = cache_bytes;
+	dbus_uint32_t negative_bytes = cache_negative_bytes;
+
+	connman_dbus_dict_append_basic(dict, "CacheEntries",
+					DBUS_TYPE_UINT32, &entries);
+	connman_dbus_dict_append_basic(dict, "CacheMemory",
+					DBUS_TYPE_UINT32, &bytes);
+	connman_dbus_dict_append_basic(dict, "CacheHits",
+					DBUS_TYPE_UINT64, &cache_stats.hits);
+	connman_dbus_dict_append_basic(dict, "CacheMisses",
+					DBUS_TYPE_UINT64, &cache_stats.misses);
+	connman_dbus_dict_append_basic(dict, "CacheEvictions",
+					DBUS_TYPE_UINT64, &cache_stats.evictions);
+	connman_dbus_dict_append_basic(dict, "NegativeCacheMemory",
+					DBUS_TYPE_UINT32, &negative_bytes);
+	connman_dbus_dict_append_basic(dict, "NegativeCacheHits",
+				DBUS_TYPE_UINT64, &cache_stats.negative_hits);
+	connman_dbus_dict_append_basic(dict, "StaleAnswers",
+				DBUS_TYPE_UINT64, &cache_stats.stale_hits);
+	connman_dbus_dict_append_basic(dict, "Prefetches",
+				DBUS_TYPE_UINT64, &cache_stats.prefetches);
+	connman_dbus_dict_append_array(dict, "Servers", DBUS_TYPE_DICT_ENTRY,
+					append_servers_statistics, NULL);
+}
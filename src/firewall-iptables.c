@@ -60,6 +60,10 @@ static GSList *managed_tables;
 static struct firewall_context *connmark_ctx;
 static unsigned int connmark_ref;
 
+/* tables changed since the outermost __connman_firewall_begin() */
+static GSList *pending_tables;
+static unsigned int transaction_depth;
+
 static int chain_to_index(const char *chain_name)
 {
 	if (!g_strcmp0(builtin_chains[NF_IP_PRE_ROUTING], chain_name))
@@ -239,6 +243,60 @@ static int delete_managed_rule(const char *table_name,
 	return err;
 }
 
+/*
+ * Every commit replaces the whole table in the kernel, so within a
+ * transaction the changed tables are only noted and committed once
+ * when it ends.
+ */
+static int commit_table(const char *table_name)
+{
+	if (transaction_depth == 0)
+		return __connman_iptables_commit(AF_INET, table_name);
+
+	if (!g_slist_find_custom(pending_tables, table_name,
+						(GCompareFunc)g_strcmp0))
+		pending_tables = g_slist_prepend(pending_tables,
+						g_strdup(table_name));
+
+	return 0;
+}
+
+int __connman_firewall_begin(void)
+{
+	transaction_depth++;
+
+	return 0;
+}
+
+int __connman_firewall_commit(void)
+{
+	GSList *list;
+	int err = 0, e;
+
+	if (transaction_depth == 0)
+		return -EINVAL;
+
+	transaction_depth--;
+	if (transaction_depth > 0)
+		return 0;
+
+	for (list = pending_tables; list; list = list->next) {
+		DBG("commit table %s", (char *)list->data);
+
+		e = __connman_iptables_commit(AF_INET, list->data);
+		if (e < 0) {
+			connman_error("Cannot commit iptables table %s: %s",
+					(char *)list->data, strerror(-e));
+			err = e;
+		}
+	}
+
+	g_slist_free_full(pending_tables, g_free);
+	pending_tables = NULL;
+
+	return err;
+}
+
 static void cleanup_managed_table(gpointer user_data)
 {
 	struct connman_managed_table *table = user_data;
@@ -285,7 +343,7 @@ static int enable_rule(struct fw_rule *rule)
 	if (err < 0)
 		return err;
 
-	err = __connman_iptables_commit(AF_INET, rule->table);
+	err = commit_table(rule->table);
 	if (err < 0)
 		return err;
 
@@ -308,7 +366,7 @@ static int disable_rule(struct fw_rule *rule)
 		return err;
 	}
 
-	err = __connman_iptables_commit(AF_INET, rule->table);
+	err = commit_table(rule->table);
 	if (err < 0) {
 		connman_error("Cannot remove previously installed "
 			"iptables rules: %s", strerror(-err));
@@ -355,7 +413,9 @@ static int firewall_enable_rules(struct firewall_context *ctx)
 {
 	struct fw_rule *rule;
 	GList *list;
-	int err = -ENOENT;
+	int err = -ENOENT, e;
+
+	__connman_firewall_begin();
 
 	for (list = g_list_first(ctx->rules); list; list = g_list_next(list)) {
 		rule = list->data;
@@ -365,6 +425,10 @@ static int firewall_enable_rules(struct firewall_context *ctx)
 			break;
 	}
 
+	e = __connman_firewall_commit();
+	if (err == 0)
+		err = e;
+
 	return err;
 }
 
@@ -375,6 +439,8 @@ static int firewall_disable_rules(struct firewall_context *ctx)
 	int e;
 	int err = -ENOENT;
 
+	__connman_firewall_begin();
+
 	for (list = g_list_last(ctx->rules); list;
 			list = g_list_previous(list)) {
 		rule = list->data;
@@ -388,6 +454,10 @@ static int firewall_disable_rules(struct firewall_context *ctx)
 			err = e;
 	}
 
+	e = __connman_firewall_commit();
+	if (e < 0)
+		err = e;
+
 	return err;
 }
 
@@ -492,11 +562,14 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					char *id, const char *src_ip,
 					uint32_t mark)
 {
-	int err;
+	int err, e;
+
+	/* the connmark and marking rules go in with one commit */
+	__connman_firewall_begin();
 
 	err = firewall_enable_connmark();
 	if (err)
-		return err;
+		goto out;
 
 	switch (id_type) {
 	case CONNMAN_SESSION_ID_TYPE_UID:
@@ -513,7 +586,8 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 		break;
 	case CONNMAN_SESSION_ID_TYPE_LSM:
 	default:
-		return -EINVAL;
+		err = -EINVAL;
+		goto out;
 	}
 
 	if (src_ip) {
@@ -522,13 +596,30 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					src_ip, mark);
 	}
 
-	return firewall_enable_rules(ctx);
+	err = firewall_enable_rules(ctx);
+
+out:
+	e = __connman_firewall_commit();
+	if (err == 0)
+		err = e;
+
+	return err;
 }
 
 int __connman_firewall_disable_marking(struct firewall_context *ctx)
 {
+	int err, e;
+
+	__connman_firewall_begin();
+
 	firewall_disable_connmark();
-	return firewall_disable_rules(ctx);
+	err = firewall_disable_rules(ctx);
+
+	e = __connman_firewall_commit();
+	if (e < 0)
+		err = e;
+
+	return err;
 }
 
 static void iterate_chains_cb(const char *chain_name, void *user_data)
@@ -622,6 +713,10 @@ void __connman_firewall_cleanup(void)
 {
 	DBG("");
 
+	g_slist_free_full(pending_tables, g_free);
+	pending_tables = NULL;
+	transaction_depth = 0;
+
 	g_slist_free_full(managed_tables, cleanup_managed_table);
 	__connman_iptables_cleanup();
 }
@@ -56,6 +56,7 @@
 #include <libnftnl/table.h>
 #include <libnftnl/chain.h>
 #include <libnftnl/rule.h>
+#include <libnftnl/set.h>
 #include <libnftnl/expr.h>
 
 #include <glib.h>
@@ -66,6 +67,17 @@
 #define CONNMAN_CHAIN_NAT_PRE "nat-prerouting"
 #define CONNMAN_CHAIN_NAT_POST "nat-postrouting"
 #define CONNMAN_CHAIN_ROUTE_OUTPUT "route-output"
+#define CONNMAN_MAP_UID_MARKS "uid-marks"
+#define CONNMAN_MAP_SADDR_MARKS "saddr-marks"
+#define CONNMAN_MAP_SNAT_ADDRS "snat-addrs"
+
+/* data types of the map keys and values as known by nft(8) */
+#define TYPE_IPADDR 7
+#define TYPE_MARK 19
+#define TYPE_IFINDEX 20
+#define TYPE_UID 24
+
+#define BATCH_SIZE_MAX (64 * 1024)
 
 static bool debug_enabled = false;
 
@@ -74,12 +86,35 @@ struct firewall_handle {
 	const char *chain;
 };
 
+struct firewall_map {
+	const char *name;
+	uint32_t id;
+	GHashTable *elements;
+};
+
+struct map_element {
+	struct firewall_map *map;
+	uint32_t key;
+	uint32_t value;
+	/* struct map_owner, the most recent first */
+	GSList *owners;
+};
+
+struct map_owner {
+	struct firewall_context *ctx;
+	uint32_t value;
+};
+
 struct firewall_context {
 	struct firewall_handle rule;
+	GSList *elements;
 };
 
 struct nftables_info {
 	struct firewall_handle ct;
+	struct firewall_map uid_marks;
+	struct firewall_map saddr_marks;
+	struct firewall_map snat_addrs;
 };
 
 static struct nftables_info *nft_info;
@@ -393,113 +428,186 @@ static int add_cmp(struct nftnl_rule *rule, uint32_t sreg, uint32_t op,
         return 0;
 }
 
-static int table_cmd(struct mnl_socket *nl, struct nftnl_table *t,
-		uint16_t cmd, uint16_t family, uint16_t type)
+/*
+ * Firewall changes are collected in one netlink batch, which the kernel
+ * applies as a single transaction. Every operation sends its own batch
+ * unless it runs between __connman_firewall_begin() and
+ * __connman_firewall_commit(), then the batch is sent by the outermost
+ * commit.
+ */
+static GByteArray *batch_buf;
+static size_t batch_last;
+static uint32_t batch_seq;
+static int batch_err;
+static unsigned int transaction_depth;
+
+static int batch_send(enum callback_return_type callback_type,
+			uint64_t *callback_value);
+
+/* makes room for the next message at the end of the batch */
+static char *batch_grow(void)
 {
-        char buf[MNL_SOCKET_BUFFER_SIZE];
-        struct mnl_nlmsg_batch *batch;
-        struct nlmsghdr *nlh;
-        uint32_t seq = 0;
-        int err;
+	unsigned int len = batch_buf->len;
 
-	bzero(buf, sizeof(buf));
+	g_byte_array_set_size(batch_buf, len + MNL_SOCKET_BUFFER_SIZE);
+	memset(batch_buf->data + len, 0, MNL_SOCKET_BUFFER_SIZE);
 
-        batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
-        nftnl_batch_begin(mnl_nlmsg_batch_current(batch), seq++);
-        mnl_nlmsg_batch_next(batch);
+	return (char *)batch_buf->data + len;
+}
 
-        nlh = nftnl_table_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
-				cmd, family, type, seq++);
-        nftnl_table_nlmsg_build_payload(nlh, t);
-	nftnl_table_free(t);
-        mnl_nlmsg_batch_next(batch);
+static void batch_put_header(uint16_t type)
+{
+	char *buf = batch_grow();
 
-        nftnl_batch_end(mnl_nlmsg_batch_current(batch), seq++);
-        mnl_nlmsg_batch_next(batch);
+	put_batch_headers(buf, type, batch_seq++);
+	g_byte_array_set_size(batch_buf, buf - (char *)batch_buf->data +
+			MNL_ALIGN(((struct nlmsghdr *)buf)->nlmsg_len));
+}
 
-	/* The current table commands do not support any callback returns. */
-        err = send_and_dispatch(nl, mnl_nlmsg_batch_head(batch),
-				mnl_nlmsg_batch_size(batch), 0, NULL);
+static char *batch_reserve(void)
+{
+	int err;
 
-        mnl_nlmsg_batch_stop(batch);
-        return err;
+	/* very long transactions are split to stay below the socket limit */
+	if (batch_buf && batch_buf->len > BATCH_SIZE_MAX) {
+		err = batch_send(CALLBACK_RETURN_NONE, NULL);
+		if (err < 0 && !batch_err)
+			batch_err = err;
+	}
+
+	if (!batch_buf) {
+		batch_buf = g_byte_array_sized_new(MNL_SOCKET_BUFFER_SIZE);
+		batch_put_header(NFNL_MSG_BATCH_BEGIN);
+	}
+
+	return batch_grow();
 }
 
-static int chain_cmd(struct mnl_socket *nl, struct nftnl_chain *chain,
-		uint16_t cmd, int family, uint16_t type,
-		enum callback_return_type cb_type, uint64_t *cb_val)
+static void batch_msg_end(struct nlmsghdr *nlh)
 {
-        char buf[MNL_SOCKET_BUFFER_SIZE];
-        struct mnl_nlmsg_batch *batch;
-        struct nlmsghdr *nlh;
-        uint32_t seq = 0;
-        int err;
+	batch_last = (unsigned char *)nlh - batch_buf->data;
+
+	g_byte_array_set_size(batch_buf,
+				batch_last + MNL_ALIGN(nlh->nlmsg_len));
+}
 
-	bzero(buf, sizeof(buf));
+static int batch_send(enum callback_return_type callback_type,
+			uint64_t *callback_value)
+{
+	struct mnl_socket *nl;
+	struct nlmsghdr *nlh;
+	int err;
 
-        batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
-        nftnl_batch_begin(mnl_nlmsg_batch_current(batch), seq++);
-        mnl_nlmsg_batch_next(batch);
+	if (!batch_buf)
+		return 0;
 
-        nlh = nftnl_chain_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
-					cmd, family, type, seq++);
-        nftnl_chain_nlmsg_build_payload(nlh, chain);
-	nftnl_chain_free(chain);
-        mnl_nlmsg_batch_next(batch);
+	/* only the last message is acked, errors are reported anyway */
+	nlh = (struct nlmsghdr *)(batch_buf->data + batch_last);
+	nlh->nlmsg_flags |= NLM_F_ACK;
 
-        nftnl_batch_end(mnl_nlmsg_batch_current(batch), seq++);
-        mnl_nlmsg_batch_next(batch);
+	batch_put_header(NFNL_MSG_BATCH_END);
 
-        err = send_and_dispatch(nl, mnl_nlmsg_batch_head(batch),
-			mnl_nlmsg_batch_size(batch), cb_type, cb_val);
+	err = socket_open_and_bind(&nl);
+	if (!err) {
+		err = send_and_dispatch(nl, batch_buf->data, batch_buf->len,
+					callback_type, callback_value);
+		mnl_socket_close(nl);
+	}
 
-        mnl_nlmsg_batch_stop(batch);
-        return err;
+	g_byte_array_free(batch_buf, TRUE);
+	batch_buf = NULL;
+
+	return err;
 }
 
-static int rule_cmd(struct mnl_socket *nl, struct nftnl_rule *rule,
-			uint16_t cmd, uint16_t family, uint16_t type,
-			enum callback_return_type callback_type,
-			uint64_t *callback_value)
+static void batch_discard(void)
 {
+	if (batch_buf)
+		g_byte_array_free(batch_buf, TRUE);
 
-        char buf[MNL_SOCKET_BUFFER_SIZE];
-        struct mnl_nlmsg_batch *batch;
-        struct nlmsghdr *nlh;
-        uint32_t seq = 0;
-        int err;
+	batch_buf = NULL;
+	batch_err = 0;
+}
 
-	bzero(buf, sizeof(buf));
+static int batch_flush(void)
+{
+	int err;
 
-	debug_netlink_dump_rule(rule);
+	if (transaction_depth > 0)
+		return 0;
 
-        batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
-        put_batch_headers(mnl_nlmsg_batch_current(batch),
-				NFNL_MSG_BATCH_BEGIN, seq++);
-        mnl_nlmsg_batch_next(batch);
+	err = batch_send(CALLBACK_RETURN_NONE, NULL);
+	if (batch_err) {
+		if (!err)
+			err = batch_err;
+		batch_err = 0;
+	}
+
+	return err;
+}
 
-        nlh = nftnl_rule_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
-					cmd, family, type, seq++);
-        nftnl_rule_nlmsg_build_payload(nlh, rule);
-        mnl_nlmsg_batch_next(batch);
+static void table_cmd(struct nftnl_table *t, uint16_t cmd, uint16_t family,
+			uint16_t type)
+{
+	struct nlmsghdr *nlh;
 
-        put_batch_headers(mnl_nlmsg_batch_current(batch),
-				NFNL_MSG_BATCH_END, seq++);
-        mnl_nlmsg_batch_next(batch);
+	nlh = nftnl_table_nlmsg_build_hdr(batch_reserve(), cmd, family, type,
+								batch_seq++);
+	nftnl_table_nlmsg_build_payload(nlh, t);
+	nftnl_table_free(t);
+	batch_msg_end(nlh);
+}
 
-        err = send_and_dispatch(nl, mnl_nlmsg_batch_head(batch),
-				mnl_nlmsg_batch_size(batch),
-				callback_type, callback_value);
-        mnl_nlmsg_batch_stop(batch);
+static void chain_cmd(struct nftnl_chain *chain, uint16_t cmd, int family,
+			uint16_t type)
+{
+	struct nlmsghdr *nlh;
 
-        return err;
+	nlh = nftnl_chain_nlmsg_build_hdr(batch_reserve(), cmd, family, type,
+								batch_seq++);
+	nftnl_chain_nlmsg_build_payload(nlh, chain);
+	nftnl_chain_free(chain);
+	batch_msg_end(nlh);
+}
+
+static void set_cmd(struct nftnl_set *set, uint16_t cmd, int family,
+			uint16_t type)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_set_nlmsg_build_hdr(batch_reserve(), cmd, family, type,
+								batch_seq++);
+	nftnl_set_nlmsg_build_payload(nlh, set);
+	nftnl_set_free(set);
+	batch_msg_end(nlh);
+}
+
+/*
+ * Rules are added to the batch. A rule whose handle is requested is
+ * sent right away together with the rest of the batch.
+ */
+static int rule_cmd(struct nftnl_rule *rule, uint16_t cmd, uint16_t family,
+			uint16_t type, enum callback_return_type callback_type,
+			uint64_t *callback_value)
+{
+	struct nlmsghdr *nlh;
+
+	debug_netlink_dump_rule(rule);
+
+	nlh = nftnl_rule_nlmsg_build_hdr(batch_reserve(), cmd, family, type,
+								batch_seq++);
+	nftnl_rule_nlmsg_build_payload(nlh, rule);
+	batch_msg_end(nlh);
+
+	if (callback_type == CALLBACK_RETURN_NONE)
+		return 0;
+
+	return batch_send(callback_type, callback_value);
 }
 
 static int rule_delete(struct firewall_handle *handle)
 {
 	struct nftnl_rule *rule;
-	struct mnl_socket *nl;
-	int err;
 
 	DBG("");
 
@@ -511,18 +619,163 @@ static int rule_delete(struct firewall_handle *handle)
 	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, handle->chain);
 	nftnl_rule_set_u64(rule, NFTNL_RULE_HANDLE, handle->handle);
 
-	err = socket_open_and_bind(&nl);
-	if (err < 0) {
-		nftnl_rule_free(rule);
-		return err;
+	rule_cmd(rule, NFT_MSG_DELRULE, NFPROTO_IPV4, 0,
+			CALLBACK_RETURN_NONE, NULL);
+	nftnl_rule_free(rule);
+
+	return batch_flush();
+}
+
+static void map_element_cmd(struct firewall_map *map, uint16_t cmd,
+				uint16_t type, uint32_t key, uint32_t value)
+{
+	struct nftnl_set_elem *elem;
+	struct nftnl_set *set;
+	struct nlmsghdr *nlh;
+
+	set = nftnl_set_alloc();
+	elem = nftnl_set_elem_alloc();
+	if (!set || !elem) {
+		if (set)
+			nftnl_set_free(set);
+		if (!batch_err)
+			batch_err = -ENOMEM;
+		return;
 	}
 
-	err = rule_cmd(nl, rule, NFT_MSG_DELRULE, NFPROTO_IPV4,
-			NLM_F_ACK, 0, NULL);
-	nftnl_rule_free(rule);
-	mnl_socket_close(nl);
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, map->name);
 
-	return err;
+	nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, &key, sizeof(key));
+	if (cmd == NFT_MSG_NEWSETELEM)
+		nftnl_set_elem_set(elem, NFTNL_SET_ELEM_DATA, &value,
+							sizeof(value));
+	nftnl_set_elem_add(set, elem);
+
+	nlh = nftnl_set_nlmsg_build_hdr(batch_reserve(), cmd, NFPROTO_IPV4,
+							type, batch_seq++);
+	nftnl_set_elems_nlmsg_build_payload(nlh, set);
+	nftnl_set_free(set);
+	batch_msg_end(nlh);
+}
+
+/*
+ * Several contexts can map the same key, for instance sessions of the
+ * same user. Each of them owns the element with its own value, the
+ * element maps to the value of the most recent owner and goes back to
+ * the value of the previous one when that owner is gone. The element
+ * stays until its last owner is disabled.
+ */
+static void map_element_set(struct map_element *element, uint32_t value)
+{
+	if (element->value == value)
+		return;
+
+	map_element_cmd(element->map, NFT_MSG_DELSETELEM, 0,
+						element->key, 0);
+	map_element_cmd(element->map, NFT_MSG_NEWSETELEM, NLM_F_CREATE,
+						element->key, value);
+	element->value = value;
+}
+
+static struct map_element *map_element_ref(struct firewall_map *map,
+					struct firewall_context *ctx,
+					uint32_t key, uint32_t value)
+{
+	struct map_element *element;
+	struct map_owner *owner;
+
+	owner = g_new0(struct map_owner, 1);
+	owner->ctx = ctx;
+	owner->value = value;
+
+	element = g_hash_table_lookup(map->elements, GUINT_TO_POINTER(key));
+	if (element) {
+		map_element_set(element, value);
+		element->owners = g_slist_prepend(element->owners, owner);
+		return element;
+	}
+
+	element = g_new0(struct map_element, 1);
+	element->map = map;
+	element->key = key;
+	element->value = value;
+	element->owners = g_slist_prepend(NULL, owner);
+
+	g_hash_table_replace(map->elements, GUINT_TO_POINTER(key), element);
+
+	map_element_cmd(map, NFT_MSG_NEWSETELEM, NLM_F_CREATE, key, value);
+
+	return element;
+}
+
+static void map_element_unref(struct map_element *element,
+					struct firewall_context *ctx)
+{
+	struct firewall_map *map = element->map;
+	struct map_owner *owner;
+	GSList *list;
+
+	for (list = element->owners; list; list = list->next) {
+		owner = list->data;
+
+		if (owner->ctx == ctx)
+			break;
+	}
+
+	if (!list)
+		return;
+
+	element->owners = g_slist_delete_link(element->owners, list);
+	g_free(owner);
+
+	if (element->owners) {
+		owner = element->owners->data;
+		map_element_set(element, owner->value);
+		return;
+	}
+
+	map_element_cmd(map, NFT_MSG_DELSETELEM, 0, element->key, 0);
+
+	g_hash_table_remove(map->elements, GUINT_TO_POINTER(element->key));
+}
+
+static void context_add_element(struct firewall_context *ctx,
+				struct firewall_map *map,
+				uint32_t key, uint32_t value)
+{
+	ctx->elements = g_slist_prepend(ctx->elements,
+					map_element_ref(map, ctx, key, value));
+}
+
+static int context_remove_elements(struct firewall_context *ctx)
+{
+	GSList *list;
+
+	for (list = ctx->elements; list; list = list->next)
+		map_element_unref(list->data, ctx);
+
+	g_slist_free(ctx->elements);
+	ctx->elements = NULL;
+
+	return batch_flush();
+}
+
+int __connman_firewall_begin(void)
+{
+	transaction_depth++;
+
+	return 0;
+}
+
+int __connman_firewall_commit(void)
+{
+	if (transaction_depth == 0)
+		return -EINVAL;
+
+	transaction_depth--;
+
+	return batch_flush();
 }
 
 struct firewall_context *__connman_firewall_create(void)
@@ -618,31 +871,26 @@ err:
 	return -ENOMEM;
 }
 
+
 int __connman_firewall_enable_nat(struct firewall_context *ctx,
 					char *address, unsigned char prefixlen,
 					char *interface)
 {
-	struct mnl_socket *nl;
 	struct nftnl_rule *rule;
 	int err;
 
 	DBG("address %s/%d interface %s", address, (int)prefixlen, interface);
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
-
 	err = build_rule_nat(address, prefixlen, interface, &rule);
 	if (err)
-		goto out;
+		return err;
 
 	ctx->rule.chain = CONNMAN_CHAIN_NAT_POST;
-        err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-			NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
+	err = rule_cmd(rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
+			NLM_F_APPEND|NLM_F_CREATE,
 			CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
 	nftnl_rule_free(rule);
-out:
-	mnl_socket_close(nl);
+
 	return err;
 }
 
@@ -651,124 +899,173 @@ int __connman_firewall_disable_nat(struct firewall_context *ctx)
 	return rule_delete(&ctx->rule);
 }
 
-static int build_rule_snat(int index, const char *address,
-				struct nftnl_rule **res)
+int __connman_firewall_enable_snat(struct firewall_context *ctx,
+				int index, const char *ifname, const char *addr)
 {
-	struct nftnl_rule *rule;
-	struct nftnl_expr *expr;
-	uint32_t snat;
-	int err;
+	DBG("index %d address %s", index, addr);
+
+	if (!nft_info)
+		return -ENOTSUP;
 
 	/*
-	 * # nft --debug netlink add rule connman nat-postrouting \
-	 *	oif eth0 snat 1.2.3.4
-	 *	ip connman nat-postrouting
-	 *	  [ meta load oif => reg 1 ]
-	 *	  [ cmp eq reg 1 0x0000000b ]
-	 *	  [ immediate reg 1 0x04030201 ]
-	 *	  [ nat snat ip addr_min reg 1 addr_max reg 0 ]
+	 * # nft add element connman snat-addrs { eth0 : 1.2.3.4 }
 	 */
+	context_add_element(ctx, &nft_info->snat_addrs, index,
+							inet_addr(addr));
 
-	rule = nftnl_rule_alloc();
-	if (!rule)
-		return -ENOMEM;
+	return batch_flush();
+}
 
-	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
-	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_NAT_POST);
+int __connman_firewall_disable_snat(struct firewall_context *ctx)
+{
+	DBG("");
 
-	/* OIF */
-	expr = nftnl_expr_alloc("meta");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_OIF);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
-	nftnl_rule_add_expr(rule, expr);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &index, sizeof(index));
-	if (err < 0)
-		goto err;
+	return context_remove_elements(ctx);
+}
 
-	/* snat */
-	expr = nftnl_expr_alloc("immediate");
-	if (!expr)
-		goto err;
-	snat = inet_addr(address);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &snat, sizeof(snat));
-	nftnl_rule_add_expr(rule, expr);
+int __connman_firewall_enable_marking(struct firewall_context *ctx,
+					enum connman_session_id_type id_type,
+					char *id, const char *src_ip,
+					uint32_t mark)
+{
+	struct passwd *pw;
 
-	expr = nftnl_expr_alloc("nat");
-        if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_NAT_TYPE, NFT_NAT_SNAT);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_NAT_FAMILY, NFPROTO_IPV4);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG_1);
-        nftnl_rule_add_expr(rule, expr);
+	DBG("");
 
-	*res = rule;
-	return 0;
+	if (!nft_info)
+		return -ENOTSUP;
 
-err:
-	nftnl_rule_free(rule);
-	return -ENOMEM;
+	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
+		pw = getpwnam(id);
+		if (!pw)
+			return -EINVAL;
+
+		/*
+		 * # nft add element connman uid-marks { wagi : 1234 }
+		 */
+		context_add_element(ctx, &nft_info->uid_marks, pw->pw_uid,
+									mark);
+	}
+	else if (!src_ip)
+		return -ENOTSUP;
+
+	/*
+	 * # nft add element connman saddr-marks { 192.168.10.31 : 1234 }
+	 */
+	if (src_ip)
+		context_add_element(ctx, &nft_info->saddr_marks,
+						inet_addr(src_ip), mark);
+
+	return batch_flush();
 }
 
-int __connman_firewall_enable_snat(struct firewall_context *ctx,
-				int index, const char *ifname, const char *addr)
+int __connman_firewall_disable_marking(struct firewall_context *ctx)
 {
-	struct nftnl_rule *rule;
-	struct mnl_socket *nl;
-	int err;
-
 	DBG("");
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
+	return context_remove_elements(ctx);
+}
 
-	err = build_rule_snat(index, addr, &rule);
-	if (err)
-		goto out;
+static struct nftnl_table *build_table(const char *name, uint16_t family)
+{
+        struct nftnl_table *table;
 
-	ctx->rule.chain = CONNMAN_CHAIN_NAT_POST;
-        err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-			NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-			CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
-	nftnl_rule_free(rule);
-out:
-	mnl_socket_close(nl);
-	return err;
+        table = nftnl_table_alloc();
+        if (!table)
+                return NULL;
+
+	nftnl_table_set_u32(table, NFTNL_TABLE_FAMILY, family);
+        nftnl_table_set_str(table, NFTNL_TABLE_NAME, name);
+
+	return table;
 }
 
-int __connman_firewall_disable_snat(struct firewall_context *ctx)
+
+static struct nftnl_chain *build_chain(const char *name, const char *table,
+				const char *type, int hooknum, int prio)
 {
-	DBG("");
+	struct nftnl_chain *chain;
 
-	return rule_delete(&ctx->rule);
+        chain = nftnl_chain_alloc();
+        if (!chain)
+                return NULL;
+
+        nftnl_chain_set_str(chain, NFTNL_CHAIN_TABLE, table);
+        nftnl_chain_set_str(chain, NFTNL_CHAIN_NAME, name);
+
+	if (type)
+		nftnl_chain_set_str(chain, NFTNL_CHAIN_TYPE, type);
+
+        if (hooknum >= 0)
+                nftnl_chain_set_u32(chain, NFTNL_CHAIN_HOOKNUM, hooknum);
+
+        if (prio >= 0)
+                nftnl_chain_set_u32(chain, NFTNL_CHAIN_PRIO, prio);
+
+	return chain;
+}
+
+
+static struct nftnl_set *build_map(struct firewall_map *map,
+				uint32_t key_type, uint32_t data_type)
+{
+	struct nftnl_set *set;
+
+	set = nftnl_set_alloc();
+	if (!set)
+		return NULL;
+
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, map->name);
+	nftnl_set_set_u32(set, NFTNL_SET_ID, map->id);
+	nftnl_set_set_u32(set, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+	nftnl_set_set_u32(set, NFTNL_SET_FLAGS, NFT_SET_MAP);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, key_type);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, sizeof(uint32_t));
+	nftnl_set_set_u32(set, NFTNL_SET_DATA_TYPE, data_type);
+	nftnl_set_set_u32(set, NFTNL_SET_DATA_LEN, sizeof(uint32_t));
+
+	return set;
 }
 
-static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
+static int add_lookup(struct nftnl_rule *rule, struct firewall_map *map)
+{
+	struct nftnl_expr *expr;
+
+	expr = nftnl_expr_alloc("lookup");
+	if (!expr)
+		return -ENOMEM;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_DREG, NFT_REG_1);
+	nftnl_expr_set_str(expr, NFTNL_EXPR_LOOKUP_SET, map->name);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SET_ID, map->id);
+
+	nftnl_rule_add_expr(rule, expr);
+
+	return 0;
+}
+
+static struct nftnl_rule *build_rule_marking(void)
 {
 	struct nftnl_rule *rule;
 	struct nftnl_expr *expr;
-	int err;
 
 	/*
-	 * http://wiki.nftables.org/wiki-nftables/index.php/Setting_packet_metainformation
-	 * http://wiki.nftables.org/wiki-nftables/index.php/Matching_packet_metainformation
+	 * http://wiki.nftables.org/wiki-nftables/index.php/Maps
 	 *
 	 * # nft --debug netlink add rule connman route-output	\
-	 *	meta skuid wagi mark set 1234
+	 *	meta mark set meta skuid map @uid-marks
 	 *
 	 *	ip connman route-output
 	 *	  [ meta load skuid => reg 1 ]
-	 *	  [ cmp eq reg 1 0x000003e8 ]
-	 *	  [ immediate reg 1 0x000004d2 ]
+	 *	  [ lookup reg 1 set uid-marks dreg 1 ]
 	 *	  [ meta set mark with reg 1 ]
 	 */
 
 	rule = nftnl_rule_alloc();
 	if (!rule)
-		return -ENOMEM;
+		return NULL;
 
 	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
 	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_ROUTE_OUTPUT);
@@ -779,16 +1076,9 @@ static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
 	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_SKUID);
 	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
 	nftnl_rule_add_expr(rule, expr);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &uid, sizeof(uid));
-	if (err < 0)
-		goto err;
 
-	expr = nftnl_expr_alloc("immediate");
-	if (!expr)
+	if (add_lookup(rule, &nft_info->uid_marks) < 0)
 		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &mark, sizeof(mark));
-	nftnl_rule_add_expr(rule, expr);
 
 	expr = nftnl_expr_alloc("meta");
 	if (!expr)
@@ -797,34 +1087,31 @@ static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
 	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG_1);
 	nftnl_rule_add_expr(rule, expr);
 
-	*res = rule;
-	return 0;
+	return rule;
 
 err:
-	return -ENOMEM;
+	nftnl_rule_free(rule);
+	return NULL;
 }
 
-static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rule **res)
+static struct nftnl_rule *build_rule_src_ip(void)
 {
 	struct nftnl_rule *rule;
 	struct nftnl_expr *expr;
-	int err;
-	in_addr_t s_addr;
 
 	/*
 	 * # nft --debug netlink add rule connman route-output \
-	 *	ip saddr 192.168.10.31 mark set 1234
+	 *	meta mark set ip saddr map @saddr-marks
 	 *
 	 *	ip connman route-output
 	 *	  [ payload load 4b @ network header + 12 => reg 1 ]
-	 *	  [ cmp eq reg 1 0x1f0aa8c0 ]
-	 *	  [ immediate reg 1 0x000004d2 ]
+	 *	  [ lookup reg 1 set saddr-marks dreg 1 ]
 	 *	  [ meta set mark with reg 1 ]
 	 */
 
 	rule = nftnl_rule_alloc();
 	if (!rule)
-		return -ENOMEM;
+		return NULL;
 
 	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
 	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_ROUTE_OUTPUT);
@@ -833,22 +1120,13 @@ static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rul
 	nftnl_rule_set_u32(rule, NFTNL_RULE_FAMILY, NFPROTO_IPV4);
 
 	/* source IP */
-	err = add_payload(rule, NFT_PAYLOAD_NETWORK_HEADER, NFT_REG_1,
-			offsetof(struct iphdr, saddr), sizeof(struct in_addr));
-	if (err < 0)
-		goto err;
-
-	s_addr = inet_addr(src_ip);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &s_addr, sizeof(s_addr));
-	if (err < 0)
+	if (add_payload(rule, NFT_PAYLOAD_NETWORK_HEADER, NFT_REG_1,
+			offsetof(struct iphdr, saddr),
+			sizeof(struct in_addr)) < 0)
 		goto err;
 
-	expr = nftnl_expr_alloc("immediate");
-	if (!expr)
+	if (add_lookup(rule, &nft_info->saddr_marks) < 0)
 		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &mark, sizeof(mark));
-	nftnl_rule_add_expr(rule, expr);
 
 	expr = nftnl_expr_alloc("meta");
 	if (!expr)
@@ -857,131 +1135,92 @@ static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rul
 	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG_1);
 	nftnl_rule_add_expr(rule, expr);
 
-	*res = rule;
-	return 0;
+	return rule;
 
 err:
-	return -ENOMEM;
+	nftnl_rule_free(rule);
+	return NULL;
 }
 
-int __connman_firewall_enable_marking(struct firewall_context *ctx,
-					enum connman_session_id_type id_type,
-					char *id, const char *src_ip,
-					uint32_t mark)
+static struct nftnl_rule *build_rule_snat(void)
 {
 	struct nftnl_rule *rule;
-	struct mnl_socket *nl;
-	struct passwd *pw;
-	uid_t uid;
-	int err;
-
-	DBG("");
-
-	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
-		pw = getpwnam(id);
-		if (!pw)
-			return -EINVAL;
-		uid = pw->pw_uid;
-	}
-	else if (!src_ip)
-		return -ENOTSUP;
-
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
-
-	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
-		err = build_rule_marking(uid, mark, &rule);
-		if (err < 0)
-			goto out;
+	struct nftnl_expr *expr;
 
-		ctx->rule.chain = CONNMAN_CHAIN_ROUTE_OUTPUT;
-		err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-				NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-				CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
+	/*
+	 * # nft --debug netlink add rule connman nat-postrouting \
+	 *	snat ip to oif map @snat-addrs
+	 *
+	 *	ip connman nat-postrouting
+	 *	  [ meta load oif => reg 1 ]
+	 *	  [ lookup reg 1 set snat-addrs dreg 1 ]
+	 *	  [ nat snat ip addr_min reg 1 addr_max reg 0 ]
+	 */
 
-		nftnl_rule_free(rule);
-	}
+	rule = nftnl_rule_alloc();
+	if (!rule)
+		return NULL;
 
-	if (src_ip) {
-		err = build_rule_src_ip(src_ip, mark, &rule);
-		if (err < 0)
-			goto out;
+	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
+	nftnl_rule_set_str(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_NAT_POST);
 
-		ctx->rule.chain = CONNMAN_CHAIN_ROUTE_OUTPUT;
-		err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-				NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-				CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
+	/* OIF */
+	expr = nftnl_expr_alloc("meta");
+	if (!expr)
+		goto err;
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_OIF);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
+	nftnl_rule_add_expr(rule, expr);
 
-		nftnl_rule_free(rule);
-	}
-out:
-	mnl_socket_close(nl);
-	return err;
-}
+	if (add_lookup(rule, &nft_info->snat_addrs) < 0)
+		goto err;
 
-int __connman_firewall_disable_marking(struct firewall_context *ctx)
-{
-	int err;
+	/* snat */
+	expr = nftnl_expr_alloc("nat");
+	if (!expr)
+		goto err;
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_NAT_TYPE, NFT_NAT_SNAT);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_NAT_FAMILY, NFPROTO_IPV4);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG_1);
+	nftnl_rule_add_expr(rule, expr);
 
-	DBG("");
+	return rule;
 
-	err = rule_delete(&ctx->rule);
-	return err;
+err:
+	nftnl_rule_free(rule);
+	return NULL;
 }
 
-static struct nftnl_table *build_table(const char *name, uint16_t family)
+static void map_element_free(gpointer data)
 {
-        struct nftnl_table *table;
-
-        table = nftnl_table_alloc();
-        if (!table)
-                return NULL;
+	struct map_element *element = data;
 
-	nftnl_table_set_u32(table, NFTNL_TABLE_FAMILY, family);
-        nftnl_table_set_str(table, NFTNL_TABLE_NAME, name);
-
-	return table;
+	g_slist_free_full(element->owners, g_free);
+	g_free(element);
 }
 
-
-static struct nftnl_chain *build_chain(const char *name, const char *table,
-				const char *type, int hooknum, int prio)
+static void init_map(struct firewall_map *map, const char *name,
+							uint32_t id)
 {
-	struct nftnl_chain *chain;
-
-        chain = nftnl_chain_alloc();
-        if (!chain)
-                return NULL;
-
-        nftnl_chain_set_str(chain, NFTNL_CHAIN_TABLE, table);
-        nftnl_chain_set_str(chain, NFTNL_CHAIN_NAME, name);
-
-	if (type)
-		nftnl_chain_set_str(chain, NFTNL_CHAIN_TYPE, type);
-
-        if (hooknum >= 0)
-                nftnl_chain_set_u32(chain, NFTNL_CHAIN_HOOKNUM, hooknum);
-
-        if (prio >= 0)
-                nftnl_chain_set_u32(chain, NFTNL_CHAIN_PRIO, prio);
-
-	return chain;
+	map->name = name;
+	map->id = id;
+	map->elements = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, map_element_free);
 }
 
 static int create_table_and_chains(struct nftables_info *nft_info)
 {
-	struct mnl_socket *nl;
 	struct nftnl_table *table;
 	struct nftnl_chain *chain;
-	int err;
-
+	struct nftnl_set *set;
+	struct nftnl_rule *rule;
+	int err = -ENOMEM;
 
 	DBG("");
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
+	/*
+	 * Everything is created in one batch, see batch_send().
+	 */
 
 	/*
 	 * Add table
@@ -992,15 +1231,10 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 	 * # nft add table connman
 	 */
 	table = build_table(CONNMAN_TABLE, NFPROTO_IPV4);
-	if (!table) {
-		err = -ENOMEM;
+	if (!table)
 		goto out;
-	}
 
-        err = table_cmd(nl, table, NFT_MSG_NEWTABLE, NFPROTO_IPV4,
-			NLM_F_CREATE|NLM_F_ACK);
-        if (err < 0)
-                goto out;
+	table_cmd(table, NFT_MSG_NEWTABLE, NFPROTO_IPV4, NLM_F_CREATE);
 
 	/*
 	 * Add basic chains
@@ -1013,16 +1247,10 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 	 */
 	chain = build_chain(CONNMAN_CHAIN_NAT_PRE, CONNMAN_TABLE,
 				"nat", NF_INET_PRE_ROUTING, 0);
-	if (!chain) {
-		err = -ENOMEM;
+	if (!chain)
 		goto out;
-	}
 
-	err = chain_cmd(nl, chain, NFT_MSG_NEWCHAIN,
-			NFPROTO_IPV4, NLM_F_CREATE | NLM_F_ACK,
-			CALLBACK_RETURN_NONE, NULL);
-	if (err < 0)
-		goto out;
+	chain_cmd(chain, NFT_MSG_NEWCHAIN, NFPROTO_IPV4, NLM_F_CREATE);
 
 	/*
 	 * # nft add chain connman nat-postrouting		\
@@ -1030,16 +1258,10 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 	 */
 	chain = build_chain(CONNMAN_CHAIN_NAT_POST, CONNMAN_TABLE,
 				"nat", NF_INET_POST_ROUTING, 0);
-	if (!chain) {
-		err = -ENOMEM;
+	if (!chain)
 		goto out;
-	}
 
-	err = chain_cmd(nl, chain, NFT_MSG_NEWCHAIN,
-			NFPROTO_IPV4, NLM_F_CREATE | NLM_F_ACK,
-			CALLBACK_RETURN_NONE, NULL);
-	if (err < 0)
-		goto out;
+	chain_cmd(chain, NFT_MSG_NEWCHAIN, NFPROTO_IPV4, NLM_F_CREATE);
 
 	/*
 	 * # nft add chain connman route-output		\
@@ -1047,36 +1269,93 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 	 */
 	chain = build_chain(CONNMAN_CHAIN_ROUTE_OUTPUT, CONNMAN_TABLE,
 				"route", NF_INET_LOCAL_OUT, 0);
-	if (!chain) {
-		err = -ENOMEM;
+	if (!chain)
 		goto out;
-	}
 
-	err = chain_cmd(nl, chain, NFT_MSG_NEWCHAIN,
-			NFPROTO_IPV4, NLM_F_CREATE | NLM_F_ACK,
-			CALLBACK_RETURN_NONE, NULL);
-	if (err < 0)
+	chain_cmd(chain, NFT_MSG_NEWCHAIN, NFPROTO_IPV4, NLM_F_CREATE);
+
+	/*
+	 * Sessions are classified with one lookup in a map instead of
+	 * one rule per session.
+	 *
+	 * # nft add map connman uid-marks { type uid : mark ; }
+	 * # nft add map connman saddr-marks { type ipv4_addr : mark ; }
+	 * # nft add map connman snat-addrs { type iface_index : ipv4_addr ; }
+	 */
+	init_map(&nft_info->uid_marks, CONNMAN_MAP_UID_MARKS, 1);
+	init_map(&nft_info->saddr_marks, CONNMAN_MAP_SADDR_MARKS, 2);
+	init_map(&nft_info->snat_addrs, CONNMAN_MAP_SNAT_ADDRS, 3);
+
+	set = build_map(&nft_info->uid_marks, TYPE_UID, TYPE_MARK);
+	if (!set)
+		goto out;
+
+	set_cmd(set, NFT_MSG_NEWSET, NFPROTO_IPV4, NLM_F_CREATE);
+
+	set = build_map(&nft_info->saddr_marks, TYPE_IPADDR, TYPE_MARK);
+	if (!set)
+		goto out;
+
+	set_cmd(set, NFT_MSG_NEWSET, NFPROTO_IPV4, NLM_F_CREATE);
+
+	set = build_map(&nft_info->snat_addrs, TYPE_IFINDEX, TYPE_IPADDR);
+	if (!set)
+		goto out;
+
+	set_cmd(set, NFT_MSG_NEWSET, NFPROTO_IPV4, NLM_F_CREATE);
+
+	rule = build_rule_marking();
+	if (!rule)
 		goto out;
 
+	rule_cmd(rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
+			NLM_F_APPEND|NLM_F_CREATE, CALLBACK_RETURN_NONE, NULL);
+	nftnl_rule_free(rule);
+
+	rule = build_rule_src_ip();
+	if (!rule)
+		goto out;
+
+	rule_cmd(rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
+			NLM_F_APPEND|NLM_F_CREATE, CALLBACK_RETURN_NONE, NULL);
+	nftnl_rule_free(rule);
+
+	rule = build_rule_snat();
+	if (!rule)
+		goto out;
+
+	rule_cmd(rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
+			NLM_F_APPEND|NLM_F_CREATE, CALLBACK_RETURN_NONE, NULL);
+	nftnl_rule_free(rule);
+
+	err = 0;
+
 out:
+	if (err)
+		batch_discard();
+	else
+		err = batch_flush();
+
 	if (err)
 		connman_warn("Failed to create basic chains: %s",
 				strerror(-err));
-	mnl_socket_close(nl);
 	return err;
 }
 
+static void cleanup_map(struct firewall_map *map)
+{
+	if (map->elements)
+		g_hash_table_destroy(map->elements);
+	map->elements = NULL;
+}
+
 static int cleanup_table_and_chains(void)
 {
 	struct nftnl_table *table;
-	struct mnl_socket *nl;
-	int err;
 
 	DBG("");
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return -ENOMEM;
+	batch_discard();
 
 	/*
 	 * Cleanup everythying in one go. There is little point in
@@ -1087,10 +1366,12 @@ static int cleanup_table_and_chains(void)
 	 * # nft delete table connman
 	 */
 	table = build_table(CONNMAN_TABLE, NFPROTO_IPV4);
-	err = table_cmd(nl, table, NFT_MSG_DELTABLE, NFPROTO_IPV4, NLM_F_ACK);
+	if (!table)
+		return -ENOMEM;
 
-	mnl_socket_close(nl);
-	return err;
+	table_cmd(table, NFT_MSG_DELTABLE, NFPROTO_IPV4, 0);
+
+	return batch_flush();
 }
 
 int __connman_firewall_init(void)
@@ -1116,6 +1397,9 @@ int __connman_firewall_init(void)
 	nft_info = g_new0(struct nftables_info, 1);
 	err = create_table_and_chains(nft_info);
 	if (err) {
+		cleanup_map(&nft_info->uid_marks);
+		cleanup_map(&nft_info->saddr_marks);
+		cleanup_map(&nft_info->snat_addrs);
 		g_free(nft_info);
 		nft_info = NULL;
 	}
@@ -1129,11 +1413,19 @@ void __connman_firewall_cleanup(void)
 
 	DBG("");
 
+	transaction_depth = 0;
+
 	err = cleanup_table_and_chains();
 	if (err < 0)
 		connman_warn("cleanup table and chains failed with '%s' %d\n",
 			strerror(-err), err);
 
+	if (nft_info) {
+		cleanup_map(&nft_info->uid_marks);
+		cleanup_map(&nft_info->saddr_marks);
+		cleanup_map(&nft_info->snat_addrs);
+	}
+
 	g_free(nft_info);
 	nft_info = NULL;
 }
@@ -25,6 +25,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <linux/if_link.h>
@@ -63,14 +64,14 @@ struct connman_ipdevice {
 	unsigned int flags;
 	char *address;
 	uint16_t mtu;
-	uint32_t rx_packets;
-	uint32_t tx_packets;
-	uint32_t rx_bytes;
-	uint32_t tx_bytes;
-	uint32_t rx_errors;
-	uint32_t tx_errors;
-	uint32_t rx_dropped;
-	uint32_t tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 
 	GSList *address_list;
 	char *ipv4_gateway;
@@ -506,17 +507,18 @@ static void free_ipdevice(gpointer data)
 }
 
 static void update_stats(struct connman_ipdevice *ipdevice,
-			const char *ifname, struct rtnl_link_stats *stats)
+			const char *ifname, struct rtnl_link_stats64 *stats,
+			bool stats32)
 {
 	struct connman_service *service;
 
 	if (stats->rx_packets == 0 && stats->tx_packets == 0)
 		return;
 
-	connman_info("%s {RX} %u packets %u bytes", ifname,
-					stats->rx_packets, stats->rx_bytes);
-	connman_info("%s {TX} %u packets %u bytes", ifname,
-					stats->tx_packets, stats->tx_bytes);
+	connman_info("%s {RX} %" PRIu64 " packets %" PRIu64 " bytes", ifname,
+			(uint64_t)stats->rx_packets, (uint64_t)stats->rx_bytes);
+	connman_info("%s {TX} %" PRIu64 " packets %" PRIu64 " bytes", ifname,
+			(uint64_t)stats->tx_packets, (uint64_t)stats->tx_bytes);
 
 	if (!ipdevice->config_ipv4 && !ipdevice->config_ipv6)
 		return;
@@ -541,13 +543,54 @@ static void update_stats(struct connman_ipdevice *ipdevice,
 				ipdevice->rx_packets, ipdevice->tx_packets,
 				ipdevice->rx_bytes, ipdevice->tx_bytes,
 				ipdevice->rx_errors, ipdevice->tx_errors,
-				ipdevice->rx_dropped, ipdevice->tx_dropped);
+				ipdevice->rx_dropped, ipdevice->tx_dropped,
+				stats32);
+}
+
+void __connman_ipconfig_update_stats(int index,
+					struct rtnl_link_stats64 *stats)
+{
+	struct connman_ipdevice *ipdevice;
+	char *ifname;
+
+	ipdevice = g_hash_table_lookup(ipdevice_hash, GINT_TO_POINTER(index));
+	if (!ipdevice)
+		return;
+
+	ifname = connman_inet_ifname(index);
+
+	update_stats(ipdevice, ifname, stats, false);
+
+	g_free(ifname);
+}
+
+int __connman_ipconfig_request_stats(void)
+{
+	struct connman_ipdevice *ipdevice;
+	GHashTableIter iter;
+	gpointer value;
+	int err = 0;
+
+	g_hash_table_iter_init(&iter, ipdevice_hash);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		ipdevice = value;
+
+		/* update_stats() ignores devices without configuration */
+		if (!ipdevice->config_ipv4 && !ipdevice->config_ipv6)
+			continue;
+
+		err = __connman_rtnl_request_stats(ipdevice->index);
+		if (err == -EALREADY)
+			err = 0;
+	}
+
+	return err;
 }
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats, bool stats32)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list, *ipconfig_copy;
@@ -587,7 +630,7 @@ void __connman_ipconfig_newlink(int index, unsigned short type,
 update:
 	ipdevice->mtu = mtu;
 
-	update_stats(ipdevice, ifname, stats);
+	update_stats(ipdevice, ifname, stats, stats32);
 
 	if (flags == ipdevice->flags)
 		goto out;
@@ -658,7 +701,8 @@ out:
 	g_free(ifname);
 }
 
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats,
+							bool stats32)
 {
 	struct connman_ipdevice *ipdevice;
 	GList *list;
@@ -672,7 +716,7 @@ void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats)
 
 	ifname = connman_inet_ifname(index);
 
-	update_stats(ipdevice, ifname, stats);
+	update_stats(ipdevice, ifname, stats, stats32);
 
 	for (list = g_list_first(ipconfig_list); list;
 						list = g_list_next(list)) {
@@ -1091,6 +1135,8 @@ const char *__connman_ipconfig_get_gateway_from_index(int index,
 void __connman_ipconfig_set_index(struct connman_ipconfig *ipconfig, int index)
 {
 	ipconfig->index = index;
+
+	__connman_service_index_changed(index);
 }
 
 const char *__connman_ipconfig_get_local(struct connman_ipconfig *ipconfig)
@@ -155,10 +155,27 @@ struct connman_iptables_entry {
 	int builtin;
 	int counter_idx;
 
+	/*
+	 * A jump refers to the entry before its target, the verdict is
+	 * only computed by update_offsets(). refs counts the jumps which
+	 * refer to this entry.
+	 */
+	struct connman_iptables_entry *jump;
+	unsigned int refs;
+
 	struct ipt_entry *entry;
 	struct ip6t_entry *entry6;
 };
 
+struct connman_iptables_chain {
+	char *name;
+	int builtin;
+
+	/* first entry and policy or RETURN entry of the chain */
+	GList *head;
+	GList *last;
+};
+
 struct connman_iptables {
 	int type;
 	char *name;
@@ -177,6 +194,7 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+	GHashTable *chains;
 };
 
 static GHashTable *table_hash = NULL;
@@ -670,158 +688,221 @@ static bool is_fallthrough(struct connman_iptables_entry *e)
 	return false;
 }
 
-static bool is_chain(struct connman_iptables *table,
-				struct connman_iptables_entry *e)
+static struct connman_iptables_chain *find_chain(
+					struct connman_iptables *table,
+					const char *chain_name)
 {
-	struct xt_entry_target *target;
+	if (!table->chains || !chain_name)
+		return NULL;
 
-	if (!e)
-		return false;
+	return g_hash_table_lookup(table->chains, chain_name);
+}
 
-	if (e->builtin >= 0)
-		return true;
+static void free_chain(gpointer data)
+{
+	struct connman_iptables_chain *chain = data;
 
-	target = iptables_entry_get_target(e);
-	
-	if (!target)
-		return false;
+	g_free(chain->name);
+	g_free(chain);
+}
 
-	if (!g_strcmp0(target->u.user.name, get_error_target(e->type)))
-		return true;
+static struct connman_iptables_chain *index_chain(
+					struct connman_iptables *table,
+					const char *chain_name, int builtin,
+					GList *head, GList *last)
+{
+	struct connman_iptables_chain *chain;
 
-	return false;
+	chain = g_new0(struct connman_iptables_chain, 1);
+	chain->name = g_strdup(chain_name);
+	chain->builtin = builtin;
+	chain->head = head;
+	chain->last = last;
+
+	g_hash_table_replace(table->chains, chain->name, chain);
+
+	return chain;
 }
 
-static GList *find_chain_head(struct connman_iptables *table,
-				const char *chain_name)
+/*
+ * Builds the chain index of a table loaded from the kernel. A chain
+ * ends with the entry before the head of the next chain, the last
+ * entry of the table is the error entry which terminates it.
+ */
+static void index_chains(struct connman_iptables *table)
 {
-	GList *list;
-	struct connman_iptables_entry *head;
+	struct connman_iptables_chain *chain = NULL;
+	struct connman_iptables_entry *e;
 	struct xt_entry_target *target;
-	int builtin;
-	
-	switch (table->type) {
-	case AF_INET:
-	case AF_INET6:
-		break;
-	default:
-		return NULL;
-	}
+	const char *name;
+	GList *list;
 
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
+	table->chains = g_hash_table_new_full(g_str_hash, g_str_equal,
+							NULL, free_chain);
 
-		/* Buit-in chain */
-		builtin = head->builtin;
+	for (list = table->entries; list && list->next; list = list->next) {
+		e = list->data;
 
-		if (builtin >= 0 && !g_strcmp0(hooknames[builtin], chain_name))
-			break;
+		if (e->builtin >= 0) {
+			name = hooknames[e->builtin];
+		} else {
+			target = iptables_entry_get_target(e);
+			if (!target || g_strcmp0(target->u.user.name,
+						get_error_target(e->type)))
+				continue;
 
-		/* User defined chain */
-		target = iptables_entry_get_target(head);
-		
-		if (!target)
-			continue;
+			name = (const char *)target->data;
+		}
 
-		if (!g_strcmp0(target->u.user.name,
-			get_error_target(table->type)) &&
-			!g_strcmp0((char *)target->data, chain_name))
-			break;
+		if (chain)
+			chain->last = list->prev;
+
+		chain = index_chain(table, name, e->builtin, list, NULL);
 	}
 
-	return list;
+	if (chain && list)
+		chain->last = list->prev;
 }
 
-static GList *find_chain_tail(struct connman_iptables *table,
-				const char *chain_name)
+/* The builtin flag marks the first entry of a builtin chain */
+static void set_chain_head(struct connman_iptables *table, GList *head,
+								int builtin)
 {
-	struct connman_iptables_entry *tail;
-	GList *chain_head, *list;
+	struct connman_iptables_chain *chain;
+	struct connman_iptables_entry *e = head->data;
 
-	chain_head = find_chain_head(table, chain_name);
-	if (!chain_head)
-		return NULL;
+	e->builtin = builtin;
 
-	/* Then we look for the next chain */
-	for (list = chain_head->next; list; list = list->next) {
-		tail = list->data;
+	chain = find_chain(table, hooknames[builtin]);
+	if (chain)
+		chain->head = head;
+}
 
-		if (is_chain(table, tail))
-			return list;
-	}
+static void set_jump(struct connman_iptables_entry *e,
+				struct connman_iptables_entry *jump)
+{
+	if (e->jump)
+		e->jump->refs--;
+
+	e->jump = jump;
 
-	/* Nothing found, we return the table end */
-	return g_list_last(table->entries);
+	if (jump)
+		jump->refs++;
 }
 
-static void update_offsets(struct connman_iptables *table)
+/*
+ * Resolves the verdicts of the jumps in a table loaded from the
+ * kernel to the entries before their targets.
+ */
+static void resolve_jumps(struct connman_iptables *table)
 {
-	GList *list, *prev;
-	struct connman_iptables_entry *entry, *prev_entry;
+	struct connman_iptables_entry *e, *prev = NULL;
+	struct xt_standard_target *t;
+	GHashTable *before;
+	GList *list;
+
+	before = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	for (list = table->entries; list; list = list->next) {
-		entry = list->data;
+		e = list->data;
 
-		if (list == table->entries) {
-			entry->offset = 0;
+		if (prev)
+			g_hash_table_insert(before,
+					GUINT_TO_POINTER(e->offset), prev);
 
+		prev = e;
+	}
+
+	for (list = table->entries; list; list = list->next) {
+		e = list->data;
+
+		if (!is_jump(e))
 			continue;
-		}
 
-		prev = list->prev;
-		prev_entry = prev->data;
+		t = (struct xt_standard_target *)
+			iptables_entry_get_target(e);
 
-		entry->offset = prev_entry->offset +
-					iptables_entry_get_next_offset(
-						prev_entry);
+		set_jump(e, g_hash_table_lookup(before,
+					GUINT_TO_POINTER(t->verdict)));
 	}
+
+	g_hash_table_destroy(before);
 }
 
-static void update_targets_reference(struct connman_iptables *table,
-				struct connman_iptables_entry *entry_before,
-				struct connman_iptables_entry *modified_entry,
-				bool is_removing)
+static GList *find_chain_head(struct connman_iptables *table,
+				const char *chain_name)
 {
-	struct connman_iptables_entry *tmp;
+	struct connman_iptables_chain *chain;
+
+	chain = find_chain(table, chain_name);
+	if (!chain)
+		return NULL;
+
+	return chain->head;
+}
+
+static GList *find_chain_tail(struct connman_iptables *table,
+				const char *chain_name)
+{
+	struct connman_iptables_chain *chain;
+
+	chain = find_chain(table, chain_name);
+	if (!chain)
+		return NULL;
+
+	/* The head of the next chain or the table end */
+	return chain->last->next;
+}
+
+/*
+ * Offsets, jump verdicts and hook entries are only brought up to date
+ * when the table is handed to the kernel, adding or removing rules
+ * does not need to touch the rest of the table.
+ */
+static void update_offsets(struct connman_iptables *table)
+{
+	struct connman_iptables_chain *chain;
+	struct connman_iptables_entry *entry;
 	struct xt_standard_target *t;
+	GHashTableIter iter;
+	gpointer value;
+	unsigned int offset = 0;
 	GList *list;
-	unsigned int offset;
 
-	offset = iptables_entry_get_next_offset(modified_entry);
+	for (list = table->entries; list; list = list->next) {
+		entry = list->data;
+
+		entry->offset = offset;
+		offset += iptables_entry_get_next_offset(entry);
+	}
 
 	for (list = table->entries; list; list = list->next) {
-		tmp = list->data;
+		entry = list->data;
 
-		if (!is_jump(tmp))
+		if (!entry->jump)
 			continue;
 
 		t = (struct xt_standard_target *)
-			iptables_entry_get_target(tmp);
-
+			iptables_entry_get_target(entry);
 		if (!t)
 			continue;
 
-		if (is_removing) {
-			if (t->verdict >= entry_before->offset)
-				t->verdict -= offset;
-		} else {
-			if (t->verdict > entry_before->offset)
-				t->verdict += offset;
-		}
+		t->verdict = entry->jump->offset +
+			iptables_entry_get_next_offset(entry->jump);
 	}
 
-	if (is_fallthrough(modified_entry)) {
-		t = (struct xt_standard_target *)
-			iptables_entry_get_target(modified_entry);
-		
-		if (!t)
-			return;
+	g_hash_table_iter_init(&iter, table->chains);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		chain = value;
 
-		t->verdict = entry_before->offset +
-			iptables_entry_get_target_offset(modified_entry) +
-			XT_ALIGN(sizeof(struct xt_standard_target));
-		t->target.u.target_size =
-			XT_ALIGN(sizeof(struct xt_standard_target));
+		if (chain->builtin < 0)
+			continue;
+
+		entry = chain->head->data;
+		table->hook_entry[chain->builtin] = entry->offset;
+
+		entry = chain->last->data;
+		table->underflow[chain->builtin] = entry->offset;
 	}
 }
 
@@ -829,7 +910,8 @@ static int iptables_add_entry(struct connman_iptables *table,
 				struct connman_iptables_entry *entry,
 				GList *before, int builtin, int counter_idx)
 {
-	struct connman_iptables_entry *e, *entry_before;
+	struct connman_iptables_entry *e;
+	struct xt_standard_target *t;
 
 	if (!table) {
 		return -EINVAL;
@@ -855,69 +937,68 @@ static int iptables_add_entry(struct connman_iptables *table,
 	e->builtin = builtin;
 	e->counter_idx = counter_idx;
 
-	table->entries = g_list_insert_before(table->entries, before, e);
 	table->num_entries++;
 	table->size += iptables_entry_get_next_offset(e);
 
+	/*
+	 * Entries loaded from the kernel come in table order, they are
+	 * prepended and iptables_init() reverses the list once.
+	 */
 	if (!before) {
+		table->entries = g_list_prepend(table->entries, e);
 		e->offset = table->size -
 				iptables_entry_get_next_offset(e);
 		return 0;
 	}
 
-	entry_before = before->data;
+	table->entries = g_list_insert_before(table->entries, before, e);
 
-	/*
-	 * We've just appended/inserted a new entry. All references
-	 * should be bumped accordingly.
-	 */
-	update_targets_reference(table, entry_before, e, false);
+	if (builtin >= 0)
+		set_chain_head(table, before->prev, builtin);
 
-	update_offsets(table);
+	/* A rule without target continues with the next entry */
+	if (is_fallthrough(e)) {
+		t = (struct xt_standard_target *)
+			iptables_entry_get_target(e);
+		t->target.u.target_size =
+			XT_ALIGN(sizeof(struct xt_standard_target));
+
+		set_jump(e, e);
+	}
 
 	return 0;
 }
 
-static int remove_table_entry(struct connman_iptables *table,
-				struct connman_iptables_entry *entry)
+static void remove_table_entry(struct connman_iptables *table, GList *node)
 {
-	int removed = 0;
-	u_int16_t next_offset;
+	struct connman_iptables_entry *entry = node->data;
+	struct connman_iptables_entry *prev = NULL, *e;
+	GList *list;
 
-	next_offset = iptables_entry_get_next_offset(entry);
 	table->num_entries--;
+	table->size -= iptables_entry_get_next_offset(entry);
 
-	table->size -= next_offset;
-	removed = next_offset;
-
-	table->entries = g_list_remove(table->entries, entry);
-
-	iptables_entry_free(entry);
+	set_jump(entry, NULL);
 
-	return removed;
-}
-
-static void delete_update_hooks(struct connman_iptables *table,
-				int builtin, GList *chain_head,
-				int removed)
-{
-	struct connman_iptables_entry *e;
-	GList *list;
-
-	e = chain_head->data;
-	e->builtin = builtin;
+	/*
+	 * Jumps which referred to this entry still go to the same
+	 * target, which now follows the previous entry.
+	 */
+	if (entry->refs) {
+		if (node->prev)
+			prev = node->prev->data;
 
-	table->underflow[builtin] -= removed;
+		for (list = table->entries; list; list = list->next) {
+			e = list->data;
 
-	for (list = chain_head->next; list; list = list->next) {
-		e = list->data;
+			if (e->jump == entry)
+				set_jump(e, prev);
+		}
+	}
 
-		if (e->builtin < 0)
-			continue;
+	table->entries = g_list_delete_link(table->entries, node);
 
-		table->hook_entry[e->builtin] -= removed;
-		table->underflow[e->builtin] -= removed;
-	}
+	iptables_entry_free(entry);
 }
 
 static int iptables_flush_chain(struct connman_iptables *table,
@@ -925,7 +1006,7 @@ static int iptables_flush_chain(struct connman_iptables *table,
 {
 	GList *chain_head, *chain_tail, *list, *next;
 	struct connman_iptables_entry *entry;
-	int builtin, removed = 0;
+	int builtin;
 
 	DBG("table %s chain %s", table->name, name);
 
@@ -949,18 +1030,15 @@ static int iptables_flush_chain(struct connman_iptables *table,
 		return 0;
 
 	while (list != chain_tail->prev) {
-		entry = list->data;
 		next = g_list_next(list);
 
-		removed += remove_table_entry(table, entry);
+		remove_table_entry(table, list);
 
 		list = next;
 	}
 
 	if (builtin >= 0)
-		delete_update_hooks(table, builtin, chain_tail->prev, removed);
-
-	update_offsets(table);
+		set_chain_head(table, chain_tail->prev, builtin);
 
 	return 0;
 }
@@ -968,7 +1046,7 @@ static int iptables_flush_chain(struct connman_iptables *table,
 static int iptables_add_chain(struct connman_iptables *table,
 				const char *name)
 {
-	GList *last;
+	GList *last, *head;
 	struct ipt_entry *entry_head = NULL;
 	struct ipt_entry *entry_return = NULL;
 	struct ip6t_entry *entry6_head = NULL;
@@ -1045,6 +1123,8 @@ static int iptables_add_chain(struct connman_iptables *table,
 	if (iptables_add_entry(table, &entry, last, -1, -1) < 0)
 		goto err_head;
 
+	head = last->prev;
+
 	standard_target_size = XT_ALIGN(sizeof(struct ipt_standard_target));
 	entry_return_size = entry_struct_size + standard_target_size;
 
@@ -1082,6 +1162,8 @@ static int iptables_add_chain(struct connman_iptables *table,
 	if (iptables_add_entry(table, &entry, last, -1, -1) < 0)
 		goto err;
 
+	index_chain(table, name, -1, head, last->prev);
+
 	return 0;
 
 err:
@@ -1120,12 +1202,10 @@ static int iptables_delete_chain(struct connman_iptables *table,
 	if (chain_head->next != chain_tail->prev)
 		return -EINVAL;
 
-	remove_table_entry(table, entry);
-
-	entry = chain_tail->prev->data;
-	remove_table_entry(table, entry);
+	g_hash_table_remove(table->chains, name);
 
-	update_offsets(table);
+	remove_table_entry(table, chain_tail->prev);
+	remove_table_entry(table, chain_head);
 
 	return 0;
 }
@@ -1226,39 +1306,6 @@ err:
 	return NULL;
 }
 
-static void update_hooks(struct connman_iptables *table, GList *chain_head,
-				struct connman_iptables_entry *entry)
-{
-	GList *list;
-	struct connman_iptables_entry *head, *e;
-	int builtin;
-	u_int16_t next_offset;
-
-	if (!table || !chain_head)
-		return;
-
-	head = chain_head->data;
-
-	builtin = head->builtin;
-	if (builtin < 0)
-		return;
-
-	next_offset = iptables_entry_get_next_offset(entry);
-
-	table->underflow[builtin] += next_offset;
-
-	for (list = chain_head->next; list; list = list->next) {
-		e = list->data;
-
-		builtin = e->builtin;
-		if (builtin < 0)
-			continue;
-
-		table->hook_entry[builtin] += next_offset;
-		table->underflow[builtin] += next_offset;
-	}
-}
-
 static struct connman_iptables_entry *prepare_rule_inclusion(
 				struct connman_iptables *table,
 				struct iptables_ip *ip,
@@ -1294,8 +1341,6 @@ static struct connman_iptables_entry *prepare_rule_inclusion(
 		goto err;
 	}
 
-	update_hooks(table, chain_head, new_entry);
-
 	/*
 	 * If the chain is builtin, and does not have any rule,
 	 * then the one that we're inserting is becoming the head
@@ -1322,6 +1367,7 @@ static int iptables_append_rule(struct connman_iptables *table,
 				const char *chain_name,
 				const char *target_name,
 				struct xtables_target *xt_t,
+				struct connman_iptables_entry *jump,
 				struct xtables_rule_match *xt_rm)
 {
 	struct connman_iptables_entry *new_entry;
@@ -1357,6 +1403,9 @@ static int iptables_append_rule(struct connman_iptables *table,
 	if (ret < 0)
 		goto err;
 
+	if (jump)
+		set_jump(chain_tail->prev->prev->data, jump);
+
 	/*
 	 * Free only the container, not the content  iptables_add_entry()
 	 * allocates new containers for entries.
@@ -1376,6 +1425,7 @@ static int iptables_insert_rule(struct connman_iptables *table,
 				const char *chain_name,
 				const char *target_name,
 				struct xtables_target *xt_t,
+				struct connman_iptables_entry *jump,
 				struct xtables_rule_match *xt_rm)
 {
 	struct connman_iptables_entry *new_entry;
@@ -1413,6 +1463,9 @@ static int iptables_insert_rule(struct connman_iptables *table,
 	if (ret < 0)
 		goto err;
 
+	if (jump)
+		set_jump(chain_head->prev->data, jump);
+
 	/*
 	 * Free only the container, not the content  iptables_add_entry()
 	 * allocates new containers for entries.
@@ -1543,11 +1596,26 @@ static bool is_same_match(struct xt_entry_match *xt_e_m1,
 	return true;
 }
 
+/*
+ * The verdict bytes of a jump are stale until update_offsets(), so
+ * jumps are matched by the entry they refer to.
+ */
+static bool is_same_jump(struct connman_iptables_entry *e,
+				struct connman_iptables_entry *jump)
+{
+	if (jump)
+		return e->jump == jump;
+
+	/* a rule without target refers to itself */
+	return !e->jump || e->jump == e;
+}
+
 static GList *find_existing_rule(struct connman_iptables *table,
 				struct iptables_ip *ip,
 				const char *chain_name,
 				const char *target_name,
 				struct xtables_target *xt_t,
+				struct connman_iptables_entry *jump,
 				GList *matches,
 				struct xtables_rule_match *xt_rm)
 {
@@ -1609,10 +1677,19 @@ static GList *find_existing_rule(struct connman_iptables *table,
 		if (xt_t) {
 			struct xt_entry_target *tmp_xt_e_t = NULL;
 
+			if (!is_same_jump(tmp, jump))
+				continue;
+
 			tmp_xt_e_t = iptables_entry_get_target(tmp);
 
-			if (!is_same_target(tmp_xt_e_t, xt_e_t))
+			if (jump) {
+				if (!tmp_xt_e_t || g_strcmp0(
+						tmp_xt_e_t->u.user.name,
+						xt_e_t->u.user.name))
+					continue;
+			} else if (!is_same_target(tmp_xt_e_t, xt_e_t)) {
 				continue;
+			}
 		}
 
 		if (matches) {
@@ -1641,17 +1718,16 @@ static int iptables_delete_rule(struct connman_iptables *table,
 				const char *chain_name,
 				const char *target_name,
 				struct xtables_target *xt_t,
+				struct connman_iptables_entry *jump,
 				GList *matches,
 				struct xtables_rule_match *xt_rm)
 {
 	struct connman_iptables_entry *entry;
 	GList *chain_head, *chain_tail, *list;
-	int builtin, removed;
+	int builtin;
 
 	DBG("table %s chain %s", table->name, chain_name);
 
-	removed = 0;
-
 	chain_head = find_chain_head(table, chain_name);
 	if (!chain_head)
 		return -EINVAL;
@@ -1661,7 +1737,7 @@ static int iptables_delete_rule(struct connman_iptables *table,
 		return -EINVAL;
 
 	list = find_existing_rule(table, ip, chain_name, target_name,
-						xt_t, matches, xt_rm);
+						xt_t, jump, matches, xt_rm);
 
 	if (!list)
 		return -EINVAL;
@@ -1679,28 +1755,14 @@ static int iptables_delete_rule(struct connman_iptables *table,
 		 * always valid. A builtin chain has always a policy
 		 * rule at the end.
 		 */
-		chain_head = chain_head->next;
-
-		entry = chain_head->data;
-		entry->builtin = builtin;
+		entry->builtin = -1;
+		set_chain_head(table, chain_head->next, builtin);
 	}
 
-	entry = list->data;
-	if (!entry)
+	if (!list->data)
 		return -EINVAL;
 
-	/* We have deleted a rule,
-	 * all references should be bumped accordingly */
-	if (list->next)
-		update_targets_reference(table, list->next->data,
-						list->data, true);
-
-	removed += remove_table_entry(table, entry);
-
-	if (builtin >= 0)
-		delete_update_hooks(table, builtin, chain_head, removed);
-
-	update_offsets(table);
+	remove_table_entry(table, list);
 
 	return 0;
 }
@@ -1759,6 +1821,8 @@ static struct ipt_replace *iptables_blob(struct connman_iptables *table)
 	struct connman_iptables_entry *e;
 	unsigned char *entry_index;
 
+	update_offsets(table);
+
 	r = g_try_malloc0(sizeof(struct ipt_replace) + table->size);
 	if (!r)
 		return NULL;
@@ -1801,6 +1865,8 @@ static struct ip6t_replace *ip6tables_blob(struct connman_iptables *table)
 	struct connman_iptables_entry *e;
 	unsigned char *entry_index;
 
+	update_offsets(table);
+
 	r = g_try_malloc0(sizeof(struct ip6t_replace) + table->size);
 	if (!r)
 		return NULL;
@@ -2417,6 +2483,10 @@ static void table_cleanup(struct connman_iptables *table)
 	}
 
 	g_list_free(table->entries);
+
+	if (table->chains)
+		g_hash_table_destroy(table->chains);
+
 	g_free(table->name);
 	
 	if (table->type == AF_INET) {
@@ -2572,6 +2642,11 @@ static struct connman_iptables *iptables_init(int type, const char *table_name)
 			add_entry,
 			table);
 
+	table->entries = g_list_reverse(table->entries);
+
+	index_chains(table);
+	resolve_jumps(table);
+
 	if (debug_enabled)
 		dump_table(table);
 
@@ -2679,6 +2754,23 @@ struct xtables_globals ip6tables_globals = {
 #endif
 };
 
+/* Jumps to a user defined chain refer to the chain head entry */
+static struct connman_iptables_entry *find_jump(
+					struct connman_iptables *table,
+					const char *target_name)
+{
+	GList *chain_head;
+
+	if (is_builtin_target(target_name))
+		return NULL;
+
+	chain_head = find_chain_head(table, target_name);
+	if (!chain_head || !chain_head->next)
+		return NULL;
+
+	return chain_head->data;
+}
+
 static struct xtables_target *prepare_target(struct connman_iptables *table,
 							const char *target_name)
 {
@@ -3046,6 +3138,7 @@ struct parse_context {
 	struct ipt_ip *ip;
 	struct ip6t_ip6 *ipv6;
 	struct xtables_target *xt_t;
+	struct connman_iptables_entry *jump;
 	GList *xt_m;
 	struct xtables_rule_match *xt_rm;
 	uint16_t proto;
@@ -3490,6 +3583,8 @@ static int parse_rule_spec(struct connman_iptables *table,
 				goto out;
 			}
 
+			ctx->jump = find_jump(table, optarg);
+
 			break;
 		case 1:
 			if (optarg[0] == '!' && optarg[1] == '\0') {
@@ -3788,7 +3883,7 @@ int __connman_iptables_append(int type,
 	iptables_ip_setup(&ip, ctx);
 
 	err = iptables_append_rule(table, &ip, chain, target_name, ctx->xt_t,
-								ctx->xt_rm);
+							ctx->jump, ctx->xt_rm);
 out:
 	cleanup_parse_context(ctx);
 	reset_xtables();
@@ -3842,7 +3937,7 @@ int __connman_iptables_insert(int type,
 	iptables_ip_setup(&ip, ctx);
 
 	err = iptables_insert_rule(table, &ip, chain, target_name, ctx->xt_t,
-								ctx->xt_rm);
+							ctx->jump, ctx->xt_rm);
 out:
 	cleanup_parse_context(ctx);
 	reset_xtables();
@@ -3896,7 +3991,7 @@ int __connman_iptables_delete(int type,
 	iptables_ip_setup(&ip, ctx);
 
 	err = iptables_delete_rule(table, &ip, chain, target_name, ctx->xt_t,
-				ctx->xt_m, ctx->xt_rm);
+				ctx->jump, ctx->xt_m, ctx->xt_rm);
 out:
 	cleanup_parse_context(ctx);
 	reset_xtables();
@@ -55,6 +55,24 @@
 #define DEFAULT_ONLINE_CHECK_INITIAL_INTERVAL 1
 #define DEFAULT_ONLINE_CHECK_MAX_INTERVAL 12
 #define DEFAULT_LOCALTIME "/etc/localtime"
+#define DEFAULT_DNS_OVER_TLS_AUTHENTICATION "strict"
+
+/*
+ * We limit the DNS cache size to some sane value so that cached data does
+ * not occupy too much memory. Each cached entry occupies on average
+ * about 100 bytes memory (depending on DNS name length).
+ * Example: caching www.connman.net uses 97 bytes memory.
+ * When either the DNSCacheSize or the DNSCacheMemory limit is hit, the
+ * dnsproxy drops the least recently used entries. Negative responses are
+ * additionally limited by DNSNegativeCacheMemory so that lookups of
+ * non-existent names cannot push out useful entries.
+ */
+#define DEFAULT_DNS_CACHE_SIZE 256
+#define DEFAULT_DNS_NEGATIVE_CACHE_MEMORY 32
+#define DEFAULT_DNS_SERVE_STALE_TIME (24 * 60 * 60)
+#define DEFAULT_DNS_PREFETCH_THRESHOLD 90
+#define DEFAULT_STATISTICS_SYNC_INTERVAL 60
+#define DEFAULT_SERVICE_SAVE_DELAY 5
 
 #define MAINFILE "main.conf"
 #define CONFIGMAINFILE CONFIGDIR "/" MAINFILE
@@ -112,6 +130,16 @@ static struct {
 	char *localtime;
 	bool regdom_follows_timezone;
 	char *resolv_conf;
+	char *dns_over_tls_authentication;
+	char **dns_over_tls_server_names;
+	char **dns_over_tls_pins;
+	unsigned int dns_cache_size;
+	unsigned int dns_cache_memory;
+	unsigned int dns_negative_cache_memory;
+	unsigned int dns_serve_stale_time;
+	unsigned int dns_prefetch_threshold;
+	unsigned int statistics_sync_interval;
+	unsigned int service_save_delay;
 } connman_settings  = {
 	.bg_scan = true,
 	.pref_timeservers = NULL,
@@ -141,6 +169,16 @@ static struct {
 	.use_gateways_as_timeservers = false,
 	.localtime = NULL,
 	.resolv_conf = NULL,
+	.dns_over_tls_authentication = NULL,
+	.dns_over_tls_server_names = NULL,
+	.dns_over_tls_pins = NULL,
+	.dns_cache_size = DEFAULT_DNS_CACHE_SIZE,
+	.dns_cache_memory = 0,
+	.dns_negative_cache_memory = DEFAULT_DNS_NEGATIVE_CACHE_MEMORY,
+	.dns_serve_stale_time = DEFAULT_DNS_SERVE_STALE_TIME,
+	.dns_prefetch_threshold = DEFAULT_DNS_PREFETCH_THRESHOLD,
+	.statistics_sync_interval = DEFAULT_STATISTICS_SYNC_INTERVAL,
+	.service_save_delay = DEFAULT_SERVICE_SAVE_DELAY,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -172,6 +210,16 @@ static struct {
 #define CONF_LOCALTIME                  "Localtime"
 #define CONF_REGDOM_FOLLOWS_TIMEZONE    "RegdomFollowsTimezone"
 #define CONF_RESOLV_CONF                "ResolvConf"
+#define CONF_DNS_OVER_TLS_AUTHENTICATION "DNSOverTLSAuthentication"
+#define CONF_DNS_OVER_TLS_SERVER_NAMES  "DNSOverTLSServerNames"
+#define CONF_DNS_OVER_TLS_PINS          "DNSOverTLSPins"
+#define CONF_DNS_CACHE_SIZE             "DNSCacheSize"
+#define CONF_DNS_CACHE_MEMORY           "DNSCacheMemory"
+#define CONF_DNS_NEGATIVE_CACHE_MEMORY  "DNSNegativeCacheMemory"
+#define CONF_DNS_SERVE_STALE_TIME       "DNSServeStaleTime"
+#define CONF_DNS_PREFETCH_THRESHOLD     "DNSPrefetchThreshold"
+#define CONF_STATISTICS_SYNC_INTERVAL   "StatisticsSyncInterval"
+#define CONF_SERVICE_SAVE_DELAY         "ServiceSaveDelay"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -203,6 +251,16 @@ static const char *supported_options[] = {
 	CONF_LOCALTIME,
 	CONF_REGDOM_FOLLOWS_TIMEZONE,
 	CONF_RESOLV_CONF,
+	CONF_DNS_OVER_TLS_AUTHENTICATION,
+	CONF_DNS_OVER_TLS_SERVER_NAMES,
+	CONF_DNS_OVER_TLS_PINS,
+	CONF_DNS_CACHE_SIZE,
+	CONF_DNS_CACHE_MEMORY,
+	CONF_DNS_NEGATIVE_CACHE_MEMORY,
+	CONF_DNS_SERVE_STALE_TIME,
+	CONF_DNS_PREFETCH_THRESHOLD,
+	CONF_STATISTICS_SYNC_INTERVAL,
+	CONF_SERVICE_SAVE_DELAY,
 	NULL
 };
 
@@ -607,6 +665,85 @@ static void parse_config(GKeyFile *config)
 		g_free(string);
 
 	g_clear_error(&error);
+
+	string = __connman_config_get_string(config, "General",
+				CONF_DNS_OVER_TLS_AUTHENTICATION, &error);
+	if (!error && (g_str_equal(string, "strict") ||
+				g_str_equal(string, "opportunistic")))
+		connman_settings.dns_over_tls_authentication = string;
+	else
+		g_free(string);
+
+	g_clear_error(&error);
+
+	str_list = __connman_config_get_string_list(config, "General",
+			CONF_DNS_OVER_TLS_SERVER_NAMES, &len, &error);
+
+	if (!error)
+		connman_settings.dns_over_tls_server_names = str_list;
+	else
+		g_strfreev(str_list);
+
+	g_clear_error(&error);
+
+	str_list = __connman_config_get_string_list(config, "General",
+			CONF_DNS_OVER_TLS_PINS, &len, &error);
+
+	if (!error)
+		connman_settings.dns_over_tls_pins = str_list;
+	else
+		g_strfreev(str_list);
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_SIZE, &error);
+	if (!error && integer >= 0)
+		connman_settings.dns_cache_size = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_MEMORY, &error);
+	if (!error && integer >= 0)
+		connman_settings.dns_cache_memory = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_NEGATIVE_CACHE_MEMORY, &error);
+	if (!error && integer >= 0)
+		connman_settings.dns_negative_cache_memory = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_SERVE_STALE_TIME, &error);
+	if (!error && integer >= 0)
+		connman_settings.dns_serve_stale_time = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_PREFETCH_THRESHOLD, &error);
+	if (!error && integer >= 0 && integer <= 100)
+		connman_settings.dns_prefetch_threshold = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_STATISTICS_SYNC_INTERVAL, &error);
+	if (!error && integer >= 0)
+		connman_settings.statistics_sync_interval = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_SERVICE_SAVE_DELAY, &error);
+	if (!error && integer >= 0)
+		connman_settings.service_save_delay = integer;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -647,6 +784,8 @@ static gboolean signal_handler(GIOChannel *channel, GIOCondition cond,
 	case SIGTERM:
 		if (__terminated == 0) {
 			connman_info("Terminating");
+			/* in case the shutdown does not finish */
+			__connman_storage_flush();
 			g_main_loop_quit(main_loop);
 		}
 
@@ -801,6 +940,11 @@ char *connman_setting_get_string(const char *key)
 		return connman_settings.localtime ?
 			connman_settings.localtime : DEFAULT_LOCALTIME;
 
+	if (g_str_equal(key, CONF_DNS_OVER_TLS_AUTHENTICATION))
+		return connman_settings.dns_over_tls_authentication ?
+			connman_settings.dns_over_tls_authentication :
+			DEFAULT_DNS_OVER_TLS_AUTHENTICATION;
+
 	return NULL;
 }
 
@@ -856,6 +1000,27 @@ unsigned int connman_setting_get_uint(const char *key)
 	if (g_str_equal(key, CONF_ONLINE_CHECK_MAX_INTERVAL))
 		return connman_settings.online_check_max_interval;
 
+	if (g_str_equal(key, CONF_DNS_CACHE_SIZE))
+		return connman_settings.dns_cache_size;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_MEMORY))
+		return connman_settings.dns_cache_memory;
+
+	if (g_str_equal(key, CONF_DNS_NEGATIVE_CACHE_MEMORY))
+		return connman_settings.dns_negative_cache_memory;
+
+	if (g_str_equal(key, CONF_DNS_SERVE_STALE_TIME))
+		return connman_settings.dns_serve_stale_time;
+
+	if (g_str_equal(key, CONF_DNS_PREFETCH_THRESHOLD))
+		return connman_settings.dns_prefetch_threshold;
+
+	if (g_str_equal(key, CONF_STATISTICS_SYNC_INTERVAL))
+		return connman_settings.statistics_sync_interval;
+
+	if (g_str_equal(key, CONF_SERVICE_SAVE_DELAY))
+		return connman_settings.service_save_delay;
+
 	return 0;
 }
 
@@ -873,6 +1038,12 @@ char **connman_setting_get_string_list(const char *key)
 	if (g_str_equal(key, CONF_TETHERING_TECHNOLOGIES))
 		return connman_settings.tethering_technologies;
 
+	if (g_str_equal(key, CONF_DNS_OVER_TLS_SERVER_NAMES))
+		return connman_settings.dns_over_tls_server_names;
+
+	if (g_str_equal(key, CONF_DNS_OVER_TLS_PINS))
+		return connman_settings.dns_over_tls_pins;
+
 	return NULL;
 }
 
@@ -974,6 +1145,7 @@ int main(int argc, char *argv[])
 		config_init(option_config);
 
 	__connman_util_init();
+	__connman_storage_init(connman_settings.service_save_delay);
 	__connman_inotify_init();
 	__connman_technology_init();
 	__connman_notifier_init();
@@ -1061,6 +1233,7 @@ int main(int argc, char *argv[])
 	__connman_notifier_cleanup();
 	__connman_technology_cleanup();
 	__connman_inotify_cleanup();
+	__connman_storage_cleanup();
 
 	__connman_util_cleanup();
 	__connman_dbus_cleanup();
@@ -1084,6 +1257,9 @@ int main(int argc, char *argv[])
 	g_free(connman_settings.online_check_ipv4_url);
 	g_free(connman_settings.online_check_ipv6_url);
 	g_free(connman_settings.localtime);
+	g_free(connman_settings.dns_over_tls_authentication);
+	g_strfreev(connman_settings.dns_over_tls_server_names);
+	g_strfreev(connman_settings.dns_over_tls_pins);
 
 	g_free(option_debug);
 	g_free(option_wifi);
@@ -195,6 +195,44 @@ static DBusMessage *get_services(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *register_services_delta(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *sender;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	err = __connman_service_register_delta(sender);
+	if (err == -EEXIST)
+		return __connman_error_already_exists(msg);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *unregister_services_delta(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	const char *sender;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	err = __connman_service_unregister_delta(sender);
+	if (err == -ESRCH)
+		return __connman_error_not_registered(msg);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
 static void append_peer_structs(DBusMessageIter *iter, void *user_data)
 {
 	__connman_peer_list_struct(iter);
@@ -235,6 +273,52 @@ static DBusMessage *get_tethering_clients(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *get_dnsproxy_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	__connman_dnsproxy_append_statistics(&dict);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
+static DBusMessage *get_storage_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	__connman_storage_append_statistics(&dict);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
 static DBusMessage *connect_provider(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -305,9 +389,79 @@ static DBusMessage *register_counter(DBusConnection *conn,
 						DBUS_TYPE_UINT32, &period,
 							DBUS_TYPE_INVALID);
 
-	/* FIXME: add handling of accuracy parameter */
+	err = __connman_counter_register(sender, path, period,
+					(uint64_t) accuracy * 1024, 0, false);
+	if (err < 0)
+		return __connman_error_failed(msg, -err);
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
+static int parse_counter_settings(DBusMessageIter *array,
+				unsigned int *period, uint64_t *bytes,
+				uint64_t *packets)
+{
+	*period = 0;
+	*bytes = *packets = 0;
+
+	while (dbus_message_iter_get_arg_type(array) ==
+							DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		const char *key;
+		int type;
+
+		dbus_message_iter_recurse(array, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+
+		dbus_message_iter_next(&entry);
+
+		dbus_message_iter_recurse(&entry, &value);
+		type = dbus_message_iter_get_arg_type(&value);
+
+		if (!g_strcmp0(key, "Period") && type == DBUS_TYPE_UINT32)
+			dbus_message_iter_get_basic(&value, period);
+		else if (!g_strcmp0(key, "ByteThreshold") &&
+						type == DBUS_TYPE_UINT64)
+			dbus_message_iter_get_basic(&value, bytes);
+		else if (!g_strcmp0(key, "PacketThreshold") &&
+						type == DBUS_TYPE_UINT64)
+			dbus_message_iter_get_basic(&value, packets);
+		else
+			return -EINVAL;
+
+		dbus_message_iter_next(array);
+	}
+
+	return 0;
+}
 
-	err = __connman_counter_register(sender, path, period);
+static DBusMessage *register_counter_with_settings(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessageIter iter, array;
+	const char *sender, *path;
+	unsigned int period;
+	uint64_t bytes, packets;
+	int err;
+
+	DBG("conn %p", conn);
+
+	sender = dbus_message_get_sender(msg);
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return __connman_error_invalid_arguments(msg);
+
+	dbus_message_iter_get_basic(&iter, &path);
+	dbus_message_iter_next(&iter);
+
+	dbus_message_iter_recurse(&iter, &array);
+
+	err = parse_counter_settings(&array, &period, &bytes, &packets);
+	if (err < 0)
+		return __connman_error_invalid_arguments(msg);
+
+	err = __connman_counter_register(sender, path, period, bytes,
+							packets, true);
 	if (err < 0)
 		return __connman_error_failed(msg, -err);
 
@@ -537,12 +691,22 @@ static const GDBusMethodTable manager_methods[] = {
 	{ GDBUS_METHOD("GetServices",
 			NULL, GDBUS_ARGS({ "services", "a(oa{sv})" }),
 			get_services) },
+	{ GDBUS_METHOD("RegisterServicesDelta", NULL, NULL,
+			register_services_delta) },
+	{ GDBUS_METHOD("UnregisterServicesDelta", NULL, NULL,
+			unregister_services_delta) },
 	{ GDBUS_METHOD("GetPeers",
 			NULL, GDBUS_ARGS({ "peers", "a(oa{sv})" }),
 			get_peers) },
 	{ GDBUS_METHOD("GetTetheringClients",
 			NULL, GDBUS_ARGS({ "tethering_clients", "as" }),
 			get_tethering_clients) },
+	{ GDBUS_METHOD("GetDNSProxyStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_dnsproxy_statistics) },
+	{ GDBUS_METHOD("GetStorageStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_storage_statistics) },
 	{ GDBUS_DEPRECATED_ASYNC_METHOD("ConnectProvider",
 			      GDBUS_ARGS({ "provider", "a{sv}" }),
 			      GDBUS_ARGS({ "path", "o" }),
@@ -557,6 +721,9 @@ static const GDBusMethodTable manager_methods[] = {
 			GDBUS_ARGS({ "path", "o" }, { "accuracy", "u" },
 					{ "period", "u" }),
 			NULL, register_counter) },
+	{ GDBUS_METHOD("RegisterCounterWithSettings",
+			GDBUS_ARGS({ "path", "o" }, { "settings", "a{sv}" }),
+			NULL, register_counter_with_settings) },
 	{ GDBUS_METHOD("UnregisterCounter",
 			GDBUS_ARGS({ "path", "o" }), NULL,
 			unregister_counter) },
@@ -597,6 +764,9 @@ static const GDBusSignalTable manager_signals[] = {
 	{ GDBUS_SIGNAL("ServicesChanged",
 			GDBUS_ARGS({ "changed", "a(oa{sv})" },
 					{ "removed", "ao" })) },
+	{ GDBUS_SIGNAL("ServicesChangedDelta",
+			GDBUS_ARGS({ "changed", "a(oua{sv})" },
+					{ "removed", "ao" })) },
 	{ GDBUS_SIGNAL("PeersChanged",
 			GDBUS_ARGS({ "changed", "a(oa{sv})" },
 					{ "removed", "ao" })) },
@@ -68,6 +68,7 @@ struct connman_network {
 	char *node;
 	char *group;
 	char *path;
+	char *service_ident;
 	int index;
 	int router_solicit_count;
 	int router_solicit_refresh_count;
@@ -1134,6 +1135,7 @@ static void network_remove(struct connman_network *network)
 
 			g_free(network->group);
 			network->group = NULL;
+			__connman_network_reset_service_ident(network);
 		}
 		break;
 	}
@@ -1241,6 +1243,7 @@ static void network_destruct(struct connman_network *network)
 
 	g_free(network->path);
 	g_free(network->group);
+	g_free(network->service_ident);
 	g_free(network->node);
 	g_free(network->name);
 	g_free(network->identifier);
@@ -1441,6 +1444,7 @@ void connman_network_set_group(struct connman_network *network,
 	}
 
 	network->group = g_strdup(group);
+	__connman_network_reset_service_ident(network);
 
 	if (network->group)
 		network_probe(network);
@@ -1465,6 +1469,36 @@ const char *__connman_network_get_ident(struct connman_network *network)
 	return connman_device_get_ident(network->device);
 }
 
+/*
+ * The identifier of the service belonging to the network. It is built
+ * from the network type, the ident of the device and the group, and
+ * kept until one of them changes, since the service is looked up for
+ * nearly every network event.
+ */
+const char *__connman_network_get_service_ident(struct connman_network *network)
+{
+	const char *ident;
+
+	if (network->service_ident)
+		return network->service_ident;
+
+	ident = __connman_network_get_ident(network);
+	if (!ident || !network->group)
+		return NULL;
+
+	network->service_ident = g_strdup_printf("%s_%s_%s",
+					__connman_network_get_type(network),
+					ident, network->group);
+
+	return network->service_ident;
+}
+
+void __connman_network_reset_service_ident(struct connman_network *network)
+{
+	g_free(network->service_ident);
+	network->service_ident = NULL;
+}
+
 bool __connman_network_get_weakness(struct connman_network *network)
 {
 	switch (network->type) {
@@ -2377,6 +2411,7 @@ void __connman_network_set_device(struct connman_network *network,
 		network_remove(network);
 
 	network->device = device;
+	__connman_network_reset_service_ident(network);
 
 	if (network->device)
 		network_probe(network);
@@ -50,6 +50,14 @@ int __connman_stats_get(struct connman_service *service,
 	return 0;
 }
 
+int __connman_stats_get_usage(struct connman_service *service,
+				enum connman_stats_resolution resolution,
+				time_t start, time_t end,
+				connman_stats_usage_cb_t cb, void *user_data)
+{
+	return -ENOTSUP;
+}
+
 int __connman_stats_init(void)
 {
 	return 0;
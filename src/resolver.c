@@ -707,6 +707,14 @@ int __connman_resolver_set_mdns(int index, bool enabled)
 	return __connman_dnsproxy_set_mdns(index, enabled);
 }
 
+int __connman_resolver_set_dns_over_tls(int index, bool enabled)
+{
+	if (!dnsproxy_enabled)
+		return -ENOTSUP;
+
+	return __connman_dnsproxy_set_dns_over_tls(index, enabled);
+}
+
 int __connman_resolver_init(gboolean dnsproxy)
 {
 	int i;
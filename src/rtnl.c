@@ -59,9 +59,23 @@ struct watch_data {
 static GSList *watch_list = NULL;
 static unsigned int watch_id = 0;
 
+/*
+ * Every counter polls the statistics with its own interval. A poll is
+ * due when the first counter is due and advances every counter that is
+ * due within UPDATE_SLACK, so counters with similar intervals share a
+ * poll without forcing everyone onto the shortest interval.
+ */
+#define UPDATE_SLACK (G_USEC_PER_SEC / 2)
+
+struct update_data {
+	unsigned int interval;
+	gint64 due;
+};
+
 static GSList *update_list = NULL;
-static guint update_interval = G_MAXUINT;
 static guint update_timeout = 0;
+static bool getstats_unsupported = false;
+static guint32 rtnl_portid = 0;
 
 struct interface_data {
 	int index;
@@ -366,11 +380,26 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+static void extract_stats32(struct rtnl_link_stats64 *stats,
+					const struct rtnl_link_stats *stats32)
+{
+	stats->rx_packets = stats32->rx_packets;
+	stats->tx_packets = stats32->tx_packets;
+	stats->rx_bytes = stats32->rx_bytes;
+	stats->tx_bytes = stats32->tx_bytes;
+	stats->rx_errors = stats32->rx_errors;
+	stats->tx_errors = stats32->tx_errors;
+	stats->rx_dropped = stats32->rx_dropped;
+	stats->tx_dropped = stats32->tx_dropped;
+}
+
 static bool extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
-				struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats, bool *stats32)
 {
+	struct rtnl_link_stats link_stats32;
+	bool have_stats64 = false;
 	struct rtattr *attr;
 
 	for (attr = IFLA_RTA(msg); RTA_OK(attr, bytes);
@@ -389,9 +418,25 @@ static bool extract_link(struct ifinfomsg *msg, int bytes,
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
 		case IFLA_STATS:
-			if (stats)
-				memcpy(stats, RTA_DATA(attr),
-					sizeof(struct rtnl_link_stats));
+			/*
+			 * The 32-bit counters wrap within seconds on fast
+			 * links, they are only used if the kernel did not
+			 * provide IFLA_STATS64 as well.
+			 */
+			if (!stats || have_stats64 ||
+				RTA_PAYLOAD(attr) < sizeof(link_stats32))
+				break;
+			memcpy(&link_stats32, RTA_DATA(attr),
+						sizeof(link_stats32));
+			extract_stats32(stats, &link_stats32);
+			*stats32 = true;
+			break;
+		case IFLA_STATS64:
+			if (!stats || RTA_PAYLOAD(attr) < sizeof(*stats))
+				break;
+			memcpy(stats, RTA_DATA(attr), sizeof(*stats));
+			have_stats64 = true;
+			*stats32 = false;
 			break;
 		case IFLA_OPERSTATE:
 			if (operstate)
@@ -411,16 +456,18 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
 	struct ether_addr address = {{ 0, 0, 0, 0, 0, 0 }};
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	struct interface_data *interface;
 	const char *ifname = NULL;
 	unsigned int mtu = 0;
 	char ident[13], str[18];
+	bool stats32 = false;
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
-	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate, &stats))
+	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate,
+						&stats, &stats32))
 		return;
 
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
@@ -452,7 +499,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	case ARPHRD_PPP:
 	case ARPHRD_NONE:
 		__connman_ipconfig_newlink(index, type, flags,
-							str, mtu, &stats);
+						str, mtu, &stats, stats32);
 		break;
 	}
 
@@ -512,13 +559,15 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 static void process_dellink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	const char *ifname = NULL;
+	bool stats32 = false;
 	GSList *list;
 
 	memset(&stats, 0, sizeof(stats));
-	if (!extract_link(msg, bytes, NULL, &ifname, NULL, &operstate, &stats))
+	if (!extract_link(msg, bytes, NULL, &ifname, NULL, &operstate,
+							&stats, &stats32))
 		return;
 
 	if (operstate != 0xff)
@@ -539,7 +588,7 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	case ARPHDR_PHONET_PIPE:
 	case ARPHRD_PPP:
 	case ARPHRD_NONE:
-		__connman_ipconfig_dellink(index, &stats);
+		__connman_ipconfig_dellink(index, &stats, stats32);
 		break;
 	}
 
@@ -921,6 +970,9 @@ static void rtnl_link(struct nlmsghdr *hdr)
 		case IFLA_STATS:
 			print_attr(attr, "stats");
 			break;
+		case IFLA_STATS64:
+			print_attr(attr, "stats64");
+			break;
 		case IFLA_COST:
 			print_attr(attr, "cost");
 			break;
@@ -981,6 +1033,27 @@ static void rtnl_dellink(struct nlmsghdr *hdr)
 				msg->ifi_change, msg, IFA_PAYLOAD(hdr));
 }
 
+static void rtnl_newstats(struct nlmsghdr *hdr)
+{
+	struct if_stats_msg *msg = (struct if_stats_msg *) NLMSG_DATA(hdr);
+	struct rtnl_link_stats64 stats;
+	struct rtattr *attr;
+	int bytes;
+
+	bytes = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+
+	for (attr = (struct rtattr *) ((char *) msg +
+					NLMSG_ALIGN(sizeof(*msg)));
+			RTA_OK(attr, bytes); attr = RTA_NEXT(attr, bytes)) {
+		if (attr->rta_type != IFLA_STATS_LINK_64 ||
+				RTA_PAYLOAD(attr) < sizeof(stats))
+			continue;
+
+		memcpy(&stats, RTA_DATA(attr), sizeof(stats));
+		__connman_ipconfig_update_stats(msg->ifindex, &stats);
+	}
+}
+
 static void rtnl_addr(struct nlmsghdr *hdr)
 {
 	struct ifaddrmsg *msg;
@@ -1300,6 +1373,10 @@ static const char *type2string(uint16_t type)
 		return "DELROUTE";
 	case RTM_NEWNDUSEROPT:
 		return "NEWNDUSEROPT";
+	case RTM_GETSTATS:
+		return "GETSTATS";
+	case RTM_NEWSTATS:
+		return "NEWSTATS";
 	default:
 		return "UNKNOWN";
 	}
@@ -1375,6 +1452,52 @@ static int process_response(guint32 seq)
 	return send_request(hdr);
 }
 
+static int send_getlink_index(int index);
+
+/* replies to requests without NLM_F_DUMP are not followed by NLMSG_DONE */
+static void process_single_response(struct nlmsghdr *hdr)
+{
+	struct nlmsghdr *req;
+
+	if (hdr->nlmsg_flags & NLM_F_MULTI || hdr->nlmsg_pid != rtnl_portid)
+		return;
+
+	req = find_request(hdr->nlmsg_seq);
+	if (!req || req->nlmsg_flags & NLM_F_DUMP)
+		return;
+
+	process_response(hdr->nlmsg_seq);
+}
+
+static void process_error(struct nlmsghdr *hdr, int error)
+{
+	struct nlmsghdr *req;
+	int index = -1;
+
+	if (hdr->nlmsg_pid != rtnl_portid)
+		return;
+
+	req = find_request(hdr->nlmsg_seq);
+	if (!req)
+		return;
+
+	/* RTM_GETSTATS exists since Linux 4.7 */
+	if (req->nlmsg_type == RTM_GETSTATS &&
+			(error == -EOPNOTSUPP || error == -EINVAL)) {
+		struct if_stats_msg *msg = NLMSG_DATA(req);
+
+		DBG("RTM_GETSTATS not supported, using RTM_GETLINK");
+
+		getstats_unsupported = true;
+		index = msg->ifindex;
+	}
+
+	process_response(hdr->nlmsg_seq);
+
+	if (index >= 0)
+		send_getlink_index(index);
+}
+
 static void rtnl_message(void *buf, size_t len)
 {
 	while (len > 0) {
@@ -1401,6 +1524,7 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			process_error(hdr, err->error);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
@@ -1423,8 +1547,13 @@ static void rtnl_message(void *buf, size_t len)
 		case RTM_NEWNDUSEROPT:
 			rtnl_newnduseropt(hdr);
 			break;
+		case RTM_NEWSTATS:
+			rtnl_newstats(hdr);
+			break;
 		}
 
+		process_single_response(hdr);
+
 		len -= hdr->nlmsg_len;
 		buf += hdr->nlmsg_len;
 	}
@@ -1531,81 +1660,220 @@ static int send_getroute(void)
 	return queue_request(hdr);
 }
 
-static gboolean update_timeout_cb(gpointer user_data)
+static int send_getlink_index(int index)
 {
-	__connman_rtnl_request_update();
+	struct nlmsghdr *hdr;
+	struct ifinfomsg *msg;
 
-	return TRUE;
+	DBG("index %d", index);
+
+	hdr = g_malloc0(NLMSG_LENGTH(sizeof(*msg)));
+
+	hdr->nlmsg_len = NLMSG_LENGTH(sizeof(*msg));
+	hdr->nlmsg_type = RTM_GETLINK;
+	hdr->nlmsg_flags = NLM_F_REQUEST;
+	hdr->nlmsg_pid = 0;
+	hdr->nlmsg_seq = request_seq++;
+
+	msg = (struct ifinfomsg *) NLMSG_DATA(hdr);
+	msg->ifi_family = AF_UNSPEC;
+	msg->ifi_index = index;
+
+	return queue_request(hdr);
 }
 
-static void update_interval_callback(guint min)
+static int send_getstats(int index)
 {
-	if (update_timeout > 0)
+	struct nlmsghdr *hdr;
+	struct if_stats_msg *msg;
+
+	if (getstats_unsupported)
+		return send_getlink_index(index);
+
+	DBG("index %d", index);
+
+	hdr = g_malloc0(NLMSG_LENGTH(sizeof(*msg)));
+
+	hdr->nlmsg_len = NLMSG_LENGTH(sizeof(*msg));
+	hdr->nlmsg_type = RTM_GETSTATS;
+	hdr->nlmsg_flags = NLM_F_REQUEST;
+	hdr->nlmsg_pid = 0;
+	hdr->nlmsg_seq = request_seq++;
+
+	msg = (struct if_stats_msg *) NLMSG_DATA(hdr);
+	msg->family = AF_UNSPEC;
+	msg->ifindex = index;
+	msg->filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+	return queue_request(hdr);
+}
+
+static bool stats_request_pending(int index)
+{
+	GSList *list;
+
+	for (list = request_list; list; list = list->next) {
+		struct nlmsghdr *hdr = list->data;
+
+		if (hdr->nlmsg_flags & NLM_F_DUMP)
+			continue;
+
+		if (hdr->nlmsg_type == RTM_GETSTATS) {
+			struct if_stats_msg *msg = NLMSG_DATA(hdr);
+
+			if (msg->ifindex == (unsigned int) index)
+				return true;
+		} else if (hdr->nlmsg_type == RTM_GETLINK) {
+			struct ifinfomsg *msg = NLMSG_DATA(hdr);
+
+			if (msg->ifi_index == index)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+int __connman_rtnl_request_stats(int index)
+{
+	if (index < 0)
+		return -EINVAL;
+
+	if (stats_request_pending(index))
+		return -EALREADY;
+
+	return send_getstats(index);
+}
+
+static gboolean update_timeout_cb(gpointer user_data);
+
+static void update_schedule(void)
+{
+	gint64 now, due = G_MAXINT64;
+	GSList *list;
+
+	if (update_timeout > 0) {
 		g_source_remove(update_timeout);
+		update_timeout = 0;
+	}
+
+	for (list = update_list; list; list = list->next) {
+		struct update_data *update = list->data;
 
-	if (min < G_MAXUINT) {
-		update_interval = min;
-		update_timeout = g_timeout_add_seconds(update_interval,
+		if (update->due < due)
+			due = update->due;
+	}
+
+	if (due == G_MAXINT64)
+		return;
+
+	now = g_get_monotonic_time();
+	if (due < now)
+		due = now;
+
+	update_timeout = g_timeout_add((due - now + 999) / 1000,
 						update_timeout_cb, NULL);
-	} else {
-		update_timeout = 0;
-		update_interval = G_MAXUINT;
+}
+
+static gboolean update_timeout_cb(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+	GSList *list;
+
+	update_timeout = 0;
+
+	for (list = update_list; list; list = list->next) {
+		struct update_data *update = list->data;
+		gint64 period = (gint64) update->interval * G_USEC_PER_SEC;
+
+		if (update->due > now + UPDATE_SLACK)
+			continue;
+
+		update->due += period;
+		if (update->due <= now)
+			update->due = now + period;
 	}
+
+	__connman_rtnl_request_update();
+
+	update_schedule();
+
+	return FALSE;
 }
 
-static gint compare_interval(gconstpointer a, gconstpointer b)
+static unsigned int update_min_interval(void)
 {
-	guint val_a = GPOINTER_TO_UINT(a);
-	guint val_b = GPOINTER_TO_UINT(b);
+	unsigned int min = G_MAXUINT;
+	GSList *list;
+
+	for (list = update_list; list; list = list->next) {
+		struct update_data *update = list->data;
+
+		if (update->interval < min)
+			min = update->interval;
+	}
 
-	return val_a - val_b;
+	return min;
 }
 
 unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
 {
-	guint min;
+	struct update_data *update;
 
 	if (interval == 0)
 		return 0;
 
-	update_list = g_slist_insert_sorted(update_list,
-			GUINT_TO_POINTER(interval), compare_interval);
+	update = g_new0(struct update_data, 1);
+	update->interval = interval;
+	update->due = g_get_monotonic_time() +
+				(gint64) interval * G_USEC_PER_SEC;
 
-	min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
-	if (min < update_interval) {
-		update_interval_callback(min);
-		__connman_rtnl_request_update();
-	}
+	update_list = g_slist_prepend(update_list, update);
+
+	/* give the new counter its initial values right away */
+	__connman_rtnl_request_update();
+
+	update_schedule();
 
-	return update_interval;
+	return update_min_interval();
 }
 
 unsigned int __connman_rtnl_update_interval_remove(unsigned int interval)
 {
-	guint min = G_MAXUINT;
+	GSList *list;
 
 	if (interval == 0)
 		return 0;
 
-	update_list = g_slist_remove(update_list, GINT_TO_POINTER(interval));
+	for (list = update_list; list; list = list->next) {
+		struct update_data *update = list->data;
+
+		if (update->interval != interval)
+			continue;
 
-	if (update_list)
-		min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
+		update_list = g_slist_delete_link(update_list, list);
+		g_free(update);
+		break;
+	}
 
-	if (min > update_interval)
-		update_interval_callback(min);
+	update_schedule();
 
-	return min;
+	return update_min_interval();
 }
 
+/*
+ * Only the interfaces of services ConnMan accounts for are polled, see
+ * __connman_ipconfig_request_stats(), instead of dumping every link.
+ */
 int __connman_rtnl_request_update(void)
 {
-	return send_getlink();
+	return __connman_ipconfig_request_stats();
 }
 
 int __connman_rtnl_init(void)
 {
 	struct sockaddr_nl addr;
+	socklen_t addr_len;
 	int sk;
 
 	DBG("");
@@ -1628,6 +1896,10 @@ int __connman_rtnl_init(void)
 		return -1;
 	}
 
+	addr_len = sizeof(addr);
+	if (getsockname(sk, (struct sockaddr *) &addr, &addr_len) == 0)
+		rtnl_portid = addr.nl_pid;
+
 	channel = g_io_channel_unix_new(sk);
 	g_io_channel_set_close_on_unref(channel, TRUE);
 
@@ -1668,7 +1940,12 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(watch_list);
 	watch_list = NULL;
 
-	g_slist_free(update_list);
+	if (update_timeout > 0) {
+		g_source_remove(update_timeout);
+		update_timeout = 0;
+	}
+
+	g_slist_free_full(update_list, g_free);
 	update_list = NULL;
 
 	for (list = request_list; list; list = list->next) {
@@ -49,6 +49,7 @@ static DBusConnection *connection = NULL;
 
 static GList *service_list = NULL;
 static GHashTable *service_hash = NULL;
+static GHashTable *index_hash = NULL;
 static GHashTable *passphrase_requested = NULL;
 static GSList *counter_list = NULL;
 static unsigned int autoconnect_id = 0;
@@ -69,6 +70,8 @@ struct connman_stats {
 
 struct connman_stats_counter {
 	bool append_all;
+	bool pending;
+	gint64 last_usage;
 	struct connman_stats stats;
 	struct connman_stats stats_roaming;
 };
@@ -106,6 +109,8 @@ struct connman_service {
 	char **domains;
 	bool mdns;
 	bool mdns_config;
+	bool dns_over_tls;
+	bool dns_over_tls_config;
 	char *hostname;
 	char *domainname;
 	char **timeservers;
@@ -146,9 +151,21 @@ struct connman_service {
 	bool hidden_service;
 	char *config_file;
 	char *config_entry;
+	DBusMessage *properties;
 };
 
 static bool allow_property_changed(struct connman_service *service);
+static void service_flush_changed(void);
+
+/*
+ * Clients registered through RegisterServicesDelta get a
+ * ServicesChangedDelta signal with only the services which moved or
+ * were added, together with their new positions, instead of the whole
+ * list. services_sent holds the paths in the order these clients saw
+ * last.
+ */
+static GHashTable *delta_listeners;
+static GPtrArray *services_sent;
 
 static struct connman_ipconfig *create_ip4config(struct connman_service *service,
 		int index, enum connman_ipconfig_method method);
@@ -157,33 +174,41 @@ static struct connman_ipconfig *create_ip6config(struct connman_service *service
 static void dns_changed(struct connman_service *service);
 static void vpn_auto_connect(void);
 static void trigger_autoconnect(struct connman_service *service);
+static int set_dns_over_tls(struct connman_service *service,
+			bool enabled);
+static void service_list_reposition(struct connman_service *service);
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
-};
-
-static void compare_path(gpointer value, gpointer user_data)
+/*
+ * Drops the serialized properties of the service, every change of a
+ * property appended by append_service_properties() has to call this.
+ */
+static void properties_changed(struct connman_service *service)
 {
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
-
-	if (data->service)
+	if (!service->properties)
 		return;
 
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
+	dbus_message_unref(service->properties);
+	service->properties = NULL;
 }
 
+#define SERVICE_PATH_PREFIX CONNMAN_PATH "/service/"
+
 static struct connman_service *find_service(const char *path)
 {
-	struct find_data data = { .path = path, .service = NULL };
+	struct connman_service *service;
 
 	DBG("path %s", path);
 
-	g_list_foreach(service_list, compare_path, &data);
+	/* the object path is made of the identifier, see service_register() */
+	if (!path || !g_str_has_prefix(path, SERVICE_PATH_PREFIX))
+		return NULL;
+
+	service = g_hash_table_lookup(service_hash,
+				path + strlen(SERVICE_PATH_PREFIX));
+	if (!service || g_strcmp0(service->path, path) != 0)
+		return NULL;
 
-	return data.service;
+	return service;
 }
 
 static const char *reason2string(enum connman_service_connect_reason reason)
@@ -406,6 +431,9 @@ void __connman_service_set_split_routing(struct connman_service *service,
 	else
 		service->order = 10;
 
+	/* the order is part of the sort key */
+	service_list_reposition(service);
+
 	/*
 	 * In order to make sure the value is propagated also when loading the
 	 * VPN service signal the value regardless of the value change.
@@ -646,6 +674,9 @@ static int service_load(struct connman_service *service)
 	service->mdns_config = g_key_file_get_boolean(keyfile,
 				service->identifier, "mDNS", NULL);
 
+	service->dns_over_tls_config = g_key_file_get_boolean(keyfile,
+				service->identifier, "DNSOverTLS", NULL);
+
 	service->hidden_service = g_key_file_get_boolean(keyfile,
 					service->identifier, "Hidden", NULL);
 
@@ -814,6 +845,10 @@ static int service_save(struct connman_service *service)
 		g_key_file_set_boolean(keyfile, service->identifier,
 				"mDNS", TRUE);
 
+	if (service->dns_over_tls_config)
+		g_key_file_set_boolean(keyfile, service->identifier,
+				"DNSOverTLS", TRUE);
+
 	if (service->hidden_service)
 		g_key_file_set_boolean(keyfile, service->identifier,
 				"Hidden", TRUE);
@@ -1092,6 +1127,17 @@ static int nameserver_add(struct connman_service *service,
 	if (index < 0)
 		return -ENXIO;
 
+	/*
+	 * The nameservers are in use as soon as they are added, during
+	 * configuration already, so DNS-over-TLS has to be on before that
+	 * or the first queries would leak in plain text.
+	 */
+	if (service->dns_over_tls_config && !service->dns_over_tls) {
+		ret = set_dns_over_tls(service, true);
+		if (ret < 0)
+			return ret;
+	}
+
 	ret = connman_resolver_append(index, NULL, nameserver);
 	if (ret >= 0)
 		nameservers_changed(service);
@@ -1290,6 +1336,8 @@ set_servers:
 				nameserver);
 	}
 
+	properties_changed(service);
+
 	return 0;
 }
 
@@ -1299,6 +1347,7 @@ void __connman_service_nameserver_clear(struct connman_service *service)
 
 	g_strfreev(service->nameservers);
 	service->nameservers = NULL;
+	properties_changed(service);
 
 	nameserver_add_all(service, CONNMAN_IPCONFIG_TYPE_ALL);
 }
@@ -1431,6 +1480,7 @@ static bool check_proxy_setup(struct connman_service *service)
 
 	if (__connman_wpad_start(service) < 0) {
 		service->proxy = CONNMAN_SERVICE_PROXY_METHOD_DIRECT;
+		properties_changed(service);
 		__connman_notifier_proxy_changed(service);
 		return true;
 	}
@@ -1665,6 +1715,8 @@ static void state_changed(struct connman_service *service)
 {
 	const char *str;
 
+	properties_changed(service);
+
 	__connman_notifier_service_state_changed(service, service->state);
 
 	str = state2string(service->state);
@@ -1681,6 +1733,8 @@ static void state_changed(struct connman_service *service)
 
 static void strength_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (service->strength == 0)
 		return;
 
@@ -1696,6 +1750,8 @@ static void favorite_changed(struct connman_service *service)
 {
 	dbus_bool_t favorite;
 
+	properties_changed(service);
+
 	if (!service->path)
 		return;
 
@@ -1712,6 +1768,8 @@ static void immutable_changed(struct connman_service *service)
 {
 	dbus_bool_t immutable;
 
+	properties_changed(service);
+
 	if (!service->path)
 		return;
 
@@ -1728,6 +1786,8 @@ static void roaming_changed(struct connman_service *service)
 {
 	dbus_bool_t roaming;
 
+	properties_changed(service);
+
 	if (!service->path)
 		return;
 
@@ -1744,6 +1804,8 @@ static void autoconnect_changed(struct connman_service *service)
 {
 	dbus_bool_t autoconnect;
 
+	properties_changed(service);
+
 	if (!service->path)
 		return;
 
@@ -1811,6 +1873,8 @@ static void append_security(DBusMessageIter *iter, void *user_data)
 
 static void security_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!service->path)
 		return;
 
@@ -2126,6 +2190,8 @@ static void settings_changed(struct connman_service *service,
 {
 	enum connman_ipconfig_type type;
 
+	properties_changed(service);
+
 	type = __connman_ipconfig_get_config_type(ipconfig);
 
 	__connman_notifier_ipconfig_changed(service, ipconfig);
@@ -2145,6 +2211,8 @@ static void settings_changed(struct connman_service *service,
 
 static void ipv4_configuration_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2166,6 +2234,8 @@ void __connman_service_notify_ipv4_configuration(
 
 static void ipv6_configuration_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2178,6 +2248,8 @@ static void ipv6_configuration_changed(struct connman_service *service)
 
 static void dns_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2188,6 +2260,8 @@ static void dns_changed(struct connman_service *service)
 
 static void dns_configuration_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2201,6 +2275,8 @@ static void dns_configuration_changed(struct connman_service *service)
 
 static void domain_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2211,6 +2287,8 @@ static void domain_changed(struct connman_service *service)
 
 static void domain_configuration_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2222,6 +2300,8 @@ static void domain_configuration_changed(struct connman_service *service)
 
 static void proxy_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2232,6 +2312,8 @@ static void proxy_changed(struct connman_service *service)
 
 static void proxy_configuration_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2246,6 +2328,8 @@ static void mdns_changed(struct connman_service *service)
 {
 	dbus_bool_t mdns = service->mdns;
 
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2258,6 +2342,8 @@ static void mdns_configuration_changed(struct connman_service *service)
 {
 	dbus_bool_t mdns_config = service->mdns_config;
 
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2284,8 +2370,57 @@ static int set_mdns(struct connman_service *service,
 	return result;
 }
 
+static void dns_over_tls_changed(struct connman_service *service)
+{
+	dbus_bool_t dns_over_tls = service->dns_over_tls;
+
+	properties_changed(service);
+
+	if (!allow_property_changed(service))
+		return;
+
+	connman_dbus_property_changed_basic(service->path,
+			CONNMAN_SERVICE_INTERFACE, "DNSOverTLS",
+			DBUS_TYPE_BOOLEAN, &dns_over_tls);
+}
+
+static void dns_over_tls_configuration_changed(
+					struct connman_service *service)
+{
+	dbus_bool_t dns_over_tls_config = service->dns_over_tls_config;
+
+	properties_changed(service);
+
+	if (!allow_property_changed(service))
+		return;
+
+	connman_dbus_property_changed_basic(service->path,
+			CONNMAN_SERVICE_INTERFACE, "DNSOverTLS.Configuration",
+			DBUS_TYPE_BOOLEAN, &dns_over_tls_config);
+}
+
+static int set_dns_over_tls(struct connman_service *service,
+			bool enabled)
+{
+	int result;
+
+	result = __connman_resolver_set_dns_over_tls(
+			__connman_service_get_index(service), enabled);
+
+	if (result == 0) {
+		if (service->dns_over_tls != enabled) {
+			service->dns_over_tls = enabled;
+			dns_over_tls_changed(service);
+		}
+	}
+
+	return result;
+}
+
 static void timeservers_configuration_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2298,6 +2433,8 @@ static void timeservers_configuration_changed(struct connman_service *service)
 
 static void link_changed(struct connman_service *service)
 {
+	properties_changed(service);
+
 	if (!allow_property_changed(service))
 		return;
 
@@ -2314,49 +2451,49 @@ static void stats_append_counters(DBusMessageIter *dict,
 	if (counters->rx_packets != stats->rx_packets || append_all) {
 		counters->rx_packets = stats->rx_packets;
 		connman_dbus_dict_append_basic(dict, "RX.Packets",
-					DBUS_TYPE_UINT32, &stats->rx_packets);
+					DBUS_TYPE_UINT64, &stats->rx_packets);
 	}
 
 	if (counters->tx_packets != stats->tx_packets || append_all) {
 		counters->tx_packets = stats->tx_packets;
 		connman_dbus_dict_append_basic(dict, "TX.Packets",
-					DBUS_TYPE_UINT32, &stats->tx_packets);
+					DBUS_TYPE_UINT64, &stats->tx_packets);
 	}
 
 	if (counters->rx_bytes != stats->rx_bytes || append_all) {
 		counters->rx_bytes = stats->rx_bytes;
 		connman_dbus_dict_append_basic(dict, "RX.Bytes",
-					DBUS_TYPE_UINT32, &stats->rx_bytes);
+					DBUS_TYPE_UINT64, &stats->rx_bytes);
 	}
 
 	if (counters->tx_bytes != stats->tx_bytes || append_all) {
 		counters->tx_bytes = stats->tx_bytes;
 		connman_dbus_dict_append_basic(dict, "TX.Bytes",
-					DBUS_TYPE_UINT32, &stats->tx_bytes);
+					DBUS_TYPE_UINT64, &stats->tx_bytes);
 	}
 
 	if (counters->rx_errors != stats->rx_errors || append_all) {
 		counters->rx_errors = stats->rx_errors;
 		connman_dbus_dict_append_basic(dict, "RX.Errors",
-					DBUS_TYPE_UINT32, &stats->rx_errors);
+					DBUS_TYPE_UINT64, &stats->rx_errors);
 	}
 
 	if (counters->tx_errors != stats->tx_errors || append_all) {
 		counters->tx_errors = stats->tx_errors;
 		connman_dbus_dict_append_basic(dict, "TX.Errors",
-					DBUS_TYPE_UINT32, &stats->tx_errors);
+					DBUS_TYPE_UINT64, &stats->tx_errors);
 	}
 
 	if (counters->rx_dropped != stats->rx_dropped || append_all) {
 		counters->rx_dropped = stats->rx_dropped;
 		connman_dbus_dict_append_basic(dict, "RX.Dropped",
-					DBUS_TYPE_UINT32, &stats->rx_dropped);
+					DBUS_TYPE_UINT64, &stats->rx_dropped);
 	}
 
 	if (counters->tx_dropped != stats->tx_dropped || append_all) {
 		counters->tx_dropped = stats->tx_dropped;
 		connman_dbus_dict_append_basic(dict, "TX.Dropped",
-					DBUS_TYPE_UINT32, &stats->tx_dropped);
+					DBUS_TYPE_UINT64, &stats->tx_dropped);
 	}
 
 	if (counters->time != stats->time || append_all) {
@@ -2404,11 +2541,24 @@ static void stats_append(struct connman_service *service,
 	__connman_counter_send_usage(counter, msg);
 }
 
+/*
+ * The 32-bit link statistics of old kernels wrap around, the difference
+ * to the last sample is then only valid modulo 2^32.
+ */
+static uint64_t stats_delta(uint64_t value, uint64_t last, bool stats32)
+{
+	if (stats32)
+		return (uint32_t)(value - last);
+
+	return value - last;
+}
+
 static void stats_update(struct connman_service *service,
-				unsigned int rx_packets, unsigned int tx_packets,
-				unsigned int rx_bytes, unsigned int tx_bytes,
-				unsigned int rx_errors, unsigned int tx_errors,
-				unsigned int rx_dropped, unsigned int tx_dropped)
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped,
+				bool stats32)
 {
 	struct connman_stats *stats = stats_get(service);
 	struct connman_stats_data *data_last = &stats->data_last;
@@ -2418,22 +2568,22 @@ static void stats_update(struct connman_service *service,
 	DBG("service %p", service);
 
 	if (stats->valid) {
-		data->rx_packets +=
-			rx_packets - data_last->rx_packets;
-		data->tx_packets +=
-			tx_packets - data_last->tx_packets;
-		data->rx_bytes +=
-			rx_bytes - data_last->rx_bytes;
-		data->tx_bytes +=
-			tx_bytes - data_last->tx_bytes;
-		data->rx_errors +=
-			rx_errors - data_last->rx_errors;
-		data->tx_errors +=
-			tx_errors - data_last->tx_errors;
-		data->rx_dropped +=
-			rx_dropped - data_last->rx_dropped;
-		data->tx_dropped +=
-			tx_dropped - data_last->tx_dropped;
+		data->rx_packets += stats_delta(rx_packets,
+					data_last->rx_packets, stats32);
+		data->tx_packets += stats_delta(tx_packets,
+					data_last->tx_packets, stats32);
+		data->rx_bytes += stats_delta(rx_bytes,
+					data_last->rx_bytes, stats32);
+		data->tx_bytes += stats_delta(tx_bytes,
+					data_last->tx_bytes, stats32);
+		data->rx_errors += stats_delta(rx_errors,
+					data_last->rx_errors, stats32);
+		data->tx_errors += stats_delta(tx_errors,
+					data_last->tx_errors, stats32);
+		data->rx_dropped += stats_delta(rx_dropped,
+					data_last->rx_dropped, stats32);
+		data->tx_dropped += stats_delta(tx_dropped,
+					data_last->tx_dropped, stats32);
 	} else {
 		stats->valid = true;
 	}
@@ -2452,16 +2602,19 @@ static void stats_update(struct connman_service *service,
 }
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_errors, unsigned int tx_errors,
-			unsigned int rx_dropped, unsigned int tx_dropped)
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped,
+			bool stats32)
 {
 	GHashTableIter iter;
 	gpointer key, value;
 	const char *counter;
 	struct connman_stats_counter *counters;
-	struct connman_stats_data *data;
+	struct connman_stats_data *data, *last;
+	unsigned int interval;
+	gint64 now;
 	int err;
 
 	if (!service)
@@ -2474,7 +2627,7 @@ void __connman_service_notify(struct connman_service *service,
 		rx_packets, tx_packets,
 		rx_bytes, tx_bytes,
 		rx_errors, tx_errors,
-		rx_dropped, tx_dropped);
+		rx_dropped, tx_dropped, stats32);
 
 	data = &stats_get(service)->data;
 	err = __connman_stats_update(service, service->roaming, data);
@@ -2482,16 +2635,86 @@ void __connman_service_notify(struct connman_service *service,
 		connman_error("Failed to store statistics for %s",
 				service->identifier);
 
+	now = g_get_monotonic_time();
+
 	g_hash_table_iter_init(&iter, service->counter_table);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
 		counter = key;
 		counters = value;
 
+		/*
+		 * A poll due for one counter updates the statistics for
+		 * all of them, but every counter is only notified at its
+		 * own period.
+		 */
+		interval = __connman_counter_get_interval(counter);
+		if (!counters->append_all && interval > 0 &&
+				now - counters->last_usage <
+					(gint64) interval * G_USEC_PER_SEC -
+					G_USEC_PER_SEC / 2)
+			continue;
+
+		last = service->roaming ? &counters->stats_roaming.data :
+						&counters->stats.data;
+
+		if (!counters->append_all &&
+				!__connman_counter_threshold_reached(counter,
+					data->rx_bytes + data->tx_bytes -
+					last->rx_bytes - last->tx_bytes,
+					data->rx_packets + data->tx_packets -
+					last->rx_packets - last->tx_packets))
+			continue;
+
+		counters->last_usage = now;
+
+		if (__connman_counter_is_batched(counter)) {
+			counters->pending = true;
+			__connman_counter_usage_pending(counter);
+			continue;
+		}
+
 		stats_append(service, counter, counters, counters->append_all);
 		counters->append_all = false;
 	}
 }
 
+void __connman_service_counter_append_usage(const char *counter,
+						DBusMessageIter *iter)
+{
+	struct connman_stats_counter *counters;
+	DBusMessageIter entry, dict;
+	GList *list;
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		counters = g_hash_table_lookup(service->counter_table, counter);
+		if (!counters || !counters->pending)
+			continue;
+
+		dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+							&service->path);
+
+		connman_dbus_dict_open(&entry, &dict);
+		stats_append_counters(&dict, &service->stats.data,
+				&counters->stats.data, counters->append_all);
+		connman_dbus_dict_close(&entry, &dict);
+
+		connman_dbus_dict_open(&entry, &dict);
+		stats_append_counters(&dict, &service->stats_roaming.data,
+				&counters->stats_roaming.data,
+				counters->append_all);
+		connman_dbus_dict_close(&entry, &dict);
+
+		dbus_message_iter_close_container(iter, &entry);
+
+		counters->pending = false;
+		counters->append_all = false;
+	}
+}
+
 int __connman_service_counter_register(const char *counter)
 {
 	struct connman_service *service;
@@ -2546,12 +2769,11 @@ int connman_service_iterate_services(connman_service_iterate_cb cb,
 	return ret;
 }
 
-static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
+static void append_service_properties(DBusMessageIter *dict,
 					struct connman_service *service)
 {
 	dbus_bool_t val;
 	const char *str;
-	GSList *list;
 
 	str = __connman_service_type2string(service->type);
 	if (str)
@@ -2595,28 +2817,10 @@ static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
 		connman_dbus_dict_append_basic(dict, "Name",
 					DBUS_TYPE_STRING, &service->name);
 
-	switch (service->type) {
-	case CONNMAN_SERVICE_TYPE_UNKNOWN:
-	case CONNMAN_SERVICE_TYPE_SYSTEM:
-	case CONNMAN_SERVICE_TYPE_GPS:
-	case CONNMAN_SERVICE_TYPE_P2P:
-		break;
-	case CONNMAN_SERVICE_TYPE_CELLULAR:
+	if (service->type == CONNMAN_SERVICE_TYPE_CELLULAR) {
 		val = service->roaming;
 		connman_dbus_dict_append_basic(dict, "Roaming",
 					DBUS_TYPE_BOOLEAN, &val);
-
-		connman_dbus_dict_append_dict(dict, "Ethernet",
-						append_ethernet, service);
-		break;
-	case CONNMAN_SERVICE_TYPE_VPN:
-	case CONNMAN_SERVICE_TYPE_WIFI:
-	case CONNMAN_SERVICE_TYPE_ETHERNET:
-	case CONNMAN_SERVICE_TYPE_BLUETOOTH:
-	case CONNMAN_SERVICE_TYPE_GADGET:
-		connman_dbus_dict_append_dict(dict, "Ethernet",
-						append_ethernet, service);
-		break;
 	}
 
 	connman_dbus_dict_append_dict(dict, "IPv4", append_ipv4, service);
@@ -2635,17 +2839,6 @@ static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
 	connman_dbus_dict_append_array(dict, "Nameservers.Configuration",
 				DBUS_TYPE_STRING, append_dnsconfig, service);
 
-	if (service->state == CONNMAN_SERVICE_STATE_READY ||
-			service->state == CONNMAN_SERVICE_STATE_ONLINE)
-		list = __connman_timeserver_get_all(service);
-	else
-		list = NULL;
-
-	connman_dbus_dict_append_array(dict, "Timeservers",
-				DBUS_TYPE_STRING, append_ts, list);
-
-	g_slist_free_full(list, g_free);
-
 	connman_dbus_dict_append_array(dict, "Timeservers.Configuration",
 				DBUS_TYPE_STRING, append_tsconfig, service);
 
@@ -2668,9 +2861,94 @@ static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
 	connman_dbus_dict_append_basic(dict, "mDNS.Configuration",
 				DBUS_TYPE_BOOLEAN, &val);
 
+	val = service->dns_over_tls;
+	connman_dbus_dict_append_basic(dict, "DNSOverTLS",
+				DBUS_TYPE_BOOLEAN, &val);
+
+	val = service->dns_over_tls_config;
+	connman_dbus_dict_append_basic(dict, "DNSOverTLS.Configuration",
+				DBUS_TYPE_BOOLEAN, &val);
+}
+
+static DBusMessage *serialize_properties(struct connman_service *service)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter, dict;
+
+	msg = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!msg)
+		return NULL;
+
+	dbus_message_iter_init_append(msg, &iter);
+
+	connman_dbus_dict_open(&iter, &dict);
+	append_service_properties(&dict, service);
+	connman_dbus_dict_close(&iter, &dict);
+
+	return msg;
+}
+
+/*
+ * The properties kept by the service itself are serialized once and
+ * the result is copied into every GetServices, GetProperties and
+ * ServicesChanged message until properties_changed() drops it. The
+ * interface data, the timeservers, the provider and the address
+ * conflict data are owned by other modules and always appended fresh.
+ */
+static void append_properties(DBusMessageIter *dict, dbus_bool_t limited,
+					struct connman_service *service)
+{
+	DBusMessageIter iter, array;
+	GSList *list;
+
+	if (!service->properties)
+		service->properties = serialize_properties(service);
+
+	if (service->properties) {
+		dbus_message_iter_init(service->properties, &iter);
+		dbus_message_iter_recurse(&iter, &array);
+
+		while (dbus_message_iter_get_arg_type(&array) ==
+							DBUS_TYPE_DICT_ENTRY) {
+			__connman_dbus_append_iter(dict, &array);
+			dbus_message_iter_next(&array);
+		}
+	} else {
+		append_service_properties(dict, service);
+	}
+
+	if (service->state == CONNMAN_SERVICE_STATE_READY ||
+			service->state == CONNMAN_SERVICE_STATE_ONLINE)
+		list = __connman_timeserver_get_all(service);
+	else
+		list = NULL;
+
+	connman_dbus_dict_append_array(dict, "Timeservers",
+				DBUS_TYPE_STRING, append_ts, list);
+
+	g_slist_free_full(list, g_free);
+
 	connman_dbus_dict_append_dict(dict, "Provider",
 						append_provider, service);
 
+	switch (service->type) {
+	case CONNMAN_SERVICE_TYPE_UNKNOWN:
+	case CONNMAN_SERVICE_TYPE_SYSTEM:
+	case CONNMAN_SERVICE_TYPE_GPS:
+	case CONNMAN_SERVICE_TYPE_P2P:
+		break;
+	case CONNMAN_SERVICE_TYPE_CELLULAR:
+	case CONNMAN_SERVICE_TYPE_VPN:
+	case CONNMAN_SERVICE_TYPE_WIFI:
+	case CONNMAN_SERVICE_TYPE_ETHERNET:
+	case CONNMAN_SERVICE_TYPE_BLUETOOTH:
+	case CONNMAN_SERVICE_TYPE_GADGET:
+		/* the MTU and the interface name change behind our back */
+		connman_dbus_dict_append_dict(dict, "Ethernet",
+						append_ethernet, service);
+		break;
+	}
+
 	if (service->network)
 		connman_network_append_acddbus(dict, service->network);
 }
@@ -2714,6 +2992,10 @@ static void append_struct(gpointer value, gpointer user_data)
 
 void __connman_service_list_struct(DBusMessageIter *iter)
 {
+	/* delta listeners apply their signals to the list returned here */
+	if (services_sent)
+		service_flush_changed();
+
 	g_list_foreach(service_list, append_struct, iter);
 }
 
@@ -2924,6 +3206,7 @@ void __connman_service_set_proxy_autoconfig(struct connman_service *service,
 		return;
 
 	service->proxy = CONNMAN_SERVICE_PROXY_METHOD_AUTO;
+	properties_changed(service);
 
 	if (service->ipconfig_ipv4) {
 		if (__connman_ipconfig_set_proxy_autoconfig(
@@ -3874,6 +4157,23 @@ static DBusMessage *set_property(DBusConnection *conn,
 
 		set_mdns(service, service->mdns_config);
 
+		service_save(service);
+	} else if (g_str_equal(name, "DNSOverTLS.Configuration")) {
+		dbus_bool_t val;
+
+		if (service->immutable)
+			return __connman_error_not_supported(msg);
+
+		if (type != DBUS_TYPE_BOOLEAN)
+			return __connman_error_invalid_arguments(msg);
+
+		dbus_message_iter_get_basic(&value, &val);
+		service->dns_over_tls_config = val;
+
+		dns_over_tls_configuration_changed(service);
+
+		set_dns_over_tls(service, service->dns_over_tls_config);
+
 		service_save(service);
 	} else if (g_str_equal(name, "IPv4.Configuration") ||
 			g_str_equal(name, "IPv6.Configuration")) {
@@ -3946,6 +4246,7 @@ static void set_error(struct connman_service *service,
 		return;
 
 	service->error = error;
+	properties_changed(service);
 
 	if (!service->path)
 		return;
@@ -4672,6 +4973,7 @@ bool __connman_service_remove(struct connman_service *service)
 	service->eap = NULL;
 
 	service->error = CONNMAN_SERVICE_ERROR_UNKNOWN;
+	properties_changed(service);
 
 	__connman_service_set_favorite(service, false);
 
@@ -4811,6 +5113,211 @@ static void service_append_removed(DBusMessageIter *iter, void *user_data)
 	g_hash_table_foreach(services_notify->remove, append_removed, iter);
 }
 
+static void snapshot_services(void)
+{
+	GList *list;
+
+	if (services_sent)
+		g_ptr_array_free(services_sent, TRUE);
+
+	services_sent = g_ptr_array_new_with_free_func(g_free);
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		if (service->path)
+			g_ptr_array_add(services_sent, g_strdup(service->path));
+	}
+}
+
+/*
+ * Marks the longest run of services which kept their relative order,
+ * so that only the others need to be reported as moved. Entries with
+ * a negative old position are new and never part of the run.
+ */
+static void mark_unmoved(const int *old_pos, unsigned int len, bool *unmoved)
+{
+	int *tails, *prev;
+	int runs = 0, lo, hi, mid, i;
+
+	tails = g_new(int, len + 1);
+	prev = g_new(int, len + 1);
+
+	for (i = 0; i < (int) len; i++) {
+		if (old_pos[i] < 0)
+			continue;
+
+		lo = 0;
+		hi = runs;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (old_pos[tails[mid]] < old_pos[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		prev[i] = lo > 0 ? tails[lo - 1] : -1;
+		tails[lo] = i;
+		if (lo == runs)
+			runs++;
+	}
+
+	for (i = runs ? tails[runs - 1] : -1; i >= 0; i = prev[i])
+		unmoved[i] = true;
+
+	g_free(tails);
+	g_free(prev);
+}
+
+static void append_delta_entry(DBusMessageIter *array,
+				struct connman_service *service,
+				dbus_uint32_t position, bool added)
+{
+	DBusMessageIter entry, dict;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL,
+								&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+							&service->path);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &position);
+
+	connman_dbus_dict_open(&entry, &dict);
+	if (added)
+		append_properties(&dict, TRUE, service);
+	connman_dbus_dict_close(&entry, &dict);
+
+	dbus_message_iter_close_container(array, &entry);
+}
+
+static DBusMessage *create_services_delta(void)
+{
+	DBusMessage *signal = NULL;
+	DBusMessageIter iter, array;
+	GHashTableIter removed;
+	GHashTable *sent;
+	GPtrArray *current;
+	gpointer key, value;
+	bool *unmoved;
+	int *old_pos;
+	unsigned int i, changes;
+	GList *list;
+
+	/* path of every service the listeners know about to its position */
+	sent = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < services_sent->len; i++)
+		g_hash_table_insert(sent, g_ptr_array_index(services_sent, i),
+						GUINT_TO_POINTER(i + 1));
+
+	current = g_ptr_array_new();
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		if (service->path)
+			g_ptr_array_add(current, service);
+	}
+
+	old_pos = g_new(int, current->len + 1);
+	unmoved = g_new0(bool, current->len + 1);
+
+	for (i = 0; i < current->len; i++) {
+		struct connman_service *service;
+
+		service = g_ptr_array_index(current, i);
+		value = g_hash_table_lookup(sent, service->path);
+
+		/* a service removed and added again is sent as new */
+		if (value && !g_hash_table_lookup(services_notify->add,
+							service->path))
+			old_pos[i] = GPOINTER_TO_UINT(value) - 1;
+		else
+			old_pos[i] = -1;
+
+		/* whatever is left in sent has been removed */
+		g_hash_table_remove(sent, service->path);
+	}
+
+	mark_unmoved(old_pos, current->len, unmoved);
+
+	changes = g_hash_table_size(sent);
+	for (i = 0; i < current->len; i++) {
+		if (!unmoved[i])
+			changes++;
+	}
+
+	if (!changes)
+		goto out;
+
+	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
+			CONNMAN_MANAGER_INTERFACE, "ServicesChangedDelta");
+	if (!signal)
+		goto out;
+
+	dbus_message_iter_init_append(signal, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_OBJECT_PATH_AS_STRING
+			DBUS_TYPE_UINT32_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					DBUS_TYPE_STRING_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING
+				DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	for (i = 0; i < current->len; i++) {
+		if (unmoved[i])
+			continue;
+
+		append_delta_entry(&array, g_ptr_array_index(current, i), i,
+							old_pos[i] < 0);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+				DBUS_TYPE_OBJECT_PATH_AS_STRING, &array);
+
+	g_hash_table_iter_init(&removed, sent);
+	while (g_hash_table_iter_next(&removed, &key, &value))
+		dbus_message_iter_append_basic(&array, DBUS_TYPE_OBJECT_PATH,
+									&key);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+out:
+	g_free(old_pos);
+	g_free(unmoved);
+	g_ptr_array_free(current, TRUE);
+	g_hash_table_destroy(sent);
+
+	return signal;
+}
+
+static void send_services_delta(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	DBusMessage *signal, *copy;
+
+	signal = create_services_delta();
+	if (!signal)
+		return;
+
+	g_hash_table_iter_init(&iter, delta_listeners);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		copy = dbus_message_copy(signal);
+		if (!copy)
+			continue;
+
+		dbus_message_set_destination(copy, key);
+		dbus_connection_send(connection, copy, NULL);
+		dbus_message_unref(copy);
+	}
+
+	dbus_message_unref(signal);
+}
+
 static gboolean service_send_changed(gpointer data)
 {
 	DBusMessage *signal;
@@ -4819,6 +5326,12 @@ static gboolean service_send_changed(gpointer data)
 
 	services_notify->id = 0;
 
+	/* before the added services are taken off services_notify */
+	if (services_sent) {
+		send_services_delta();
+		snapshot_services();
+	}
+
 	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
 			CONNMAN_MANAGER_INTERFACE, "ServicesChanged");
 	if (!signal)
@@ -4846,6 +5359,68 @@ static void service_schedule_changed(void)
 	services_notify->id = g_timeout_add(100, service_send_changed, NULL);
 }
 
+static void service_flush_changed(void)
+{
+	if (services_notify->id == 0)
+		return;
+
+	g_source_remove(services_notify->id);
+	service_send_changed(NULL);
+}
+
+static void delta_listener_disconnect(DBusConnection *conn, void *user_data)
+{
+	const char *owner = user_data;
+
+	DBG("owner %s", owner);
+
+	g_hash_table_remove(delta_listeners, owner);
+
+	if (g_hash_table_size(delta_listeners) == 0) {
+		g_ptr_array_free(services_sent, TRUE);
+		services_sent = NULL;
+	}
+}
+
+int __connman_service_register_delta(const char *owner)
+{
+	char *key;
+	guint watch;
+
+	DBG("owner %s", owner);
+
+	if (g_hash_table_lookup(delta_listeners, owner))
+		return -EEXIST;
+
+	/* the new listener starts from the current order */
+	service_flush_changed();
+	if (!services_sent)
+		snapshot_services();
+
+	key = g_strdup(owner);
+	watch = g_dbus_add_disconnect_watch(connection, owner,
+					delta_listener_disconnect, key, NULL);
+	g_hash_table_replace(delta_listeners, key, GUINT_TO_POINTER(watch));
+
+	return 0;
+}
+
+int __connman_service_unregister_delta(const char *owner)
+{
+	gpointer watch;
+
+	DBG("owner %s", owner);
+
+	watch = g_hash_table_lookup(delta_listeners, owner);
+	if (!watch)
+		return -ESRCH;
+
+	g_dbus_remove_watch(connection, GPOINTER_TO_UINT(watch));
+	delta_listener_disconnect(connection, (gpointer) owner);
+
+	return 0;
+}
+
 int __connman_service_move(struct connman_service *service,
 				struct connman_service *target, bool before)
 {
@@ -5007,6 +5582,92 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static void append_usage(struct connman_stats_usage *usage,
+						void *user_data)
+{
+	DBusMessageIter *array = user_data;
+	DBusMessageIter dict;
+	uint64_t start = usage->start;
+
+	connman_dbus_dict_open(array, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Start",
+					DBUS_TYPE_UINT64, &start);
+	connman_dbus_dict_append_basic(&dict, "RX.Bytes",
+					DBUS_TYPE_UINT64, &usage->rx_bytes);
+	connman_dbus_dict_append_basic(&dict, "TX.Bytes",
+					DBUS_TYPE_UINT64, &usage->tx_bytes);
+	connman_dbus_dict_append_basic(&dict, "RX.Packets",
+					DBUS_TYPE_UINT64, &usage->rx_packets);
+	connman_dbus_dict_append_basic(&dict, "TX.Packets",
+					DBUS_TYPE_UINT64, &usage->tx_packets);
+	connman_dbus_dict_append_basic(&dict, "Roaming.RX.Bytes",
+				DBUS_TYPE_UINT64, &usage->roaming_rx_bytes);
+	connman_dbus_dict_append_basic(&dict, "Roaming.TX.Bytes",
+				DBUS_TYPE_UINT64, &usage->roaming_tx_bytes);
+	connman_dbus_dict_append_basic(&dict, "Roaming.RX.Packets",
+				DBUS_TYPE_UINT64, &usage->roaming_rx_packets);
+	connman_dbus_dict_append_basic(&dict, "Roaming.TX.Packets",
+				DBUS_TYPE_UINT64, &usage->roaming_tx_packets);
+
+	connman_dbus_dict_close(array, &dict);
+}
+
+static DBusMessage *get_usage(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	enum connman_stats_resolution resolution;
+	DBusMessageIter iter, array;
+	const char *str;
+	dbus_uint64_t start, end;
+	DBusMessage *reply;
+	int err;
+
+	DBG("service %p", service);
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &str,
+					DBUS_TYPE_UINT64, &start,
+					DBUS_TYPE_UINT64, &end,
+					DBUS_TYPE_INVALID))
+		return __connman_error_invalid_arguments(msg);
+
+	if (g_str_equal(str, "hour"))
+		resolution = CONNMAN_STATS_RESOLUTION_HOUR;
+	else if (g_str_equal(str, "day"))
+		resolution = CONNMAN_STATS_RESOLUTION_DAY;
+	else if (g_str_equal(str, "month"))
+		resolution = CONNMAN_STATS_RESOLUTION_MONTH;
+	else
+		return __connman_error_invalid_arguments(msg);
+
+	if (start > G_MAXINT64 || end > G_MAXINT64 || start > end)
+		return __connman_error_invalid_arguments(msg);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &array);
+
+	err = __connman_stats_get_usage(service, resolution, start, end,
+						append_usage, &array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (err < 0) {
+		dbus_message_unref(reply);
+		return __connman_error_failed(msg, -err);
+	}
+
+	return reply;
+}
+
 static void service_schedule_added(struct connman_service *service)
 {
 	DBG("service %p", service);
@@ -5064,6 +5725,11 @@ static const GDBusMethodTable service_methods[] = {
 			GDBUS_ARGS({ "service", "o" }), NULL,
 			move_after) },
 	{ GDBUS_METHOD("ResetCounters", NULL, NULL, reset_counters) },
+	{ GDBUS_METHOD("GetUsage",
+			GDBUS_ARGS({ "resolution", "s" }, { "start", "t" },
+					{ "end", "t" }),
+			GDBUS_ARGS({ "usage", "aa{sv}" }),
+			get_usage) },
 	{ },
 };
 
@@ -5137,6 +5803,9 @@ static void service_free(gpointer user_data)
 	g_strfreev(service->proxies);
 	g_strfreev(service->excludes);
 
+	if (service->properties)
+		dbus_message_unref(service->properties);
+
 	g_free(service->hostname);
 	g_free(service->domainname);
 	g_free(service->pac);
@@ -5279,6 +5948,8 @@ connman_service_ref_debug(struct connman_service *service,
 	return service;
 }
 
+static void index_hash_remove_service(struct connman_service *service);
+
 /**
  * connman_service_unref:
  * @service: service structure
@@ -5296,6 +5967,7 @@ void connman_service_unref_debug(struct connman_service *service,
 		return;
 
 	service_list = g_list_remove(service_list, service);
+	index_hash_remove_service(service);
 
 	__connman_service_disconnect(service);
 
@@ -5471,6 +6143,58 @@ static void service_list_sort(void)
 	}
 }
 
+/*
+ * The place of a connected VPN depends on the state of its transport,
+ * so a change of any other service may move it as well.
+ */
+static bool vpn_order_depends_on(struct connman_service *service)
+{
+	GList *list;
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *temp = list->data;
+
+		if (temp == service)
+			continue;
+
+		/* connected services come first */
+		if (!is_connected(temp->state))
+			break;
+
+		if (temp->type == CONNMAN_SERVICE_TYPE_VPN)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Moves a service whose state, favorite or strength changed to its new
+ * place instead of sorting the whole list again. Only the services it
+ * passes are compared with it, which for a strength change during a
+ * scan are usually few.
+ */
+static void service_list_reposition(struct connman_service *service)
+{
+	GList *node;
+	bool moved;
+
+	if (service->type != CONNMAN_SERVICE_TYPE_VPN &&
+				vpn_order_depends_on(service)) {
+		service_list_sort();
+		return;
+	}
+
+	node = g_list_find(service_list, service);
+	if (!node)
+		return;
+
+	service_list = util_list_reposition(service_list, node,
+						service_compare, &moved);
+	if (moved)
+		service_schedule_changed();
+}
+
 int __connman_service_compare(const struct connman_service *a,
 					const struct connman_service *b)
 {
@@ -5631,7 +6355,7 @@ int __connman_service_set_favorite_delayed(struct connman_service *service,
 
 	if (!delay_ordering) {
 
-		service_list_sort();
+		service_list_reposition(service);
 
 		__connman_connection_update_gateway();
 	}
@@ -5744,6 +6468,7 @@ void __connman_service_set_search_domains(struct connman_service *service,
 		g_strfreev(service->domains);
 
 	service->domains = g_strdupv(domains);
+	properties_changed(service);
 
 	searchdomain_add_all(service);
 }
@@ -5756,6 +6481,14 @@ int __connman_service_set_mdns(struct connman_service *service,
 	return set_mdns(service, enabled);
 }
 
+int __connman_service_set_dns_over_tls(struct connman_service *service,
+			bool enabled)
+{
+	service->dns_over_tls_config = enabled;
+
+	return set_dns_over_tls(service, enabled);
+}
+
 static void report_error_cb(void *user_context, bool retry,
 							void *user_data)
 {
@@ -5770,7 +6503,7 @@ static void report_error_cb(void *user_context, bool retry,
 		__connman_service_clear_error(service);
 
 		service_complete(service);
-		service_list_sort();
+		service_list_reposition(service);
 		__connman_connection_update_gateway();
 	}
 }
@@ -5898,6 +6631,7 @@ static void request_input_cb(struct connman_service *service,
 		/* It is not relevant to stay on Failure state
 		 * when failing is due to wrong user input */
 		service->state = CONNMAN_SERVICE_STATE_IDLE;
+		properties_changed(service);
 
 		if (!service->hidden) {
 			/*
@@ -6176,7 +6910,7 @@ static int service_indicate_state(struct connman_service *service)
 		break;
 	}
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -6494,6 +7228,7 @@ int __connman_service_ipconfig_indicate_state(struct connman_service *service,
 		if (type == CONNMAN_IPCONFIG_TYPE_IPV4)
 			service_rp_filter(service, true);
 		set_mdns(service, service->mdns_config);
+		set_dns_over_tls(service, service->dns_over_tls_config);
 		break;
 	case CONNMAN_SERVICE_STATE_ONLINE:
 		break;
@@ -6523,6 +7258,9 @@ int __connman_service_ipconfig_indicate_state(struct connman_service *service,
 	else
 		service->state_ipv6 = new_state;
 
+	/* the IPv4 and IPv6 dictionaries are only filled when connected */
+	properties_changed(service);
+
 	if (!is_connected(old_state) && is_connected(new_state))
 		nameserver_add_all(service, type);
 
@@ -6853,6 +7591,7 @@ int __connman_service_disconnect(struct connman_service *service)
 
 	service->connect_reason = CONNMAN_SERVICE_CONNECT_REASON_NONE;
 	service->proxy = CONNMAN_SERVICE_PROXY_METHOD_UNKNOWN;
+	properties_changed(service);
 
 	connman_agent_cancel(service);
 
@@ -6922,6 +7661,9 @@ static void provision_changed(gpointer value, gpointer user_data)
 			service->config_file, service->config_entry);
 	if (ret > 0)
 		data->ret = ret;
+
+	/* provisioning sets most properties without notifying them */
+	properties_changed(service);
 }
 
 int __connman_service_provision_changed(const char *ident)
@@ -7000,7 +7742,7 @@ static int service_register(struct connman_service *service)
 	if (service->path)
 		return -EALREADY;
 
-	service->path = g_strdup_printf("%s/service/%s", CONNMAN_PATH,
+	service->path = g_strdup_printf("%s%s", SERVICE_PATH_PREFIX,
 						service->identifier);
 
 	DBG("path %s", service->path);
@@ -7013,7 +7755,7 @@ static int service_register(struct connman_service *service)
 	if (__connman_config_provision_service(service) < 0)
 		service_load(service);
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -7152,6 +7894,9 @@ static struct connman_ipconfig *create_ip4config(struct connman_service *service
 
 	__connman_ipconfig_set_ops(ipconfig_ipv4, &service_ops);
 
+	__connman_service_index_changed(index);
+	properties_changed(service);
+
 	return ipconfig_ipv4;
 }
 
@@ -7169,6 +7914,9 @@ static struct connman_ipconfig *create_ip6config(struct connman_service *service
 
 	__connman_ipconfig_set_ops(ipconfig_ipv6, &service_ops);
 
+	__connman_service_index_changed(index);
+	properties_changed(service);
+
 	return ipconfig_ipv6;
 }
 
@@ -7240,47 +7988,105 @@ void connman_service_create_ip6config(struct connman_service *service,
  */
 struct connman_service *connman_service_lookup_from_network(struct connman_network *network)
 {
-	struct connman_service *service;
-	const char *ident, *group;
-	char *name;
+	const char *ident;
 
 	if (!network)
 		return NULL;
 
-	ident = __connman_network_get_ident(network);
+	ident = __connman_network_get_service_ident(network);
 	if (!ident)
 		return NULL;
 
-	group = connman_network_get_group(network);
-	if (!group)
-		return NULL;
+	return lookup_by_identifier(ident);
+}
 
-	name = g_strdup_printf("%s_%s_%s",
-			__connman_network_get_type(network), ident, group);
-	service = lookup_by_identifier(name);
-	g_free(name);
+static bool service_has_index(struct connman_service *service, int index)
+{
+	return __connman_ipconfig_get_index(service->ipconfig_ipv4) == index ||
+		__connman_ipconfig_get_index(service->ipconfig_ipv6) == index;
+}
 
-	return service;
+/*
+ * index_hash maps an index to the services having it, in no particular
+ * order, so reordering service_list leaves it alone. A missing entry is
+ * rebuilt from service_list; an entry is dropped only when a service may
+ * have gained its index, a service losing the index is pruned on lookup.
+ */
+static void index_hash_remove_service(struct connman_service *service)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!index_hash)
+		return;
+
+	g_hash_table_iter_init(&iter, index_hash);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		GSList *services = value;
+
+		if (!g_slist_find(services, service))
+			continue;
+
+		services = g_slist_remove(services, service);
+		g_hash_table_iter_replace(&iter, services);
+	}
+}
+
+static void index_hash_free_entry(gpointer key, gpointer value,
+						gpointer user_data)
+{
+	g_slist_free(value);
+}
+
+void __connman_service_index_changed(int index)
+{
+	GSList *services;
+
+	if (!index_hash || index < 0)
+		return;
+
+	services = g_hash_table_lookup(index_hash, GINT_TO_POINTER(index));
+	g_hash_table_remove(index_hash, GINT_TO_POINTER(index));
+	g_slist_free(services);
 }
 
 struct connman_service *__connman_service_lookup_from_index(int index)
 {
-	struct connman_service *service;
-	GList *list;
+	struct connman_service *service = NULL;
+	GSList *services = NULL, *list, *next;
+	gpointer value;
+	GList *iter;
 
-	for (list = service_list; list; list = list->next) {
-		service = list->data;
+	if (!index_hash || index < 0)
+		return NULL;
+
+	if (g_hash_table_lookup_extended(index_hash, GINT_TO_POINTER(index),
+						NULL, &value)) {
+		services = value;
+	} else {
+		for (iter = service_list; iter; iter = iter->next) {
+			if (service_has_index(iter->data, index))
+				services = g_slist_prepend(services,
+								iter->data);
+		}
+	}
 
-		if (__connman_ipconfig_get_index(service->ipconfig_ipv4)
-							== index)
-			return service;
+	/* The service sorting first is the one service_list has in front */
+	for (list = services; list; list = next) {
+		next = list->next;
 
-		if (__connman_ipconfig_get_index(service->ipconfig_ipv6)
-							== index)
-			return service;
+		if (!service_has_index(list->data, index)) {
+			services = g_slist_delete_link(services, list);
+			continue;
+		}
+
+		if (!service || service_compare(list->data, service) < 0)
+			service = list->data;
 	}
 
-	return NULL;
+	g_hash_table_replace(index_hash, GINT_TO_POINTER(index), services);
+
+	return service;
 }
 
 const char *connman_service_get_identifier(struct connman_service *service)
@@ -7404,6 +8210,8 @@ static void update_from_network(struct connman_service *service,
 	if (service->type == CONNMAN_SERVICE_TYPE_WIFI)
 		update_wps_values(service, network);
 
+	properties_changed(service);
+
 	if (service->strength > strength && service->network) {
 		connman_network_unref(service->network);
 		service->network = connman_network_ref(network);
@@ -7414,7 +8222,7 @@ static void update_from_network(struct connman_service *service,
 	if (!service->network)
 		service->network = connman_network_ref(network);
 
-	service_list_sort();
+	service_list_reposition(service);
 }
 
 static void trigger_autoconnect(struct connman_service *service)
@@ -7470,8 +8278,7 @@ static void trigger_autoconnect(struct connman_service *service)
 struct connman_service * __connman_service_create_from_network(struct connman_network *network)
 {
 	struct connman_service *service;
-	const char *ident, *group;
-	char *name;
+	const char *ident;
 	unsigned int *auto_connect_types, *favorite_types;
 	int i, index;
 
@@ -7480,18 +8287,11 @@ struct connman_service * __connman_service_create_from_network(struct connman_ne
 	if (!network)
 		return NULL;
 
-	ident = __connman_network_get_ident(network);
+	ident = __connman_network_get_service_ident(network);
 	if (!ident)
 		return NULL;
 
-	group = connman_network_get_group(network);
-	if (!group)
-		return NULL;
-
-	name = g_strdup_printf("%s_%s_%s",
-			__connman_network_get_type(network), ident, group);
-	service = service_get(name);
-	g_free(name);
+	service = service_get(ident);
 
 	if (!service)
 		return NULL;
@@ -7583,6 +8383,7 @@ void __connman_service_update_from_network(struct connman_network *network)
 	if (g_strcmp0(service->name, name) != 0) {
 		g_free(service->name);
 		service->name = g_strdup(name);
+		properties_changed(service);
 
 		if (allow_property_changed(service))
 			connman_dbus_property_changed_basic(service->path,
@@ -7621,7 +8422,7 @@ roaming:
 
 sorting:
 	if (need_sort) {
-		service_list_sort();
+		service_list_reposition(service);
 	}
 }
 
@@ -7822,6 +8623,8 @@ int __connman_service_init(void)
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, service_free);
 
+	index_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	passphrase_requested = g_hash_table_new(g_direct_hash, g_direct_equal);
 
 	services_notify = g_new0(struct _services_notify, 1);
@@ -7829,6 +8632,9 @@ int __connman_service_init(void)
 			g_str_equal, g_free, NULL);
 	services_notify->add = g_hash_table_new(g_str_hash, g_str_equal);
 
+	delta_listeners = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
+
 	remove_unprovisioned_services();
 
 	return 0;
@@ -7836,6 +8642,9 @@ int __connman_service_init(void)
 
 void __connman_service_cleanup(void)
 {
+	GHashTableIter iter;
+	gpointer key, value;
+
 	DBG("");
 
 	if (vpn_autoconnect_id) {
@@ -7856,12 +8665,28 @@ void __connman_service_cleanup(void)
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
+	g_hash_table_foreach(index_hash, index_hash_free_entry, NULL);
+	g_hash_table_destroy(index_hash);
+	index_hash = NULL;
+
 	g_hash_table_destroy(passphrase_requested);
 	passphrase_requested = NULL;
 
 	g_slist_free(counter_list);
 	counter_list = NULL;
 
+	g_hash_table_iter_init(&iter, delta_listeners);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_dbus_remove_watch(connection, GPOINTER_TO_UINT(value));
+
+	g_hash_table_destroy(delta_listeners);
+	delta_listeners = NULL;
+
+	if (services_sent) {
+		g_ptr_array_free(services_sent, TRUE);
+		services_sent = NULL;
+	}
+
 	if (services_notify->id != 0) {
 		g_source_remove(services_notify->id);
 		service_send_changed(NULL);
@@ -33,8 +33,11 @@
 static DBusConnection *connection;
 static GHashTable *session_hash;
 static GHashTable *service_hash;
+static GHashTable *bearer_hash;
 static struct connman_session *ecall_session;
 static uint32_t session_mark = 256;
+/* marks of destroyed groups, handed out again before new ones */
+static GSList *free_marks;
 
 struct session_info {
 	struct connman_session_config config;
@@ -58,16 +61,14 @@ struct connman_session {
 	char *user_allowed_interface;
 
 	bool ecall;
+	bool destroying;
 
-	enum connman_session_id_type id_type;
-	struct firewall_context *fw;
-	uint32_t mark;
-	int index;
-	char *addr;
-	char *gateway;
-	unsigned char prefixlen;
-	bool policy_routing;
-	bool snat_enabled;
+	struct session_group *group;
+	struct fw_snat *fw_snat;
+
+	/* number and total time of the Update notifications sent */
+	unsigned int notify_count;
+	gint64 notify_time;
 };
 
 struct connman_service_info {
@@ -85,6 +86,20 @@ struct fw_snat {
 
 GSList *fw_snat_list;
 
+/* sessions sharing one fwmark, routing table and marking rules */
+struct session_group {
+	char *key;
+	GSList *sessions;
+	uint32_t mark;
+	struct firewall_context *fw;
+	bool policy_routing;
+	int index;
+	char *gateway;
+	unsigned char prefixlen;
+};
+
+static GHashTable *group_hash;
+
 static struct connman_session_policy *policy;
 static void session_activate(struct connman_session *session);
 static void session_deactivate(struct connman_session *session);
@@ -98,6 +113,40 @@ static void cleanup_service(gpointer data)
 	g_free(info);
 }
 
+/*
+ * The bearer index maps every service type to the sessions which have
+ * it in their allowed bearers, so that a service changing its state is
+ * only matched against the sessions which could use it.
+ */
+static void bearer_index_add(struct connman_session *session)
+{
+	GSList *list, *sessions;
+
+	for (list = session->info->config.allowed_bearers; list;
+						list = list->next) {
+		sessions = g_hash_table_lookup(bearer_hash, list->data);
+		sessions = g_slist_prepend(sessions, session);
+		g_hash_table_replace(bearer_hash, list->data, sessions);
+	}
+}
+
+static void bearer_index_remove(struct connman_session *session)
+{
+	GSList *list, *sessions;
+
+	for (list = session->info->config.allowed_bearers; list;
+						list = list->next) {
+		sessions = g_hash_table_lookup(bearer_hash, list->data);
+		sessions = g_slist_remove(sessions, session);
+
+		if (sessions)
+			g_hash_table_replace(bearer_hash, list->data,
+								sessions);
+		else
+			g_hash_table_remove(bearer_hash, list->data);
+	}
+}
+
 static const char *state2string(enum connman_session_state state)
 {
 	switch (state) {
@@ -218,11 +267,10 @@ static struct fw_snat *fw_snat_lookup(int index, const char *addr)
 	return NULL;
 }
 
-static int fw_snat_create(struct connman_session *session,
+static struct fw_snat *fw_snat_create(struct connman_session *session,
 				int index, const char *ifname, const char *addr)
 {
 	struct fw_snat *fw_snat;
-	int err;
 
 	fw_snat = g_new0(struct fw_snat, 1);
 
@@ -232,20 +280,18 @@ static int fw_snat_create(struct connman_session *session,
 
 	fw_snat->id = __connman_firewall_enable_snat(fw_snat->fw,
 						index, ifname, addr);
-	if (fw_snat->id < 0) {
-		err = fw_snat->id;
+	if (fw_snat->id < 0)
 		goto err;
-	}
 
 	fw_snat_list = g_slist_prepend(fw_snat_list, fw_snat);
 	fw_snat->sessions = g_slist_prepend(fw_snat->sessions, session);
 
-	return 0;
+	return fw_snat;
 err:
 	__connman_firewall_destroy(fw_snat->fw);
 	g_free(fw_snat->addr);
 	g_free(fw_snat);
-	return err;
+	return NULL;
 }
 
 static void fw_snat_ref(struct connman_session *session,
@@ -267,25 +313,67 @@ static void fw_snat_unref(struct connman_session *session,
 
 	__connman_firewall_disable_snat(fw_snat->fw);
 	__connman_firewall_destroy(fw_snat->fw);
+	g_free(fw_snat->addr);
 	g_free(fw_snat);
 }
 
-static int init_firewall_session(struct connman_session *session)
+static bool session_has_identity(struct connman_session *session)
+{
+	return session->policy_config->id_type !=
+					CONNMAN_SESSION_ID_TYPE_UNKNOWN ||
+		session->info->config.source_ip_rule;
+}
+
+/*
+ * Everything the fwmark, the routing table and the marking rules of a
+ * session depend on. Sessions with the same key share them.
+ */
+static char *session_group_key(struct connman_session *session)
+{
+	struct connman_ipconfig *ipconfig = NULL;
+	const char *ident = NULL, *addr = NULL, *gateway = NULL;
+	unsigned char prefixlen = 0;
+	int index = -1;
+
+	if (!session_has_identity(session))
+		return NULL;
+
+	if (session->service) {
+		ident = connman_service_get_identifier(session->service);
+		ipconfig = __connman_service_get_ip4config(session->service);
+	}
+
+	if (ipconfig) {
+		index = __connman_ipconfig_get_index(ipconfig);
+		gateway = __connman_ipconfig_get_gateway(ipconfig);
+		prefixlen = __connman_ipconfig_get_prefixlen(ipconfig);
+
+		if (session->info->config.source_ip_rule)
+			addr = __connman_ipconfig_get_local(ipconfig);
+	}
+
+	return g_strdup_printf("%d/%s/%s/%s/%d/%s/%u",
+				session->policy_config->id_type,
+				session->policy_config->id ?
+					session->policy_config->id : "",
+				addr ? addr : "", ident ? ident : "",
+				index, gateway ? gateway : "", prefixlen);
+}
+
+static int init_firewall_group(struct session_group *group,
+				struct connman_session *session)
 {
 	struct firewall_context *fw;
 	int err;
 	struct connman_ipconfig *ipconfig = NULL;
 	const char *addr = NULL;
 
-	if (session->policy_config->id_type == CONNMAN_SESSION_ID_TYPE_UNKNOWN &&
-			!session->info->config.source_ip_rule)
-		return 0;
-
 	DBG("");
 
 	if (session->info->config.source_ip_rule) {
 		ipconfig = __connman_service_get_ip4config(session->service);
-		if (session->policy_config->id_type == CONNMAN_SESSION_ID_TYPE_UNKNOWN && !ipconfig)
+		if (session->policy_config->id_type ==
+				CONNMAN_SESSION_ID_TYPE_UNKNOWN && !ipconfig)
 			return 0;
 	}
 
@@ -293,84 +381,79 @@ static int init_firewall_session(struct connman_session *session)
 	if (!fw)
 		return -ENOMEM;
 
-	if (session->info->config.source_ip_rule && ipconfig) {
+	if (session->info->config.source_ip_rule && ipconfig)
 		addr = __connman_ipconfig_get_local(ipconfig);
-	}
 
-	err =__connman_firewall_enable_marking(fw,
+	err = __connman_firewall_enable_marking(fw,
 					session->policy_config->id_type,
 					session->policy_config->id,
-					addr, session->mark);
+					addr, group->mark);
 	if (err < 0) {
 		__connman_firewall_destroy(fw);
 		return err;
 	}
-	session->id_type = session->policy_config->id_type;
-	session->fw = fw;
+	group->fw = fw;
 
 	return 0;
 }
 
-static void cleanup_firewall_session(struct connman_session *session)
+static void cleanup_firewall_group(struct session_group *group)
 {
-	if (!session->fw)
+	if (!group->fw)
 		return;
 
-	__connman_firewall_disable_marking(session->fw);
-	__connman_firewall_disable_snat(session->fw);
-	__connman_firewall_destroy(session->fw);
+	__connman_firewall_disable_marking(group->fw);
+	__connman_firewall_destroy(group->fw);
 
-	session->fw = NULL;
+	group->fw = NULL;
 }
 
-static int init_routing_table(struct connman_session *session)
+static int init_routing_table(struct session_group *group,
+				struct connman_session *session)
 {
 	int err;
 
-	if (session->policy_config->id_type == CONNMAN_SESSION_ID_TYPE_UNKNOWN &&
-			!session->info->config.source_ip_rule)
-		return 0;
-
 	if (!session->service)
 		return 0;
 
 	DBG("");
 
-	err = __connman_inet_add_fwmark_rule(session->mark,
-						AF_INET, session->mark);
+	err = __connman_inet_add_fwmark_rule(group->mark,
+						AF_INET, group->mark);
 	if (err < 0)
 		return err;
 
-	err = __connman_inet_add_fwmark_rule(session->mark,
-						AF_INET6, session->mark);
+	err = __connman_inet_add_fwmark_rule(group->mark,
+						AF_INET6, group->mark);
 	if (err < 0)
-		__connman_inet_del_fwmark_rule(session->mark,
-						AF_INET, session->mark);
-	session->policy_routing = true;
+		__connman_inet_del_fwmark_rule(group->mark,
+						AF_INET, group->mark);
+	group->policy_routing = true;
 
 	return err;
 }
 
-static void del_default_route(struct connman_session *session)
+static void del_default_route(struct session_group *group)
 {
-	if (!session->gateway)
+	if (!group->gateway)
 		return;
 
 	DBG("index %d routing table %d default gateway %s/%u",
-		session->index, session->mark, session->gateway, session->prefixlen);
+		group->index, group->mark, group->gateway, group->prefixlen);
 
-	__connman_inet_del_subnet_from_table(session->mark,
-		session->index, session->gateway, session->prefixlen);
+	__connman_inet_del_subnet_from_table(group->mark,
+		group->index, group->gateway, group->prefixlen);
 
-	__connman_inet_del_default_from_table(session->mark,
-					session->index, session->gateway);
-	g_free(session->gateway);
-	session->gateway = NULL;
-	session->prefixlen = 0;
-	session->index = -1;
+	__connman_inet_del_default_from_table(group->mark,
+					group->index, group->gateway);
+	g_free(group->gateway);
+	group->gateway = NULL;
+	group->prefixlen = 0;
+	group->index = -1;
 }
 
-static void add_default_route(struct connman_session *session)
+static void add_default_route(struct session_group *group,
+				struct connman_session *session)
 {
 	struct connman_ipconfig *ipconfig;
 	int err;
@@ -380,119 +463,209 @@ static void add_default_route(struct connman_session *session)
 		return;
 
 	ipconfig = __connman_service_get_ip4config(session->service);
-	session->index = __connman_ipconfig_get_index(ipconfig);
-	session->gateway = g_strdup(__connman_ipconfig_get_gateway(ipconfig));
+	group->index = __connman_ipconfig_get_index(ipconfig);
+	group->gateway = g_strdup(__connman_ipconfig_get_gateway(ipconfig));
 
-	if (!session->gateway)
-		session->gateway = g_strdup(inet_ntoa(addr));
+	if (!group->gateway)
+		group->gateway = g_strdup(inet_ntoa(addr));
 
-	session->prefixlen = __connman_ipconfig_get_prefixlen(ipconfig);
+	group->prefixlen = __connman_ipconfig_get_prefixlen(ipconfig);
 
 	DBG("index %d routing table %d default gateway %s/%u",
-		session->index, session->mark, session->gateway, session->prefixlen);
+		group->index, group->mark, group->gateway, group->prefixlen);
 
-	err = __connman_inet_add_default_to_table(session->mark,
-					session->index, session->gateway);
+	err = __connman_inet_add_default_to_table(group->mark,
+					group->index, group->gateway);
 	if (err < 0)
-		DBG("session %p %s", session, strerror(-err));
+		DBG("group %p %s", group, strerror(-err));
 
-	err = __connman_inet_add_subnet_to_table(session->mark,
-					session->index, session->gateway, session->prefixlen);
+	err = __connman_inet_add_subnet_to_table(group->mark,
+					group->index, group->gateway, group->prefixlen);
 	if (err < 0)
-		DBG("session add subnet route %p %s", session, strerror(-err));
+		DBG("group add subnet route %p %s", group, strerror(-err));
 }
 
-static void del_nat_rules(struct connman_session *session)
+static void cleanup_routing_table(struct session_group *group)
 {
-	struct fw_snat *fw_snat;
+	DBG("");
+
+	if (group->policy_routing) {
+		__connman_inet_del_fwmark_rule(group->mark,
+					AF_INET6, group->mark);
+
+		__connman_inet_del_fwmark_rule(group->mark,
+					AF_INET, group->mark);
+		group->policy_routing = false;
+	}
+
+	del_default_route(group);
+}
+
+static void session_group_destroy(struct session_group *group)
+{
+	DBG("group %p mark %u", group, group->mark);
+
+	cleanup_routing_table(group);
+	cleanup_firewall_group(group);
+
+	free_marks = g_slist_prepend(free_marks,
+					GUINT_TO_POINTER(group->mark));
+
+	g_hash_table_remove(group_hash, group->key);
+	g_free(group->key);
+	g_free(group);
+}
+
+static int session_group_create(struct connman_session *session,
+				char *key, struct session_group **result)
+{
+	struct session_group *group;
+	int err;
+
+	group = g_new0(struct session_group, 1);
+	group->key = key;
+	group->index = -1;
+
+	if (free_marks) {
+		group->mark = GPOINTER_TO_UINT(free_marks->data);
+		free_marks = g_slist_delete_link(free_marks, free_marks);
+	} else {
+		group->mark = session_mark++;
+	}
+
+	DBG("group %p mark %u key %s", group, group->mark, key);
+
+	g_hash_table_replace(group_hash, group->key, group);
 
-	if (!session->snat_enabled)
+	err = init_firewall_group(group, session);
+	if (err < 0)
+		goto err;
+
+	err = init_routing_table(group, session);
+	if (err < 0)
+		goto err;
+
+	add_default_route(group, session);
+
+	*result = group;
+
+	return 0;
+
+err:
+	session_group_destroy(group);
+	return err;
+}
+
+static void leave_session_group(struct connman_session *session)
+{
+	struct session_group *group = session->group;
+
+	if (!group)
 		return;
 
-	session->snat_enabled = false;
-	fw_snat = fw_snat_lookup(session->index, session->addr);
+	session->group = NULL;
+
+	group->sessions = g_slist_remove(group->sessions, session);
+	if (!group->sessions)
+		session_group_destroy(group);
+}
+
+/*
+ * Moves the session to the group matching its identity and service.
+ * Only the first session of a group touches the firewall and the
+ * routing tables, the others just join it.
+ */
+static int update_session_group(struct connman_session *session)
+{
+	struct session_group *group;
+	char *key;
+	int err;
+
+	key = session_group_key(session);
+
+	if (session->group && !g_strcmp0(session->group->key, key)) {
+		g_free(key);
+		return 0;
+	}
 
-	if (!fw_snat)
+	leave_session_group(session);
+
+	if (!key)
+		return 0;
+
+	group = g_hash_table_lookup(group_hash, key);
+	if (group) {
+		g_free(key);
+	} else {
+		err = session_group_create(session, key, &group);
+		if (err < 0)
+			return err;
+	}
+
+	group->sessions = g_slist_prepend(group->sessions, session);
+	session->group = group;
+
+	return 0;
+}
+
+static void del_nat_rules(struct connman_session *session)
+{
+	if (!session->fw_snat)
 		return;
 
-	fw_snat_unref(session, fw_snat);
+	fw_snat_unref(session, session->fw_snat);
+	session->fw_snat = NULL;
 }
 
-static void add_nat_rules(struct connman_session *session)
+static void update_nat_rules(struct connman_session *session)
 {
 	struct connman_ipconfig *ipconfig;
 	struct fw_snat *fw_snat;
 	const char *addr;
-	int index, err;
+	int index;
 	char *ifname;
 
-	if (!session->service)
+	if (!session->service) {
+		del_nat_rules(session);
 		return;
+	}
 
 	ipconfig = __connman_service_get_ip4config(session->service);
 	index = __connman_ipconfig_get_index(ipconfig);
-	ifname = connman_inet_ifname(index);
 	addr = __connman_ipconfig_get_local(ipconfig);
 
-	if (!addr)
+	fw_snat = session->fw_snat;
+	if (fw_snat && fw_snat->index == index &&
+				!g_strcmp0(fw_snat->addr, addr))
 		return;
 
-	g_free(session->addr);
-	session->addr = g_strdup(addr);
+	del_nat_rules(session);
+
+	if (!addr)
+		return;
 
-	session->snat_enabled = true;
-	fw_snat = fw_snat_lookup(index, session->addr);
+	fw_snat = fw_snat_lookup(index, addr);
 	if (fw_snat) {
 		fw_snat_ref(session, fw_snat);
+		session->fw_snat = fw_snat;
 		return;
 	}
 
-	err = fw_snat_create(session, index, ifname, addr);
-	if (err < 0) {
+	ifname = connman_inet_ifname(index);
+
+	session->fw_snat = fw_snat_create(session, index, ifname, addr);
+	if (!session->fw_snat)
 		DBG("failed to add SNAT rule");
-		session->snat_enabled = false;
-	}
 
 	g_free(ifname);
 }
 
 uint32_t connman_session_firewall_get_fwmark(struct connman_session *session)
 {
-	return session->mark;
-}
-
-static void cleanup_routing_table(struct connman_session *session)
-{
-	DBG("");
-
-	if (session->policy_routing) {
-		__connman_inet_del_fwmark_rule(session->mark,
-					AF_INET6, session->mark);
-
-		__connman_inet_del_fwmark_rule(session->mark,
-					AF_INET, session->mark);
-		session->policy_routing = false;
-	}
-
-	del_default_route(session);
-}
-
-static void update_firewall(struct connman_session *session)
-{
-	cleanup_firewall_session(session);
-	init_firewall_session(session);
-}
+	if (!session->group)
+		return 0;
 
-static void update_routing_table(struct connman_session *session)
-{
-	cleanup_routing_table(session);
-	init_routing_table(session);
-	add_default_route(session);
-}
-
-static void cleanup_nat_rules(struct connman_session *session)
-{
-	del_nat_rules(session);
+	return session->group->mark;
 }
 
 static void destroy_policy_config(struct connman_session *session)
@@ -524,8 +697,6 @@ static void free_session(struct connman_session *session)
 	g_free(session->notify_path);
 	g_free(session->info);
 	g_free(session->info_last);
-	g_free(session->gateway);
-	g_free(session->addr);
 
 	g_free(session);
 }
@@ -547,9 +718,10 @@ static void cleanup_session(gpointer user_data)
 
 	DBG("remove %s", session->session_path);
 
-	cleanup_nat_rules(session);
-	cleanup_routing_table(session);
-	cleanup_firewall_session(session);
+	/* keeps the state updates below from moving it to a new group */
+	session->destroying = true;
+
+	__connman_firewall_begin();
 
 	if (session->active)
 		set_active_session(session, false);
@@ -557,6 +729,16 @@ static void cleanup_session(gpointer user_data)
 	session_deactivate(session);
 	update_session_state(session);
 
+	del_nat_rules(session);
+	leave_session_group(session);
+
+	__connman_firewall_commit();
+
+	bearer_index_remove(session);
+
+	DBG("session %p sent %u notifications in %" G_GINT64_FORMAT " usec",
+			session, session->notify_count, session->notify_time);
+
 	g_slist_free(session->user_allowed_bearers);
 	g_free(session->user_allowed_interface);
 
@@ -1007,6 +1189,7 @@ static gboolean session_notify(gpointer user_data)
 	struct connman_session *session = user_data;
 	DBusMessage *msg;
 	DBusMessageIter array, dict;
+	gint64 start;
 
 	if (!compute_notifiable_changes(session))
 		return FALSE;
@@ -1014,6 +1197,8 @@ static gboolean session_notify(gpointer user_data)
 	DBG("session %p owner %s notify_path %s", session,
 		session->owner, session->notify_path);
 
+	start = g_get_monotonic_time();
+
 	msg = dbus_message_new_method_call(session->owner, session->notify_path,
 						CONNMAN_NOTIFICATION_INTERFACE,
 						"Update");
@@ -1029,6 +1214,9 @@ static gboolean session_notify(gpointer user_data)
 
 	g_dbus_send_message(connection, msg);
 
+	session->notify_count++;
+	session->notify_time += g_get_monotonic_time() - start;
+
 	return FALSE;
 }
 
@@ -1060,15 +1248,10 @@ int connman_session_config_update(struct connman_session *session)
 	 * might have changed. We can still optimize this later.
 	 */
 
-	if (session->id_type != session->policy_config->id_type) {
-		cleanup_firewall_session(session);
-		err = init_firewall_session(session);
-		if (err < 0) {
-			connman_session_destroy(session);
-			return err;
-		}
-
-		session->id_type = session->policy_config->id_type;
+	err = update_session_group(session);
+	if (err < 0) {
+		connman_session_destroy(session);
+		return err;
 	}
 
 	apply_policy_on_bearers(
@@ -1086,8 +1269,10 @@ int connman_session_config_update(struct connman_session *session)
 	session->active = false;
 	session_deactivate(session);
 
+	bearer_index_remove(session);
 	g_slist_free(info->config.allowed_bearers);
 	info->config.allowed_bearers = allowed_bearers;
+	bearer_index_add(session);
 
 	g_free(info->config.allowed_interface);
 	info->config.allowed_interface = allowed_interface;
@@ -1202,6 +1387,7 @@ static DBusMessage *change_session(DBusConnection *conn,
 			session_deactivate(session);
 			update_session_state(session);
 
+			bearer_index_remove(session);
 			g_slist_free(info->config.allowed_bearers);
 			session->user_allowed_bearers = allowed_bearers;
 
@@ -1209,6 +1395,7 @@ static DBusMessage *change_session(DBusConnection *conn,
 					session->policy_config->allowed_bearers,
 					session->user_allowed_bearers,
 					&info->config.allowed_bearers);
+			bearer_index_add(session);
 
 			session_activate(session);
 		} else {
@@ -1360,14 +1547,7 @@ static int session_policy_config_cb(struct connman_session *session,
 	session->policy_config = config;
 	session->info->config.source_ip_rule = creation_data->source_ip_rule;
 
-	session->mark = session_mark++;
-	session->index = -1;
-
-	err = init_firewall_session(session);
-	if (err < 0)
-		goto err;
-
-	err = init_routing_table(session);
+	err = update_session_group(session);
 	if (err < 0)
 		goto err;
 
@@ -1400,6 +1580,7 @@ static int session_policy_config_cb(struct connman_session *session,
 		session->user_allowed_interface);
 
 	g_hash_table_replace(session_hash, session->session_path, session);
+	bearer_index_add(session);
 
 	DBG("add %s", session->session_path);
 
@@ -1723,10 +1904,14 @@ static void update_session_state(struct connman_session *session)
 
 	DBG("session %p state %s", session, state2string(state));
 
-	update_firewall(session);
-	del_nat_rules(session);
-	update_routing_table(session);
-	add_nat_rules(session);
+	if (!session->destroying) {
+		__connman_firewall_begin();
+
+		update_session_group(session);
+		update_nat_rules(session);
+
+		__connman_firewall_commit();
+	}
 
 	if (policy && policy->update_session_state)
 		policy->update_session_state(session, state);
@@ -1877,37 +2062,72 @@ static void session_deactivate(struct connman_session *session)
 	session->info->state = CONNMAN_SESSION_STATE_DISCONNECTED;
 }
 
-static void handle_service_state_online(struct connman_service *service,
+static bool session_add_service(struct connman_session *session,
+					struct connman_service *service,
+					enum connman_service_state state,
+					struct connman_service_info *info)
+{
+	if (session->service == service)
+		return false;
+
+	if (!is_session_connected(session, state) ||
+			!session_match_service(session, service))
+		return false;
+
+	DBG("session %p add service %p", session, service);
+
+	info->sessions = g_slist_prepend(info->sessions, session);
+	session->service = service;
+	update_session_state(session);
+
+	return true;
+}
+
+static unsigned int handle_service_state_online(
+					struct connman_service *service,
 					enum connman_service_state state,
 					struct connman_service_info *info)
 {
 	GHashTableIter iter;
 	gpointer key, value;
+	GSList *list, *next;
+	unsigned int visited = 0;
 
-	g_hash_table_iter_init(&iter, session_hash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		struct connman_session *session = value;
-		bool connected;
+	for (list = info->sessions; list; list = next) {
+		struct connman_session *session = list->data;
 
-		connected = is_session_connected(session, state);
+		next = list->next;
+		visited++;
 
-		if (session->service == service) {
-			if (!connected) {
-				DBG("session %p remove service %p", session, service);
-				info->sessions = g_slist_remove(info->sessions,
-							session);
-				session->service = NULL;
-				update_session_state(session);
-			}
-		} else if (connected && session_match_service(session, service)) {
-			DBG("session %p add service %p", session, service);
+		if (session->service != service ||
+				is_session_connected(session, state))
+			continue;
 
-			info->sessions = g_slist_prepend(info->sessions,
-							session);
-			session->service = service;
-			update_session_state(session);
+		DBG("session %p remove service %p", session, service);
+		info->sessions = g_slist_delete_link(info->sessions, list);
+		session->service = NULL;
+		update_session_state(session);
+	}
+
+	/* a policy deciding about the bearers has to see every session */
+	if (policy && policy->allowed) {
+		g_hash_table_iter_init(&iter, session_hash);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			session_add_service(value, service, state, info);
+			visited++;
 		}
+
+		return visited;
 	}
+
+	list = g_hash_table_lookup(bearer_hash,
+			GINT_TO_POINTER(connman_service_get_type(service)));
+	for (; list; list = list->next) {
+		session_add_service(list->data, service, state, info);
+		visited++;
+	}
+
+	return visited;
 }
 
 static void handle_service_state_offline(struct connman_service *service,
@@ -1936,6 +2156,8 @@ static void service_state_changed(struct connman_service *service,
 				enum connman_service_state state)
 {
 	struct connman_service_info *info;
+	unsigned int visited;
+	gint64 start;
 
 	DBG("service %p state %d", service, state);
 
@@ -1951,7 +2173,9 @@ static void service_state_changed(struct connman_service *service,
 		if (!info)
 			return;
 
+		__connman_firewall_begin();
 		handle_service_state_offline(service, info);
+		__connman_firewall_commit();
 
 		g_hash_table_remove(service_hash, service);
 
@@ -1964,41 +2188,60 @@ static void service_state_changed(struct connman_service *service,
 		}
 
 		info->service = service;
-		handle_service_state_online(service, state, info);
+
+		start = g_get_monotonic_time();
+
+		/* all sessions moving to the service share the commits */
+		__connman_firewall_begin();
+		visited = handle_service_state_online(service, state, info);
+		__connman_firewall_commit();
+
+		DBG("service %p visited %u of %u sessions in %" G_GINT64_FORMAT
+			" usec", service, visited,
+			g_hash_table_size(session_hash),
+			g_get_monotonic_time() - start);
 	}
 }
 
 static void ipconfig_changed(struct connman_service *service,
 				struct connman_ipconfig *ipconfig)
 {
-	GHashTableIter iter;
-	gpointer key, value;
+	struct connman_service_info *service_info;
 	struct connman_session *session;
 	struct session_info *info;
 	enum connman_ipconfig_type type;
+	GSList *list;
 
 	DBG("service %p ipconfig %p", service, ipconfig);
 
+	/* only the sessions using the service are affected */
+	service_info = g_hash_table_lookup(service_hash, service);
+	if (!service_info)
+		return;
+
 	type = __connman_ipconfig_get_config_type(ipconfig);
 
-	g_hash_table_iter_init(&iter, session_hash);
+	__connman_firewall_begin();
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		session = value;
+	for (list = service_info->sessions; list; list = list->next) {
+		session = list->data;
 		info = session->info;
 
 		if (info->state == CONNMAN_SESSION_STATE_DISCONNECTED)
 			continue;
 
-		if (session->service && session->service == service) {
-			update_session_state(session);
+		if (session->service != service)
+			continue;
 
-			if (type == CONNMAN_IPCONFIG_TYPE_IPV4)
-				ipconfig_ipv4_changed(session);
-			else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
-				ipconfig_ipv6_changed(session);
-		}
+		update_session_state(session);
+
+		if (type == CONNMAN_IPCONFIG_TYPE_IPV4)
+			ipconfig_ipv4_changed(session);
+		else if (type == CONNMAN_IPCONFIG_TYPE_IPV6)
+			ipconfig_ipv6_changed(session);
 	}
+
+	__connman_firewall_commit();
 }
 
 static const struct connman_notifier session_notifier = {
@@ -2028,6 +2271,11 @@ int __connman_session_init(void)
 
 	service_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 						NULL, cleanup_service);
+
+	bearer_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, NULL);
+
+	group_hash = g_hash_table_new(g_str_hash, g_str_equal);
 	return 0;
 }
 
@@ -2045,6 +2293,12 @@ void __connman_session_cleanup(void)
 	session_hash = NULL;
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
+	g_hash_table_destroy(bearer_hash);
+	bearer_hash = NULL;
+	g_hash_table_destroy(group_hash);
+	group_hash = NULL;
+	g_slist_free(free_marks);
+	free_marks = NULL;
 
 	dbus_connection_unref(connection);
 }
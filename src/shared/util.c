@@ -128,3 +128,58 @@ char *util_timeval_to_iso8601(struct timeval *time)
 
 	return g_strdup(buf);
 }
+
+/*
+ * Moves node, whose sort key changed, to its place in the otherwise
+ * sorted list. Only the elements between its old and its new place are
+ * compared. Returns the new head of the list.
+ */
+GList *util_list_reposition(GList *list, GList *node, GCompareFunc func,
+							bool *moved)
+{
+	GList *pos, *last = NULL, *sibling;
+
+	*moved = false;
+
+	for (pos = node->prev; pos; pos = pos->prev) {
+		if (func(node->data, pos->data) >= 0)
+			break;
+	}
+
+	if (pos != node->prev) {
+		sibling = pos ? pos->next : list;
+	} else {
+		for (pos = node->next; pos; pos = pos->next) {
+			if (func(node->data, pos->data) <= 0)
+				break;
+
+			last = pos;
+		}
+
+		if (pos == node->next)
+			return list;
+
+		sibling = pos;
+	}
+
+	list = g_list_remove_link(list, node);
+
+	if (sibling) {
+		node->prev = sibling->prev;
+		node->next = sibling;
+
+		if (sibling->prev)
+			sibling->prev->next = node;
+		else
+			list = node;
+
+		sibling->prev = node;
+	} else {
+		node->prev = last;
+		last->next = node;
+	}
+
+	*moved = true;
+
+	return list;
+}
@@ -21,6 +21,7 @@
  *
  */
 
+#include <stdbool.h>
 #include <sys/time.h>
 
 #include <glib.h>
@@ -53,3 +54,6 @@ static inline struct cb_data *cb_data_new(void *cb, void *user_data)
 
 void util_iso8601_to_timeval(char *str, struct timeval *time);
 char *util_timeval_to_iso8601(struct timeval *time);
+
+GList *util_list_reposition(GList *list, GList *node, GCompareFunc func,
+							bool *moved);
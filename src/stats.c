@@ -24,11 +24,13 @@
 #endif
 
 #include <errno.h>
+#include <stddef.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
@@ -45,7 +47,15 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC 0xFA01B916
+#define MAGIC_V1 0xFA00B916
+#define STATS_FILE_VERSION 3
+
+#define CHECKSUM_INIT 2166136261U
+#define CHECKSUM_PRIME 16777619U
+
+/* records from after a checkpoint are not accepted from the future */
+#define MAX_CLOCK_SKEW (24 * 60 * 60)
 
 /*
  * Statistics counters are stored into a ring buffer which is stored
@@ -58,10 +68,13 @@
  *   The grows by _SC_PAGESIZE step size
  *   For each service a file is created
  *   Each file has a header where the indexes are stored
+ *   The header carries the format version, files using an older
+ *   layout (MAGIC_V1 or version 2) are converted when opened
  *
  * Entries properties:
  *   Each entry has a timestamp
  *   A flag to mark if the entry is either home (0) or roaming (1) entry
+ *   A checksum over the timestamp, the flag and the counters
  *   The entries are fixed sized (stats_record)
  *
  * Ring buffer properties:
@@ -77,28 +90,143 @@
  *   if 'roaming' has the value UINT_MAX', 'roaming' is invalid
  *   'first' points to the first entry in the ring buffer
  *   'last' points to the last entry in the ring buffer
+ *   If full, the oldest entry is moved to the history file
  *
- * History file:
+ * Checkpoints:
+ *   Writes only go to the mapping, the kernel writes the pages back
+ *   in any order
+ *   Every StatisticsSyncInterval seconds the files with changes are
+ *   synced and then 'begin' and 'end' are stored with a sequence number
+ *   and a checksum into one of the two checkpoint slots of the header
+ *   When opened, the ring buffer starts from the newest valid checkpoint
+ *   and is rolled forward over the following entries with a valid
+ *   checksum and increasing timestamps
+ *
+ * History files:
  *   Same format as the ring buffer file
- *   For a period of at least 2 months daily records are kept
- *   If older, then only a monthly record is kept
+ *   The history file keeps one home and one roaming record per day,
+ *   the entries moved out of the ring buffer replace the record of
+ *   their day
+ *   If full, its oldest entry is moved on the same way to the monthly
+ *   file, which keeps one record per accounting period
+ *
+ * Usage file:
+ *   Per hour, day and month the traffic of the service, not cumulated
+ *   Each resolution is a ring of buckets sorted by their start time,
+ *   so a time range is found by binary search
+ *   Buckets are only added for periods with traffic
+ *   The file has a fixed size, pages are only allocated when used
+ *   When created, the buckets are filled from the ring buffer file
  */
 
+enum stats_period {
+	STATS_PERIOD_NONE,
+	STATS_PERIOD_DAY,
+	STATS_PERIOD_MONTH,
+};
+
+struct stats_checkpoint {
+	unsigned int seq;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int checksum;
+};
 
 struct stats_file_header {
 	unsigned int magic;
+	unsigned int version;
 	unsigned int begin;
 	unsigned int end;
 	unsigned int home;
 	unsigned int roaming;
+	struct stats_checkpoint checkpoint[2];
 };
 
 struct stats_record {
+	time_t ts;
+	unsigned int roaming;
+	unsigned int checksum;
+	struct connman_stats_data data;
+};
+
+/* layout written before the counters were widened to 64 bits */
+struct stats_file_header_v1 {
+	unsigned int magic;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int home;
+	unsigned int roaming;
+};
+
+struct stats_record_v1 {
+	time_t ts;
+	unsigned int roaming;
+	struct {
+		unsigned int rx_packets;
+		unsigned int tx_packets;
+		unsigned int rx_bytes;
+		unsigned int tx_bytes;
+		unsigned int rx_errors;
+		unsigned int tx_errors;
+		unsigned int rx_dropped;
+		unsigned int tx_dropped;
+		unsigned int time;
+	} data;
+};
+
+/* layout written before checkpoints and record checksums */
+struct stats_file_header_v2 {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int home;
+	unsigned int roaming;
+};
+
+struct stats_record_v2 {
 	time_t ts;
 	unsigned int roaming;
 	struct connman_stats_data data;
 };
 
+struct stats_layout {
+	size_t header_len;
+	size_t record_len;
+	void (*convert)(struct stats_record *rec, const void *old);
+};
+
+#define USAGE_MAGIC 0xFA02B916
+#define USAGE_VERSION 1
+
+static const unsigned int usage_capacity[CONNMAN_STATS_RESOLUTION_MAX] = {
+	24 * 31,	/* hours of a month */
+	366 * 2,	/* days of two years */
+	12 * 10,	/* months of ten years */
+};
+
+struct usage_series {
+	unsigned int begin;
+	unsigned int count;
+};
+
+struct usage_file_header {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int capacity[CONNMAN_STATS_RESOLUTION_MAX];
+	struct usage_series series[CONNMAN_STATS_RESOLUTION_MAX];
+};
+
+#define USAGE_HEADER_LEN ((sizeof(struct usage_file_header) + 7) & ~7)
+
+struct usage_file {
+	int fd;
+	char *name;
+	char *addr;
+	size_t len;
+	struct connman_stats_usage *buckets[CONNMAN_STATS_RESOLUTION_MAX];
+};
+
 struct stats_file {
 	int fd;
 	char *name;
@@ -106,25 +234,25 @@ struct stats_file {
 	size_t len;
 	size_t max_len;
 
+	struct usage_file usage;
+
 	/* cached values */
 	struct stats_record *first;
 	struct stats_record *last;
 	struct stats_record *home;
 	struct stats_record *roaming;
 
+	/* changed since the last checkpoint */
+	bool dirty;
+
 	/* history */
-	char *history_name;
+	struct stats_file *history;
+	enum stats_period period;
 	int account_period_offset;
 };
 
-struct stats_iter {
-	struct stats_file *file;
-	struct stats_record *begin;
-	struct stats_record *end;
-	struct stats_record *it;
-};
-
 static GHashTable *stats_hash = NULL;
+static guint sync_timeout = 0;
 
 static struct stats_file_header *get_hdr(struct stats_file *file)
 {
@@ -169,6 +297,14 @@ static struct stats_record *get_roaming(struct stats_file *file)
 	return (struct stats_record *)(file->addr + hdr->roaming);
 }
 
+static void set_begin(struct stats_file *file, struct stats_record *begin)
+{
+	struct stats_file_header *hdr;
+
+	hdr = get_hdr(file);
+	hdr->begin = (char *)begin - file->addr;
+}
+
 static void set_end(struct stats_file *file, struct stats_record *end)
 {
 	struct stats_file_header *hdr;
@@ -182,7 +318,8 @@ static void set_home(struct stats_file *file, struct stats_record *home)
 	struct stats_file_header *hdr;
 
 	hdr = get_hdr(file);
-	hdr->home = (char *)home - file->addr;
+	hdr->home = home ? (char *)home - file->addr : UINT_MAX;
+	file->home = home;
 }
 
 static void set_roaming(struct stats_file *file, struct stats_record *roaming)
@@ -190,7 +327,8 @@ static void set_roaming(struct stats_file *file, struct stats_record *roaming)
 	struct stats_file_header *hdr;
 
 	hdr = get_hdr(file);
-	hdr->roaming = (char *)roaming - file->addr;
+	hdr->roaming = roaming ? (char *)roaming - file->addr : UINT_MAX;
+	file->roaming = roaming;
 }
 
 static struct stats_record *get_next(struct stats_file *file,
@@ -204,6 +342,15 @@ static struct stats_record *get_next(struct stats_file *file,
 	return cur;
 }
 
+static struct stats_record *get_prev(struct stats_file *file,
+					struct stats_record *cur)
+{
+	if (cur == file->first)
+		return file->last;
+
+	return cur - 1;
+}
+
 static struct stats_record *get_iterator_begin(struct stats_file *file)
 {
 	return get_next(file, get_begin(file));
@@ -214,6 +361,183 @@ static struct stats_record *get_iterator_end(struct stats_file *file)
 	return get_next(file, get_end(file));
 }
 
+/* the newest record of the service, it might be in a history file */
+static struct stats_record *get_latest(struct stats_file *file, bool roaming)
+{
+	struct stats_record *rec;
+
+	for (; file; file = file->history) {
+		rec = roaming ? file->roaming : file->home;
+		if (rec)
+			return rec;
+	}
+
+	return NULL;
+}
+
+/* FNV-1a */
+static unsigned int checksum_update(unsigned int hash, const void *buf,
+							size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= CHECKSUM_PRIME;
+	}
+
+	return hash;
+}
+
+static unsigned int record_checksum(const struct stats_record *rec)
+{
+	unsigned int hash;
+
+	hash = checksum_update(CHECKSUM_INIT, rec,
+				offsetof(struct stats_record, checksum));
+
+	return checksum_update(hash, &rec->data, sizeof(rec->data));
+}
+
+static bool record_valid(const struct stats_record *rec)
+{
+	return rec->checksum == record_checksum(rec);
+}
+
+static unsigned int checkpoint_checksum(const struct stats_checkpoint *cp)
+{
+	return checksum_update(CHECKSUM_INIT, cp,
+				offsetof(struct stats_checkpoint, checksum));
+}
+
+static bool offset_valid(struct stats_file *file, unsigned int off)
+{
+	if (off < sizeof(struct stats_file_header) ||
+			off + sizeof(struct stats_record) > file->len)
+		return false;
+
+	off -= sizeof(struct stats_file_header);
+
+	return off % sizeof(struct stats_record) == 0;
+}
+
+static struct stats_checkpoint *get_checkpoint(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_checkpoint *cp = NULL, *it;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		it = &hdr->checkpoint[i];
+
+		if (it->checksum != checkpoint_checksum(it) ||
+				!offset_valid(file, it->begin) ||
+				!offset_valid(file, it->end))
+			continue;
+
+		if (!cp || (int)(it->seq - cp->seq) > 0)
+			cp = it;
+	}
+
+	return cp;
+}
+
+/*
+ * Called when no record is pending in the page cache anymore, e.g. when
+ * closing the file. Everything up to 'end' is synced before the
+ * checkpoint refers to it, so a checkpoint never points to a record
+ * which did not make it to the disk.
+ */
+static void stats_file_checkpoint(struct stats_file *file)
+{
+	struct stats_checkpoint *cp;
+	unsigned int seq;
+
+	if (!file->dirty)
+		return;
+
+	if (msync(file->addr, file->len, MS_SYNC) < 0) {
+		connman_warn("msync error %s for %s", strerror(errno),
+								file->name);
+		return;
+	}
+
+	cp = get_checkpoint(file);
+	seq = cp ? cp->seq + 1 : 1;
+
+	cp = &get_hdr(file)->checkpoint[seq % 2];
+	cp->seq = seq;
+	cp->begin = get_hdr(file)->begin;
+	cp->end = get_hdr(file)->end;
+	cp->checksum = checkpoint_checksum(cp);
+
+	/* the header is in the first page */
+	msync(file->addr, sysconf(_SC_PAGESIZE), MS_SYNC);
+
+	file->dirty = false;
+}
+
+static void stats_file_sync(struct stats_file *file)
+{
+	/* records moved to the history are kept until it is synced */
+	if (file->history)
+		stats_file_sync(file->history);
+
+	if (!file->dirty)
+		return;
+
+	if (file->usage.addr)
+		msync(file->usage.addr, file->usage.len, MS_SYNC);
+
+	stats_file_checkpoint(file);
+}
+
+static gboolean sync_cb(gpointer user_data)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	sync_timeout = 0;
+
+	g_hash_table_iter_init(&iter, stats_hash);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		stats_file_sync(value);
+
+	return FALSE;
+}
+
+static void stats_file_set_dirty(struct stats_file *file)
+{
+	unsigned int interval;
+
+	file->dirty = true;
+
+	if (sync_timeout)
+		return;
+
+	/* without an interval, only page writeback and closing sync */
+	interval = connman_setting_get_uint("StatisticsSyncInterval");
+	if (interval)
+		sync_timeout = g_timeout_add_seconds(interval, sync_cb, NULL);
+}
+
+static void usage_file_close(struct usage_file *usage)
+{
+	if (usage->addr) {
+		msync(usage->addr, usage->len, MS_SYNC);
+		munmap(usage->addr, usage->len);
+		usage->addr = NULL;
+	}
+
+	if (usage->fd >= 0) {
+		close(usage->fd);
+		usage->fd = -1;
+	}
+
+	g_free(usage->name);
+	usage->name = NULL;
+}
+
 static void stats_free(gpointer user_data)
 {
 	struct stats_file *file = user_data;
@@ -221,16 +545,22 @@ static void stats_free(gpointer user_data)
 	if (!file)
 		return;
 
-	msync(file->addr, file->len, MS_SYNC);
+	stats_free(file->history);
+	file->history = NULL;
 
-	munmap(file->addr, file->len);
-	file->addr = NULL;
+	usage_file_close(&file->usage);
 
-	close(file->fd);
-	file->fd = -1;
+	if (file->addr) {
+		stats_file_checkpoint(file);
 
-	g_free(file->history_name);
-	file->history_name = NULL;
+		munmap(file->addr, file->len);
+		file->addr = NULL;
+	}
+
+	if (file->fd >= 0) {
+		close(file->fd);
+		file->fd = -1;
+	}
 
 	g_free(file->name);
 	file->name = NULL;
@@ -342,19 +672,285 @@ static int stats_open(struct stats_file *file,
 	return 0;
 }
 
-static int stats_open_temp(struct stats_file *file)
+static int append_record(struct stats_file *file,
+				struct stats_record *rec);
+
+/* first day of the accounting period date is in */
+static void account_period_start(GDate *date, int account_period_offset)
 {
-	file->name = g_strdup_printf("%s/stats.XXXXXX.tmp",
-					STORAGEDIR);
-	file->fd = g_mkstemp_full(file->name, O_RDWR | O_CREAT, 0644);
-	if (file->fd < 0) {
-		connman_error("create temporary file error %s for %s",
-				strerror(errno), file->name);
-		g_free(file->name);
-		file->name = NULL;
-		return -errno;
+	unsigned int days;
+
+	if (g_date_get_day(date) < account_period_offset)
+		g_date_subtract_months(date, 1);
+
+	days = g_date_get_days_in_month(g_date_get_month(date),
+					g_date_get_year(date));
+
+	g_date_set_day(date, MIN((unsigned int)account_period_offset, days));
+}
+
+static bool same_period(struct stats_file *file, time_t a, time_t b)
+{
+	GDate date_a, date_b;
+
+	g_date_set_time_t(&date_a, a);
+	g_date_set_time_t(&date_b, b);
+
+	if (file->period == STATS_PERIOD_MONTH) {
+		account_period_start(&date_a, file->account_period_offset);
+		account_period_start(&date_b, file->account_period_offset);
+	}
+
+	return g_date_compare(&date_a, &date_b) == 0;
+}
+
+/*
+ * Adds a record moved out of the ring buffer the history file belongs
+ * to. The counters are cumulated, so the newest record of a period is
+ * all that needs to be kept of it.
+ */
+static void history_add(struct stats_file *file, struct stats_record *rec)
+{
+	struct stats_record *latest;
+
+	/* moved already before a checkpoint was missed */
+	if ((file->home && rec->ts < file->home->ts) ||
+			(file->roaming && rec->ts < file->roaming->ts))
+		return;
+
+	latest = rec->roaming ? file->roaming : file->home;
+	if (!latest || !same_period(file, latest->ts, rec->ts)) {
+		append_record(file, rec);
+		return;
+	}
+
+	memcpy(latest, rec, sizeof(struct stats_record));
+	latest->checksum = record_checksum(latest);
+
+	stats_file_set_dirty(file);
+}
+
+/* makes room for one record by moving the oldest one to the history */
+static void stats_file_evict(struct stats_file *file)
+{
+	struct stats_record *oldest;
+
+	oldest = get_iterator_begin(file);
+
+	if (file->history && record_valid(oldest))
+		history_add(file->history, oldest);
+
+	if (oldest == file->home)
+		set_home(file, NULL);
+	if (oldest == file->roaming)
+		set_roaming(file, NULL);
+
+	set_begin(file, oldest);
+}
+
+static struct stats_record *find_latest(struct stats_file *file,
+						bool roaming)
+{
+	struct stats_record *begin, *it;
+
+	begin = get_begin(file);
+
+	for (it = get_end(file); it != begin; it = get_prev(file, it)) {
+		if (!!it->roaming == roaming && record_valid(it))
+			return it;
+	}
+
+	return NULL;
+}
+
+/*
+ * Restores the indexes after the file was not closed properly. The
+ * records following the checkpoint have been written back by the
+ * kernel, or not, or only partly. They are taken until the first one
+ * with a wrong checksum or which is older than its predecessor, which
+ * is an entry of the previous round through the ring buffer.
+ */
+static int stats_file_recover(struct stats_file *file)
+{
+	struct stats_file_header *hdr = get_hdr(file);
+	struct stats_checkpoint *cp;
+	struct stats_record *end, *next;
+	unsigned int nr, max_entries;
+	time_t limit;
+
+	cp = get_checkpoint(file);
+	if (cp) {
+		hdr->begin = cp->begin;
+		hdr->end = cp->end;
+	} else if (!offset_valid(file, hdr->begin) ||
+			!offset_valid(file, hdr->end)) {
+		return -EINVAL;
+	}
+
+	limit = time(NULL) + MAX_CLOCK_SKEW;
+	max_entries = file->last - file->first + 1;
+	end = get_end(file);
+
+	for (nr = 0; nr < max_entries; nr++) {
+		next = get_next(file, end);
+
+		if (!record_valid(next) || next->ts > limit)
+			break;
+
+		if (end != get_begin(file) && next->ts < end->ts)
+			break;
+
+		if (next == get_begin(file))
+			stats_file_evict(file);
+
+		set_end(file, next);
+		end = next;
 	}
 
+	if (nr > 0)
+		DBG("file %s %u records after checkpoint", file->name, nr);
+
+	set_home(file, find_latest(file, false));
+	set_roaming(file, find_latest(file, true));
+
+	return 0;
+}
+
+static bool stats_file_old_offset_valid(struct stats_file *file,
+					const struct stats_layout *layout,
+					unsigned int off)
+{
+	if (off < layout->header_len ||
+			off + layout->record_len > file->len)
+		return false;
+
+	off -= layout->header_len;
+
+	return off % layout->record_len == 0;
+}
+
+static void stats_record_from_v1(struct stats_record *rec, const void *old)
+{
+	const struct stats_record_v1 *rec_v1 = old;
+
+	rec->ts = rec_v1->ts;
+	rec->roaming = rec_v1->roaming;
+	rec->data.rx_packets = rec_v1->data.rx_packets;
+	rec->data.tx_packets = rec_v1->data.tx_packets;
+	rec->data.rx_bytes = rec_v1->data.rx_bytes;
+	rec->data.tx_bytes = rec_v1->data.tx_bytes;
+	rec->data.rx_errors = rec_v1->data.rx_errors;
+	rec->data.tx_errors = rec_v1->data.tx_errors;
+	rec->data.rx_dropped = rec_v1->data.rx_dropped;
+	rec->data.tx_dropped = rec_v1->data.tx_dropped;
+	rec->data.time = rec_v1->data.time;
+}
+
+static void stats_record_from_v2(struct stats_record *rec, const void *old)
+{
+	const struct stats_record_v2 *rec_v2 = old;
+
+	rec->ts = rec_v2->ts;
+	rec->roaming = rec_v2->roaming;
+	memcpy(&rec->data, &rec_v2->data, sizeof(rec->data));
+}
+
+static const struct stats_layout layout_v1 = {
+	.header_len = sizeof(struct stats_file_header_v1),
+	.record_len = sizeof(struct stats_record_v1),
+	.convert = stats_record_from_v1,
+};
+
+static const struct stats_layout layout_v2 = {
+	.header_len = sizeof(struct stats_file_header_v2),
+	.record_len = sizeof(struct stats_record_v2),
+	.convert = stats_record_from_v2,
+};
+
+/*
+ * Converts a file with an older layout in place. The records are
+ * copied out of the ring buffer first, because the new header is
+ * larger and the new records overwrite the old ones. Appending them
+ * sets the home and roaming indexes again.
+ */
+static int stats_file_migrate(struct stats_file *file,
+				const struct stats_layout *layout,
+				unsigned int begin, unsigned int end)
+{
+	struct stats_file_header *hdr;
+	char *first, *last, *it;
+	struct stats_record *records;
+	unsigned int max_entries, nr = 0, i;
+
+	if (!stats_file_old_offset_valid(file, layout, begin) ||
+			!stats_file_old_offset_valid(file, layout, end))
+		return -EINVAL;
+
+	max_entries = (file->len - layout->header_len) / layout->record_len;
+
+	records = g_try_new0(struct stats_record, max_entries);
+	if (!records)
+		return -ENOMEM;
+
+	first = file->addr + layout->header_len;
+	last = first + (max_entries - 1) * layout->record_len;
+	it = file->addr + begin;
+
+	/* the valid records are (begin, end] */
+	while (it != file->addr + end && nr < max_entries) {
+		it = it == last ? first : it + layout->record_len;
+
+		layout->convert(&records[nr++], it);
+	}
+
+	DBG("file %s %u records", file->name, nr);
+
+	hdr = get_hdr(file);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = MAGIC;
+	hdr->version = STATS_FILE_VERSION;
+	hdr->begin = sizeof(struct stats_file_header);
+	hdr->end = sizeof(struct stats_file_header);
+	hdr->home = UINT_MAX;
+	hdr->roaming = UINT_MAX;
+
+	stats_file_update_cache(file);
+
+	for (i = 0; i < nr; i++) {
+		if (append_record(file, &records[i]) < 0)
+			break;
+	}
+
+	g_free(records);
+
+	return 0;
+}
+
+/*
+ * Keeps a copy of a file which could not be converted next to it, as
+ * name.v<version>, so that starting over does not lose its records.
+ * The file is left alone when the copy fails.
+ */
+static int stats_file_set_aside(struct stats_file *file,
+				unsigned int version, int err)
+{
+	GError *error = NULL;
+	char *name;
+
+	name = g_strdup_printf("%s.v%u", file->name, version);
+
+	connman_warn("Cannot convert statistics file %s: %s, moving it "
+				"to %s", file->name, strerror(-err), name);
+
+	if (!g_file_set_contents(name, file->addr, file->len, &error)) {
+		connman_error("Cannot save %s: %s", name, error->message);
+		g_error_free(error);
+		g_free(name);
+		return err;
+	}
+
+	g_free(name);
+
 	return 0;
 }
 
@@ -398,279 +994,328 @@ static int stats_file_setup(struct stats_file *file)
 
 	hdr = get_hdr(file);
 
-	if (hdr->magic != MAGIC ||
-			hdr->begin < sizeof(struct stats_file_header) ||
-			hdr->end < sizeof(struct stats_file_header) ||
-			hdr->home < sizeof(struct stats_file_header) ||
-			hdr->roaming < sizeof(struct stats_file_header) ||
-			hdr->begin > file->len ||
-			hdr->end > file->len) {
-		hdr->magic = MAGIC;
-		hdr->begin = sizeof(struct stats_file_header);
-		hdr->end = sizeof(struct stats_file_header);
-		hdr->home = UINT_MAX;
-		hdr->roaming = UINT_MAX;
+	if (hdr->magic == MAGIC_V1) {
+		struct stats_file_header_v1 *hdr_v1 = (void *)hdr;
 
-		stats_file_update_cache(file);
+		err = stats_file_migrate(file, &layout_v1, hdr_v1->begin,
+							hdr_v1->end);
+		if (err < 0)
+			err = stats_file_set_aside(file, 1, err);
+	} else if (hdr->magic == MAGIC && hdr->version == 2) {
+		struct stats_file_header_v2 *hdr_v2 = (void *)hdr;
+
+		err = stats_file_migrate(file, &layout_v2, hdr_v2->begin,
+							hdr_v2->end);
+		if (err < 0)
+			err = stats_file_set_aside(file, 2, err);
 	}
 
-	return 0;
-}
+	if (err < 0) {
+		munmap(file->addr, file->len);
+		file->addr = NULL;
+		close(file->fd);
+		file->fd = -1;
+		g_free(file->name);
+		file->name = NULL;
 
+		return err;
+	}
 
-static struct stats_record *get_next_record(struct stats_iter *iter)
-{
-	if (iter->it != iter->end) {
-		struct stats_record *tmp;
+	if (hdr->magic == MAGIC && hdr->version == STATS_FILE_VERSION &&
+					stats_file_recover(file) == 0)
+		return 0;
 
-		tmp = iter->it;
-		iter->it = get_next(iter->file, iter->it);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = MAGIC;
+	hdr->version = STATS_FILE_VERSION;
+	hdr->begin = sizeof(struct stats_file_header);
+	hdr->end = sizeof(struct stats_file_header);
+	hdr->home = UINT_MAX;
+	hdr->roaming = UINT_MAX;
 
-		return tmp;
-	}
+	stats_file_update_cache(file);
+	stats_file_set_dirty(file);
 
-	return NULL;
+	return 0;
 }
 
 static int append_record(struct stats_file *file,
 				struct stats_record *rec)
 {
-	struct stats_record *cur, *next;
+	struct stats_record *next;
 	int err;
 
-	if (file->last == get_end(file)) {
+	if (file->len < file->max_len && file->last == get_end(file)) {
+		DBG("grow file %s", file->name);
+
 		err = stats_file_remap(file, file->len +
 					sysconf(_SC_PAGESIZE));
 		if (err < 0)
 			return err;
-
-		stats_file_update_cache(file);
 	}
 
-	cur = get_end(file);
-	next = get_next(file, cur);
+	next = get_next(file, get_end(file));
+
+	if (next == get_begin(file))
+		stats_file_evict(file);
 
 	memcpy(next, rec, sizeof(struct stats_record));
+	next->checksum = record_checksum(next);
+
+	if (next->roaming)
+		set_roaming(file, next);
+	else
+		set_home(file, next);
 
 	set_end(file, next);
 
+	stats_file_set_dirty(file);
+
 	return 0;
 }
 
-static struct stats_record *process_file(struct stats_iter *iter,
-					struct stats_file *temp_file,
-					struct stats_record *cur,
-					GDate *date_change_step_size,
-					int account_period_offset)
+static struct usage_file_header *usage_get_hdr(struct usage_file *usage)
 {
-	struct stats_record *home, *roaming;
-	struct stats_record *next;
-
-	home = NULL;
-	roaming = NULL;
-
-	if (!cur)
-		cur = get_next_record(iter);
-	next = get_next_record(iter);
-
-	while (next) {
-		GDate date_cur;
-		GDate date_next;
-		bool append;
-
-		append = false;
-
-		if (cur->roaming)
-			roaming = cur;
-		else
-			home = cur;
-
-		g_date_set_time_t(&date_cur, cur->ts);
-		g_date_set_time_t(&date_next, next->ts);
+	return (struct usage_file_header *)usage->addr;
+}
 
-		if (g_date_compare(&date_cur, date_change_step_size) < 0) {
-			/* month period size */
-			GDateDay day_cur, day_next;
-			GDateMonth month_cur, month_next;
+static struct connman_stats_usage *usage_get_bucket(struct usage_file *usage,
+				enum connman_stats_resolution resolution,
+				unsigned int index)
+{
+	struct usage_series *series;
 
-			month_cur = g_date_get_month(&date_cur);
-			month_next = g_date_get_month(&date_next);
+	series = &usage_get_hdr(usage)->series[resolution];
 
-			day_cur = g_date_get_day(&date_cur);
-			day_next = g_date_get_day(&date_next);
+	return &usage->buckets[resolution][(series->begin + index) %
+					usage_capacity[resolution]];
+}
 
-			if (day_cur == day_next && month_cur != month_next) {
-				append = true;
-			} else if (day_cur < account_period_offset &&
-					day_next >= account_period_offset) {
-				append = true;
-			}
-		} else {
-			/* day period size */
-			if (g_date_days_between(&date_cur, &date_next) > 0)
-				append = true;
-		}
+static time_t usage_bucket_start(enum connman_stats_resolution resolution,
+					time_t ts)
+{
+	struct tm tm;
 
-		if (append) {
-			if (home) {
-				append_record(temp_file, home);
-				home = NULL;
-			}
+	if (resolution == CONNMAN_STATS_RESOLUTION_HOUR)
+		return ts - ts % 3600;
 
-			if (roaming) {
-				append_record(temp_file, roaming);
-				roaming = NULL;
-			}
-		}
+	/* days and months follow the local calendar like the history */
+	localtime_r(&ts, &tm);
+	tm.tm_sec = 0;
+	tm.tm_min = 0;
+	tm.tm_hour = 0;
+	tm.tm_isdst = -1;
 
-		cur = next;
-		next = get_next_record(iter);
-	}
+	if (resolution == CONNMAN_STATS_RESOLUTION_MONTH)
+		tm.tm_mday = 1;
 
-	return cur;
+	return mktime(&tm);
 }
 
-static int summarize(struct stats_file *data_file,
-			struct stats_file *history_file,
-			struct stats_file *temp_file)
+static uint64_t counter_delta(uint64_t cur, uint64_t prev)
 {
-	struct stats_iter data_iter;
-	struct stats_iter history_iter;
-	struct stats_record *cur, *next;
+	/* the counters start over after ResetCounters */
+	return cur >= prev ? cur - prev : cur;
+}
 
-	GDate today, date_change_step_size;
+static void usage_add(struct usage_file *usage, time_t ts, bool roaming,
+				const struct connman_stats_data *data,
+				const struct connman_stats_data *prev)
+{
+	uint64_t rx_bytes, tx_bytes, rx_packets, tx_packets;
+	struct usage_file_header *hdr = usage_get_hdr(usage);
+	int i;
 
-	/*
-	 * First calculate the date when switch from monthly
-	 * accounting period size to daily size
-	 */
-	g_date_set_time_t(&today, time(NULL));
+	rx_bytes = counter_delta(data->rx_bytes, prev->rx_bytes);
+	tx_bytes = counter_delta(data->tx_bytes, prev->tx_bytes);
+	rx_packets = counter_delta(data->rx_packets, prev->rx_packets);
+	tx_packets = counter_delta(data->tx_packets, prev->tx_packets);
 
-	date_change_step_size = today;
-	if (g_date_get_day(&today) - data_file->account_period_offset >= 0)
-		g_date_subtract_months(&date_change_step_size, 2);
-	else
-		g_date_subtract_months(&date_change_step_size, 3);
+	if (!rx_bytes && !tx_bytes && !rx_packets && !tx_packets)
+		return;
 
-	g_date_set_day(&date_change_step_size,
-			data_file->account_period_offset);
+	for (i = 0; i < CONNMAN_STATS_RESOLUTION_MAX; i++) {
+		struct usage_series *series = &hdr->series[i];
+		struct connman_stats_usage *bucket = NULL;
+		time_t start = usage_bucket_start(i, ts);
 
+		/*
+		 * If the clock went back, the traffic is added to the last
+		 * bucket so that the series stays sorted.
+		 */
+		if (series->count > 0) {
+			bucket = usage_get_bucket(usage, i, series->count - 1);
+			if (bucket->start < start)
+				bucket = NULL;
+		}
 
-	/* Now process history file */
-	cur = NULL;
+		if (!bucket) {
+			if (series->count == usage_capacity[i]) {
+				series->begin = (series->begin + 1) %
+							usage_capacity[i];
+				series->count--;
+			}
 
-	if (history_file) {
-		history_iter.file = history_file;
-		history_iter.begin = get_iterator_begin(history_iter.file);
-		history_iter.end = get_iterator_end(history_iter.file);
-		history_iter.it = history_iter.begin;
+			bucket = usage_get_bucket(usage, i, series->count);
+			memset(bucket, 0, sizeof(*bucket));
+			bucket->start = start;
+			series->count++;
+		}
 
-		cur = process_file(&history_iter, temp_file, NULL,
-					&date_change_step_size,
-					data_file->account_period_offset);
+		if (roaming) {
+			bucket->roaming_rx_bytes += rx_bytes;
+			bucket->roaming_tx_bytes += tx_bytes;
+			bucket->roaming_rx_packets += rx_packets;
+			bucket->roaming_tx_packets += tx_packets;
+		} else {
+			bucket->rx_bytes += rx_bytes;
+			bucket->tx_bytes += tx_bytes;
+			bucket->rx_packets += rx_packets;
+			bucket->tx_packets += tx_packets;
+		}
 	}
+}
 
-	data_iter.file = data_file;
-	data_iter.begin = get_iterator_begin(data_iter.file);
-	data_iter.end = get_iterator_end(data_iter.file);
-	data_iter.it = data_iter.begin;
-
-	/*
-	 * Ensure date_file records are newer than the history_file
-	 * record
-	 */
-	if (cur) {
-		next = get_next_record(&data_iter);
-		while (next && cur->ts > next->ts)
-			next = get_next_record(&data_iter);
+static void usage_fill_from_records(struct stats_file *file)
+{
+	struct stats_record *it, *end, *prev;
+	struct stats_record *home = NULL, *roaming = NULL;
+
+	end = get_iterator_end(file);
+	for (it = get_iterator_begin(file); it != end;
+					it = get_next(file, it)) {
+		prev = it->roaming ? roaming : home;
+		if (prev)
+			usage_add(&file->usage, it->ts, it->roaming,
+						&it->data, &prev->data);
+
+		if (it->roaming)
+			roaming = it;
+		else
+			home = it;
 	}
+}
 
-	/* And finally process the new data records */
-	cur = process_file(&data_iter, temp_file, cur,
-				&date_change_step_size,
-				data_file->account_period_offset);
+static bool usage_file_valid(struct usage_file *usage)
+{
+	struct usage_file_header *hdr = usage_get_hdr(usage);
+	int i;
 
-	if (cur)
-		append_record(temp_file, cur);
+	if (hdr->magic != USAGE_MAGIC || hdr->version != USAGE_VERSION)
+		return false;
 
-	return 0;
-}
+	for (i = 0; i < CONNMAN_STATS_RESOLUTION_MAX; i++) {
+		if (hdr->capacity[i] != usage_capacity[i] ||
+				hdr->series[i].begin >= usage_capacity[i] ||
+				hdr->series[i].count > usage_capacity[i])
+			return false;
+	}
 
-static void stats_file_unmap(struct stats_file *file)
-{
-	msync(file->addr, file->len, MS_SYNC);
-	munmap(file->addr, file->len);
-	file->addr = NULL;
+	return true;
 }
 
-static void stats_file_cleanup(struct stats_file *file)
+static int usage_file_open(struct stats_file *file, const char *name)
 {
-	file->fd = -1;
-	g_free(file->name);
-	file->name = NULL;
-}
+	struct usage_file *usage = &file->usage;
+	struct usage_file_header *hdr;
+	size_t len = USAGE_HEADER_LEN;
+	struct stat st;
+	char *addr;
+	int i, err;
 
-static int stats_file_close_swap(struct stats_file *history_file,
-					struct stats_file *temp_file)
-{
-	int err;
+	for (i = 0; i < CONNMAN_STATS_RESOLUTION_MAX; i++)
+		len += usage_capacity[i] * sizeof(struct connman_stats_usage);
 
-	stats_file_unmap(history_file);
-	stats_file_unmap(temp_file);
+	usage->fd = TFR(open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+	if (usage->fd < 0) {
+		err = -errno;
+		connman_error("open error %s for %s", strerror(-err), name);
+		return err;
+	}
 
-	close(temp_file->fd);
+	usage->name = g_strdup(name);
 
-	unlink(history_file->name);
+	if (fstat(usage->fd, &st) < 0 || (size_t)st.st_size != len) {
+		if (ftruncate(usage->fd, len) < 0) {
+			err = -errno;
+			connman_error("ftruncate error %s for %s",
+						strerror(-err), name);
+			usage_file_close(usage);
+			return err;
+		}
+	}
 
-	err = link(temp_file->name, history_file->name);
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+							usage->fd, 0);
+	if (addr == MAP_FAILED) {
+		err = -errno;
+		connman_error("mmap error %s for %s", strerror(-err), name);
+		usage_file_close(usage);
+		return err;
+	}
 
-	unlink(temp_file->name);
+	usage->addr = addr;
+	usage->len = len;
 
-	close(history_file->fd);
+	addr += USAGE_HEADER_LEN;
+	for (i = 0; i < CONNMAN_STATS_RESOLUTION_MAX; i++) {
+		usage->buckets[i] = (struct connman_stats_usage *)addr;
+		addr += usage_capacity[i] * sizeof(struct connman_stats_usage);
+	}
 
-	stats_file_cleanup(history_file);
-	stats_file_cleanup(temp_file);
+	if (usage_file_valid(usage))
+		return 0;
 
-	return err;
+	hdr = usage_get_hdr(usage);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = USAGE_MAGIC;
+	hdr->version = USAGE_VERSION;
+	for (i = 0; i < CONNMAN_STATS_RESOLUTION_MAX; i++)
+		hdr->capacity[i] = usage_capacity[i];
+
+	usage_fill_from_records(file);
+
+	return 0;
 }
 
-static int stats_file_history_update(struct stats_file *data_file)
+static struct stats_file *history_open(const char *identifier,
+					const char *name,
+					enum stats_period period,
+					struct stats_file *history)
 {
-	struct stats_file _history_file, *history_file;
-	struct stats_file _temp_file, *temp_file;
+	struct stats_file *file;
+	char *path;
 	int err;
 
-	history_file = &_history_file;
-	temp_file = &_temp_file;
+	file = g_new0(struct stats_file, 1);
+	file->fd = -1;
+	file->usage.fd = -1;
+	file->period = period;
+	file->history = history;
 
-	bzero(history_file, sizeof(struct stats_file));
-	bzero(temp_file, sizeof(struct stats_file));
+	/* TODO: Use a global config file instead of hard coded value. */
+	file->account_period_offset = 1;
 
-	history_file->fd = -1;
-	temp_file->fd = -1;
+	path = g_strdup_printf("%s/%s/%s", STORAGEDIR, identifier, name);
+	err = stats_open(file, path);
+	g_free(path);
 
-	err = stats_open(history_file, data_file->history_name);
-	if (err < 0)
-		return err;
-	stats_file_setup(history_file);
+	if (err == 0)
+		err = stats_file_setup(file);
 
-	err = stats_open_temp(temp_file);
 	if (err < 0) {
-		stats_free(history_file);
-		return err;
+		connman_warn("Cannot open %s file of %s", name, identifier);
+		stats_free(file);
+		return NULL;
 	}
-	stats_file_setup(temp_file);
-
-	summarize(data_file, history_file, temp_file);
-
-	err = stats_file_close_swap(history_file, temp_file);
 
-	return err;
+	return file;
 }
 
 int __connman_stats_service_register(struct connman_service *service)
 {
 	struct stats_file *file;
+	const char *identifier;
 	char *name, *dir;
 	int err;
 
@@ -699,16 +1344,22 @@ int __connman_stats_service_register(struct connman_service *service)
 			return -ENOMEM;
 
 		file->fd = -1;
+		file->usage.fd = -1;
 
 		g_hash_table_insert(stats_hash, service, file);
 	} else {
 		return -EALREADY;
 	}
 
-	name = g_strdup_printf("%s/%s/data", STORAGEDIR,
-				connman_service_get_identifier(service));
-	file->history_name = g_strdup_printf("%s/%s/history", STORAGEDIR,
-				connman_service_get_identifier(service));
+	identifier = connman_service_get_identifier(service);
+
+	/* without history files the old records are dropped */
+	file->history = history_open(identifier, "monthly",
+						STATS_PERIOD_MONTH, NULL);
+	file->history = history_open(identifier, "history",
+					STATS_PERIOD_DAY, file->history);
+
+	name = g_strdup_printf("%s/%s/data", STORAGEDIR, identifier);
 
 	/* TODO: Use a global config file instead of hard coded value. */
 	file->account_period_offset = 1;
@@ -722,6 +1373,11 @@ int __connman_stats_service_register(struct connman_service *service)
 	if (err < 0)
 		goto err;
 
+	/* without the usage file only GetUsage fails */
+	name = g_strdup_printf("%s/%s/usage", STORAGEDIR, identifier);
+	usage_file_open(file, name);
+	g_free(name);
+
 	return 0;
 
 err:
@@ -742,45 +1398,24 @@ int  __connman_stats_update(struct connman_service *service,
 				struct connman_stats_data *data)
 {
 	struct stats_file *file;
-	struct stats_record *next;
-	int err;
+	struct stats_record rec, *prev;
 
 	file = g_hash_table_lookup(stats_hash, service);
 	if (!file)
 		return -EEXIST;
 
-	if (file->len < file->max_len &&
-			file->last == get_end(file)) {
-		DBG("grow file %s", file->name);
-
-		err = stats_file_remap(file, file->len + sysconf(_SC_PAGESIZE));
-		if (err < 0)
-			return err;
-	}
-
-	next = get_next(file, get_end(file));
-
-	if (next == get_begin(file)) {
-		DBG("ring buffer is full, update history file");
-
-		if (stats_file_history_update(file) < 0) {
-			connman_warn("history file update failed %s",
-					file->history_name);
-		}
-	}
+	/* the checksum covers the padding as well */
+	memset(&rec, 0, sizeof(rec));
+	rec.ts = time(NULL);
+	rec.roaming = roaming;
+	memcpy(&rec.data, data, sizeof(struct connman_stats_data));
 
-	next->ts = time(NULL);
-	next->roaming = roaming;
-	memcpy(&next->data, data, sizeof(struct connman_stats_data));
-
-	if (!roaming)
-		set_home(file, next);
-	else
-		set_roaming(file, next);
-
-	set_end(file, next);
+	/* before rec is appended, the latest record is the previous one */
+	prev = get_latest(file, roaming);
+	if (prev && file->usage.addr)
+		usage_add(&file->usage, rec.ts, roaming, data, &prev->data);
 
-	return 0;
+	return append_record(file, &rec);
 }
 
 int __connman_stats_get(struct connman_service *service,
@@ -794,11 +1429,7 @@ int __connman_stats_get(struct connman_service *service,
 	if (!file)
 		return -EEXIST;
 
-	if (!roaming)
-		rec = file->home;
-	else
-		rec = file->roaming;
-
+	rec = get_latest(file, roaming);
 	if (rec) {
 		memcpy(data, &rec->data,
 			sizeof(struct connman_stats_data));
@@ -807,6 +1438,54 @@ int __connman_stats_get(struct connman_service *service,
 	return 0;
 }
 
+int __connman_stats_get_usage(struct connman_service *service,
+				enum connman_stats_resolution resolution,
+				time_t start, time_t end,
+				connman_stats_usage_cb_t cb, void *user_data)
+{
+	struct connman_stats_usage *bucket;
+	struct usage_series *series;
+	struct stats_file *file;
+	unsigned int low, high, mid;
+	time_t first;
+
+	file = g_hash_table_lookup(stats_hash, service);
+	if (!file)
+		return -EEXIST;
+
+	if (resolution >= CONNMAN_STATS_RESOLUTION_MAX)
+		return -EINVAL;
+
+	if (!file->usage.addr)
+		return -EIO;
+
+	series = &usage_get_hdr(&file->usage)->series[resolution];
+	first = usage_bucket_start(resolution, start);
+
+	/* first bucket not before the one containing start */
+	low = 0;
+	high = series->count;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+
+		if (usage_get_bucket(&file->usage, resolution,
+						mid)->start < first)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	for (; low < series->count; low++) {
+		bucket = usage_get_bucket(&file->usage, resolution, low);
+		if (bucket->start >= end)
+			break;
+
+		cb(bucket, user_data);
+	}
+
+	return 0;
+}
+
 int __connman_stats_init(void)
 {
 	DBG("");
@@ -821,6 +1500,11 @@ void __connman_stats_cleanup(void)
 {
 	DBG("");
 
+	if (sync_timeout) {
+		g_source_remove(sync_timeout);
+		sync_timeout = 0;
+	}
+
 	g_hash_table_destroy(stats_hash);
 	stats_hash = NULL;
 }
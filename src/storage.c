@@ -38,6 +38,29 @@
 #define MODE		(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | \
 			S_IXGRP | S_IROTH | S_IXOTH)
 
+/*
+ * Service settings are written behind. A save only keeps the new
+ * contents, which reach the disk ServiceSaveDelay seconds after the
+ * first unwritten save of the service, so that a burst of changes
+ * costs one write. Loads see the pending contents and removing the
+ * service drops them. Before __connman_storage_init(), and without a
+ * delay as in connman-vpnd, every save is written at once.
+ */
+struct pending_save {
+	char *service_id;
+	gchar *data;
+	gsize length;
+	guint timeout;
+};
+
+static GHashTable *pending_saves;
+static unsigned int save_delay;
+
+/* write amplification: saves requested against files written */
+static unsigned int save_requests;
+static unsigned int save_writes;
+static unsigned long long save_bytes;
+
 static GKeyFile *storage_load(const char *pathname)
 {
 	GKeyFile *keyfile = NULL;
@@ -56,21 +79,30 @@ static GKeyFile *storage_load(const char *pathname)
 	return keyfile;
 }
 
-static int storage_save(GKeyFile *keyfile, char *pathname)
+static int storage_write(const char *pathname, const gchar *data,
+							gsize length)
 {
-	gchar *data = NULL;
-	gsize length = 0;
 	GError *error = NULL;
-	int ret = 0;
-
-	data = g_key_file_to_data(keyfile, &length, NULL);
 
 	if (!g_file_set_contents(pathname, data, length, &error)) {
 		DBG("Failed to store information: %s", error->message);
 		g_error_free(error);
-		ret = -EIO;
+		return -EIO;
 	}
 
+	return 0;
+}
+
+static int storage_save(GKeyFile *keyfile, char *pathname)
+{
+	gchar *data = NULL;
+	gsize length = 0;
+	int ret;
+
+	data = g_key_file_to_data(keyfile, &length, NULL);
+
+	ret = storage_write(pathname, data, length);
+
 	g_free(data);
 
 	return ret;
@@ -183,6 +215,11 @@ gchar **connman_storage_get_services(void)
 				strncmp(d->d_name, "provider_", 9) == 0)
 			continue;
 
+		/* added below, the settings file might not exist yet */
+		if (pending_saves &&
+				g_hash_table_lookup(pending_saves, d->d_name))
+			continue;
+
 		switch (d->d_type) {
 		case DT_DIR:
 		case DT_UNKNOWN:
@@ -204,6 +241,15 @@ gchar **connman_storage_get_services(void)
 
 	closedir(dir);
 
+	if (pending_saves) {
+		GHashTableIter iter;
+		gpointer key;
+
+		g_hash_table_iter_init(&iter, pending_saves);
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+			g_string_append_printf(result, "%s/", (char *) key);
+	}
+
 	str = g_string_free(result, FALSE);
 	if (str && str[0] != '\0') {
 		/*
@@ -220,8 +266,29 @@ gchar **connman_storage_get_services(void)
 
 GKeyFile *connman_storage_load_service(const char *service_id)
 {
+	struct pending_save *pending = NULL;
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
+	GError *error = NULL;
+
+	if (pending_saves)
+		pending = g_hash_table_lookup(pending_saves, service_id);
+
+	if (pending) {
+		keyfile = g_key_file_new();
+
+		if (!g_key_file_load_from_data(keyfile, pending->data,
+					pending->length, 0, &error)) {
+			DBG("Unable to load %s: %s", service_id,
+							error->message);
+			g_clear_error(&error);
+
+			g_key_file_free(keyfile);
+			keyfile = NULL;
+		}
+
+		return keyfile;
+	}
 
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if (!pathname)
@@ -233,10 +300,58 @@ GKeyFile *connman_storage_load_service(const char *service_id)
 	return keyfile;
 }
 
+static int write_service(const char *service_id, const gchar *data,
+							gsize length)
+{
+	gchar *pathname;
+	int ret;
+
+	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id,
+								SETTINGS);
+
+	ret = storage_write(pathname, data, length);
+
+	g_free(pathname);
+
+	save_writes++;
+	save_bytes += length;
+
+	DBG("service %s saves %u writes %u bytes %llu", service_id,
+				save_requests, save_writes, save_bytes);
+
+	return ret;
+}
+
+static void pending_save_free(gpointer data)
+{
+	struct pending_save *pending = data;
+
+	if (pending->timeout)
+		g_source_remove(pending->timeout);
+
+	g_free(pending->service_id);
+	g_free(pending->data);
+	g_free(pending);
+}
+
+static gboolean pending_save_timeout(gpointer user_data)
+{
+	struct pending_save *pending = user_data;
+
+	pending->timeout = 0;
+
+	write_service(pending->service_id, pending->data, pending->length);
+	g_hash_table_remove(pending_saves, pending->service_id);
+
+	return FALSE;
+}
+
 int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 {
+	struct pending_save *pending;
+	gchar *data, *dirname;
+	gsize length = 0;
 	int ret = 0;
-	gchar *pathname, *dirname;
 
 	dirname = g_strdup_printf("%s/%s", STORAGEDIR, service_id);
 	if (!dirname)
@@ -252,15 +367,53 @@ int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 		}
 	}
 
-	pathname = g_strdup_printf("%s/%s", dirname, SETTINGS);
-
 	g_free(dirname);
 
-	ret = storage_save(keyfile, pathname);
+	data = g_key_file_to_data(keyfile, &length, NULL);
 
-	g_free(pathname);
+	save_requests++;
 
-	return ret;
+	if (!pending_saves || !save_delay) {
+		ret = write_service(service_id, data, length);
+		g_free(data);
+		return ret;
+	}
+
+	pending = g_hash_table_lookup(pending_saves, service_id);
+	if (!pending) {
+		pending = g_new0(struct pending_save, 1);
+		pending->service_id = g_strdup(service_id);
+		pending->timeout = g_timeout_add_seconds(save_delay,
+					pending_save_timeout, pending);
+
+		g_hash_table_replace(pending_saves, pending->service_id,
+								pending);
+	}
+
+	/* the newer contents replace the unwritten ones */
+	g_free(pending->data);
+	pending->data = data;
+	pending->length = length;
+
+	return 0;
+}
+
+void __connman_storage_flush(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (!pending_saves)
+		return;
+
+	g_hash_table_iter_init(&iter, pending_saves);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct pending_save *pending = value;
+
+		write_service(pending->service_id, pending->data,
+							pending->length);
+		g_hash_table_iter_remove(&iter);
+	}
 }
 
 static bool remove_file(const char *service_id, const char *file)
@@ -305,17 +458,29 @@ static bool remove_dir(const char *service_id)
 
 bool __connman_storage_remove_service(const char *service_id)
 {
+	static const char *stats_files[] = {
+		"data", "usage", "monthly", "history",
+		/* copies of files which could not be converted */
+		"data.v1", "data.v2",
+		NULL
+	};
 	bool removed;
+	int i;
+
+	if (pending_saves)
+		g_hash_table_remove(pending_saves, service_id);
 
 	/* Remove service configuration file */
 	removed = remove_file(service_id, SETTINGS);
 	if (!removed)
 		return false;
 
-	/* Remove the statistics file also */
-	removed = remove_file(service_id, "data");
-	if (!removed)
-		return false;
+	/* Remove the statistics files also */
+	for (i = 0; stats_files[i]; i++) {
+		removed = remove_file(service_id, stats_files[i]);
+		if (!removed)
+			return false;
+	}
 
 	removed = remove_dir(service_id);
 	if (!removed)
@@ -452,3 +617,44 @@ gchar **__connman_storage_get_providers(void)
 
 	return providers;
 }
+
+void __connman_storage_append_statistics(DBusMessageIter *dict)
+{
+	dbus_uint32_t requests = save_requests;
+	dbus_uint32_t writes = save_writes;
+	dbus_uint64_t bytes = save_bytes;
+
+	connman_dbus_dict_append_basic(dict, "SaveRequests",
+					DBUS_TYPE_UINT32, &requests);
+	connman_dbus_dict_append_basic(dict, "Writes",
+					DBUS_TYPE_UINT32, &writes);
+	connman_dbus_dict_append_basic(dict, "WrittenBytes",
+					DBUS_TYPE_UINT64, &bytes);
+}
+
+int __connman_storage_init(unsigned int delay)
+{
+	DBG("delay %u", delay);
+
+	save_delay = delay;
+
+	pending_saves = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, pending_save_free);
+
+	return 0;
+}
+
+void __connman_storage_cleanup(void)
+{
+	DBG("");
+
+	__connman_storage_flush();
+
+	if (save_requests)
+		connman_info("Service settings saved %u times in %u writes "
+				"of %llu bytes", save_requests, save_writes,
+				save_bytes);
+
+	g_hash_table_destroy(pending_saves);
+	pending_saves = NULL;
+}
@@ -0,0 +1,378 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "connman.h"
+
+/*
+ * Counts the heap allocations the internal dnsproxy makes per query.
+ * Like dnsproxy-standalone, the proxy runs inside this program, which
+ * also acts as its client and as its upstream DNS server. Every phase
+ * sends one query at a time and counts the calls to the malloc() family
+ * and to free() from sending the query until the reply arrived:
+ *
+ *	forward		a new name, the answer has TTL 0 and is not cached
+ *	cache insert	a new name, the answer is added to the cache
+ *	cache hit	a name answered from the cache
+ *
+ * Example:
+ *	dnsproxy-alloc 5353 127.0.0.2 1000
+ *
+ * Binding the upstream side requires the privilege to use port 53.
+ * The counting relies on the glibc allocator entry points, configure
+ * only builds this tool when they are available.
+ */
+
+#define MAX_MSG_LEN 512
+#define WARMUP_QUERIES 128
+#define CACHE_HIT_NAMES 64
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long alloc_count;
+static unsigned long alloc_bytes;
+static unsigned long free_count;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if (alignment % sizeof(void *) ||
+				alignment & (alignment - 1))
+		return EINVAL;
+
+	ptr = memalign(alignment, size);
+	if (!ptr && size)
+		return ENOMEM;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+void free(void *ptr)
+{
+	if (ptr)
+		free_count++;
+
+	__libc_free(ptr);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "%s: <listen-port> <dns-server> [queries]\n", prog);
+	exit(1);
+}
+
+static int create_socket(const char *addr, int port, bool do_bind)
+{
+	struct sockaddr_in sin;
+	int sk, err;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+		fprintf(stderr, "Invalid IPv4 address %s\n", addr);
+		return -EINVAL;
+	}
+
+	sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sk < 0)
+		return -errno;
+
+	if ((do_bind ? bind(sk, (struct sockaddr *)&sin, sizeof(sin)) :
+			connect(sk, (struct sockaddr *)&sin,
+						sizeof(sin))) < 0) {
+		err = -errno;
+		fprintf(stderr, "Cannot use %s port %d: %s\n", addr, port,
+							strerror(-err));
+		close(sk);
+		return err;
+	}
+
+	return sk;
+}
+
+static int build_query(unsigned char *buf, uint16_t id, const char *prefix,
+							unsigned int nr)
+{
+	char label[32];
+	int len, label_len;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		/* recursion desired */
+	buf[5] = 0x01;		/* one question */
+	len = 12;
+
+	/* multi label names so that no search domain is appended */
+	label_len = snprintf(label, sizeof(label), "%s%u", prefix, nr);
+	buf[len++] = label_len;
+	memcpy(buf + len, label, label_len);
+	len += label_len;
+
+	buf[len++] = 5;
+	memcpy(buf + len, "alloc", 5);
+	len += 5;
+
+	buf[len++] = 4;
+	memcpy(buf + len, "test", 4);
+	len += 4;
+
+	buf[len++] = 0;
+
+	buf[len++] = 0x00;	/* type A */
+	buf[len++] = 0x01;
+	buf[len++] = 0x00;	/* class IN */
+	buf[len++] = 0x01;
+
+	return len;
+}
+
+static int build_reply(unsigned char *buf, int len, uint32_t ttl)
+{
+	unsigned char answer[] = {
+		0xc0, 0x0c,		/* pointer to the question */
+		0x00, 0x01,		/* type A */
+		0x00, 0x01,		/* class IN */
+		0x00, 0x00, 0x00, 0x00,	/* ttl */
+		0x00, 0x04,		/* rdlen */
+		192, 0, 2, 1,		/* TEST-NET-1 address */
+	};
+
+	if (len < 12 || len + (int)sizeof(answer) > MAX_MSG_LEN)
+		return -ENOBUFS;
+
+	answer[6] = ttl >> 24;
+	answer[7] = ttl >> 16;
+	answer[8] = ttl >> 8;
+	answer[9] = ttl;
+
+	buf[2] |= 0x80;		/* qr */
+	buf[3] = 0x80;		/* ra, rcode 0 */
+	buf[6] = 0x00;		/* one answer */
+	buf[7] = 0x01;
+	buf[8] = buf[9] = buf[10] = buf[11] = 0;
+
+	memcpy(buf + len, answer, sizeof(answer));
+
+	return len + sizeof(answer);
+}
+
+/* runs the main loop until a datagram is waiting on sk */
+static int iterate_until_readable(int sk, unsigned char *buf,
+				struct sockaddr_in *from, socklen_t *from_len)
+{
+	int len;
+
+	while (1) {
+		len = recvfrom(sk, buf, MAX_MSG_LEN, MSG_DONTWAIT,
+					(struct sockaddr *)from, from_len);
+		if (len >= 0 || errno != EAGAIN)
+			return len;
+
+		g_main_context_iteration(NULL, TRUE);
+	}
+}
+
+static int exchange(int client_sk, int upstream_sk, const char *prefix,
+				unsigned int nr, bool forward, uint32_t ttl)
+{
+	unsigned char buf[MAX_MSG_LEN];
+	struct sockaddr_in from;
+	socklen_t from_len = sizeof(from);
+	int len;
+
+	len = build_query(buf, nr, prefix, nr);
+	if (send(client_sk, buf, len, 0) < 0)
+		return -errno;
+
+	if (forward) {
+		len = iterate_until_readable(upstream_sk, buf, &from,
+								&from_len);
+		if (len < 0)
+			return -errno;
+
+		len = build_reply(buf, len, ttl);
+		if (len < 0)
+			return len;
+
+		sendto(upstream_sk, buf, len, 0, (struct sockaddr *)&from,
+								from_len);
+	}
+
+	len = iterate_until_readable(client_sk, buf, NULL, NULL);
+	if (len < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void run_phase(const char *label, int client_sk, int upstream_sk,
+			const char *prefix, unsigned int count,
+			unsigned int names, bool forward, uint32_t ttl)
+{
+	unsigned long count_start, bytes_start, frees_start;
+	unsigned long allocs, bytes, frees;
+	unsigned int i;
+
+	count_start = alloc_count;
+	bytes_start = alloc_bytes;
+	frees_start = free_count;
+
+	for (i = 0; i < count; i++) {
+		if (exchange(client_sk, upstream_sk, prefix, i % names,
+						forward, ttl) < 0) {
+			fprintf(stderr, "query %u of %s failed\n", i, prefix);
+			return;
+		}
+	}
+
+	allocs = alloc_count - count_start;
+	bytes = alloc_bytes - bytes_start;
+	frees = free_count - frees_start;
+
+	if (!label)
+		return;
+
+	printf("%-14s %8u %12lu %10.2f %10.1f %10.2f\n", label, count,
+				allocs, (double)allocs / count,
+				(double)bytes / count, (double)frees / count);
+}
+
+int main(int argc, const char **argv)
+{
+	unsigned int port, count = 1000;
+	int client_sk, upstream_sk;
+	const char *server;
+
+	if (argc != 3 && argc != 4)
+		usage(argv[0]);
+
+	port = atoi(argv[1]);
+	server = argv[2];
+	if (argc == 4)
+		count = atoi(argv[3]);
+
+	if (!port || !count)
+		usage(argv[0]);
+
+	upstream_sk = create_socket(server, 53, true);
+	if (upstream_sk < 0)
+		return 1;
+
+	__connman_util_init();
+	__connman_dnsproxy_set_listen_port(port);
+
+	if (__connman_dnsproxy_init() < 0) {
+		fprintf(stderr, "failed to initialize dnsproxy\n");
+		return 1;
+	}
+
+	/* see dnsproxy-standalone, this enables the fallback server */
+	__connman_dnsproxy_append(-1, "alloc.test", server);
+	__connman_dnsproxy_append(15, "alloc.test", server);
+	__connman_dnsproxy_remove(15, "alloc.test", server);
+
+	client_sk = create_socket("127.0.0.1", port, false);
+	if (client_sk < 0)
+		return 1;
+
+	/* let the proxy size its tables and pools before counting */
+	run_phase(NULL, client_sk, upstream_sk, "w", WARMUP_QUERIES,
+					WARMUP_QUERIES, true, 0);
+
+	printf("%-14s %8s %12s %10s %10s %10s\n", "", "queries",
+				"allocations", "per query", "bytes/query",
+				"frees/query");
+
+	run_phase("forward", client_sk, upstream_sk, "f", count, count,
+								true, 0);
+	run_phase("cache insert", client_sk, upstream_sk, "c", count,
+						count, true, 3600);
+
+	/* fill the cache with the names for the last phase */
+	run_phase(NULL, client_sk, upstream_sk, "h", CACHE_HIT_NAMES,
+					CACHE_HIT_NAMES, true, 3600);
+	run_phase("cache hit", client_sk, upstream_sk, "h", count,
+					CACHE_HIT_NAMES, false, 0);
+
+	close(client_sk);
+	close(upstream_sk);
+
+	__connman_dnsproxy_cleanup();
+	__connman_util_cleanup();
+
+	return 0;
+}
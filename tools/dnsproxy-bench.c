@@ -0,0 +1,355 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+/*
+ * Replays synthetic query/reply bursts through a running dnsproxy
+ * (see tools/dnsproxy-standalone.c) while acting as its upstream DNS
+ * server. For every burst size all queries are put in flight first and
+ * the upstream replies are then released at once, so the time the proxy
+ * needs to turn them around is dominated by matching each reply to its
+ * pending request.
+ *
+ * Example:
+ *	dnsproxy-standalone 5353 bench.test 127.0.0.2 &
+ *	dnsproxy-bench --port 5353 --upstream 127.0.0.2 --count 4096
+ *
+ * Binding the upstream side requires the privilege to use port 53.
+ */
+
+#define MAX_MSG_LEN 512
+#define RECV_TIMEOUT_MS 2000
+
+struct pending_query {
+	unsigned char buf[MAX_MSG_LEN];
+	int len;
+};
+
+static gint option_port = 53;
+static gchar *option_upstream = NULL;
+static gint option_count = 4096;
+static gint option_rounds = 3;
+
+static GOptionEntry options[] = {
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &option_port,
+			"Local port dnsproxy listens on", "PORT" },
+	{ "upstream", 's', 0, G_OPTION_ARG_STRING, &option_upstream,
+			"Address dnsproxy uses as DNS server", "ADDR" },
+	{ "count", 'n', 0, G_OPTION_ARG_INT, &option_count,
+			"Largest number of queries in flight", "NR" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &option_rounds,
+			"Bursts per size, the best one is reported", "NR" },
+	{ NULL },
+};
+
+static int create_socket(const char *addr, int port, bool do_bind,
+				struct sockaddr_storage *sa, socklen_t *sa_len)
+{
+	struct addrinfo hints, *rp;
+	char service[8];
+	int rcvbuf = 4 * 1024 * 1024;
+	int sk, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+
+	snprintf(service, sizeof(service), "%d", port);
+
+	err = getaddrinfo(addr, service, &hints, &rp);
+	if (err) {
+		fprintf(stderr, "Invalid address %s: %s\n", addr,
+							gai_strerror(err));
+		return -EINVAL;
+	}
+
+	sk = socket(rp->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sk < 0) {
+		err = -errno;
+		freeaddrinfo(rp);
+		return err;
+	}
+
+	setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (do_bind && bind(sk, rp->ai_addr, rp->ai_addrlen) < 0) {
+		err = -errno;
+		fprintf(stderr, "Cannot bind to %s port %d: %s\n", addr, port,
+							strerror(-err));
+		close(sk);
+		freeaddrinfo(rp);
+		return err;
+	}
+
+	memcpy(sa, rp->ai_addr, rp->ai_addrlen);
+	*sa_len = rp->ai_addrlen;
+
+	freeaddrinfo(rp);
+
+	return sk;
+}
+
+static int recv_timeout(int sk, unsigned char *buf, size_t len,
+			struct sockaddr_storage *from, socklen_t *from_len)
+{
+	struct pollfd pfd = { .fd = sk, .events = POLLIN };
+	int err;
+
+	err = poll(&pfd, 1, RECV_TIMEOUT_MS);
+	if (err <= 0)
+		return -ETIMEDOUT;
+
+	if (from_len)
+		*from_len = sizeof(*from);
+
+	err = recvfrom(sk, buf, len, 0, (struct sockaddr *)from, from_len);
+	if (err < 0)
+		return -errno;
+
+	return err;
+}
+
+static int build_query(unsigned char *buf, uint16_t id, unsigned int round,
+							unsigned int nr)
+{
+	char label[32];
+	int len, label_len;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		/* recursion desired */
+	buf[5] = 0x01;		/* one question */
+	len = 12;
+
+	/*
+	 * Use a fresh, multi label name for every query so that the proxy
+	 * neither answers from its cache nor appends search domains.
+	 */
+	label_len = snprintf(label, sizeof(label), "r%u-q%u", round, nr);
+	buf[len++] = label_len;
+	memcpy(buf + len, label, label_len);
+	len += label_len;
+
+	buf[len++] = 5;
+	memcpy(buf + len, "bench", 5);
+	len += 5;
+
+	buf[len++] = 4;
+	memcpy(buf + len, "test", 4);
+	len += 4;
+
+	buf[len++] = 0;
+
+	buf[len++] = 0x00;	/* type A */
+	buf[len++] = 0x01;
+	buf[len++] = 0x00;	/* class IN */
+	buf[len++] = 0x01;
+
+	return len;
+}
+
+static int build_reply(struct pending_query *query)
+{
+	static const unsigned char answer[] = {
+		0xc0, 0x0c,		/* pointer to the question */
+		0x00, 0x01,		/* type A */
+		0x00, 0x01,		/* class IN */
+		0x00, 0x00, 0x0e, 0x10,	/* ttl 3600 */
+		0x00, 0x04,		/* rdlen */
+		192, 0, 2, 1,		/* TEST-NET-1 address */
+	};
+	unsigned char *buf = query->buf;
+
+	if (query->len + (int)sizeof(answer) > MAX_MSG_LEN)
+		return -ENOBUFS;
+
+	buf[2] |= 0x80;		/* qr */
+	buf[3] = 0x80;		/* ra, rcode 0 */
+	buf[6] = 0x00;		/* one answer */
+	buf[7] = 0x01;
+	buf[8] = buf[9] = buf[10] = buf[11] = 0;
+
+	memcpy(buf + query->len, answer, sizeof(answer));
+	query->len += sizeof(answer);
+
+	return query->len;
+}
+
+static gint64 run_burst(int client_sk, struct sockaddr_storage *proxy,
+			socklen_t proxy_len, int upstream_sk,
+			struct pending_query *queries, unsigned int count,
+			unsigned int round)
+{
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	unsigned char buf[MAX_MSG_LEN];
+	unsigned int i, replies = 0;
+	gint64 start;
+	int len;
+
+	for (i = 0; i < count; i++) {
+		len = build_query(buf, i, round, i);
+		if (sendto(client_sk, buf, len, 0, (struct sockaddr *)proxy,
+						proxy_len) < 0) {
+			fprintf(stderr, "Cannot send query: %s\n",
+							strerror(errno));
+			return -1;
+		}
+	}
+
+	/* collect the forwarded queries so that all are in flight */
+	for (i = 0; i < count; i++) {
+		len = recv_timeout(upstream_sk, queries[i].buf, MAX_MSG_LEN,
+					&from, &from_len);
+		if (len < 0) {
+			fprintf(stderr, "Only %u of %u queries forwarded\n",
+								i, count);
+			return -1;
+		}
+
+		queries[i].len = len;
+	}
+
+	/*
+	 * Reply newest first, the most expensive order for a request
+	 * lookup which scans the pending requests from the oldest one.
+	 */
+	start = g_get_monotonic_time();
+
+	for (i = count; i > 0; i--) {
+		struct pending_query *query = &queries[i - 1];
+
+		if (build_reply(query) < 0)
+			continue;
+
+		sendto(upstream_sk, query->buf, query->len, 0,
+				(struct sockaddr *)&from, from_len);
+	}
+
+	while (replies < count) {
+		if (recv_timeout(client_sk, buf, sizeof(buf), NULL, NULL) < 0)
+			break;
+
+		replies++;
+	}
+
+	if (replies < count) {
+		fprintf(stderr, "Only %u of %u replies received\n",
+							replies, count);
+		return -1;
+	}
+
+	return g_get_monotonic_time() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct sockaddr_storage proxy, upstream;
+	socklen_t proxy_len, upstream_len;
+	struct pending_query *queries;
+	int client_sk, upstream_sk;
+	unsigned int count, round = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (!option_upstream || option_count <= 0 || option_rounds <= 0) {
+		g_printerr("Upstream address and positive counts required\n");
+		exit(1);
+	}
+
+	upstream_sk = create_socket(option_upstream, 53, true,
+					&upstream, &upstream_len);
+	if (upstream_sk < 0)
+		exit(1);
+
+	client_sk = create_socket(strchr(option_upstream, ':') ?
+					"::1" : "127.0.0.1", option_port,
+					false, &proxy, &proxy_len);
+	if (client_sk < 0) {
+		close(upstream_sk);
+		exit(1);
+	}
+
+	queries = g_new0(struct pending_query, option_count);
+
+	printf("%10s %14s %14s\n", "in flight", "burst (usec)",
+							"per reply (usec)");
+
+	for (count = 16; count <= (unsigned int)option_count; count *= 2) {
+		gint64 best = -1;
+		int i;
+
+		for (i = 0; i < option_rounds; i++) {
+			gint64 elapsed = run_burst(client_sk, &proxy,
+					proxy_len, upstream_sk, queries,
+					count, round++);
+
+			if (elapsed < 0)
+				goto out;
+
+			if (best < 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("%10u %14" G_GINT64_FORMAT " %14.2f\n", count, best,
+						(double)best / count);
+	}
+
+out:
+	g_free(queries);
+	close(client_sk);
+	close(upstream_sk);
+	g_free(option_upstream);
+
+	return 0;
+}
@@ -0,0 +1,444 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+/*
+ * Sustained load generator for dnsproxy. Like dnsproxy-test it sends
+ * plain UDP queries to the proxy, but keeps a fixed number of them in
+ * flight for the whole run and reports the achieved queries per second
+ * together with the latency distribution.
+ *
+ * The queried names cycle through --names different ones, so a small
+ * number mostly measures the cache path and a large one the forwarding
+ * path. With --upstream the tool also answers the forwarded queries
+ * itself, so no real DNS server is involved:
+ *
+ *	dnsproxy-standalone 5353 load.test 127.0.0.2 &
+ *	dnsproxy-load --port 5353 --upstream 127.0.0.2 --names 100000
+ *
+ * Binding the upstream side requires the privilege to use port 53.
+ */
+
+#define MAX_MSG_LEN 512
+#define MAX_IN_FLIGHT 65536
+#define QUERY_TIMEOUT_USEC (2 * G_USEC_PER_SEC)
+
+static gint option_port = 53;
+static gchar *option_server = NULL;
+static gchar *option_upstream = NULL;
+static gint option_duration = 10;
+static gint option_window = 64;
+static gint option_names = 1000;
+
+static GOptionEntry options[] = {
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &option_port,
+			"Port dnsproxy listens on", "PORT" },
+	{ "server", 'a', 0, G_OPTION_ARG_STRING, &option_server,
+			"Address dnsproxy listens on", "ADDR" },
+	{ "upstream", 's', 0, G_OPTION_ARG_STRING, &option_upstream,
+			"Answer queries dnsproxy sends to this address",
+			"ADDR" },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &option_duration,
+			"Length of the run in seconds", "SEC" },
+	{ "window", 'w', 0, G_OPTION_ARG_INT, &option_window,
+			"Number of queries kept in flight", "NR" },
+	{ "names", 'n', 0, G_OPTION_ARG_INT, &option_names,
+			"Number of different names queried", "NR" },
+	{ NULL },
+};
+
+struct load_stats {
+	guint64 sent;
+	guint64 received;
+	guint64 lost;
+	guint64 unexpected;
+	guint64 upstream;
+	GArray *latencies;
+};
+
+/* send time of the query with this transaction ID, 0 if none */
+static gint64 in_flight[MAX_IN_FLIGHT];
+
+static int create_socket(const char *addr, int port, bool do_bind,
+				struct sockaddr_storage *sa, socklen_t *sa_len)
+{
+	struct addrinfo hints, *rp;
+	char service[8];
+	int bufsize = 4 * 1024 * 1024;
+	int sk, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+
+	snprintf(service, sizeof(service), "%d", port);
+
+	err = getaddrinfo(addr, service, &hints, &rp);
+	if (err) {
+		fprintf(stderr, "Invalid address %s: %s\n", addr,
+							gai_strerror(err));
+		return -EINVAL;
+	}
+
+	sk = socket(rp->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sk < 0) {
+		err = -errno;
+		freeaddrinfo(rp);
+		return err;
+	}
+
+	setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	setsockopt(sk, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+	if (do_bind)
+		err = bind(sk, rp->ai_addr, rp->ai_addrlen);
+	else
+		err = connect(sk, rp->ai_addr, rp->ai_addrlen);
+
+	if (err < 0) {
+		err = -errno;
+		fprintf(stderr, "Cannot use %s port %d: %s\n", addr, port,
+							strerror(-err));
+		close(sk);
+		freeaddrinfo(rp);
+		return err;
+	}
+
+	if (sa) {
+		memcpy(sa, rp->ai_addr, rp->ai_addrlen);
+		*sa_len = rp->ai_addrlen;
+	}
+
+	freeaddrinfo(rp);
+
+	return sk;
+}
+
+static int build_query(unsigned char *buf, uint16_t id, unsigned int nr)
+{
+	char label[16];
+	int len, label_len;
+
+	memset(buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;		/* recursion desired */
+	buf[5] = 0x01;		/* one question */
+	len = 12;
+
+	/* multi label names so that no search domain is appended */
+	label_len = snprintf(label, sizeof(label), "q%u", nr);
+	buf[len++] = label_len;
+	memcpy(buf + len, label, label_len);
+	len += label_len;
+
+	buf[len++] = 4;
+	memcpy(buf + len, "load", 4);
+	len += 4;
+
+	buf[len++] = 4;
+	memcpy(buf + len, "test", 4);
+	len += 4;
+
+	buf[len++] = 0;
+
+	buf[len++] = 0x00;	/* type A */
+	buf[len++] = 0x01;
+	buf[len++] = 0x00;	/* class IN */
+	buf[len++] = 0x01;
+
+	return len;
+}
+
+static int build_reply(unsigned char *buf, int len)
+{
+	static const unsigned char answer[] = {
+		0xc0, 0x0c,		/* pointer to the question */
+		0x00, 0x01,		/* type A */
+		0x00, 0x01,		/* class IN */
+		0x00, 0x00, 0x0e, 0x10,	/* ttl 3600 */
+		0x00, 0x04,		/* rdlen */
+		192, 0, 2, 1,		/* TEST-NET-1 address */
+	};
+
+	if (len < 12 || len + (int)sizeof(answer) > MAX_MSG_LEN)
+		return -ENOBUFS;
+
+	buf[2] |= 0x80;		/* qr */
+	buf[3] = 0x80;		/* ra, rcode 0 */
+	buf[6] = 0x00;		/* one answer */
+	buf[7] = 0x01;
+	buf[8] = buf[9] = buf[10] = buf[11] = 0;
+
+	memcpy(buf + len, answer, sizeof(answer));
+
+	return len + sizeof(answer);
+}
+
+static void answer_upstream(int upstream_sk, struct load_stats *stats)
+{
+	unsigned char buf[MAX_MSG_LEN];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	int len;
+
+	while (1) {
+		from_len = sizeof(from);
+		len = recvfrom(upstream_sk, buf, sizeof(buf), MSG_DONTWAIT,
+					(struct sockaddr *)&from, &from_len);
+		if (len < 0)
+			return;
+
+		len = build_reply(buf, len);
+		if (len < 0)
+			continue;
+
+		sendto(upstream_sk, buf, len, 0, (struct sockaddr *)&from,
+								from_len);
+		stats->upstream++;
+	}
+}
+
+static void read_replies(int client_sk, struct load_stats *stats,
+						unsigned int *pending)
+{
+	unsigned char buf[MAX_MSG_LEN];
+	gint64 now;
+	guint32 latency;
+	uint16_t id;
+	int len;
+
+	while (1) {
+		len = recv(client_sk, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0)
+			return;
+
+		if (len < 12) {
+			stats->unexpected++;
+			continue;
+		}
+
+		id = buf[0] << 8 | buf[1];
+		if (!in_flight[id]) {
+			/* late reply of a query already counted as lost */
+			stats->unexpected++;
+			continue;
+		}
+
+		now = g_get_monotonic_time();
+		latency = now - in_flight[id];
+		in_flight[id] = 0;
+		(*pending)--;
+
+		g_array_append_val(stats->latencies, latency);
+		stats->received++;
+	}
+}
+
+/* forget queries which were not answered in time */
+static void expire_queries(struct load_stats *stats, unsigned int *pending)
+{
+	gint64 deadline = g_get_monotonic_time() - QUERY_TIMEOUT_USEC;
+	unsigned int id;
+
+	for (id = 0; id < MAX_IN_FLIGHT; id++) {
+		if (!in_flight[id] || in_flight[id] > deadline)
+			continue;
+
+		in_flight[id] = 0;
+		(*pending)--;
+		stats->lost++;
+	}
+}
+
+static int compare_latency(gconstpointer a, gconstpointer b)
+{
+	const guint32 *la = a, *lb = b;
+
+	return (*la > *lb) - (*la < *lb);
+}
+
+static guint32 percentile(GArray *sorted, double pct)
+{
+	guint idx;
+
+	if (sorted->len == 0)
+		return 0;
+
+	idx = (guint)(pct / 100 * (sorted->len - 1) + 0.5);
+
+	return g_array_index(sorted, guint32, idx);
+}
+
+static void run_load(int client_sk, int upstream_sk,
+					struct load_stats *stats)
+{
+	struct pollfd pfd[2];
+	unsigned char buf[MAX_MSG_LEN];
+	unsigned int pending = 0, nr = 0, nfds;
+	uint16_t next_id = 0;
+	gint64 start, end, last_expire, now;
+	int len;
+
+	pfd[0].fd = client_sk;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = upstream_sk;
+	pfd[1].events = POLLIN;
+	nfds = upstream_sk < 0 ? 1 : 2;
+
+	start = last_expire = g_get_monotonic_time();
+	end = start + (gint64)option_duration * G_USEC_PER_SEC;
+
+	/* after the run, wait for the replies of the last queries */
+	while ((now = g_get_monotonic_time()) < end + QUERY_TIMEOUT_USEC) {
+		if (now >= end && pending == 0)
+			break;
+
+		while (now < end && pending < (unsigned int)option_window) {
+			while (in_flight[next_id])
+				next_id++;
+
+			len = build_query(buf, next_id, nr);
+			if (send(client_sk, buf, len, 0) < 0)
+				break;
+
+			in_flight[next_id] = now = g_get_monotonic_time();
+			next_id++;
+			nr = (nr + 1) % option_names;
+			pending++;
+			stats->sent++;
+		}
+
+		if (poll(pfd, nfds, 100) < 0 && errno != EINTR)
+			break;
+
+		if (upstream_sk >= 0 && (pfd[1].revents & POLLIN))
+			answer_upstream(upstream_sk, stats);
+
+		if (pfd[0].revents & POLLIN)
+			read_replies(client_sk, stats, &pending);
+
+		if (now - last_expire > G_USEC_PER_SEC) {
+			expire_queries(stats, &pending);
+			last_expire = now;
+		}
+	}
+
+	stats->lost += pending;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct load_stats stats;
+	const char *server;
+	int client_sk, upstream_sk = -1;
+	double elapsed;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_duration <= 0 || option_names <= 0 ||
+			option_window <= 0 || option_window >= MAX_IN_FLIGHT) {
+		g_printerr("Duration, names and window must be positive, "
+				"window below %d\n", MAX_IN_FLIGHT);
+		exit(1);
+	}
+
+	server = option_server ? option_server : "127.0.0.1";
+
+	if (option_upstream) {
+		upstream_sk = create_socket(option_upstream, 53, true,
+								NULL, NULL);
+		if (upstream_sk < 0)
+			exit(1);
+	}
+
+	client_sk = create_socket(server, option_port, false, NULL, NULL);
+	if (client_sk < 0) {
+		if (upstream_sk >= 0)
+			close(upstream_sk);
+		exit(1);
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	stats.latencies = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+								1 << 20);
+
+	run_load(client_sk, upstream_sk, &stats);
+
+	g_array_sort(stats.latencies, compare_latency);
+	elapsed = option_duration;
+
+	printf("queries sent      %" G_GUINT64_FORMAT "\n", stats.sent);
+	printf("replies received  %" G_GUINT64_FORMAT "\n", stats.received);
+	printf("queries lost      %" G_GUINT64_FORMAT "\n", stats.lost);
+	printf("unexpected        %" G_GUINT64_FORMAT "\n", stats.unexpected);
+	if (upstream_sk >= 0)
+		printf("upstream answers  %" G_GUINT64_FORMAT "\n",
+							stats.upstream);
+	printf("throughput        %.0f queries/s\n",
+						stats.received / elapsed);
+	printf("latency (usec)    p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+			percentile(stats.latencies, 50),
+			percentile(stats.latencies, 90),
+			percentile(stats.latencies, 99),
+			percentile(stats.latencies, 99.9),
+			percentile(stats.latencies, 100));
+
+	g_array_free(stats.latencies, TRUE);
+	close(client_sk);
+	if (upstream_sk >= 0)
+		close(upstream_sk);
+	g_free(option_server);
+	g_free(option_upstream);
+
+	return 0;
+}
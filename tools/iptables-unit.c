@@ -25,6 +25,7 @@
 
 #include <glib.h>
 #include <errno.h>
+#include <stdio.h>
 
 #include "../src/connman.h"
 
@@ -706,6 +707,107 @@ static void test_nat_basic1(void)
 	g_free(service);
 }
 
+#define BENCH_SESSIONS 32
+
+static unsigned int commit_count;
+
+int __real___connman_iptables_commit(int type, const char *table_name);
+
+/* linked with --wrap, counts how often a table is replaced */
+int __wrap___connman_iptables_commit(int type, const char *table_name)
+{
+	commit_count++;
+
+	return __real___connman_iptables_commit(type, table_name);
+}
+
+/*
+ * Tethering NAT plus sessions which all have marking and SNAT rules,
+ * set up and torn down either context by context or within one
+ * firewall transaction.
+ */
+static void run_session_scenario(const char *label, bool transaction)
+{
+	struct firewall_context *nat_ctx;
+	struct firewall_context *mark_ctx[BENCH_SESSIONS];
+	struct firewall_context *snat_ctx[BENCH_SESSIONS];
+	char address[] = "192.168.2.1", interface[] = "eth0";
+	char id[16], src_ip[16], snat_ip[16];
+	unsigned int setup_commits, i;
+	gint64 start, setup_time;
+	int err;
+
+	commit_count = 0;
+	start = g_get_monotonic_time();
+
+	if (transaction)
+		__connman_firewall_begin();
+
+	nat_ctx = __connman_firewall_create();
+	err = __connman_firewall_enable_nat(nat_ctx, address, 24, interface);
+	g_assert(err == 0);
+
+	for (i = 0; i < BENCH_SESSIONS; i++) {
+		snprintf(id, sizeof(id), "%u", 10000 + i);
+		snprintf(src_ip, sizeof(src_ip), "10.0.0.%u", i + 1);
+		snprintf(snat_ip, sizeof(snat_ip), "10.1.0.%u", i + 1);
+
+		mark_ctx[i] = __connman_firewall_create();
+		err = __connman_firewall_enable_marking(mark_ctx[i],
+					CONNMAN_SESSION_ID_TYPE_UID, id,
+					src_ip, i + 1);
+		g_assert(err == 0);
+
+		snat_ctx[i] = __connman_firewall_create();
+		err = __connman_firewall_enable_snat(snat_ctx[i], 0, "eth0",
+								snat_ip);
+		g_assert(err == 0);
+	}
+
+	if (transaction)
+		g_assert(__connman_firewall_commit() == 0);
+
+	setup_time = g_get_monotonic_time() - start;
+	setup_commits = commit_count;
+
+	commit_count = 0;
+	start = g_get_monotonic_time();
+
+	if (transaction)
+		__connman_firewall_begin();
+
+	for (i = BENCH_SESSIONS; i > 0; i--) {
+		__connman_firewall_disable_snat(snat_ctx[i - 1]);
+		__connman_firewall_destroy(snat_ctx[i - 1]);
+
+		__connman_firewall_disable_marking(mark_ctx[i - 1]);
+		__connman_firewall_destroy(mark_ctx[i - 1]);
+	}
+
+	__connman_firewall_disable_nat(nat_ctx);
+	__connman_firewall_destroy(nat_ctx);
+
+	if (transaction)
+		g_assert(__connman_firewall_commit() == 0);
+
+	printf("# %-14s %8u %10.1f %8u %10.1f\n", label, setup_commits,
+			setup_time / 1000.0, commit_count,
+			(g_get_monotonic_time() - start) / 1000.0);
+
+	assert_rule_not_exists(AF_INET, "nat",
+		"-A POSTROUTING -s 192.168.2.0/24 -o eth0 -j MASQUERADE");
+}
+
+static void test_firewall_session_bench(void)
+{
+	printf("# %d sessions\n", BENCH_SESSIONS);
+	printf("# %-14s %8s %10s %8s %10s\n", "", "commits", "setup (ms)",
+						"commits", "teardown (ms)");
+
+	run_session_scenario("per context", false);
+	run_session_scenario("transaction", true);
+}
+
 static gchar *option_debug = NULL;
 
 static bool parse_debug(const char *key, const char *value,
@@ -773,10 +875,15 @@ int main(int argc, char *argv[])
 	g_test_add_func("/nat/basic0", test_nat_basic0);
 	g_test_add_func("/nat/basic1", test_nat_basic1);
 
+	/* run with -m perf */
+	if (g_test_perf())
+		g_test_add_func("/firewall/session-bench",
+					test_firewall_session_bench);
+
 	err = g_test_run();
 
 	__connman_nat_cleanup();
-	__connman_iptables_cleanup();
+	__connman_firewall_cleanup();
 
 	g_free(option_debug);
 
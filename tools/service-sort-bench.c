@@ -0,0 +1,209 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "src/shared/util.h"
+
+/*
+ * Simulates the scan result churn of a dense Wi-Fi site on a service
+ * list and compares sorting the whole list after every strength update,
+ * as service.c used to do, with moving only the updated service through
+ * util_list_reposition(). The entries are ordered like disconnected
+ * services in service_compare(): favorites first, then by type, by
+ * strength and by name.
+ *
+ * Example:
+ *	service-sort-bench --services 300 --updates 100000
+ */
+
+static gint option_services = 300;
+static gint option_updates = 100000;
+static gint option_jitter = 5;
+
+static GOptionEntry options[] = {
+	{ "services", 'n', 0, G_OPTION_ARG_INT, &option_services,
+			"Number of services in the list", "NR" },
+	{ "updates", 'u', 0, G_OPTION_ARG_INT, &option_updates,
+			"Number of strength updates", "NR" },
+	{ "jitter", 'j', 0, G_OPTION_ARG_INT, &option_jitter,
+			"Largest strength change of an update", "NR" },
+	{ NULL },
+};
+
+struct bench_service {
+	bool favorite;
+	int type;
+	unsigned char strength;
+	char *name;
+};
+
+static guint64 comparisons;
+
+static gint bench_compare(gconstpointer a, gconstpointer b)
+{
+	const struct bench_service *service_a = a, *service_b = b;
+	gint strength;
+
+	comparisons++;
+
+	if (service_a->favorite != service_b->favorite)
+		return service_a->favorite ? -1 : 1;
+
+	if (service_a->type != service_b->type)
+		return service_a->type - service_b->type;
+
+	strength = (gint) service_b->strength - (gint) service_a->strength;
+	if (strength)
+		return strength;
+
+	return g_strcmp0(service_a->name, service_b->name);
+}
+
+static void update_strength(struct bench_service *service, GRand *rand)
+{
+	gint strength;
+
+	strength = service->strength +
+		g_rand_int_range(rand, -option_jitter, option_jitter + 1);
+
+	service->strength = CLAMP(strength, 1, 100);
+}
+
+static bool is_sorted(GList *list)
+{
+	for (; list && list->next; list = list->next) {
+		if (bench_compare(list->data, list->next->data) > 0)
+			return false;
+	}
+
+	return true;
+}
+
+static GList *create_list(struct bench_service *services, GRand *rand)
+{
+	GList *list = NULL;
+	int i;
+
+	for (i = 0; i < option_services; i++) {
+		struct bench_service *service = &services[i];
+
+		service->favorite = g_rand_int_range(rand, 0, 20) == 0;
+		service->type = g_rand_int_range(rand, 0, 50) ? 0 : 1;
+		service->strength = g_rand_int_range(rand, 1, 101);
+		service->name = g_strdup_printf("bss-%d", i);
+
+		list = g_list_prepend(list, service);
+	}
+
+	return g_list_sort(list, bench_compare);
+}
+
+static void run(const char *label, bool reposition)
+{
+	struct bench_service *services;
+	GList *list;
+	GRand *rand;
+	gint64 start, elapsed;
+	guint64 moves = 0;
+	bool moved;
+	int i;
+
+	/* both runs see the same list and the same updates */
+	rand = g_rand_new_with_seed(1);
+	services = g_new0(struct bench_service, option_services);
+	list = create_list(services, rand);
+
+	comparisons = 0;
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < option_updates; i++) {
+		struct bench_service *service;
+
+		service = &services[g_rand_int_range(rand, 0,
+							option_services)];
+		update_strength(service, rand);
+
+		if (reposition) {
+			list = util_list_reposition(list,
+						g_list_find(list, service),
+						bench_compare, &moved);
+			if (moved)
+				moves++;
+		} else {
+			list = g_list_sort(list, bench_compare);
+		}
+	}
+
+	elapsed = g_get_monotonic_time() - start;
+
+	printf("%-12s %10.3f usec/update %10.1f compares/update",
+				label, (double)elapsed / option_updates,
+				(double)comparisons / option_updates);
+	if (reposition)
+		printf(" %5.1f%% moved", 100.0 * moves / option_updates);
+	printf("\n");
+
+	if (!is_sorted(list))
+		fprintf(stderr, "%s: list is not sorted\n", label);
+
+	for (i = 0; i < option_services; i++)
+		g_free(services[i].name);
+	g_free(services);
+	g_list_free(list);
+	g_rand_free(rand);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_services <= 0 || option_updates <= 0 || option_jitter < 0) {
+		g_printerr("Services and updates must be positive\n");
+		exit(1);
+	}
+
+	printf("%d services, %d updates, strength jitter %d\n",
+			option_services, option_updates, option_jitter);
+
+	run("full sort", false);
+	run("reposition", true);
+
+	return 0;
+}
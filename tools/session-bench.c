@@ -0,0 +1,403 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gdbus.h>
+
+/*
+ * Measures how connmand scales with the number of sessions. The tool
+ * creates --sessions sessions, each with its own notifier object, and
+ * reports the latency of CreateSession and Destroy. With --service it
+ * also disconnects and reconnects that service --rounds times and
+ * reports how many Update notifications the change caused and how long
+ * it took until the last one arrived.
+ *
+ * The tool uses the system bus, so it can run against a connmand on a
+ * private bus by pointing both at the same daemon:
+ *
+ *	dbus-daemon --config-file=test.conf --print-address --fork
+ *	export DBUS_SYSTEM_BUS_ADDRESS=<printed address>
+ *	connmand -n -d src/session.c &
+ *	session-bench --sessions 4000 --service /net/connman/service/...
+ *
+ * With debugging enabled for src/session.c, connmand logs the time spent
+ * per notification and the number of sessions visited per service
+ * change.
+ */
+
+#define CONNMAN_SERVICE			"net.connman"
+#define CONNMAN_MANAGER_INTERFACE	CONNMAN_SERVICE ".Manager"
+#define CONNMAN_SERVICE_INTERFACE	CONNMAN_SERVICE ".Service"
+#define CONNMAN_SESSION_INTERFACE	CONNMAN_SERVICE ".Session"
+#define CONNMAN_NOTIFICATION_INTERFACE	CONNMAN_SERVICE ".Notification"
+
+#define NOTIFY_PATH_PREFIX	"/session_bench/"
+#define CHECK_INTERVAL_MS	10
+#define CHANGE_TIMEOUT_USEC	(30 * G_USEC_PER_SEC)
+
+static gint option_sessions = 1000;
+static gchar *option_service = NULL;
+static gchar *option_bearer = NULL;
+static gint option_rounds = 3;
+static gint option_quiet = 500;
+
+static GOptionEntry options[] = {
+	{ "sessions", 'n', 0, G_OPTION_ARG_INT, &option_sessions,
+			"Number of sessions to create", "NR" },
+	{ "service", 's', 0, G_OPTION_ARG_STRING, &option_service,
+			"Object path of the service to toggle", "PATH" },
+	{ "bearer", 'b', 0, G_OPTION_ARG_STRING, &option_bearer,
+			"Allowed bearer of the sessions", "NAME" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &option_rounds,
+			"Disconnect and connect cycles", "NR" },
+	{ "quiet", 'q', 0, G_OPTION_ARG_INT, &option_quiet,
+			"Time without updates ending a phase", "MSEC" },
+	{ NULL },
+};
+
+static GMainLoop *main_loop;
+
+/* Update notifications of the current phase */
+static guint64 updates;
+static gint64 phase_start;
+static gint64 last_update;
+
+static DBusHandlerResult notify_filter(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	const char *path = dbus_message_get_path(msg);
+	DBusMessage *reply;
+
+	if (!path || !g_str_has_prefix(path, NOTIFY_PATH_PREFIX))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (dbus_message_is_method_call(msg, CONNMAN_NOTIFICATION_INTERFACE,
+							"Update")) {
+		updates++;
+		last_update = g_get_monotonic_time();
+	}
+
+	if (!dbus_message_get_no_reply(msg)) {
+		reply = dbus_message_new_method_return(msg);
+		if (reply) {
+			dbus_connection_send(conn, reply, NULL);
+			dbus_message_unref(reply);
+		}
+	}
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static gboolean check_quiet(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (now - phase_start > CHANGE_TIMEOUT_USEC)
+		goto done;
+
+	if (updates && now - last_update > option_quiet * 1000)
+		goto done;
+
+	return TRUE;
+
+done:
+	g_main_loop_quit(main_loop);
+	return FALSE;
+}
+
+/* runs the main loop until no notification arrived for a while */
+static void wait_for_updates(void)
+{
+	g_timeout_add(CHECK_INTERVAL_MS, check_quiet, NULL);
+	g_main_loop_run(main_loop);
+}
+
+static void start_phase(void)
+{
+	updates = 0;
+	phase_start = last_update = g_get_monotonic_time();
+}
+
+static DBusMessage *call(DBusConnection *conn, DBusMessage *msg)
+{
+	DBusMessage *reply;
+	DBusError error;
+
+	dbus_error_init(&error);
+
+	reply = dbus_connection_send_with_reply_and_block(conn, msg, -1,
+								&error);
+	dbus_message_unref(msg);
+
+	if (!reply) {
+		fprintf(stderr, "%s\n", error.message);
+		dbus_error_free(&error);
+	}
+
+	return reply;
+}
+
+static char *create_session(DBusConnection *conn, const char *notify_path)
+{
+	DBusMessage *msg, *reply;
+	DBusMessageIter iter, dict, entry, value, array;
+	const char *key = "AllowedBearers";
+	const char *path;
+	char *session_path;
+
+	msg = dbus_message_new_method_call(CONNMAN_SERVICE, "/",
+				CONNMAN_MANAGER_INTERFACE, "CreateSession");
+	if (!msg)
+		return NULL;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	if (option_bearer) {
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+		dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+				DBUS_TYPE_ARRAY_AS_STRING
+				DBUS_TYPE_STRING_AS_STRING, &value);
+		dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY,
+				DBUS_TYPE_STRING_AS_STRING, &array);
+		dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING,
+								&option_bearer);
+		dbus_message_iter_close_container(&value, &array);
+		dbus_message_iter_close_container(&entry, &value);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &dict);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
+								&notify_path);
+
+	reply = call(conn, msg);
+	if (!reply)
+		return NULL;
+
+	if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_OBJECT_PATH, &path,
+						DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		return NULL;
+	}
+
+	session_path = g_strdup(path);
+	dbus_message_unref(reply);
+
+	return session_path;
+}
+
+static int destroy_session(DBusConnection *conn, const char *session_path)
+{
+	DBusMessage *msg, *reply;
+
+	msg = dbus_message_new_method_call(CONNMAN_SERVICE, session_path,
+				CONNMAN_SESSION_INTERFACE, "Destroy");
+	if (!msg)
+		return -1;
+
+	reply = call(conn, msg);
+	if (!reply)
+		return -1;
+
+	dbus_message_unref(reply);
+
+	return 0;
+}
+
+/* the reply is ignored, Connect only returns once the service is up */
+static void change_service(DBusConnection *conn, const char *method)
+{
+	DBusMessage *msg;
+
+	msg = dbus_message_new_method_call(CONNMAN_SERVICE, option_service,
+				CONNMAN_SERVICE_INTERFACE, method);
+	if (!msg)
+		return;
+
+	dbus_message_set_no_reply(msg, TRUE);
+	dbus_connection_send(conn, msg, NULL);
+	dbus_message_unref(msg);
+}
+
+static int compare_latency(gconstpointer a, gconstpointer b)
+{
+	const guint32 *la = a, *lb = b;
+
+	return (*la > *lb) - (*la < *lb);
+}
+
+static guint32 percentile(GArray *sorted, double pct)
+{
+	guint idx;
+
+	if (sorted->len == 0)
+		return 0;
+
+	idx = (guint)(pct / 100 * (sorted->len - 1) + 0.5);
+
+	return g_array_index(sorted, guint32, idx);
+}
+
+static void print_latencies(const char *label, GArray *latencies)
+{
+	g_array_sort(latencies, compare_latency);
+
+	printf("%-10s %8u calls  p50 %u p90 %u p99 %u max %u usec\n", label,
+				latencies->len,
+				percentile(latencies, 50),
+				percentile(latencies, 90),
+				percentile(latencies, 99),
+				percentile(latencies, 100));
+}
+
+static void run_change(DBusConnection *conn, const char *method, int round)
+{
+	start_phase();
+	change_service(conn, method);
+	wait_for_updates();
+
+	printf("%-10s round %d  %8" G_GUINT64_FORMAT " updates  last after "
+			"%" G_GINT64_FORMAT " usec\n", method, round, updates,
+			updates ? last_update - phase_start : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	DBusConnection *conn;
+	DBusError err;
+	GArray *latencies;
+	char **session_paths;
+	char *notify_path;
+	gint64 start;
+	int i, created = 0;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			g_printerr("%s\n", error->message);
+			g_error_free(error);
+		} else
+			g_printerr("An unknown error occurred\n");
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_sessions <= 0 || option_rounds < 0 || option_quiet <= 0) {
+		g_printerr("Sessions and quiet time must be positive\n");
+		exit(1);
+	}
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	dbus_error_init(&err);
+
+	conn = g_dbus_setup_bus(DBUS_BUS_SYSTEM, NULL, &err);
+	if (!conn) {
+		if (dbus_error_is_set(&err)) {
+			fprintf(stderr, "%s\n", err.message);
+			dbus_error_free(&err);
+		} else
+			fprintf(stderr, "Can't register with system bus\n");
+		exit(1);
+	}
+
+	dbus_connection_add_filter(conn, notify_filter, NULL, NULL);
+
+	session_paths = g_new0(char *, option_sessions);
+	latencies = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+							option_sessions);
+
+	start_phase();
+
+	for (i = 0; i < option_sessions; i++) {
+		guint32 latency;
+
+		notify_path = g_strdup_printf(NOTIFY_PATH_PREFIX "%d", i);
+
+		start = g_get_monotonic_time();
+		session_paths[i] = create_session(conn, notify_path);
+		latency = g_get_monotonic_time() - start;
+
+		g_free(notify_path);
+
+		if (!session_paths[i])
+			break;
+
+		g_array_append_val(latencies, latency);
+		created++;
+	}
+
+	print_latencies("create", latencies);
+
+	/* the notifications with the initial settings of every session */
+	wait_for_updates();
+	printf("%-10s %8" G_GUINT64_FORMAT " updates\n", "initial", updates);
+
+	for (i = 0; option_service && i < option_rounds; i++) {
+		run_change(conn, "Disconnect", i);
+		run_change(conn, "Connect", i);
+	}
+
+	g_array_set_size(latencies, 0);
+
+	for (i = 0; i < created; i++) {
+		guint32 latency;
+
+		start = g_get_monotonic_time();
+		if (destroy_session(conn, session_paths[i]) < 0)
+			break;
+		latency = g_get_monotonic_time() - start;
+
+		g_array_append_val(latencies, latency);
+	}
+
+	print_latencies("destroy", latencies);
+
+	for (i = 0; i < created; i++)
+		g_free(session_paths[i]);
+	g_free(session_paths);
+	g_array_free(latencies, TRUE);
+
+	dbus_connection_remove_filter(conn, notify_filter, NULL);
+	dbus_connection_unref(conn);
+	g_main_loop_unref(main_loop);
+
+	g_free(option_service);
+	g_free(option_bearer);
+
+	return 0;
+}
@@ -29,12 +29,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <sys/time.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 
 #include <glib.h>
@@ -46,31 +49,43 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC 0xFA01B916
+#define MAGIC_V1 0xFA00B916
+#define STATS_FILE_VERSION 3
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
+struct stats_checkpoint {
+	unsigned int seq;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int checksum;
+};
+
 struct stats_file_header {
 	unsigned int magic;
+	unsigned int version;
 	unsigned int begin;
 	unsigned int end;
 	unsigned int home;
 	unsigned int roaming;
+	struct stats_checkpoint checkpoint[2];
 };
 
 struct stats_record {
 	time_t ts;
 	unsigned int roaming;
+	unsigned int checksum;
 	struct connman_stats_data data;
 };
 
@@ -186,6 +201,30 @@ static void set_end(struct stats_file *file, struct stats_record *end)
 	hdr->end = (char *)end - file->addr;
 }
 
+/* FNV-1a, as computed by connmand */
+static unsigned int checksum_update(unsigned int hash, const void *buf,
+							size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static unsigned int record_checksum(const struct stats_record *rec)
+{
+	unsigned int hash;
+
+	hash = checksum_update(2166136261U, rec,
+				offsetof(struct stats_record, checksum));
+
+	return checksum_update(hash, &rec->data, sizeof(rec->data));
+}
+
 static int get_index(struct stats_file *file, struct stats_record *rec)
 {
 	return rec - file->first;
@@ -217,7 +256,8 @@ static void stats_print_record(struct stats_record *rec)
 	char buffer[30];
 
 	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&rec->ts));
-	printf("%p %lld %s %01d %d %d %d %d %d %d %d %d %d\n",
+	printf("%p %lld %s %01d %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %u\n",
 		rec, (long long int)rec->ts, buffer,
 		rec->roaming,
 		rec->data.rx_packets,
@@ -270,6 +310,7 @@ static void stats_hdr_info(struct stats_file *file)
 
 	printf("Header\n");
 	printf("  magic           0x%08x\n", hdr->magic);
+	printf("  version         %u\n", hdr->version);
 	printf("  begin           [%d] 0x%08x\n",
 		get_index(file, begin), hdr->begin);
 	printf("  end             [%d] 0x%08x\n",
@@ -307,23 +348,23 @@ static void stats_print_entries(struct stats_file *file)
 static void stats_print_rec_diff(struct stats_record *begin,
 					struct stats_record *end)
 {
-	printf("\trx_packets: %d\n",
+	printf("\trx_packets: %" PRIu64 "\n",
 		end->data.rx_packets - begin->data.rx_packets);
-	printf("\ttx_packets: %d\n",
+	printf("\ttx_packets: %" PRIu64 "\n",
 		end->data.tx_packets - begin->data.tx_packets);
-	printf("\trx_bytes:   %d\n",
+	printf("\trx_bytes:   %" PRIu64 "\n",
 		end->data.rx_bytes - begin->data.rx_bytes);
-	printf("\ttx_bytes:   %d\n",
+	printf("\ttx_bytes:   %" PRIu64 "\n",
 		end->data.tx_bytes - begin->data.tx_bytes);
-	printf("\trx_errors:  %d\n",
+	printf("\trx_errors:  %" PRIu64 "\n",
 		end->data.rx_errors - begin->data.rx_errors);
-	printf("\ttx_errors:  %d\n",
+	printf("\ttx_errors:  %" PRIu64 "\n",
 		end->data.tx_errors - begin->data.tx_errors);
-	printf("\trx_dropped: %d\n",
+	printf("\trx_dropped: %" PRIu64 "\n",
 		end->data.rx_dropped - begin->data.rx_dropped);
-	printf("\ttx_dropped: %d\n",
+	printf("\ttx_dropped: %" PRIu64 "\n",
 		end->data.tx_dropped - begin->data.tx_dropped);
-	printf("\ttime:       %d\n",
+	printf("\ttime:       %u\n",
 		end->data.time - begin->data.time);
 }
 
@@ -504,14 +545,23 @@ static int stats_open(struct stats_file *file, const char *name)
 
 	/* Initialize new file */
 	hdr = get_hdr(file);
-	if (hdr->magic != MAGIC ||
+	if (hdr->magic == MAGIC_V1 ||
+			(hdr->magic == MAGIC && hdr->version < STATS_FILE_VERSION)) {
+		fprintf(stderr, "%s uses an older format, connmand "
+				"converts it when opening it\n", file->name);
+		return -EINVAL;
+	}
+
+	if (hdr->magic != MAGIC || hdr->version != STATS_FILE_VERSION ||
 			hdr->begin < sizeof(struct stats_file_header) ||
 			hdr->end < sizeof(struct stats_file_header) ||
 			hdr->home < sizeof(struct stats_file_header) ||
 			hdr->roaming < sizeof(struct stats_file_header) ||
 			hdr->begin > file->len ||
 			hdr->end > file->len) {
+		memset(hdr, 0, sizeof(*hdr));
 		hdr->magic = MAGIC;
+		hdr->version = STATS_FILE_VERSION;
 		hdr->begin = sizeof(struct stats_file_header);
 		hdr->end = sizeof(struct stats_file_header);
 		hdr->home = UINT_MAX;
@@ -544,7 +594,9 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 
 	hdr = get_hdr(file);
 
+	memset(hdr, 0, sizeof(*hdr));
 	hdr->magic = MAGIC;
+	hdr->version = STATS_FILE_VERSION;
 	hdr->begin = sizeof(struct stats_file_header);
 	hdr->end = sizeof(struct stats_file_header);
 	hdr->home = UINT_MAX;
@@ -599,6 +651,7 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 			next->data.tx_bytes += pkt * (rand() % 1500);
 		}
 
+		next->checksum = record_checksum(next);
 		set_end(file, next);
 
 		if ((rand() % 50) == 0)
@@ -642,6 +695,7 @@ static int append_record(struct stats_file *file,
 	next = get_next(file, cur);
 
 	memcpy(next, rec, sizeof(struct stats_record));
+	next->checksum = record_checksum(next);
 
 	set_end(file, next);
 
@@ -424,6 +424,40 @@ static void iptables_test_basic0()
 	__connman_iptables_cleanup();
 }
 
+/*
+ * The managed chains of the firewall are torn down in one transaction:
+ * the last rule of the chain, the jump to it and the chain itself are
+ * deleted before the table is committed once. The jump has to be found
+ * although the offsets are only updated at commit time.
+ */
+static void iptables_test_jump_delete0()
+{
+	set_test_config(TEST_CONFIG_PASS);
+
+	__connman_iptables_init();
+
+	g_assert(!__connman_iptables_new_chain(AF_INET, "filter", "INPUT"));
+	g_assert(!__connman_iptables_new_chain(AF_INET, "filter",
+				"connman-INPUT"));
+	g_assert_cmpint(__connman_iptables_insert(AF_INET, "filter", "INPUT",
+				"-j connman-INPUT"), ==, 0);
+	g_assert_cmpint(__connman_iptables_insert(AF_INET, "filter",
+				"connman-INPUT",
+				"-p tcp -m tcp --dport 42 -j ACCEPT"), ==, 0);
+
+	g_assert_cmpint(__connman_iptables_delete(AF_INET, "filter",
+				"connman-INPUT",
+				"-p tcp -m tcp --dport 42 -j ACCEPT"), ==, 0);
+	g_assert_cmpint(__connman_iptables_delete(AF_INET, "filter", "INPUT",
+				"-j connman-INPUT"), ==, 0);
+	g_assert_cmpint(__connman_iptables_delete_chain(AF_INET, "filter",
+				"connman-INPUT"), ==, 0);
+
+	g_assert_cmpint(__connman_iptables_commit(AF_INET, "filter"), ==, 0);
+
+	__connman_iptables_cleanup();
+}
+
 /*
  * These ok0...ok6 tests test the error handling. The setjmp() position is set
  * properly for the functions that will trigger it and as a result, depending on
@@ -676,6 +710,8 @@ int main (int argc, char *argv[])
 			"Unit Tests Connection Manager", VERSION);
 
 	g_test_add_func("/iptables/test_basic0", iptables_test_basic0);
+	g_test_add_func("/iptables/test_jump_delete0",
+					iptables_test_jump_delete0);
 	g_test_add_func("/iptables/test_jmp_ok0", iptables_test_jmp_ok0);
 	g_test_add_func("/iptables/test_jmp_ok1", iptables_test_jmp_ok1);
 	g_test_add_func("/iptables/test_jmp_ok2", iptables_test_jmp_ok2);
@@ -254,6 +254,7 @@ int main(int argc, char *argv[])
 	else
 		__vpn_settings_init(option_config);
 
+	__connman_storage_init(0);
 	__connman_inotify_init();
 	__connman_agent_init();
 	__vpn_provider_init();
@@ -282,6 +283,7 @@ int main(int argc, char *argv[])
 	__vpn_provider_cleanup();
 	__connman_agent_cleanup();
 	__connman_inotify_cleanup();
+	__connman_storage_cleanup();
 	__connman_dbus_cleanup();
 	__connman_log_cleanup(false);
 	__vpn_settings_cleanup();